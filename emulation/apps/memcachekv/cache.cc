@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <cstring>
+
+#include <apps/memcachekv/cache.h>
+
+// Seeds of the sketch rows (from Caffeine's FrequencySketch)
+static const uint64_t row_seeds[memcachekv::FrequencySketch::DEPTH] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+    0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+};
+
+namespace memcachekv {
+
+CachePolicy::CachePolicy()
+    : limit(0), eviction(EvictionType::CLOCK), admission(false)
+{
+}
+
+bool parse_cache_policy(const char *str, CachePolicy &policy)
+{
+    const char *comma = strchr(str, ',');
+    size_t len = comma != nullptr ? (size_t)(comma - str) : strlen(str);
+    if (len == strlen("clock") && strncmp(str, "clock", len) == 0) {
+        policy.eviction = EvictionType::CLOCK;
+    } else if (len == strlen("lru") && strncmp(str, "lru", len) == 0) {
+        policy.eviction = EvictionType::SAMPLED_LRU;
+    } else {
+        return false;
+    }
+    policy.admission = false;
+    if (comma != nullptr) {
+        if (strcmp(comma + 1, "tinylfu") != 0) {
+            return false;
+        }
+        policy.admission = true;
+    }
+    return true;
+}
+
+FrequencySketch::FrequencySketch(size_t capacity)
+    : n_samples(0)
+{
+    size_t n_words = 64;
+    while (n_words < capacity) {
+        n_words <<= 1;
+    }
+    this->table = new std::atomic<uint64_t>[n_words];
+    for (size_t i = 0; i < n_words; i++) {
+        this->table[i].store(0, std::memory_order_relaxed);
+    }
+    this->mask = n_words - 1;
+    this->sample_size = n_words * SAMPLE_FACTOR;
+}
+
+FrequencySketch::~FrequencySketch()
+{
+    delete[] this->table;
+}
+
+size_t FrequencySketch::counter_of(keyhash_t keyhash, int i, int &shift) const
+{
+    uint64_t hash = ((uint64_t)keyhash + row_seeds[i]) * row_seeds[i];
+    hash ^= hash >> 32;
+    // Row i uses counters 4i to 4i+3 of its word
+    shift = ((i << 2) + (int)((hash >> 48) & 3)) << 2;
+    return hash & this->mask;
+}
+
+void FrequencySketch::increment(keyhash_t keyhash)
+{
+    bool added = false;
+    for (int i = 0; i < DEPTH; i++) {
+        int shift;
+        std::atomic<uint64_t> &word = this->table[counter_of(keyhash, i, shift)];
+        uint64_t w = word.load(std::memory_order_relaxed);
+        while (((w >> shift) & MAX_COUNT) < MAX_COUNT) {
+            if (word.compare_exchange_weak(w, w + (1ULL << shift),
+                                           std::memory_order_relaxed)) {
+                added = true;
+                break;
+            }
+        }
+    }
+    if (added &&
+        this->n_samples.fetch_add(1, std::memory_order_relaxed) + 1 == this->sample_size) {
+        halve();
+    }
+}
+
+int FrequencySketch::frequency(keyhash_t keyhash) const
+{
+    uint64_t freq = MAX_COUNT;
+    for (int i = 0; i < DEPTH; i++) {
+        int shift;
+        uint64_t w = this->table[counter_of(keyhash, i, shift)].load(std::memory_order_relaxed);
+        freq = std::min(freq, (w >> shift) & MAX_COUNT);
+    }
+    return (int)freq;
+}
+
+void FrequencySketch::halve()
+{
+    // Increments racing with this may be lost
+    for (size_t i = 0; i <= this->mask; i++) {
+        uint64_t w = this->table[i].load(std::memory_order_relaxed);
+        this->table[i].store((w >> 1) & 0x7777777777777777ULL, std::memory_order_relaxed);
+    }
+    this->n_samples.fetch_sub(this->sample_size / 2, std::memory_order_relaxed);
+}
+
+} // namespace memcachekv
@@ -0,0 +1,74 @@
+#ifndef _MEMCACHEKV_CACHE_H_
+#define _MEMCACHEKV_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <apps/memcachekv/message.h>
+
+namespace memcachekv {
+
+/*
+ * Eviction policies of a memory-bounded store.
+ *
+ * CLOCK:       a hand sweeps the table; hits raise an entry's count (up to
+ *              3) and the hand lowers it, evicting entries found at 0. Keys
+ *              seen once go first, so scans push out little of the hot set.
+ * SAMPLED_LRU: evicts the least recently used of a few randomly sampled
+ *              entries (as Redis). Not scan resistant on its own.
+ */
+enum class EvictionType {
+    CLOCK,
+    SAMPLED_LRU
+};
+
+struct CachePolicy {
+    CachePolicy();
+
+    // Bytes of items (keys, values and their metadata), or 0 for no limit
+    size_t limit;
+    EvictionType eviction;
+    // TinyLFU: only insert a key if it is read more often than the victim
+    bool admission;
+};
+
+// Parses "clock" or "lru", optionally followed by ",tinylfu"
+bool parse_cache_policy(const char *str, CachePolicy &policy);
+
+/*
+ * TinyLFU frequency sketch: a count-min sketch of 4-bit counters, packed 16
+ * to a word. All counters are halved after every SAMPLE_FACTOR increments
+ * per word, so frequencies reflect recent accesses. Counters are
+ * incremented with a CAS, so concurrent increments are not lost; only those
+ * racing with the halving may be, which only makes estimates slightly low.
+ * Keys with saturated counters are read without writing.
+ */
+class FrequencySketch {
+public:
+    // Sized to track about capacity keys
+    FrequencySketch(size_t capacity);
+    ~FrequencySketch();
+
+    void increment(keyhash_t keyhash);
+    // Estimated recent accesses, at most MAX_COUNT
+    int frequency(keyhash_t keyhash) const;
+
+    static const int DEPTH = 4;
+    static const uint64_t MAX_COUNT = 15;
+    static const size_t SAMPLE_FACTOR = 10;
+
+private:
+    // Word and bit offset of the counter of keyhash in row i
+    inline size_t counter_of(keyhash_t keyhash, int i, int &shift) const;
+    void halve();
+
+    std::atomic<uint64_t> *table;
+    size_t mask;
+    size_t sample_size;
+    std::atomic<size_t> n_samples;
+};
+
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_CACHE_H_ */
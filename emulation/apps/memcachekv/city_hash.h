@@ -0,0 +1,40 @@
+// Copyright (c) 2011 Google, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+//
+// CityHash, by Geoff Pike and Jyrki Alakuijala
+//
+// CityHash32, ported from octeon/city_hash.c for little-endian hosts. Both
+// produce the same hash for the same bytes.
+
+#ifndef _MEMCACHEKV_CITY_HASH_H_
+#define _MEMCACHEKV_CITY_HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace memcachekv {
+
+// Hash function for a byte array.
+uint32_t CityHash32(const char *s, size_t len);
+
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_CITY_HASH_H_ */
@@ -11,8 +11,9 @@ using std::cin;
 namespace memcachekv {
 
 CLIClient::CLIClient(Configuration *config,
-                     MessageCodec *codec)
-    : config(config), codec(codec)
+                     MessageCodec *codec,
+                     const Placement *placement)
+    : config(config), codec(codec), placement(placement)
 {
 }
 
@@ -25,15 +26,16 @@ void CLIClient::receive_message(const Message &msg, const Address &addr, int tid
     MemcacheKVMessage kvmsg;
     this->codec->decode(msg, kvmsg);
     assert(kvmsg.type == MemcacheKVMessage::Type::REPLY);
-    printf("Reply type %u keyhash %u server %u ver %u result %u value %s\n",
+    printf("Reply type %u keyhash %u server %u ver %u result %u value %.*s\n",
            (unsigned int)kvmsg.reply.op_type, kvmsg.reply.keyhash, kvmsg.reply.server_id,
-           kvmsg.reply.ver, (unsigned int)kvmsg.reply.result, kvmsg.reply.value.c_str());
+           kvmsg.reply.ver, (unsigned int)kvmsg.reply.result,
+           (int)kvmsg.reply.value.size(), kvmsg.reply.value.data());
 }
 
 void CLIClient::run()
 {
     MemcacheKVMessage kvmsg;
-    string input;
+    string input, key, value;
 
     kvmsg.type = MemcacheKVMessage::Type::REQUEST;
     kvmsg.request.client_id = 0;
@@ -43,17 +45,17 @@ void CLIClient::run()
         getline(cin, input);
         kvmsg.request.op.op_type = static_cast<OpType>(stoi(input));
         printf("key: ");
-        getline(cin, input);
-        kvmsg.request.op.key = input;
+        getline(cin, key);
+        kvmsg.request.op.key = StringView(key);
         printf("value: ");
-        getline(cin, input);
-        kvmsg.request.op.value = input;
+        getline(cin, value);
+        kvmsg.request.op.value = StringView(value);
         kvmsg.request.req_id++;
         kvmsg.request.client_id = this->config->client_id;
-        kvmsg.request.server_id = key_to_node_id(kvmsg.request.op.key,
-                                                 this->config->num_nodes);
+        kvmsg.request.op.keyhash = compute_keyhash(key);
+        kvmsg.request.server_id = this->placement->node_id(kvmsg.request.op.keyhash);
 
-        Message msg;
+        Message msg(this->transport);
         this->codec->encode(msg, kvmsg);
 
         int rack_id = kvmsg.request.op.op_type == OpType::GET ? this->config->num_racks-1 : 0;
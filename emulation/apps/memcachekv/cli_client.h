@@ -4,13 +4,15 @@
 #include <application.h>
 #include <configuration.h>
 #include <message.h>
+#include <apps/memcachekv/placement.h>
 
 namespace memcachekv {
 
 class CLIClient : public Application {
 public:
     CLIClient(Configuration *config,
-              MessageCodec *codec);
+              MessageCodec *codec,
+              const Placement *placement);
     ~CLIClient();
 
     virtual void receive_message(const Message &msg,
@@ -22,6 +24,7 @@ public:
 private:
     Configuration *config;
     MessageCodec *codec;
+    const Placement *placement;
 };
 
 } // namespace memcachekv
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <sys/time.h>
 #include <thread>
@@ -12,6 +13,13 @@ static thread_local uint32_t req_id = 1;
 #define LATENCY_CHECK_COUNT 100
 #define LATENCY_CHECK_PTILE 0.99
 #define MIN_INTERVAL 1000
+// Batching: flush a batch once its request would exceed a packet, or when
+// its first op has waited this long (us). Timeouts are checked at least
+// every BATCH_WAIT_TICKS of the wait between ops.
+#define BATCH_MAX_BYTES 1400
+#define BATCH_OP_OVERHEAD 8
+#define BATCH_TIMEOUT 100
+#define BATCH_WAIT_TICKS 1000
 
 using std::string;
 
@@ -125,16 +133,17 @@ void KVWorkloadGenerator::next_operation(int tid, Operation &op, long &time)
     ThreadState &ts = this->thread_states.at(tid);
     switch (this->key_type) {
     case KeyType::UNIFORM:
-        op.key = this->keys.at(ts.unif_int_dist(ts.generator));
+        ts.key = this->keys.at(ts.unif_int_dist(ts.generator));
         break;
     case KeyType::ZIPF:
-        op.key = this->keys.at(next_zipf_key_index(tid));
+        ts.key = this->keys.at(next_zipf_key_index(tid));
         break;
     }
+    op.key = StringView(ts.key);
 
     op.op_type = next_op_type(tid);
     if (op.op_type == OpType::PUT) {
-        op.value = this->value;
+        op.value = StringView(this->value);
     }
 
     switch (this->send_mode) {
@@ -186,12 +195,27 @@ void KVWorkloadGenerator::adjust_send_rate(int tid)
     }
 }
 
+Client::Batch::Batch()
+    : n_ops(0), req_bytes(0), has_write(false)
+{
+}
+
 Client::Client(Configuration *config,
                Stats *stats,
                KVWorkloadGenerator *gen,
-               MessageCodec *codec)
-    : config(config), stats(stats), gen(gen), codec(codec)
+               MessageCodec *codec,
+               const Placement *placement,
+               int batch_size)
+    : config(config), stats(stats), gen(gen), codec(codec), placement(placement),
+    batch_size(batch_size)
 {
+    if (batch_size > (int)MemcacheKVBatchRequest::MAX_OPS) {
+        panic("Batch size should be <= %zu", MemcacheKVBatchRequest::MAX_OPS);
+    }
+    if (batch_size > 1) {
+        this->batches.resize(config->n_app_threads,
+                             std::vector<Batch>(config->num_nodes));
+    }
 }
 
 Client::~Client()
@@ -204,10 +228,20 @@ void Client::receive_message(const Message &msg, const Address &addr, int tid)
     if (!this->codec->decode(msg, kvmsg)) {
         panic("Failed to decode message");
     }
-    assert(kvmsg.type == MemcacheKVMessage::Type::REPLY);
-    assert(kvmsg.reply.client_id == this->config->client_id);
-
-    complete_op(tid, kvmsg.reply);
+    switch (kvmsg.type) {
+    case MemcacheKVMessage::Type::REPLY:
+        assert(kvmsg.reply.client_id == this->config->client_id);
+        complete_op(tid, kvmsg.reply);
+        break;
+    case MemcacheKVMessage::Type::BATCH_REPLY:
+        assert(kvmsg.batch_reply.client_id == this->config->client_id);
+        for (size_t i = 0; i < kvmsg.batch_reply.n_ops; i++) {
+            complete_op(tid, kvmsg.batch_reply.ops[i]);
+        }
+        break;
+    default:
+        panic("Client received unexpected kv message");
+    }
 }
 
 void Client::run()
@@ -231,19 +265,35 @@ void Client::run_thread(int tid)
 
     do {
         this->gen->next_operation(tid, msg.request.op, time);
-        wait_ticks(time);
+        if (this->batch_size > 1) {
+            wait_batching(tid, time);
+        } else {
+            wait_ticks(time);
+        }
         gettimeofday(&now, nullptr);
         msg.request.req_time = (uint32_t)now.tv_usec;
-        msg.request.server_id = key_to_node_id(msg.request.op.key, this->config->num_nodes);
-        msg.request.req_id = req_id++;
-        execute_op(msg);
+        msg.request.op.keyhash = compute_keyhash(msg.request.op.key.data(),
+                                                 msg.request.op.key.size());
+        msg.request.server_id = this->placement->node_id(msg.request.op.keyhash);
+        if (this->batch_size > 1) {
+            batch_op(tid, msg.request.server_id, msg.request.op, now);
+        } else {
+            msg.request.req_id = req_id++;
+            execute_op(msg);
+        }
         this->stats->report_issue(tid);
     } while (latency(start, now) < this->config->duration * 1000000);
+
+    if (this->batch_size > 1) {
+        for (int server_id = 0; server_id < this->config->num_nodes; server_id++) {
+            flush_batch(tid, server_id);
+        }
+    }
 }
 
 void Client::execute_op(const MemcacheKVMessage &kvmsg)
 {
-    Message msg;
+    Message msg(this->transport);
     if (!this->codec->encode(msg, kvmsg)) {
         panic("Failed to encode message");
     }
@@ -257,6 +307,88 @@ void Client::execute_op(const MemcacheKVMessage &kvmsg)
     }
 }
 
+void Client::batch_op(int tid, int server_id, const Operation &op,
+                      const struct timeval &now)
+{
+    Batch &batch = this->batches.at(tid).at(server_id);
+
+    if (batch.n_ops == 0) {
+        batch.start = now;
+    }
+    batch.keys[batch.n_ops].assign(op.key.data(), op.key.size());
+    batch.ops[batch.n_ops] = op;
+    batch.ops[batch.n_ops].key = StringView(batch.keys[batch.n_ops]);
+    batch.n_ops++;
+    // Only the server knows the size of the values it returns, and it
+    // splits batch replies that exceed a packet
+    batch.req_bytes += BATCH_OP_OVERHEAD + op.key.size();
+    if (op.op_type != OpType::GET) {
+        batch.req_bytes += op.value.size();
+        batch.has_write = true;
+    }
+    if (batch.n_ops >= (size_t)this->batch_size ||
+        batch.req_bytes >= BATCH_MAX_BYTES) {
+        flush_batch(tid, server_id);
+    }
+    flush_expired_batches(tid, now);
+}
+
+void Client::flush_expired_batches(int tid, const struct timeval &now)
+{
+    std::vector<Batch> &batches = this->batches.at(tid);
+    for (int i = 0; i < this->config->num_nodes; i++) {
+        if (batches[i].n_ops > 0 && latency(batches[i].start, now) >= BATCH_TIMEOUT) {
+            flush_batch(tid, i);
+        }
+    }
+}
+
+void Client::wait_batching(int tid, long ticks)
+{
+    struct timeval now;
+    while (ticks > 0) {
+        long slice = std::min(ticks, (long)BATCH_WAIT_TICKS);
+        wait_ticks(slice);
+        ticks -= slice;
+        gettimeofday(&now, nullptr);
+        flush_expired_batches(tid, now);
+    }
+}
+
+void Client::flush_batch(int tid, int server_id)
+{
+    Batch &batch = this->batches.at(tid).at(server_id);
+    if (batch.n_ops == 0) {
+        return;
+    }
+
+    MemcacheKVMessage kvmsg;
+    kvmsg.type = MemcacheKVMessage::Type::BATCH_REQ;
+    kvmsg.batch_request.client_id = this->config->client_id;
+    kvmsg.batch_request.server_id = server_id;
+    kvmsg.batch_request.req_id = req_id++;
+    // Latency of every op in the batch includes the time spent batching
+    kvmsg.batch_request.req_time = (uint32_t)batch.start.tv_usec;
+    kvmsg.batch_request.n_ops = batch.n_ops;
+    kvmsg.batch_request.ops = batch.ops;
+
+    Message msg(this->transport);
+    if (!this->codec->encode(msg, kvmsg)) {
+        panic("Failed to encode message");
+    }
+    if (this->config->use_endhost_lb) {
+        this->transport->send_message_to_lb(msg);
+    } else {
+        // Chain replication: batches with writes go to the head rack
+        int rack_id = batch.has_write ? 0 : this->config->num_racks-1;
+        this->transport->send_message_to_node(msg, rack_id, server_id);
+    }
+
+    batch.n_ops = 0;
+    batch.req_bytes = 0;
+    batch.has_write = false;
+}
+
 void Client::complete_op(int tid, const MemcacheKVReply &reply)
 {
     struct timeval start_time, end_time;
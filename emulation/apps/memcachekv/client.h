@@ -13,6 +13,7 @@
 #include <configuration.h>
 #include <apps/memcachekv/stats.h>
 #include <apps/memcachekv/message.h>
+#include <apps/memcachekv/placement.h>
 
 namespace memcachekv {
 
@@ -50,6 +51,8 @@ public:
                         Stats *stats);
     ~KVWorkloadGenerator();
 
+    // op's key and value refer to the generator's buffers, valid until the
+    // thread's next call
     void next_operation(int tid, Operation &op, long &time);
 
 private:
@@ -80,6 +83,8 @@ private:
 
         uint64_t op_count;
         long mean_interval;
+        // Key of the thread's current operation, which only holds a view
+        std::string key;
         std::default_random_engine generator;
         std::uniform_real_distribution<float> unif_real_dist;
         std::uniform_int_distribution<int> unif_int_dist;
@@ -90,10 +95,14 @@ private:
 
 class Client : public Application {
 public:
+    // batch_size > 1 sends up to that many operations on keys with the same
+    // home server in one batch request
     Client(Configuration *config,
            Stats *stats,
            KVWorkloadGenerator *gen,
-           MessageCodec *codec);
+           MessageCodec *codec,
+           const Placement *placement,
+           int batch_size);
     ~Client();
 
     virtual void receive_message(const Message &msg,
@@ -104,12 +113,39 @@ public:
 
 private:
     void execute_op(const MemcacheKVMessage &kvmsg);
+    void batch_op(int tid, int server_id, const Operation &op,
+                  const struct timeval &now);
+    void flush_batch(int tid, int server_id);
+    // Flushes the batches whose first op has waited BATCH_TIMEOUT
+    void flush_expired_batches(int tid, const struct timeval &now);
+    // wait_ticks(ticks), flushing batches that time out meanwhile
+    void wait_batching(int tid, long ticks);
     void complete_op(int tid, const MemcacheKVReply &reply);
 
     Configuration *config;
     Stats *stats;
     KVWorkloadGenerator *gen;
     MessageCodec *codec;
+    const Placement *placement;
+    int batch_size;
+
+    // Operations waiting to be sent to one server
+    class Batch {
+    public:
+        Batch();
+
+        // Keys are copied, as the generator reuses its key buffer
+        std::string keys[MemcacheKVBatchRequest::MAX_OPS];
+        Operation ops[MemcacheKVBatchRequest::MAX_OPS];
+        size_t n_ops;
+        // Estimated request size
+        size_t req_bytes;
+        bool has_write;
+        // Generation time of the first op
+        struct timeval start;
+    };
+    // Per thread, per server
+    std::vector<std::vector<Batch>> batches;
 };
 
 } // namespace memcachekv
@@ -27,7 +27,7 @@ void Controller::run()
 {
     // Just send one message to the controller
     this->replied = false;
-    Message msg;
+    Message msg(this->transport);
     this->codec.encode(msg, this->ctrlmsg);
     for (int i = 0; i < this->config->num_racks; i++) {
         this->transport->send_message_to_controller(msg, i);
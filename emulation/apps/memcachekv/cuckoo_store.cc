@@ -0,0 +1,745 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <sys/mman.h>
+
+#include <logger.h>
+#include <apps/memcachekv/cuckoo_store.h>
+#include <apps/memcachekv/epoch.h>
+#include <apps/memcachekv/utils.h>
+
+#define CACHE_LINE_SIZE 64
+#define TABLE_PAGE_SIZE 4096
+
+// Picks the entries kicked out along cuckoo paths
+thread_local static unsigned int cuckoo_seed = 1;
+// Picks the buckets sampled for eviction
+thread_local static unsigned int evict_seed = 1;
+
+namespace memcachekv {
+
+CuckooStore::Entry::Entry(const StringView &key, keyhash_t keyhash,
+                          ver_t ver, const std::shared_ptr<const Value> &value)
+    : keyhash(keyhash), ver(ver), value(value), key_len(key.size()), access(0)
+{
+    memcpy(reinterpret_cast<char*>(this + 1), key.data(), key.size());
+}
+
+CuckooStore::Table::Table(size_t n_buckets)
+    : mask(n_buckets - 1), n_prefaulted(0), next_migrate(0), n_migrated(0)
+{
+    // Zero-filled pages are empty buckets, and are only faulted in when
+    // first used, so growing does not stall on clearing the new table
+    void *mem = mmap(nullptr, n_buckets * sizeof(Bucket), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        panic("Failed to allocate cuckoo store (%zu buckets)", n_buckets);
+    }
+    this->buckets = static_cast<Bucket*>(mem);
+}
+
+CuckooStore::Table::~Table()
+{
+    munmap(this->buckets, (this->mask + 1) * sizeof(Bucket));
+}
+
+void CuckooStore::Table::prefault()
+{
+    size_t b = this->n_prefaulted.fetch_add(1, std::memory_order_relaxed) *
+        (TABLE_PAGE_SIZE / sizeof(Bucket));
+    if (b <= this->mask) {
+        // The table may already be in use: write without changing anything
+        this->buckets[b].ver.fetch_add(0, std::memory_order_relaxed);
+    }
+}
+
+CuckooStore::Entry *CuckooStore::Table::find(size_t bucket, uint8_t tag,
+                                             const StringView &key,
+                                             keyhash_t keyhash) const
+{
+    const Bucket &b = this->buckets[bucket];
+    for (int j = 0; j < SLOTS_PER_BUCKET; j++) {
+        if (b.tags[j].load(std::memory_order_relaxed) != tag) {
+            continue;
+        }
+        Entry *entry = b.entries[j].load(std::memory_order_acquire);
+        if (entry != nullptr && entry->keyhash == keyhash && key.equals(entry->key(), entry->key_len)) {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+CuckooStore::CuckooStore(size_t capacity, SlabAllocator *slab, const CachePolicy &policy)
+    : slab(slab), policy(policy), sketch(nullptr), old_table(nullptr),
+    next_table(nullptr), n_items(0), used(0), clock_hand(0), lru_tick(0),
+    n_evictions(0), n_rejections(0)
+{
+    static_assert(sizeof(Bucket) == CACHE_LINE_SIZE, "Bucket should fill a cache line");
+
+    if (policy.admission) {
+        this->sketch = new FrequencySketch(capacity);
+    }
+    size_t n_buckets = MIN_BUCKETS;
+    while (policy.limit == 0 && n_buckets * SLOTS_PER_BUCKET < capacity * 2) {
+        n_buckets <<= 1;
+    }
+    this->table.store(new Table(n_buckets));
+}
+
+CuckooStore::~CuckooStore()
+{
+    Table *tables[3] = {this->table.load(), this->old_table.load(), this->next_table.load()};
+    for (Table *t : tables) {
+        if (t == nullptr) {
+            continue;
+        }
+        for (size_t i = 0; i <= t->mask; i++) {
+            for (int j = 0; j < SLOTS_PER_BUCKET; j++) {
+                Entry *entry = t->buckets[i].entries[j].load(std::memory_order_relaxed);
+                if (entry != nullptr) {
+                    free_entry(entry);
+                }
+            }
+        }
+        delete t;
+    }
+    delete this->sketch;
+}
+
+bool CuckooStore::get(const StringView &key, keyhash_t keyhash,
+                      ver_t &ver, std::shared_ptr<const Value> &value)
+{
+    uint32_t hv = mix_hash32(keyhash);
+    uint8_t tag = tag_of(hv);
+    Epoch::Guard guard;
+
+    // Admission weighs keys by how often they are read
+    if (this->sketch != nullptr) {
+        this->sketch->increment(keyhash);
+    }
+    for (int spins = 0; ; spins++) {
+        if (spins >= MAX_SPINS) {
+            std::this_thread::yield();
+        }
+        Table *t = this->table.load(std::memory_order_acquire);
+        Table *old = this->old_table.load(std::memory_order_acquire);
+        if (old == t) {
+            // Growing is switching tables
+            continue;
+        }
+        // Until its bucket is migrated, the key may still be in the old
+        // table: read the old versions first, so a key migrated after we
+        // looked in the new table shows up as a version change
+        size_t ob1 = 0, ob2 = 0;
+        uint32_t ov1 = 0, ov2 = 0;
+        if (old != nullptr) {
+            ob1 = old->index_of(hv);
+            ob2 = old->alt_index(ob1, tag);
+            ov1 = old->buckets[ob1].ver.load(std::memory_order_acquire);
+            ov2 = old->buckets[ob2].ver.load(std::memory_order_acquire);
+        }
+        size_t b1 = t->index_of(hv), b2 = t->alt_index(b1, tag);
+        const Bucket &l1 = t->buckets[b1], &l2 = t->buckets[b2];
+        uint32_t v1 = l1.ver.load(std::memory_order_acquire);
+        uint32_t v2 = l2.ver.load(std::memory_order_acquire);
+        Entry *entry = t->find(b1, tag, key, keyhash);
+        if (entry == nullptr) {
+            entry = t->find(b2, tag, key, keyhash);
+        }
+        if (entry == nullptr && old != nullptr) {
+            entry = old->find(ob1, tag, key, keyhash);
+            if (entry == nullptr) {
+                entry = old->find(ob2, tag, key, keyhash);
+            }
+        }
+        if (entry != nullptr) {
+            // Entries are immutable, and alive until the guard is released
+            ver = entry->ver;
+            value = entry->value;
+            touch(entry);
+            return true;
+        }
+        // A miss only counts if no bucket was modified meanwhile, and the
+        // buckets of t were not migrated to an even bigger table
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (((v1 | v2) & (LOCKED | MIGRATED)) == 0 &&
+            l1.ver.load(std::memory_order_relaxed) == v1 &&
+            l2.ver.load(std::memory_order_relaxed) == v2 &&
+            (old == nullptr ||
+             (((ov1 | ov2) & LOCKED) == 0 &&
+              old->buckets[ob1].ver.load(std::memory_order_relaxed) == ov1 &&
+              old->buckets[ob2].ver.load(std::memory_order_relaxed) == ov2))) {
+            return false;
+        }
+    }
+}
+
+bool CuckooStore::put(const StringView &key, keyhash_t keyhash,
+                      ver_t ver, const std::shared_ptr<const Value> &value)
+{
+    uint32_t hv = mix_hash32(keyhash);
+    uint8_t tag = tag_of(hv);
+    size_t charge = charge_of(key.size(), *value);
+    bool has_space = this->policy.limit == 0;
+    Epoch::Guard guard;
+
+    while (true) {
+        Table *t = this->table.load(std::memory_order_acquire);
+        Table *old = this->old_table.load(std::memory_order_acquire);
+        if (old == t) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (old != nullptr) {
+            // Move the key out of the old table, then amortize the rest of
+            // the migration
+            size_t ob1 = old->index_of(hv);
+            migrate_bucket(old, t, ob1);
+            migrate_bucket(old, t, old->alt_index(ob1, tag));
+            for (int i = 0; i < MIGRATE_BATCH; i++) {
+                size_t b = old->next_migrate.fetch_add(1, std::memory_order_relaxed);
+                if (b > old->mask) {
+                    break;
+                }
+                migrate_bucket(old, t, b);
+            }
+        }
+
+        size_t b1 = t->index_of(hv), b2 = t->alt_index(b1, tag);
+        size_t candidates[2] = {b1, b2};
+        if (!lock(t, b1, b2)) {
+            // t itself was replaced meanwhile
+            continue;
+        }
+        // Replace the entry of an existing key
+        for (size_t b : candidates) {
+            Bucket &bucket = t->buckets[b];
+            for (int j = 0; j < SLOTS_PER_BUCKET; j++) {
+                if (bucket.tags[j].load(std::memory_order_relaxed) != tag) {
+                    continue;
+                }
+                Entry *entry = bucket.entries[j].load(std::memory_order_relaxed);
+                if (entry == nullptr || entry->keyhash != keyhash || !key.equals(entry->key(), entry->key_len)) {
+                    continue;
+                }
+                bool stored = ver >= entry->ver;
+                if (stored) {
+                    Entry *replacement = new_entry(key, keyhash, ver, value);
+                    if (replacement == nullptr) {
+                        // Out of memory: keep the current value
+                        unlock(t, b1, b2);
+                        return false;
+                    }
+                    replacement->access.store(entry->access.load(std::memory_order_relaxed),
+                                              std::memory_order_relaxed);
+                    touch(replacement);
+                    bucket.entries[j].store(replacement, std::memory_order_release);
+                }
+                unlock(t, b1, b2);
+                if (stored) {
+                    if (this->policy.limit > 0) {
+                        // Wraps around if the value shrank
+                        this->used.fetch_add(charge - charge_of(entry->key_len, *entry->value),
+                                             std::memory_order_relaxed);
+                    }
+                    retire_entry(entry);
+                }
+                return stored;
+            }
+        }
+        if (!has_space) {
+            // Evicting locks other buckets
+            unlock(t, b1, b2);
+            if (!make_space(keyhash, charge)) {
+                return false;
+            }
+            // The key may have been inserted meanwhile: look again
+            has_space = true;
+            continue;
+        }
+        // Insert into a free slot
+        Entry *entry = new_entry(key, keyhash, ver, value);
+        if (entry == nullptr) {
+            unlock(t, b1, b2);
+            return false;
+        }
+        if (this->policy.limit > 0) {
+            // Counts as one access. Inserts are what evictions make room
+            // for, so they advance the LRU clock.
+            if (this->policy.eviction == EvictionType::CLOCK) {
+                entry->access.store(1, std::memory_order_relaxed);
+            } else {
+                entry->access.store(this->lru_tick.fetch_add(1, std::memory_order_relaxed) + 1,
+                                    std::memory_order_relaxed);
+            }
+        }
+        if (insert_free(t, b1, b2, tag, entry)) {
+            unlock(t, b1, b2);
+            if (this->policy.limit > 0) {
+                this->used.fetch_add(charge, std::memory_order_relaxed);
+            }
+            size_t n_items = this->n_items.fetch_add(1, std::memory_order_relaxed) + 1;
+            if (n_items * 100 > t->n_slots() * MAX_LOAD_PERCENT) {
+                grow(t);
+            } else if (n_items * 100 > t->n_slots() * PREPARE_LOAD_PERCENT) {
+                prepare_grow(t, n_items);
+            }
+            return true;
+        }
+        unlock(t, b1, b2);
+        free_entry(entry);
+
+        if (!make_room(t, b1, b2)) {
+            grow(t);
+        }
+    }
+}
+
+void CuckooStore::report() const
+{
+    Table *t = this->table.load(std::memory_order_acquire);
+    size_t n_items = this->n_items.load(std::memory_order_relaxed);
+    if (this->policy.limit == 0) {
+        info("Cuckoo store: %zu items in %zu buckets", n_items, t->mask + 1);
+        return;
+    }
+    info("Cuckoo store: %zu items in %zu buckets, %zu of %zu MB used, "
+         "%llu evictions, %llu inserts rejected by admission",
+         n_items, t->mask + 1,
+         this->used.load(std::memory_order_relaxed) >> 20, this->policy.limit >> 20,
+         (unsigned long long)this->n_evictions.load(std::memory_order_relaxed),
+         (unsigned long long)this->n_rejections.load(std::memory_order_relaxed));
+}
+
+void CuckooStore::prefetch(keyhash_t keyhash) const
+{
+    uint32_t hv = mix_hash32(keyhash);
+    Epoch::Guard guard;
+    const Table *t = this->table.load(std::memory_order_acquire);
+    size_t b1 = t->index_of(hv);
+    __builtin_prefetch(&t->buckets[b1], 1);
+    __builtin_prefetch(&t->buckets[t->alt_index(b1, tag_of(hv))], 1);
+}
+
+void CuckooStore::scan(const ScanFunction &fn) const
+{
+    Epoch::Guard guard;
+    Table *t, *old;
+    while (true) {
+        t = this->table.load(std::memory_order_acquire);
+        old = this->old_table.load(std::memory_order_acquire);
+        if (old != t) {
+            break;
+        }
+        // Growing is switching tables
+        std::this_thread::yield();
+    }
+    // Old table first: entries migrated meanwhile are found again in t
+    const Table *tables[] = {old, t};
+    for (const Table *table : tables) {
+        if (table == nullptr) {
+            continue;
+        }
+        for (size_t b = 0; b <= table->mask; b++) {
+            const Bucket &bucket = table->buckets[b];
+            for (int j = 0; j < SLOTS_PER_BUCKET; j++) {
+                const Entry *entry = bucket.entries[j].load(std::memory_order_acquire);
+                if (entry != nullptr) {
+                    fn(StringView(entry->key(), entry->key_len),
+                       entry->keyhash, entry->ver, entry->value);
+                }
+            }
+        }
+    }
+}
+
+CuckooStore::Entry *CuckooStore::new_entry(const StringView &key, keyhash_t keyhash,
+                                           ver_t ver, const std::shared_ptr<const Value> &value)
+{
+    size_t size = sizeof(Entry) + key.size();
+    void *mem = this->slab != nullptr ? this->slab->alloc(size) : ::operator new(size);
+    if (mem == nullptr) {
+        return nullptr;
+    }
+    return new (mem) Entry(key, keyhash, ver, value);
+}
+
+void CuckooStore::free_entry(Entry *entry)
+{
+    if (this->slab != nullptr) {
+        free_slab_entry(entry);
+    } else {
+        free_heap_entry(entry);
+    }
+}
+
+void CuckooStore::retire_entry(Entry *entry)
+{
+    Epoch::retire(entry, this->slab != nullptr ? free_slab_entry : free_heap_entry);
+}
+
+void CuckooStore::free_heap_entry(void *entry)
+{
+    static_cast<Entry*>(entry)->~Entry();
+    ::operator delete(entry);
+}
+
+void CuckooStore::free_slab_entry(void *entry)
+{
+    static_cast<Entry*>(entry)->~Entry();
+    SlabAllocator::free(entry);
+}
+
+bool CuckooStore::lock(Table *t, size_t b1, size_t b2)
+{
+    // Lock in index order to avoid deadlocks
+    if (b1 > b2) {
+        std::swap(b1, b2);
+    }
+    if (!acquire(t->buckets[b1])) {
+        return false;
+    }
+    if (b2 != b1 && !acquire(t->buckets[b2])) {
+        unlock(t, b1, b1);
+        return false;
+    }
+    // Readers seeing any of our stores must also see the odd versions
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+
+bool CuckooStore::acquire(Bucket &bucket)
+{
+    uint32_t v = bucket.ver.load(std::memory_order_relaxed);
+    for (int spins = 0; ; spins++) {
+        if ((v & MIGRATED) != 0) {
+            return false;
+        }
+        if ((v & LOCKED) == 0 &&
+            bucket.ver.compare_exchange_weak(v, v + 1, std::memory_order_acquire)) {
+            return true;
+        }
+        if (spins >= MAX_SPINS) {
+            std::this_thread::yield();
+        }
+        v = bucket.ver.load(std::memory_order_relaxed);
+    }
+}
+
+void CuckooStore::unlock(Table *t, size_t b1, size_t b2)
+{
+    // Versions wrap around below the MIGRATED bit
+    Bucket &l1 = t->buckets[b1], &l2 = t->buckets[b2];
+    l1.ver.store((l1.ver.load(std::memory_order_relaxed) + 1) & ~MIGRATED,
+                 std::memory_order_release);
+    if (b2 != b1) {
+        l2.ver.store((l2.ver.load(std::memory_order_relaxed) + 1) & ~MIGRATED,
+                     std::memory_order_release);
+    }
+}
+
+bool CuckooStore::insert_free(Table *t, size_t b1, size_t b2, uint8_t tag, Entry *entry)
+{
+    size_t candidates[2] = {b1, b2};
+    for (size_t b : candidates) {
+        Bucket &bucket = t->buckets[b];
+        for (int j = 0; j < SLOTS_PER_BUCKET; j++) {
+            if (bucket.entries[j].load(std::memory_order_relaxed) != nullptr) {
+                continue;
+            }
+            bucket.entries[j].store(entry, std::memory_order_release);
+            bucket.tags[j].store(tag, std::memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+void CuckooStore::prepare_grow(Table *t, size_t n_items)
+{
+    Table *next = this->next_table.load(std::memory_order_acquire);
+    if (next == nullptr) {
+        std::lock_guard<std::mutex> lck(this->grow_lock);
+        if (this->table.load(std::memory_order_relaxed) != t) {
+            return;
+        }
+        next = this->next_table.load(std::memory_order_relaxed);
+        if (next == nullptr) {
+            next = new Table((t->mask + 1) * 2);
+            this->next_table.store(next, std::memory_order_release);
+        }
+    }
+    // Fault in pages a few at a time, rather than all at once when the
+    // migration starts filling the table
+    if (n_items % PREFAULT_INTERVAL == 0) {
+        next->prefault();
+    }
+}
+
+void CuckooStore::grow(Table *t)
+{
+    std::lock_guard<std::mutex> lck(this->grow_lock);
+    if (this->table.load(std::memory_order_relaxed) != t) {
+        return;
+    }
+    // Finish the previous migration first, in case puts outpaced it
+    Table *old;
+    while ((old = this->old_table.load(std::memory_order_acquire)) != nullptr) {
+        size_t b = old->next_migrate.fetch_add(1, std::memory_order_relaxed);
+        if (b <= old->mask) {
+            migrate_bucket(old, t, b);
+        } else {
+            // Wait for migrations of other writers
+            std::this_thread::yield();
+        }
+    }
+    Table *bigger = this->next_table.exchange(nullptr, std::memory_order_relaxed);
+    if (bigger == nullptr) {
+        bigger = new Table((t->mask + 1) * 2);
+    }
+    this->old_table.store(t, std::memory_order_release);
+    this->table.store(bigger, std::memory_order_release);
+}
+
+void CuckooStore::migrate_bucket(Table *old, Table *t, size_t b)
+{
+    Bucket &bucket = old->buckets[b];
+    if (!acquire(bucket)) {
+        // Already migrated
+        return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int j = 0; j < SLOTS_PER_BUCKET; j++) {
+        Entry *entry = bucket.entries[j].load(std::memory_order_relaxed);
+        if (entry != nullptr) {
+            insert_migrated(t, entry);
+            bucket.entries[j].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    // Migrated buckets stay empty, and are never locked again
+    bucket.ver.store((bucket.ver.load(std::memory_order_relaxed) + 1) | MIGRATED,
+                     std::memory_order_release);
+
+    if (old->n_migrated.fetch_add(1, std::memory_order_acq_rel) == old->mask) {
+        // Last bucket: readers may still be looking at the old table
+        this->old_table.store(nullptr, std::memory_order_release);
+        Epoch::retire(old, (old->mask + 1) * sizeof(Bucket));
+    }
+}
+
+void CuckooStore::insert_migrated(Table *t, Entry *entry)
+{
+    uint32_t hv = mix_hash32(entry->keyhash);
+    uint8_t tag = tag_of(hv);
+    size_t b1 = t->index_of(hv), b2 = t->alt_index(b1, tag);
+
+    // t cannot be replaced before the migration to it completes
+    while (true) {
+        lock(t, b1, b2);
+        bool inserted = insert_free(t, b1, b2, tag, entry);
+        unlock(t, b1, b2);
+        if (inserted) {
+            return;
+        }
+        if (!make_room(t, b1, b2)) {
+            panic("Cuckoo store is full while growing (%zu buckets)", t->mask + 1);
+        }
+    }
+}
+
+bool CuckooStore::make_room(Table *t, size_t b1, size_t b2)
+{
+    // Random walks from both buckets, as octeon's cuckoo_search
+    PathEntry paths[2][MAX_CUCKOO_DEPTH];
+
+    for (int attempt = 0; attempt < MAX_CUCKOO_ATTEMPTS; attempt++) {
+        size_t cur[2] = {b1, b2};
+        bool retry = false;
+        for (int depth = 0; depth < MAX_CUCKOO_DEPTH && !retry; depth++) {
+            for (int p = 0; p < 2; p++) {
+                const Bucket &bucket = t->buckets[cur[p]];
+                PathEntry &step = paths[p][depth];
+                step.bucket = cur[p];
+                step.slot = -1;
+                step.entry = nullptr;
+                for (int j = 0; j < SLOTS_PER_BUCKET; j++) {
+                    if (bucket.entries[j].load(std::memory_order_acquire) == nullptr) {
+                        step.slot = j;
+                        break;
+                    }
+                }
+                if (step.slot < 0) {
+                    // Bucket is full: kick out a random entry
+                    step.slot = rand_r(&cuckoo_seed) % SLOTS_PER_BUCKET;
+                    step.entry = bucket.entries[step.slot].load(std::memory_order_acquire);
+                }
+                if (step.entry == nullptr) {
+                    // Found a free slot: shift the path into it
+                    if (move_path(t, paths[p], depth)) {
+                        return true;
+                    }
+                    retry = true;
+                    break;
+                }
+                cur[p] = t->alt_index(cur[p], tag_of(mix_hash32(step.entry->keyhash)));
+            }
+        }
+    }
+    return false;
+}
+
+bool CuckooStore::move_path(Table *t, const PathEntry *path, int depth)
+{
+    // Move entries backwards from the free slot, so that every entry stays
+    // reachable in one of its buckets
+    for (int d = depth - 1; d >= 0; d--) {
+        const PathEntry &from = path[d], &to = path[d + 1];
+        Bucket &src = t->buckets[from.bucket], &dst = t->buckets[to.bucket];
+
+        if (!lock(t, from.bucket, to.bucket)) {
+            return false;
+        }
+        // The path was found without locks: check it still holds
+        if (src.entries[from.slot].load(std::memory_order_relaxed) != from.entry ||
+            dst.entries[to.slot].load(std::memory_order_relaxed) != nullptr) {
+            unlock(t, from.bucket, to.bucket);
+            return false;
+        }
+        dst.entries[to.slot].store(from.entry, std::memory_order_release);
+        dst.tags[to.slot].store(tag_of(mix_hash32(from.entry->keyhash)),
+                                std::memory_order_release);
+        src.entries[from.slot].store(nullptr, std::memory_order_release);
+        unlock(t, from.bucket, to.bucket);
+    }
+    return true;
+}
+
+void CuckooStore::touch(Entry *entry)
+{
+    // Only store on a change, so hot entries are not written by every read
+    if (this->policy.limit == 0) {
+        return;
+    }
+    uint32_t access = entry->access.load(std::memory_order_relaxed);
+    if (this->policy.eviction == EvictionType::CLOCK) {
+        if (access < MAX_CLOCK_COUNT) {
+            entry->access.store(access + 1, std::memory_order_relaxed);
+        }
+    } else {
+        uint32_t now = this->lru_tick.load(std::memory_order_relaxed);
+        if (access != now) {
+            entry->access.store(now, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool CuckooStore::make_space(keyhash_t keyhash, size_t charge)
+{
+    int freq = this->sketch != nullptr ? this->sketch->frequency(keyhash) : -1;
+    for (int attempt = 0; attempt < MAX_EVICT_ATTEMPTS; ) {
+        if (this->used.load(std::memory_order_relaxed) + charge <= this->policy.limit) {
+            return true;
+        }
+        EvictResult result = this->policy.eviction == EvictionType::CLOCK ?
+            evict_clock(freq) : evict_lru(freq);
+        if (result == EvictResult::REJECTED) {
+            this->n_rejections.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (result == EvictResult::NONE) {
+            attempt++;
+        }
+    }
+    // No victims (e.g. items are still in the old table): go over the limit
+    return true;
+}
+
+CuckooStore::EvictResult CuckooStore::evict_clock(int freq)
+{
+    Table *t = this->table.load(std::memory_order_acquire);
+    for (size_t n = 0; n < CLOCK_SWEEP_BUCKETS; n++) {
+        size_t b = this->clock_hand.fetch_add(1, std::memory_order_relaxed) & t->mask;
+        const Bucket &bucket = t->buckets[b];
+        for (int j = 0; j < SLOTS_PER_BUCKET; j++) {
+            Entry *entry = bucket.entries[j].load(std::memory_order_acquire);
+            if (entry == nullptr) {
+                continue;
+            }
+            // Racing reads may undo this: the entry was read anyway
+            uint32_t count = entry->access.load(std::memory_order_relaxed);
+            if (count > 0) {
+                entry->access.store(count - 1, std::memory_order_relaxed);
+                continue;
+            }
+            EvictResult result = evict(t, b, j, entry, freq);
+            if (result != EvictResult::NONE) {
+                return result;
+            }
+        }
+    }
+    return EvictResult::NONE;
+}
+
+CuckooStore::EvictResult CuckooStore::evict_lru(int freq)
+{
+    Table *t = this->table.load(std::memory_order_acquire);
+    uint32_t now = this->lru_tick.load(std::memory_order_relaxed);
+    Entry *victim = nullptr;
+    size_t victim_bucket = 0;
+    int victim_slot = 0, n_sampled = 0;
+    int32_t victim_age = 0;
+
+    for (int n = 0; n < LRU_SAMPLE_BUCKETS && n_sampled < LRU_SAMPLES; n++) {
+        size_t b = (size_t)rand_r(&evict_seed) & t->mask;
+        const Bucket &bucket = t->buckets[b];
+        for (int j = 0; j < SLOTS_PER_BUCKET; j++) {
+            Entry *entry = bucket.entries[j].load(std::memory_order_acquire);
+            if (entry == nullptr) {
+                continue;
+            }
+            n_sampled++;
+            // Negative if accessed after we read the tick
+            int32_t age = (int32_t)(now - entry->access.load(std::memory_order_relaxed));
+            if (victim == nullptr || age > victim_age) {
+                victim = entry;
+                victim_bucket = b;
+                victim_slot = j;
+                victim_age = age;
+            }
+        }
+    }
+    if (victim == nullptr) {
+        return EvictResult::NONE;
+    }
+    return evict(t, victim_bucket, victim_slot, victim, freq);
+}
+
+CuckooStore::EvictResult CuckooStore::evict(Table *t, size_t b, int slot, Entry *entry, int freq)
+{
+    // The victim was found without locks (and cannot be freed meanwhile, as
+    // the caller holds an epoch guard): check it is still there
+    if (!lock(t, b, b)) {
+        return EvictResult::NONE;
+    }
+    Bucket &bucket = t->buckets[b];
+    if (bucket.entries[slot].load(std::memory_order_relaxed) != entry) {
+        unlock(t, b, b);
+        return EvictResult::NONE;
+    }
+    if (freq >= 0 && freq <= this->sketch->frequency(entry->keyhash)) {
+        unlock(t, b, b);
+        return EvictResult::REJECTED;
+    }
+    bucket.entries[slot].store(nullptr, std::memory_order_release);
+    unlock(t, b, b);
+
+    this->n_items.fetch_sub(1, std::memory_order_relaxed);
+    this->used.fetch_sub(charge_of(entry->key_len, *entry->value), std::memory_order_relaxed);
+    this->n_evictions.fetch_add(1, std::memory_order_relaxed);
+    retire_entry(entry);
+    return EvictResult::EVICTED;
+}
+
+} // namespace memcachekv
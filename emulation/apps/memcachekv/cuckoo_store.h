@@ -0,0 +1,224 @@
+#ifndef _MEMCACHEKV_CUCKOO_STORE_H_
+#define _MEMCACHEKV_CUCKOO_STORE_H_
+
+#include <atomic>
+#include <mutex>
+
+#include <apps/memcachekv/cache.h>
+#include <apps/memcachekv/slab.h>
+#include <apps/memcachekv/store.h>
+
+namespace memcachekv {
+
+/*
+ * Concurrent cuckoo hash table, ported from octeon/hash_table.c: every key
+ * has two candidate 4-way buckets, and 8-bit tags let lookups skip slots
+ * without touching their keys. Keys and values have arbitrary length.
+ *
+ * Reads are lock-free. Slots point to immutable entries, which writers
+ * replace rather than modify and free through epoch-based reclamation.
+ * Writers lock the buckets they modify with per-bucket versioned spinlocks. A
+ * lookup that misses re-checks the versions of both buckets, so a key being
+ * moved between its buckets by a cuckoo displacement is not reported
+ * missing (the KVC_START_READ/KVC_END_READ protocol of the octeon table).
+ *
+ * The table doubles when it gets too full or a cuckoo path cannot be found.
+ * Growing only switches to an empty table; buckets of the old table are then
+ * migrated a few at a time by puts, and readers check both tables meanwhile.
+ * A put first migrates the old buckets of its own key, so a key is never in
+ * both tables. Migrated buckets are marked so that writers still working on
+ * the old table retry on the new one.
+ *
+ * With a memory limit, inserting a new key first evicts entries of the
+ * current table until the key fits (see EvictionType); finding a victim
+ * takes no lock, and evicting it only locks its bucket. The limit is
+ * enforced approximately: concurrent inserts may overshoot it by an item
+ * each, and items still in an old table are not evicted until migrated.
+ * With admission, a key is only inserted if the sketch has seen it read more
+ * often than each victim, and put returns false otherwise.
+ */
+class CuckooStore : public Store {
+public:
+    // Initially sized to hold capacity items at a load factor of at most 1/2,
+    // unless policy limits memory, in which case the table grows with the
+    // items that fit. Entries are allocated from slab, or the heap if nullptr.
+    CuckooStore(size_t capacity, SlabAllocator *slab, const CachePolicy &policy);
+    ~CuckooStore();
+
+    virtual bool get(const StringView &key, keyhash_t keyhash,
+                     ver_t &ver, std::shared_ptr<const Value> &value) override final;
+    virtual bool put(const StringView &key, keyhash_t keyhash,
+                     ver_t ver, const std::shared_ptr<const Value> &value) override final;
+    virtual void report() const override final;
+    // Lock-free: items put, moved or migrated meanwhile may be missed or
+    // visited twice. Defers reclamation until it returns.
+    virtual void scan(const ScanFunction &fn) const override final;
+    virtual void prefetch(keyhash_t keyhash) const override final;
+
+    static const int SLOTS_PER_BUCKET = 4;
+    static const size_t MIN_BUCKETS = 64;
+    static const int MAX_CUCKOO_DEPTH = 250;
+    static const int MAX_CUCKOO_ATTEMPTS = 16;
+    // Load factor (in percent) beyond which the table grows
+    static const size_t MAX_LOAD_PERCENT = 90;
+    // Load factor (in percent) at which the next table is allocated, and its
+    // pages faulted in ahead of growing
+    static const size_t PREPARE_LOAD_PERCENT = 75;
+    // Inserts per page of the next table faulted in
+    static const size_t PREFAULT_INTERVAL = 8;
+    // Old buckets migrated by each put while the table grows
+    static const int MIGRATE_BATCH = 1;
+    // Spins before yielding to a (possibly descheduled) writer
+    static const int MAX_SPINS = 64;
+    // Highest CLOCK count of an entry, i.e. sweeps it survives unread
+    static const uint32_t MAX_CLOCK_COUNT = 3;
+    // Buckets the CLOCK hand sweeps per eviction attempt
+    static const size_t CLOCK_SWEEP_BUCKETS = 1024;
+    // Entries sampled by SAMPLED_LRU, and buckets visited to find them
+    static const int LRU_SAMPLES = 8;
+    static const int LRU_SAMPLE_BUCKETS = 16;
+    // Victims an insert tries to find before exceeding the limit
+    static const int MAX_EVICT_ATTEMPTS = 8;
+
+private:
+    // Followed by the key bytes, in the same allocation
+    struct Entry {
+        Entry(const StringView &key, keyhash_t keyhash,
+              ver_t ver, const std::shared_ptr<const Value> &value);
+
+        const char *key() const
+        {
+            return reinterpret_cast<const char*>(this + 1);
+        }
+
+        keyhash_t keyhash;
+        ver_t ver;
+        std::shared_ptr<const Value> value;
+        uint32_t key_len;
+        // Eviction state, the only mutable field: CLOCK count, or the
+        // SAMPLED_LRU tick of the last access
+        std::atomic<uint32_t> access;
+    };
+
+    struct Bucket {
+        // Versioned spinlock: odd while the bucket is being modified, and
+        // MIGRATED once its entries have moved to a bigger table
+        std::atomic<uint32_t> ver;
+        std::atomic<uint8_t> tags[SLOTS_PER_BUCKET];
+        std::atomic<Entry*> entries[SLOTS_PER_BUCKET];
+        char pad[24];
+    };
+    static const uint32_t LOCKED = 1;
+    static const uint32_t MIGRATED = 1U << 31;
+
+    struct Table {
+        Table(size_t n_buckets);
+        ~Table();
+
+        inline size_t index_of(uint32_t hv) const
+        {
+            return hv & this->mask;
+        }
+        // Alternate bucket of a key with tag in bucket (an involution)
+        inline size_t alt_index(size_t bucket, uint8_t tag) const
+        {
+            // magic number (i.e. 0x5bd1e995) is the hash constant from MurmurHash2
+            return (bucket ^ (((uint32_t)tag + 1) * 0x5bd1e995)) & this->mask;
+        }
+        inline size_t n_slots() const
+        {
+            return (this->mask + 1) * SLOTS_PER_BUCKET;
+        }
+        Entry *find(size_t bucket, uint8_t tag,
+                    const StringView &key, keyhash_t keyhash) const;
+        // Faults in the next page of the table
+        void prefault();
+
+        Bucket *buckets;
+        size_t mask;
+        std::atomic<size_t> n_prefaulted;
+        // Migration progress, once this table is being replaced
+        std::atomic<size_t> next_migrate;
+        std::atomic<size_t> n_migrated;
+    };
+
+    // One step of a cuckoo path: entry (nullptr for a free slot) at slot
+    struct PathEntry {
+        size_t bucket;
+        int slot;
+        Entry *entry;
+    };
+
+    enum class EvictResult {
+        EVICTED,
+        REJECTED,
+        NONE
+    };
+
+    static inline uint8_t tag_of(uint32_t hv)
+    {
+        return hv >> 24;
+    }
+    // Memory of an item counted against the limit
+    static inline size_t charge_of(size_t key_len, const Value &value)
+    {
+        return sizeof(Entry) + key_len + sizeof(Value) + value.size();
+    }
+    // Returns nullptr if the slab allocator is exhausted
+    Entry *new_entry(const StringView &key, keyhash_t keyhash,
+                     ver_t ver, const std::shared_ptr<const Value> &value);
+    void free_entry(Entry *entry);
+    // Frees entry once no reader can reference it
+    void retire_entry(Entry *entry);
+    static void free_heap_entry(void *entry);
+    static void free_slab_entry(void *entry);
+
+    // Lock functions fail on migrated buckets
+    static bool acquire(Bucket &bucket);
+    static bool lock(Table *t, size_t b1, size_t b2);
+    static void unlock(Table *t, size_t b1, size_t b2);
+    // Stores entry in a free slot of bucket b1 or b2 (both locked)
+    static bool insert_free(Table *t, size_t b1, size_t b2, uint8_t tag, Entry *entry);
+    // Frees a slot in bucket b1 or b2 by moving entries along a cuckoo path
+    static bool make_room(Table *t, size_t b1, size_t b2);
+    static bool move_path(Table *t, const PathEntry *path, int depth);
+    // Allocates the table replacing t and faults in part of it
+    void prepare_grow(Table *t, size_t n_items);
+    // Switches to a table twice the size of t, unless t was already replaced
+    void grow(Table *t);
+    // Moves the entries of bucket b of the old table to table t
+    void migrate_bucket(Table *old, Table *t, size_t b);
+    static void insert_migrated(Table *t, Entry *entry);
+    // Records an access to entry for eviction
+    void touch(Entry *entry);
+    // Evicts until charge more bytes fit in the limit. Fails if admission
+    // rejects the key (keyhash).
+    bool make_space(keyhash_t keyhash, size_t charge);
+    // Finds a victim and evicts it, unless a key read freq times (if not
+    // negative) is not more frequent
+    EvictResult evict_clock(int freq);
+    EvictResult evict_lru(int freq);
+    // Evicts entry from slot of bucket b, if still there
+    EvictResult evict(Table *t, size_t b, int slot, Entry *entry, int freq);
+
+    SlabAllocator *slab;
+    CachePolicy policy;
+    FrequencySketch *sketch;
+    std::atomic<Table*> table;
+    // Table being migrated to table, or nullptr
+    std::atomic<Table*> old_table;
+    // Table to grow into next, allocated ahead of time
+    std::atomic<Table*> next_table;
+    std::mutex grow_lock;
+    std::atomic<size_t> n_items;
+    // Memory bound: bytes charged for items, and eviction progress
+    std::atomic<size_t> used;
+    std::atomic<size_t> clock_hand;
+    std::atomic<uint32_t> lru_tick;
+    std::atomic<uint64_t> n_evictions;
+    std::atomic<uint64_t> n_rejections;
+};
+
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_CUCKOO_STORE_H_ */
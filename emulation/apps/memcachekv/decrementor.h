@@ -3,6 +3,7 @@
 
 #include <application.h>
 #include <configuration.h>
+#include <apps/memcachekv/wire.h>
 
 namespace memcachekv {
 
@@ -25,12 +26,8 @@ private:
 
     typedef uint16_t identifier_t;
     typedef uint8_t op_type_t;
-    typedef uint32_t keyhash_t;
-    typedef uint8_t node_t;
-    typedef uint16_t load_t;
-    typedef uint32_t ver_t;
 
-    static const size_t BUFSIZE = sizeof(identifier_t) + sizeof(op_type_t) + sizeof(keyhash_t) + sizeof(node_t) + sizeof(load_t) + sizeof(ver_t) + sizeof(node_t) + sizeof(load_t);
+    static const size_t BUFSIZE = wire::pegasus::HEADER_SIZE;
 
     static const identifier_t PEGASUS = 0x4750;
     static const op_type_t DEC = 0xF;
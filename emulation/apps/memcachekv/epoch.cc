@@ -0,0 +1,168 @@
+#include <logger.h>
+#include <apps/memcachekv/epoch.h>
+
+namespace memcachekv {
+
+/*
+ * An object retired in epoch e may still be referenced by guards entered in
+ * epochs e and e+1, so it is freed once the global epoch reaches e+2. The
+ * global epoch only advances when every active guard has seen it.
+ */
+static std::atomic<uint64_t> global_epoch(1);
+
+// Epoch announced by each registered thread; 0 while outside any guard
+struct EpochSlot {
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> used;
+    char pad[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<bool>)];
+};
+static EpochSlot slots[Epoch::MAX_THREADS];
+static std::atomic<int> n_slots(0);
+
+std::mutex Epoch::orphans_lock;
+std::vector<Epoch::Retired> Epoch::orphans;
+Epoch::ThreadState *Epoch::states[Epoch::MAX_THREADS];
+
+Epoch::ThreadState::ThreadState()
+    : slot(-1), depth(0), retired_bytes(0), n_exits(0)
+{
+    for (int i = 0; i < MAX_THREADS; i++) {
+        bool expected = false;
+        if (slots[i].used.compare_exchange_strong(expected, true)) {
+            slots[i].epoch.store(0);
+            this->slot = i;
+            break;
+        }
+    }
+    if (this->slot < 0) {
+        panic("More than %d threads use epoch reclamation", MAX_THREADS);
+    }
+    {
+        std::lock_guard<std::mutex> lck(orphans_lock);
+        states[this->slot] = this;
+    }
+    int n = n_slots.load();
+    while (n <= this->slot && !n_slots.compare_exchange_weak(n, this->slot + 1)) {
+    }
+}
+
+Epoch::ThreadState::~ThreadState()
+{
+    collect(*this);
+    {
+        std::lock_guard<std::mutex> lck(orphans_lock);
+        // Still referenced by other threads: hand over to the next collector
+        orphans.insert(orphans.end(), this->retired.begin(), this->retired.end());
+        states[this->slot] = nullptr;
+    }
+    slots[this->slot].epoch.store(0);
+    slots[this->slot].used.store(false);
+}
+
+Epoch::ThreadState &Epoch::thread_state()
+{
+    thread_local static ThreadState state;
+    return state;
+}
+
+Epoch::Guard::Guard()
+{
+    ThreadState &state = thread_state();
+    if (state.depth++ == 0) {
+        slots[state.slot].epoch.store(global_epoch.load(std::memory_order_relaxed),
+                                      std::memory_order_relaxed);
+        // Announce the epoch before reading any shared object
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+Epoch::Guard::~Guard()
+{
+    ThreadState &state = thread_state();
+    if (--state.depth == 0) {
+        slots[state.slot].epoch.store(0, std::memory_order_release);
+        if (!state.retired.empty() && ++state.n_exits >= COLLECT_INTERVAL) {
+            try_advance();
+            collect(state);
+        }
+    }
+}
+
+void Epoch::retire(void *obj, void (*deleter)(void*), size_t bytes)
+{
+    ThreadState &state = thread_state();
+    Retired r;
+    r.obj = obj;
+    r.deleter = deleter;
+    r.epoch = global_epoch.load();
+    r.bytes = bytes;
+    state.retired.push_back(r);
+    state.retired_bytes += bytes;
+    if (state.retired.size() >= COLLECT_THRESHOLD || state.retired_bytes >= COLLECT_BYTES) {
+        try_advance();
+        collect(state);
+    }
+}
+
+void Epoch::drain()
+{
+    std::vector<Retired> retired;
+    {
+        std::lock_guard<std::mutex> lck(orphans_lock);
+        retired.swap(orphans);
+        for (int i = 0; i < MAX_THREADS; i++) {
+            ThreadState *state = states[i];
+            if (state != nullptr) {
+                retired.insert(retired.end(), state->retired.begin(), state->retired.end());
+                state->retired.clear();
+                state->retired_bytes = 0;
+            }
+        }
+    }
+    // Outside the lock, as deleters may retire objects in turn
+    for (const Retired &r : retired) {
+        r.deleter(r.obj);
+    }
+}
+
+bool Epoch::try_advance()
+{
+    uint64_t epoch = global_epoch.load();
+    int n = n_slots.load();
+    for (int i = 0; i < n; i++) {
+        uint64_t e = slots[i].epoch.load();
+        if (e != 0 && e != epoch) {
+            return false;
+        }
+    }
+    return global_epoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+void Epoch::collect(ThreadState &state)
+{
+    std::vector<Retired> &retired = state.retired;
+    uint64_t epoch = global_epoch.load();
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+        if (retired[i].epoch + 2 <= epoch) {
+            state.retired_bytes -= retired[i].bytes;
+            retired[i].deleter(retired[i].obj);
+        } else {
+            retired[kept++] = retired[i];
+        }
+    }
+    retired.resize(kept);
+    state.n_exits = 0;
+
+    // Adopt objects retired by exited threads
+    std::unique_lock<std::mutex> lck(orphans_lock, std::try_to_lock);
+    if (lck.owns_lock() && !orphans.empty()) {
+        for (const Retired &r : orphans) {
+            state.retired_bytes += r.bytes;
+        }
+        retired.insert(retired.end(), orphans.begin(), orphans.end());
+        orphans.clear();
+    }
+}
+
+} // namespace memcachekv
@@ -0,0 +1,81 @@
+#ifndef _MEMCACHEKV_EPOCH_H_
+#define _MEMCACHEKV_EPOCH_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace memcachekv {
+
+/*
+ * Epoch-based memory reclamation for lock-free readers. Readers access
+ * shared objects only while holding an Epoch::Guard; writers unlink an
+ * object first and then retire it, and it is freed once every guard that
+ * might still reference it has been released. Process-wide, so objects of
+ * several stores share the same epochs.
+ */
+class Epoch {
+public:
+    class Guard {
+    public:
+        Guard();
+        ~Guard();
+    };
+
+    // bytes is the memory obj holds. Large objects (e.g. a whole table) are
+    // collected eagerly rather than after COLLECT_THRESHOLD retirements.
+    template<typename T>
+    static void retire(T *obj, size_t bytes = 0)
+    {
+        retire(obj, [](void *p) { delete static_cast<T*>(p); }, bytes);
+    }
+    static void retire(void *obj, void (*deleter)(void*), size_t bytes = 0);
+    // Frees the objects retired by every thread. Only once no thread
+    // accesses the stores any more, e.g. before deleting their allocator.
+    static void drain();
+
+    static const int MAX_THREADS = 256;
+
+private:
+    struct Retired {
+        void *obj;
+        void (*deleter)(void*);
+        uint64_t epoch;
+        size_t bytes;
+    };
+
+    struct ThreadState {
+        ThreadState();
+        ~ThreadState();
+
+        int slot;
+        int depth;
+        std::vector<Retired> retired;
+        // Of the objects in retired
+        size_t retired_bytes;
+        // Guards left since the last collection
+        unsigned n_exits;
+    };
+
+    static ThreadState &thread_state();
+    static bool try_advance();
+    static void collect(ThreadState &state);
+
+    static const size_t COLLECT_THRESHOLD = 64;
+    static const size_t COLLECT_BYTES = 1 << 20;
+    // While a thread holds retired objects, it also collects every
+    // COLLECT_INTERVAL guards, so that they are freed even if it retires
+    // nothing else
+    static const unsigned COLLECT_INTERVAL = 1024;
+
+    // Retired objects left behind by exited threads
+    static std::mutex orphans_lock;
+    static std::vector<Retired> orphans;
+    // State of each registered thread, by slot, also under orphans_lock
+    static ThreadState *states[MAX_THREADS];
+};
+
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_EPOCH_H_ */
@@ -21,6 +21,9 @@
 #define OP_MGR_REQ  0x5
 #define OP_MGR_ACK  0x6
 #define OP_PUT_FWD  0x7
+#define OP_BATCH    0x8
+#define OP_REP_BATCH 0x9
+#define OP_BATCH_SKIP 0x80
 
 #define USE_LOCKING
 
@@ -97,18 +100,20 @@ void RSetData::unlock()
 #endif /* USE_LOCKING */
 }
 
-LoadBalancer::LoadBalancer(Configuration *config)
-    : config(config), ver_next(1)
+LoadBalancer::LoadBalancer(Configuration *config, const Placement *placement)
+    : config(config), placement(placement), ver_next(1), running(true)
 {
     for (node_t i = 0; i < config->node_addresses.at(0).size(); i++) {
         this->all_servers.insert(i);
     }
+    this->codec = new WireCodec(false);
     this->ctrl_codec = new ControllerCodec();
     this->stats_lock = PTHREAD_RWLOCK_INITIALIZER;
 }
 
 LoadBalancer::~LoadBalancer()
 {
+    delete this->codec;
     delete this->ctrl_codec;
 }
 
@@ -129,7 +134,6 @@ bool LoadBalancer::receive_raw(void *buf, void *tdata, int tid)
     if (meta.forward) {
         rewrite_address(buf, meta);
         rewrite_pegasus_header(buf, header);
-        calculate_chksum(buf);
         this->transport->send_raw(buf, tdata);
         return true;
     } else {
@@ -142,6 +146,11 @@ void LoadBalancer::run()
     this->transport->run_app_threads(this);
 }
 
+void LoadBalancer::stop()
+{
+    this->running = false;
+}
+
 typedef std::function<bool(std::pair<keyhash_t, count_t>,
                            std::pair<keyhash_t, count_t>)> Comparator;
 static Comparator comp_desc =
@@ -160,7 +169,7 @@ static Comparator comp_asc =
 
 void LoadBalancer::run_thread(int tid)
 {
-    while (true) {
+    while (this->running) {
         usleep(LoadBalancer::STATS_EPOCH);
         /*
          * Construct hot ukeys sorted in descending order,
@@ -209,42 +218,38 @@ void LoadBalancer::run_thread(int tid)
     }
 }
 
-bool LoadBalancer::parse_pegasus_header(const void *pkt, struct PegasusHeader &header)
+bool LoadBalancer::parse_pegasus_header(void *pkt, struct PegasusHeader &header)
 {
-    const char *ptr = (const char*)pkt;
+    namespace hdr = wire::pegasus;
+    const struct udphdr *udp = (const struct udphdr*)((char*)pkt + ETHER_HDR_LEN + IPV4_HDR_LEN);
+    char *ptr = (char*)pkt + ETHER_HDR_LEN + IPV4_HDR_LEN + UDP_HDR_LEN;
 
-    ptr += ETHER_HDR_LEN;
-    ptr += IPV4_HDR_LEN;
-    ptr += UDP_HDR_LEN;
-
-    if (*(identifier_t*)ptr != PEGASUS_IDENTIFIER) {
+    if (hdr::identifier::load(ptr) != PEGASUS_IDENTIFIER) {
         return false;
     }
-    ptr += sizeof(identifier_t);
-    header.op_type = *(op_type_t*)ptr;
-    ptr += sizeof(op_type_t);
-    convert_endian(&header.keyhash, ptr, sizeof(keyhash_t));
-    ptr += sizeof(keyhash_t);
-    header.client_id = *(node_t*)ptr;
-    ptr += sizeof(node_t);
-    header.server_id = *(node_t*)ptr;
-    ptr += sizeof(node_t);
-    convert_endian(&header.load, ptr, sizeof(load_t));
-    ptr += sizeof(load_t);
-    convert_endian(&header.ver, ptr, sizeof(ver_t));
-    ptr += sizeof(ver_t);
-    ptr += sizeof(bitmap_t);
+    header.op_type = hdr::op_type::load(ptr);
+    header.keyhash = hdr::keyhash::load(ptr);
+    header.client_id = hdr::client_id::load(ptr);
+    header.server_id = hdr::server_id::load(ptr);
+    header.load = hdr::load::load(ptr);
+    header.ver = hdr::ver::load(ptr);
 
     switch (header.op_type) {
     case OP_GET:
     case OP_PUT:
     case OP_DEL:
-        ptr += sizeof(req_id_t);
-        ptr += sizeof(req_time_t);
-        ptr += sizeof(op_type_t);
-        header.key_len = *(key_len_t*)ptr;
-        ptr += sizeof(key_len_t);
-        header.key = (const char*)ptr;
+        header.key_len = hdr::request::key_len::load(ptr);
+        header.key = ptr + hdr::request::BASE_SIZE;
+        break;
+    case OP_BATCH:
+        if (ntohs(udp->len) < UDP_HDR_LEN + hdr::batch_request::BASE_SIZE) {
+            return false;
+        }
+        header.req_id = hdr::batch_request::req_id::load(ptr);
+        header.req_time = hdr::batch_request::req_time::load(ptr);
+        header.n_ops = hdr::batch_request::n_ops::load(ptr);
+        header.ops = ptr + hdr::batch_request::BASE_SIZE;
+        header.end = ptr + ntohs(udp->len) - UDP_HDR_LEN;
         break;
     default:
         break;
@@ -254,25 +259,15 @@ bool LoadBalancer::parse_pegasus_header(const void *pkt, struct PegasusHeader &h
 
 void LoadBalancer::rewrite_pegasus_header(void *pkt, const struct PegasusHeader &header)
 {
-    char *ptr = (char*)pkt;
-
-    ptr += ETHER_HDR_LEN;
-    ptr += IPV4_HDR_LEN;
-    ptr += UDP_HDR_LEN;
-
-    ptr += sizeof(identifier_t);
-    *(op_type_t*)ptr = header.op_type;
-    ptr += sizeof(op_type_t);
-    convert_endian(ptr, &header.keyhash, sizeof(keyhash_t));
-    ptr += sizeof(keyhash_t);
-    *(node_t*)ptr = header.client_id;
-    ptr += sizeof(node_t);
-    *(node_t*)ptr = header.server_id;
-    ptr += sizeof(node_t);
-    convert_endian(ptr, &header.load, sizeof(load_t));
-    ptr += sizeof(load_t);
-    convert_endian(ptr, &header.ver, sizeof(ver_t));
-    ptr += sizeof(ver_t);
+    namespace hdr = wire::pegasus;
+    char *ptr = (char*)pkt + ETHER_HDR_LEN + IPV4_HDR_LEN + UDP_HDR_LEN;
+
+    hdr::op_type::store(ptr, header.op_type);
+    hdr::keyhash::store(ptr, header.keyhash);
+    hdr::client_id::store(ptr, header.client_id);
+    hdr::server_id::store(ptr, header.server_id);
+    hdr::load::store(ptr, header.load);
+    hdr::ver::store(ptr, header.ver);
 }
 
 void LoadBalancer::rewrite_address(void *pkt, struct MetaData &meta)
@@ -292,35 +287,36 @@ void LoadBalancer::rewrite_address(void *pkt, struct MetaData &meta)
     memcpy(eth->ether_dhost, &dst_addr->ether_addr, ETH_ALEN);
     ptr += ETHER_HDR_LEN;
     struct iphdr *ip = (struct iphdr*)ptr;
+    // The addresses are adjacent: patch the checksum for both at once
+    uint64_t old_addrs, new_addrs;
+    memcpy(&old_addrs, &ip->saddr, sizeof(old_addrs));
     ip->saddr = src_addr->ip_addr;
     ip->daddr = dst_addr->ip_addr;
+    if (!this->transport->raw_ip_checksum_offload()) {
+        memcpy(&new_addrs, &ip->saddr, sizeof(new_addrs));
+        ip->check = update_chksum(ip->check, old_addrs, new_addrs);
+    }
     ptr += IPV4_HDR_LEN;
     struct udphdr *udp = (struct udphdr*)ptr;
     // Do not rewrite src udp port: we use the sender's random src udp port for
     // RSS
     udp->dest = dst_addr->udp_port;
+    udp->check = 0;
 }
 
-void LoadBalancer::calculate_chksum(void *pkt)
+uint16_t LoadBalancer::update_chksum(uint16_t chksum, uint64_t old_val, uint64_t new_val)
 {
-    char *ptr = (char*)pkt;
-    ptr += ETHER_HDR_LEN;
-    /* IP checksum */
-    struct iphdr *ip = (struct iphdr*)ptr;
-    // clear checksum before calculation
-    ip->check = 0;
-    uint32_t sum = 0;
-    uint16_t *v = (uint16_t*)ptr;
-    for (size_t i = 0; i < IPV4_HDR_LEN / sizeof(uint16_t); i++) {
-        sum += *v++;
-    }
-    sum = (sum >> 16) + (sum & 0xFFFF);
-    sum += (sum >> 16);
-    ip->check = ~sum;
-    /* UDP checksum */
-    ptr += IPV4_HDR_LEN;
-    struct udphdr *udp = (struct udphdr*)ptr;
-    udp->check = 0;
+    // Incremental update (RFC 1624): HC' = ~(~HC + ~m + m'), with the 16-bit
+    // words of m summed 32 bits at a time and folded once
+    uint64_t sum = (uint16_t)~chksum;
+    old_val = ~old_val;
+    sum += (old_val & 0xFFFFFFFF) + (old_val >> 32);
+    sum += (new_val & 0xFFFFFFFF) + (new_val >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
 }
 
 void LoadBalancer::process_pegasus_header(struct PegasusHeader &header,
@@ -344,6 +340,12 @@ void LoadBalancer::process_pegasus_header(struct PegasusHeader &header,
     case OP_MGR_ACK:
         handle_mgr_ack(header, meta);
         break;
+    case OP_BATCH:
+        handle_batch_req(header, meta);
+        break;
+    case OP_REP_BATCH:
+        handle_batch_reply(header, meta);
+        break;
     case OP_PUT_FWD:
         panic("Not implemented");
         break;
@@ -407,6 +409,103 @@ void LoadBalancer::handle_reply(struct PegasusHeader &header,
     }
 }
 
+void LoadBalancer::handle_batch_req(struct PegasusHeader &header,
+                                    struct MetaData &meta)
+{
+    namespace bop = wire::pegasus::batch_op;
+    char *ptr = header.ops;
+    bool has_write = false;
+    int n_ops = 0;
+
+    meta.is_server = true;
+    meta.forward = false;
+    meta.is_rkey = false;
+    meta.dst = header.server_id;
+    for (int i = 0; i < header.n_ops; i++) {
+        PegasusHeader op_header = header;
+        MetaData op_meta;
+        StringView value;
+        char *op_ptr = ptr;
+
+        if ((size_t)(header.end - ptr) < bop::BASE_SIZE) {
+            return;
+        }
+        op_header.op_type = bop::op_type::load(ptr);
+        op_header.keyhash = bop::keyhash::load(ptr);
+        op_header.key_len = bop::key_len::load(ptr);
+        op_header.key = ptr + bop::BASE_SIZE;
+        ptr += bop::BASE_SIZE + op_header.key_len;
+        if ((op_header.op_type & ~OP_BATCH_SKIP) == OP_PUT) {
+            // value_len (16) + value
+            if (header.end - ptr < (ptrdiff_t)sizeof(uint16_t)) {
+                return;
+            }
+            value = StringView(ptr + sizeof(uint16_t), wire::load<uint16_t>(ptr));
+            ptr += sizeof(uint16_t) + value.size();
+        }
+        if (ptr > header.end) {
+            return;
+        }
+        if (op_header.op_type & OP_BATCH_SKIP) {
+            continue;
+        }
+
+        if (this->rset.find(op_header.keyhash) != this->rset.end()) {
+            // Replicated key: route it as a single request, so that it is
+            // served by (and versioned for) its replica set
+            if (op_header.op_type == OP_GET) {
+                handle_read_req(op_header, op_meta);
+            } else {
+                handle_write_req(op_header, op_meta);
+            }
+            send_batch_op(op_header, op_meta, value);
+            bop::op_type::store(op_ptr, op_header.op_type | OP_BATCH_SKIP);
+        } else {
+            op_meta.is_rkey = false;
+            update_stats(op_header, op_meta);
+            has_write = has_write || op_header.op_type != OP_GET;
+            n_ops++;
+        }
+    }
+    // Writes left in the batch share one version
+    if (has_write) {
+        header.ver = std::atomic_fetch_add(&this->ver_next, {1});
+    }
+    meta.forward = n_ops > 0;
+}
+
+void LoadBalancer::handle_batch_reply(struct PegasusHeader &header,
+                                      struct MetaData &meta)
+{
+    // Batches only carry unreplicated keys: no replica set to update
+    meta.is_server = false;
+    meta.forward = true;
+    meta.dst = header.client_id;
+}
+
+void LoadBalancer::send_batch_op(const struct PegasusHeader &header,
+                                 const struct MetaData &meta,
+                                 const StringView &value)
+{
+    MemcacheKVMessage kvmsg;
+    kvmsg.type = MemcacheKVMessage::Type::REQUEST;
+    kvmsg.request.client_id = header.client_id;
+    kvmsg.request.server_id = header.server_id;
+    kvmsg.request.req_id = header.req_id;
+    kvmsg.request.req_time = header.req_time;
+    kvmsg.request.op.op_type = static_cast<OpType>(header.op_type);
+    kvmsg.request.op.keyhash = header.keyhash;
+    kvmsg.request.op.ver = header.ver;
+    kvmsg.request.op.key = StringView(header.key, header.key_len);
+    kvmsg.request.op.value = value;
+
+    Message msg(this->transport);
+    if (!this->codec->encode(msg, kvmsg)) {
+        panic("Failed to encode batch op");
+    }
+    this->transport->send_message_to_local_node(msg, meta.dst);
+}
+
 void LoadBalancer::handle_mgr_req(struct PegasusHeader &header,
                                   struct MetaData &meta)
 {
@@ -452,7 +551,8 @@ void LoadBalancer::update_stats(const struct PegasusHeader &header,
 
 void LoadBalancer::add_rkey(keyhash_t keyhash, const std::string &key)
 {
-    node_t home = keyhash % this->config->num_nodes;
+    // Same home server the client addressed the key to
+    node_t home = this->placement->node_id(keyhash);
     RSetData data(0, home);
     this->rkeys.insert(std::make_pair(keyhash, key));
     auto res = this->rset.insert(std::make_pair(keyhash, data));
@@ -463,7 +563,7 @@ void LoadBalancer::add_rkey(keyhash_t keyhash, const std::string &key)
         ctrl.replication.keyhash = keyhash;
         ctrl.replication.key = key;
 
-        Message msg;
+        Message msg(this->transport);
         if (!this->ctrl_codec->encode(msg, ctrl)) {
             panic("Failed to encode ControllerMessage");
         }
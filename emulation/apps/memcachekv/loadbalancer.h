@@ -10,6 +10,7 @@
 
 #include <application.h>
 #include <apps/memcachekv/message.h>
+#include <apps/memcachekv/placement.h>
 
 typedef uint16_t identifier_t;
 typedef uint8_t op_type_t;
@@ -37,6 +38,12 @@ struct PegasusHeader {
     ver_t ver;
     const char *key;
     size_t key_len;
+    /* Batch requests */
+    req_id_t req_id;
+    req_time_t req_time;
+    uint8_t n_ops;
+    char *ops;
+    const char *end;
 };
 
 /* Process pipeline metadata */
@@ -72,7 +79,7 @@ private:
 
 class LoadBalancer : public Application {
 public:
-    LoadBalancer(Configuration *config);
+    LoadBalancer(Configuration *config, const Placement *placement);
     ~LoadBalancer();
 
     virtual void receive_message(const Message &msg,
@@ -82,11 +89,15 @@ public:
     virtual void run() override final;
     virtual void run_thread(int tid) override final;
 
+    // Stops the stats threads
+    void stop();
+
 private:
-    bool parse_pegasus_header(const void *pkt, struct PegasusHeader &header);
+    bool parse_pegasus_header(void *pkt, struct PegasusHeader &header);
     void rewrite_pegasus_header(void *pkt, const struct PegasusHeader &header);
     void rewrite_address(void *pkt, struct MetaData &meta);
-    void calculate_chksum(void *pkt);
+    // Patch an IP checksum for a changed 64-bit field
+    static uint16_t update_chksum(uint16_t chksum, uint64_t old_val, uint64_t new_val);
     void process_pegasus_header(struct PegasusHeader &header,
                                 struct MetaData &meta);
     void handle_read_req(struct PegasusHeader &header,
@@ -95,6 +106,14 @@ private:
                           struct MetaData &meta);
     void handle_reply(struct PegasusHeader &header,
                       struct MetaData &meta);
+    void handle_batch_req(struct PegasusHeader &header,
+                          struct MetaData &meta);
+    void handle_batch_reply(struct PegasusHeader &header,
+                            struct MetaData &meta);
+    // Send one op of a batch as a request of its own
+    void send_batch_op(const struct PegasusHeader &header,
+                       const struct MetaData &meta,
+                       const StringView &value);
     void handle_mgr_req(struct PegasusHeader &header,
                         struct MetaData &meta);
     void handle_mgr_ack(struct PegasusHeader &header,
@@ -106,8 +125,11 @@ private:
                       keyhash_t oldhash, const std::string &oldkey);
 
     Configuration *config;
+    const Placement *placement;
+    MessageCodec *codec;
     ControllerCodec *ctrl_codec;
     std::atomic_uint ver_next;
+    std::atomic<bool> running;
     static const size_t MAX_RSET_SIZE = 32;
     tbb::concurrent_unordered_map<keyhash_t, RSetData> rset;
     RSetData all_servers;
@@ -11,39 +11,27 @@ using std::string;
 
 namespace memcachekv {
 
+// Decoded batch operations, valid until the thread's next decode
+thread_local static Operation batch_ops[MemcacheKVBatchRequest::MAX_OPS];
+thread_local static MemcacheKVReply batch_replies[MemcacheKVBatchRequest::MAX_OPS];
+
 bool WireCodec::decode(const Message &in, MemcacheKVMessage &out)
 {
-    const char *ptr = (const char*)in.buf();
+    namespace hdr = wire::pegasus;
+    const char *buf = (const char*)in.buf();
+    const char *ptr;
     size_t buf_size = in.len();
 
     if (buf_size < PACKET_BASE_SIZE) {
         return false;
     }
-    if (this->proto_enable && *(identifier_t*)ptr != PEGASUS) {
-        return false;
-    }
-    if (!this->proto_enable && *(identifier_t*)ptr != STATIC) {
+    if (hdr::identifier::load(buf) != (this->proto_enable ? PEGASUS : STATIC)) {
         return false;
     }
     // Header
-    ptr += sizeof(identifier_t);
-    op_type_t op_type = *(op_type_t*)ptr;
-    ptr += sizeof(op_type_t);
-    keyhash_t keyhash;
-    convert_endian(&keyhash, ptr, sizeof(keyhash_t));
-    ptr += sizeof(keyhash_t);
-    uint8_t client_id = *(node_t*)ptr;
-    ptr += sizeof(node_t);
-    uint8_t server_id = *(node_t*)ptr;
-    ptr += sizeof(node_t);
-    load_t load;
-    convert_endian(&load, ptr, sizeof(load_t));
-    ptr += sizeof(load_t);
-    ver_t ver;
-    convert_endian(&ver, ptr, sizeof(ver_t));
-    ptr += sizeof(ver_t);
-    ptr += sizeof(bitmap_t);
-    ptr += sizeof(hdr_req_id_t);
+    op_type_t op_type = hdr::op_type::load(buf);
+    keyhash_t keyhash = hdr::keyhash::load(buf);
+    ver_t ver = hdr::ver::load(buf);
 
     // Payload
     switch (op_type) {
@@ -52,65 +40,59 @@ bool WireCodec::decode(const Message &in, MemcacheKVMessage &out)
     case OP_DEL:
     case OP_PUT_FWD: {
         // Request
+        namespace req = hdr::request;
         if (buf_size < REQUEST_BASE_SIZE) {
             return false;
         }
         out.type = MemcacheKVMessage::Type::REQUEST;
-        out.request.client_id = client_id;
-        out.request.server_id = server_id;
-        out.request.req_id = *(req_id_t*)ptr;
-        ptr += sizeof(req_id_t);
-        out.request.req_time = *(req_time_t*)ptr;
-        ptr += sizeof(req_time_t);
-        out.request.op.op_type = static_cast<OpType>(*(op_type_t*)ptr);
-        ptr += sizeof(op_type_t);
+        out.request.client_id = hdr::client_id::load(buf);
+        out.request.server_id = hdr::server_id::load(buf);
+        out.request.req_id = req::req_id::load(buf);
+        out.request.req_time = req::req_time::load(buf);
+        out.request.op.op_type = static_cast<OpType>(req::op_type::load(buf));
         out.request.op.keyhash = keyhash;
         out.request.op.ver = ver;
-        key_len_t key_len = *(key_len_t*)ptr;
-        ptr += sizeof(key_len_t);
+        key_len_t key_len = req::key_len::load(buf);
         if (buf_size < REQUEST_BASE_SIZE + key_len) {
             return false;
         }
-        out.request.op.key = string(ptr, key_len);
+        ptr = buf + REQUEST_BASE_SIZE;
+        out.request.op.key = StringView(ptr, key_len);
         ptr += key_len;
         if (op_type == OP_PUT || op_type == OP_PUT_FWD) {
             if (buf_size < REQUEST_BASE_SIZE + key_len + sizeof(value_len_t)) {
                 return false;
             }
-            value_len_t value_len = *(value_len_t*)ptr;
+            value_len_t value_len = wire::load<value_len_t>(ptr);
             ptr += sizeof(value_len_t);
             if (buf_size < REQUEST_BASE_SIZE + key_len + sizeof(value_len_t) + value_len) {
                 return false;
             }
-            out.request.op.value = string(ptr, value_len);
+            out.request.op.value = StringView(ptr, value_len);
         }
         break;
     }
     case OP_REP_R:
     case OP_REP_W: {
+        namespace rep = hdr::reply;
         if (buf_size < REPLY_BASE_SIZE) {
             return false;
         }
         out.type = MemcacheKVMessage::Type::REPLY;
-        out.reply.client_id = client_id;
-        out.reply.server_id = server_id;
+        out.reply.client_id = hdr::client_id::load(buf);
+        out.reply.server_id = hdr::server_id::load(buf);
         out.reply.keyhash = keyhash;
-        out.reply.load = load;
+        out.reply.load = hdr::load::load(buf);
         out.reply.ver = ver;
-        out.reply.req_id = *(req_id_t*)ptr;
-        ptr += sizeof(req_id_t);
-        out.reply.req_time = *(req_time_t*)ptr;
-        ptr += sizeof(req_time_t);
-        out.reply.op_type = static_cast<OpType>(*(op_type_t*)ptr);
-        ptr += sizeof(op_type_t);
-        out.reply.result = static_cast<Result>(*(result_t*)ptr);
-        ptr += sizeof(result_t);
-        value_len_t value_len = *(value_len_t*)ptr;
-        ptr += sizeof(value_len_t);
+        out.reply.req_id = rep::req_id::load(buf);
+        out.reply.req_time = rep::req_time::load(buf);
+        out.reply.op_type = static_cast<OpType>(rep::op_type::load(buf));
+        out.reply.result = static_cast<Result>(rep::result::load(buf));
+        value_len_t value_len = rep::value_len::load(buf);
         if (buf_size < REPLY_BASE_SIZE + value_len) {
             return false;
         }
-        out.reply.value = string(ptr, value_len);
+        out.reply.value = StringView(buf + REPLY_BASE_SIZE, value_len);
         break;
     }
     case OP_RC_REQ: {
@@ -120,14 +102,126 @@ bool WireCodec::decode(const Message &in, MemcacheKVMessage &out)
         out.type = MemcacheKVMessage::Type::RC_REQ;
         out.rc_request.keyhash = keyhash;
         out.rc_request.ver = ver;
-        key_len_t key_len = *(key_len_t *)ptr;
-        ptr += sizeof(key_len_t);
-        out.rc_request.key = string(ptr, key_len);
+        key_len_t key_len = hdr::rc_request::key_len::load(buf);
+        if (buf_size < RC_REQ_BASE_SIZE + key_len) {
+            return false;
+        }
+        ptr = buf + hdr::rc_request::key_len::END;
+        out.rc_request.key = StringView(ptr, key_len);
         ptr += key_len;
-        value_len_t value_len = *(value_len_t *)ptr;
+        value_len_t value_len = wire::load<value_len_t>(ptr);
         ptr += sizeof(value_len_t);
-        out.rc_request.value = string(ptr, value_len);
-        ptr += value_len;
+        if (buf_size < RC_REQ_BASE_SIZE + key_len + value_len) {
+            return false;
+        }
+        out.rc_request.value = StringView(ptr, value_len);
+        break;
+    }
+    case OP_BATCH: {
+        namespace batch = hdr::batch_request;
+        namespace bop = hdr::batch_op;
+        if (buf_size < BATCH_REQ_BASE_SIZE) {
+            return false;
+        }
+        size_t n_ops = batch::n_ops::load(buf);
+        if (n_ops > MemcacheKVBatchRequest::MAX_OPS) {
+            return false;
+        }
+        out.type = MemcacheKVMessage::Type::BATCH_REQ;
+        out.batch_request.client_id = hdr::client_id::load(buf);
+        out.batch_request.server_id = hdr::server_id::load(buf);
+        out.batch_request.req_id = batch::req_id::load(buf);
+        out.batch_request.req_time = batch::req_time::load(buf);
+        out.batch_request.n_ops = 0;
+        out.batch_request.ops = batch_ops;
+        const char *end = buf + buf_size;
+        ptr = buf + BATCH_REQ_BASE_SIZE;
+        for (size_t i = 0; i < n_ops; i++) {
+            if ((size_t)(end - ptr) < bop::BASE_SIZE) {
+                return false;
+            }
+            op_type_t bop_type = bop::op_type::load(ptr);
+            Operation &op = batch_ops[out.batch_request.n_ops];
+            op.op_type = static_cast<OpType>(bop_type & ~BATCH_OP_SKIP);
+            op.keyhash = bop::keyhash::load(ptr);
+            op.ver = ver;
+            key_len_t key_len = bop::key_len::load(ptr);
+            ptr += bop::BASE_SIZE;
+            if ((size_t)(end - ptr) < key_len) {
+                return false;
+            }
+            op.key = StringView(ptr, key_len);
+            ptr += key_len;
+            op.value = StringView();
+            switch (op.op_type) {
+            case OpType::GET:
+            case OpType::DEL:
+                break;
+            case OpType::PUT: {
+                if ((size_t)(end - ptr) < sizeof(value_len_t)) {
+                    return false;
+                }
+                value_len_t value_len = wire::load<value_len_t>(ptr);
+                ptr += sizeof(value_len_t);
+                if ((size_t)(end - ptr) < value_len) {
+                    return false;
+                }
+                op.value = StringView(ptr, value_len);
+                ptr += value_len;
+                break;
+            }
+            default:
+                return false;
+            }
+            if (!(bop_type & BATCH_OP_SKIP)) {
+                out.batch_request.n_ops++;
+            }
+        }
+        break;
+    }
+    case OP_REP_BATCH: {
+        namespace batch = hdr::batch_reply;
+        namespace bop = hdr::batch_op_reply;
+        if (buf_size < BATCH_REPLY_BASE_SIZE) {
+            return false;
+        }
+        size_t n_ops = batch::n_ops::load(buf);
+        if (n_ops > MemcacheKVBatchRequest::MAX_OPS) {
+            return false;
+        }
+        out.type = MemcacheKVMessage::Type::BATCH_REPLY;
+        out.batch_reply.client_id = hdr::client_id::load(buf);
+        out.batch_reply.server_id = hdr::server_id::load(buf);
+        out.batch_reply.req_id = batch::req_id::load(buf);
+        out.batch_reply.req_time = batch::req_time::load(buf);
+        out.batch_reply.n_ops = n_ops;
+        out.batch_reply.ops = batch_replies;
+        const char *end = buf + buf_size;
+        ptr = buf + BATCH_REPLY_BASE_SIZE;
+        for (size_t i = 0; i < n_ops; i++) {
+            if ((size_t)(end - ptr) < bop::BASE_SIZE) {
+                return false;
+            }
+            MemcacheKVReply &reply = batch_replies[i];
+            reply.client_id = out.batch_reply.client_id;
+            reply.server_id = out.batch_reply.server_id;
+            reply.req_id = out.batch_reply.req_id;
+            reply.req_time = out.batch_reply.req_time;
+            reply.op_type = static_cast<OpType>(bop::op_type::load(ptr));
+            reply.keyhash = 0;
+            reply.ver = ver;
+            reply.key = StringView();
+            reply.value_owner = nullptr;
+            reply.result = static_cast<Result>(bop::result::load(ptr));
+            reply.load = 0;
+            value_len_t value_len = bop::value_len::load(ptr);
+            ptr += bop::BASE_SIZE;
+            if ((size_t)(end - ptr) < value_len) {
+                return false;
+            }
+            reply.value = StringView(ptr, value_len);
+            ptr += value_len;
+        }
         break;
     }
     case OP_RC_ACK: {
@@ -140,8 +234,23 @@ bool WireCodec::decode(const Message &in, MemcacheKVMessage &out)
     return true;
 }
 
+bool WireCodec::peek_keyhash(const Message &in, memcachekv::keyhash_t &keyhash)
+{
+    const void *buf = in.buf();
+
+    if (in.len() < PACKET_BASE_SIZE) {
+        return false;
+    }
+    if (wire::pegasus::identifier::load(buf) != (this->proto_enable ? PEGASUS : STATIC)) {
+        return false;
+    }
+    keyhash = wire::pegasus::keyhash::load(buf);
+    return true;
+}
+
 bool WireCodec::encode(Message &out, const MemcacheKVMessage &in)
 {
+    namespace hdr = wire::pegasus;
     // First determine buffer size
     size_t buf_size;
     switch (in.type) {
@@ -154,7 +263,8 @@ bool WireCodec::encode(Message &out, const MemcacheKVMessage &in)
         break;
     }
     case MemcacheKVMessage::Type::REPLY: {
-        buf_size = REPLY_BASE_SIZE + in.reply.value.size();
+        // A stored value is attached as an external tail, not copied
+        buf_size = REPLY_BASE_SIZE + (in.reply.value_owner ? 0 : in.reply.value.size());
         break;
     }
     case MemcacheKVMessage::Type::RC_REQ: {
@@ -165,114 +275,134 @@ bool WireCodec::encode(Message &out, const MemcacheKVMessage &in)
         buf_size = RC_ACK_BASE_SIZE;
         break;
     }
+    case MemcacheKVMessage::Type::BATCH_REQ: {
+        if (in.batch_request.n_ops == 0 ||
+            in.batch_request.n_ops > MemcacheKVBatchRequest::MAX_OPS) {
+            return false;
+        }
+        buf_size = BATCH_REQ_BASE_SIZE;
+        for (size_t i = 0; i < in.batch_request.n_ops; i++) {
+            const Operation &op = in.batch_request.ops[i];
+            buf_size += hdr::batch_op::BASE_SIZE + op.key.size();
+            if (op.op_type == OpType::PUT) {
+                buf_size += sizeof(value_len_t) + op.value.size();
+            }
+        }
+        break;
+    }
+    case MemcacheKVMessage::Type::BATCH_REPLY: {
+        if (in.batch_reply.n_ops > MemcacheKVBatchRequest::MAX_OPS) {
+            return false;
+        }
+        buf_size = BATCH_REPLY_BASE_SIZE;
+        for (size_t i = 0; i < in.batch_reply.n_ops; i++) {
+            const MemcacheKVReply &reply = in.batch_reply.ops[i];
+            buf_size += hdr::batch_op_reply::BASE_SIZE;
+            if (reply.op_type == OpType::GET) {
+                buf_size += reply.value.size();
+            }
+        }
+        break;
+    }
     default:
         return false;
     }
 
-    char *buf = (char*)malloc(buf_size);
-    char *ptr = buf;
+    char *buf = (char*)out.alloc_buf(buf_size);
+    char *ptr;
     // Header
-    if (this->proto_enable) {
-        *(identifier_t*)ptr = PEGASUS;
-    } else {
-        *(identifier_t*)ptr = STATIC;
-    }
-    ptr += sizeof(identifier_t);
+    hdr::identifier::store(buf, this->proto_enable ? PEGASUS : STATIC);
     switch (in.type) {
     case MemcacheKVMessage::Type::REQUEST: {
         switch (in.request.op.op_type) {
         case OpType::GET:
-            *(op_type_t*)ptr = OP_GET;
+            hdr::op_type::store(buf, OP_GET);
             break;
         case OpType::PUT:
-            *(op_type_t*)ptr = OP_PUT;
+            hdr::op_type::store(buf, OP_PUT);
             break;
         case OpType::DEL:
-            *(op_type_t*)ptr = OP_DEL;
+            hdr::op_type::store(buf, OP_DEL);
             break;
         case OpType::PUTFWD:
-            *(op_type_t*)ptr = OP_PUT_FWD;
+            hdr::op_type::store(buf, OP_PUT_FWD);
             break;
         default:
             return false;
         }
-        ptr += sizeof(op_type_t);
-        keyhash_t hash = (keyhash_t)compute_keyhash(in.request.op.key);
-        convert_endian(ptr, &hash, sizeof(keyhash_t));
-        ptr += sizeof(keyhash_t);
-        *(node_t*)ptr = in.request.client_id;
-        ptr += sizeof(node_t);
-        *(node_t*)ptr = in.request.server_id;
-        ptr += sizeof(node_t);
-        ptr += sizeof(load_t);
-        ver_t base_version = BASE_VERSION;
-        convert_endian(ptr, &base_version, sizeof(ver_t));
-        ptr += sizeof(ver_t);
-        *(bitmap_t*)ptr = 0;
-        ptr += sizeof(bitmap_t);
-        *(hdr_req_id_t*)ptr = (hdr_req_id_t)in.request.req_id;
-        ptr += sizeof(hdr_req_id_t);
+        hdr::keyhash::store(buf, in.request.op.keyhash);
+        hdr::client_id::store(buf, in.request.client_id);
+        hdr::server_id::store(buf, in.request.server_id);
+        hdr::load::store(buf, 0);
+        // Versions are assigned by the load balancer
+        hdr::ver::store(buf, in.request.op.ver != 0 ? in.request.op.ver : BASE_VERSION);
+        hdr::bitmap::store(buf, 0);
+        hdr::hdr_req_id::store(buf, (hdr_req_id_t)in.request.req_id);
         break;
     }
     case MemcacheKVMessage::Type::REPLY: {
         switch (in.reply.op_type) {
         case OpType::GET:
-            *(op_type_t*)ptr = OP_REP_R;
+            hdr::op_type::store(buf, OP_REP_R);
             break;
         case OpType::PUT:
         case OpType::DEL:
-            *(op_type_t*)ptr = OP_REP_W;
+            hdr::op_type::store(buf, OP_REP_W);
             break;
         default:
             return false;
         }
-        ptr += sizeof(op_type_t);
-        convert_endian(ptr, &in.reply.keyhash, sizeof(keyhash_t));
-        ptr += sizeof(keyhash_t);
-        *(node_t*)ptr = in.reply.client_id;
-        ptr += sizeof(node_t);
-        *(node_t*)ptr = in.reply.server_id;
-        ptr += sizeof(node_t);
-        convert_endian(ptr, &in.reply.load, sizeof(load_t));
-        ptr += sizeof(load_t);
-        convert_endian(ptr, &in.reply.ver, sizeof(ver_t));
-        ptr += sizeof(ver_t);
-        bitmap_t bitmap = 1 << in.reply.server_id;
-        convert_endian(ptr, &bitmap, sizeof(bitmap_t));
-        ptr += sizeof(bitmap_t);
-        *(hdr_req_id_t*)ptr = (hdr_req_id_t)in.reply.req_id;
-        ptr += sizeof(hdr_req_id_t);
+        hdr::keyhash::store(buf, in.reply.keyhash);
+        hdr::client_id::store(buf, in.reply.client_id);
+        hdr::server_id::store(buf, in.reply.server_id);
+        hdr::load::store(buf, in.reply.load);
+        hdr::ver::store(buf, in.reply.ver);
+        hdr::bitmap::store(buf, 1 << in.reply.server_id);
+        hdr::hdr_req_id::store(buf, (hdr_req_id_t)in.reply.req_id);
         break;
     }
     case MemcacheKVMessage::Type::RC_REQ: {
-        *(op_type_t*)ptr = OP_RC_REQ;
-        ptr += sizeof(op_type_t);
-        convert_endian(ptr, &in.rc_request.keyhash, sizeof(keyhash_t));
-        ptr += sizeof(keyhash_t);
-        ptr += sizeof(node_t);
-        ptr += sizeof(node_t);
-        ptr += sizeof(load_t);
-        convert_endian(ptr, &in.rc_request.ver, sizeof(ver_t));
-        ptr += sizeof(ver_t);
-        ptr += sizeof(bitmap_t);
-        ptr += sizeof(hdr_req_id_t);
+        hdr::op_type::store(buf, OP_RC_REQ);
+        hdr::keyhash::store(buf, in.rc_request.keyhash);
+        hdr::client_id::store(buf, 0);
+        hdr::server_id::store(buf, 0);
+        hdr::load::store(buf, 0);
+        hdr::ver::store(buf, in.rc_request.ver);
+        hdr::bitmap::store(buf, 0);
+        hdr::hdr_req_id::store(buf, 0);
         break;
     }
     case MemcacheKVMessage::Type::RC_ACK: {
-        *(op_type_t*)ptr = OP_RC_ACK;
-        ptr += sizeof(op_type_t);
-        convert_endian(ptr, &in.rc_ack.keyhash, sizeof(keyhash_t));
-        ptr += sizeof(keyhash_t);
-        ptr += sizeof(node_t);
-        *(node_t*)ptr = in.rc_ack.server_id;
-        ptr += sizeof(node_t);
-        ptr += sizeof(load_t);
-        convert_endian(ptr, &in.rc_ack.ver, sizeof(ver_t));
-        ptr += sizeof(ver_t);
-        bitmap_t bitmap = 1 << in.rc_ack.server_id;
-        convert_endian(ptr, &bitmap, sizeof(bitmap_t));
-        ptr += sizeof(bitmap_t);
-        ptr += sizeof(hdr_req_id_t);
+        hdr::op_type::store(buf, OP_RC_ACK);
+        hdr::keyhash::store(buf, in.rc_ack.keyhash);
+        hdr::client_id::store(buf, 0);
+        hdr::server_id::store(buf, in.rc_ack.server_id);
+        hdr::load::store(buf, 0);
+        hdr::ver::store(buf, in.rc_ack.ver);
+        hdr::bitmap::store(buf, 1 << in.rc_ack.server_id);
+        hdr::hdr_req_id::store(buf, 0);
+        break;
+    }
+    case MemcacheKVMessage::Type::BATCH_REQ: {
+        // Header key hash is the first op's, for flow steering
+        hdr::op_type::store(buf, OP_BATCH);
+        hdr::client_id::store(buf, in.batch_request.client_id);
+        hdr::server_id::store(buf, in.batch_request.server_id);
+        hdr::load::store(buf, 0);
+        hdr::ver::store(buf, BASE_VERSION);
+        hdr::bitmap::store(buf, 0);
+        hdr::hdr_req_id::store(buf, (hdr_req_id_t)in.batch_request.req_id);
+        break;
+    }
+    case MemcacheKVMessage::Type::BATCH_REPLY: {
+        hdr::op_type::store(buf, OP_REP_BATCH);
+        hdr::keyhash::store(buf, 0);
+        hdr::client_id::store(buf, in.batch_reply.client_id);
+        hdr::server_id::store(buf, in.batch_reply.server_id);
+        hdr::load::store(buf, 0);
+        hdr::ver::store(buf, 0);
+        hdr::bitmap::store(buf, 1 << in.batch_reply.server_id);
+        hdr::hdr_req_id::store(buf, (hdr_req_id_t)in.batch_reply.req_id);
         break;
     }
     default:
@@ -282,158 +412,194 @@ bool WireCodec::encode(Message &out, const MemcacheKVMessage &in)
     // Payload
     switch (in.type) {
     case MemcacheKVMessage::Type::REQUEST: {
-        *(req_id_t*)ptr = (req_id_t)in.request.req_id;
-        ptr += sizeof(req_id_t);
-        *(req_time_t*)ptr = (req_time_t)in.request.req_time;
-        ptr += sizeof(req_time_t);
-        *(op_type_t*)ptr = static_cast<op_type_t>(in.request.op.op_type);
-        ptr += sizeof(op_type_t);
-        *(key_len_t*)ptr = (key_len_t)in.request.op.key.size();
-        ptr += sizeof(key_len_t);
+        namespace req = hdr::request;
+        req::req_id::store(buf, (req_id_t)in.request.req_id);
+        req::req_time::store(buf, (req_time_t)in.request.req_time);
+        req::op_type::store(buf, static_cast<op_type_t>(in.request.op.op_type));
+        req::key_len::store(buf, (key_len_t)in.request.op.key.size());
+        ptr = buf + REQUEST_BASE_SIZE;
         memcpy(ptr, in.request.op.key.data(), in.request.op.key.size());
         ptr += in.request.op.key.size();
         if (in.request.op.op_type == OpType::PUT ||
             in.request.op.op_type == OpType::PUTFWD) {
-            *(value_len_t*)ptr = (value_len_t)in.request.op.value.size();
+            wire::store<value_len_t>(ptr, in.request.op.value.size());
             ptr += sizeof(value_len_t);
             memcpy(ptr, in.request.op.value.data(), in.request.op.value.size());
-            ptr += in.request.op.value.size();
         }
         break;
     }
     case MemcacheKVMessage::Type::REPLY: {
-        *(req_id_t*)ptr = (req_id_t)in.reply.req_id;
-        ptr += sizeof(req_id_t);
-        *(req_time_t*)ptr = (req_time_t)in.reply.req_time;
-        ptr += sizeof(req_time_t);
-        *(op_type_t*)ptr = static_cast<op_type_t>(in.reply.op_type);
-        ptr += sizeof(op_type_t);
-        *(result_t *)ptr = (result_t)in.reply.result;
-        ptr += sizeof(result_t);
-        *(value_len_t *)ptr = (value_len_t)in.reply.value.size();
-        ptr += sizeof(value_len_t);
-        if (in.reply.value.size() > 0) {
-            memcpy(ptr, in.reply.value.data(), in.reply.value.size());
-            ptr += in.reply.value.size();
+        namespace rep = hdr::reply;
+        rep::req_id::store(buf, (req_id_t)in.reply.req_id);
+        rep::req_time::store(buf, (req_time_t)in.reply.req_time);
+        rep::op_type::store(buf, static_cast<op_type_t>(in.reply.op_type));
+        rep::result::store(buf, (result_t)in.reply.result);
+        rep::value_len::store(buf, (value_len_t)in.reply.value.size());
+        if (in.reply.value_owner) {
+            out.set_ext(in.reply.value.data(),
+                        in.reply.value.size(),
+                        *in.reply.value_owner);
+        } else if (in.reply.value.size() > 0) {
+            memcpy(buf + REPLY_BASE_SIZE, in.reply.value.data(), in.reply.value.size());
         }
         break;
     }
     case MemcacheKVMessage::Type::RC_REQ: {
-        *(key_len_t *)ptr = (key_len_t)in.rc_request.key.size();
-        ptr += sizeof(key_len_t);
+        hdr::rc_request::key_len::store(buf, (key_len_t)in.rc_request.key.size());
+        ptr = buf + hdr::rc_request::key_len::END;
         memcpy(ptr, in.rc_request.key.data(), in.rc_request.key.size());
         ptr += in.rc_request.key.size();
-        *(value_len_t *)ptr = (value_len_t)in.rc_request.value.size();
+        wire::store<value_len_t>(ptr, in.rc_request.value.size());
         ptr += sizeof(value_len_t);
         memcpy(ptr, in.rc_request.value.data(), in.rc_request.value.size());
-        ptr += in.rc_request.value.size();
         break;
     }
     case MemcacheKVMessage::Type::RC_ACK: {
         // empty
         break;
     }
+    case MemcacheKVMessage::Type::BATCH_REQ: {
+        namespace bop = hdr::batch_op;
+        hdr::batch_request::req_id::store(buf, (req_id_t)in.batch_request.req_id);
+        hdr::batch_request::req_time::store(buf, (req_time_t)in.batch_request.req_time);
+        hdr::batch_request::n_ops::store(buf, (uint8_t)in.batch_request.n_ops);
+        ptr = buf + BATCH_REQ_BASE_SIZE;
+        for (size_t i = 0; i < in.batch_request.n_ops; i++) {
+            const Operation &op = in.batch_request.ops[i];
+            if (i == 0) {
+                hdr::keyhash::store(buf, op.keyhash);
+            }
+            switch (op.op_type) {
+            case OpType::GET:
+            case OpType::PUT:
+            case OpType::DEL:
+                break;
+            default:
+                return false;
+            }
+            bop::op_type::store(ptr, static_cast<op_type_t>(op.op_type));
+            bop::keyhash::store(ptr, op.keyhash);
+            bop::key_len::store(ptr, (key_len_t)op.key.size());
+            ptr += bop::BASE_SIZE;
+            memcpy(ptr, op.key.data(), op.key.size());
+            ptr += op.key.size();
+            if (op.op_type == OpType::PUT) {
+                wire::store<value_len_t>(ptr, op.value.size());
+                ptr += sizeof(value_len_t);
+                memcpy(ptr, op.value.data(), op.value.size());
+                ptr += op.value.size();
+            }
+        }
+        break;
+    }
+    case MemcacheKVMessage::Type::BATCH_REPLY: {
+        namespace bop = hdr::batch_op_reply;
+        hdr::batch_reply::req_id::store(buf, (req_id_t)in.batch_reply.req_id);
+        hdr::batch_reply::req_time::store(buf, (req_time_t)in.batch_reply.req_time);
+        hdr::batch_reply::n_ops::store(buf, (uint8_t)in.batch_reply.n_ops);
+        ptr = buf + BATCH_REPLY_BASE_SIZE;
+        for (size_t i = 0; i < in.batch_reply.n_ops; i++) {
+            // Values are copied: a message has at most one external tail
+            const MemcacheKVReply &reply = in.batch_reply.ops[i];
+            size_t value_len = reply.op_type == OpType::GET ? reply.value.size() : 0;
+            bop::op_type::store(ptr, static_cast<op_type_t>(reply.op_type));
+            bop::result::store(ptr, (result_t)reply.result);
+            bop::value_len::store(ptr, (value_len_t)value_len);
+            ptr += bop::BASE_SIZE;
+            memcpy(ptr, reply.value.data(), value_len);
+            ptr += value_len;
+        }
+        break;
+    }
     default:
         return false;
     }
 
-    out.set_message(buf, buf_size, true);
     return true;
 }
 
 bool NetcacheCodec::decode(const Message &in, MemcacheKVMessage &out)
 {
-    const char *ptr = (const char*)in.buf();
+    namespace hdr = wire::netcache;
+    const char *buf = (const char*)in.buf();
+    const char *ptr;
     size_t buf_size = in.len();
 
     if (buf_size < PACKET_BASE_SIZE) {
         return false;
     }
-    if (*(identifier_t*)ptr != NETCACHE) {
+    if (hdr::identifier::load(buf) != NETCACHE) {
         return false;
     }
-    ptr += sizeof(identifier_t);
-    op_type_t op_type = *(op_type_t*)ptr;
-    ptr += sizeof(op_type_t);
-    ptr += KEY_SIZE;
-    string cached_value = string(ptr, VALUE_SIZE);
-    ptr += VALUE_SIZE;
+    op_type_t op_type = hdr::op_type::load(buf);
+    StringView cached_value(hdr::value::ptr(buf), VALUE_SIZE);
 
     switch (op_type) {
     case OP_READ:
     case OP_WRITE: {
+        namespace req = hdr::request;
         if (buf_size < REQUEST_BASE_SIZE) {
             return false;
         }
         out.type = MemcacheKVMessage::Type::REQUEST;
-        out.request.client_id = *(client_id_t*)ptr;
-        ptr += sizeof(client_id_t);
-        out.request.req_id = *(req_id_t*)ptr;
-        ptr += sizeof(req_id_t);
-        out.request.req_time = *(req_time_t*)ptr;
-        ptr += sizeof(req_time_t);
-        out.request.op.op_type = static_cast<OpType>(*(op_type_t*)ptr);
-        ptr += sizeof(op_type_t);
-        key_len_t key_len = *(key_len_t*)ptr;
-        ptr += sizeof(key_len_t);
+        out.request.client_id = req::client_id::load(buf);
+        out.request.req_id = req::req_id::load(buf);
+        out.request.req_time = req::req_time::load(buf);
+        out.request.op.op_type = static_cast<OpType>(req::op_type::load(buf));
+        key_len_t key_len = req::key_len::load(buf);
         if (buf_size < REQUEST_BASE_SIZE + key_len) {
             return false;
         }
-        out.request.op.key = string(ptr, key_len);
+        ptr = buf + REQUEST_BASE_SIZE;
+        out.request.op.key = StringView(ptr, key_len);
+        // Netcache headers carry no key hash
+        out.request.op.keyhash = compute_keyhash(ptr, key_len);
         ptr += key_len;
         if (out.request.op.op_type == OpType::PUT) {
             if (buf_size < REQUEST_BASE_SIZE + key_len + sizeof(value_len_t)) {
                 return false;
             }
-            value_len_t value_len = *(value_len_t*)ptr;
+            value_len_t value_len = wire::load<value_len_t>(ptr);
             ptr += sizeof(value_len_t);
             if (buf_size < REQUEST_BASE_SIZE + key_len + sizeof(value_len_t) + value_len) {
                 return false;
             }
-            out.request.op.value = string(ptr, value_len);
+            out.request.op.value = StringView(ptr, value_len);
         }
         break;
     }
     case OP_REP_R:
     case OP_REP_W: {
+        namespace rep = hdr::reply;
         if (buf_size < REPLY_BASE_SIZE) {
             return false;
         }
         out.type = MemcacheKVMessage::Type::REPLY;
-        out.reply.server_id = *(server_id_t*)ptr;
-        ptr += sizeof(server_id_t);
-        out.reply.client_id = *(client_id_t*)ptr;
-        ptr += sizeof(client_id_t);
-        out.reply.req_id = *(req_id_t*)ptr;
-        ptr += sizeof(req_id_t);
-        out.reply.req_time = *(req_time_t*)ptr;
-        ptr += sizeof(req_time_t);
-        out.reply.op_type = static_cast<OpType>(*(op_type_t*)ptr);
-        ptr += sizeof(op_type_t);
-        out.reply.result = static_cast<Result>(*(result_t*)ptr);
-        ptr += sizeof(result_t);
-        value_len_t value_len = *(value_len_t*)ptr;
-        ptr += sizeof(value_len_t);
+        out.reply.server_id = rep::server_id::load(buf);
+        out.reply.client_id = rep::client_id::load(buf);
+        out.reply.req_id = rep::req_id::load(buf);
+        out.reply.req_time = rep::req_time::load(buf);
+        out.reply.op_type = static_cast<OpType>(rep::op_type::load(buf));
+        out.reply.result = static_cast<Result>(rep::result::load(buf));
+        value_len_t value_len = rep::value_len::load(buf);
         if (buf_size < REPLY_BASE_SIZE + value_len) {
             return false;
         }
-        out.reply.value = string(ptr, value_len);
+        out.reply.value = StringView(buf + REPLY_BASE_SIZE, value_len);
         break;
     }
     case OP_CACHE_HIT: {
+        // The switch turns the request around in place
+        namespace req = hdr::request;
         if (buf_size < REQUEST_BASE_SIZE) {
             return false;
         }
         out.type = MemcacheKVMessage::Type::REPLY;
         out.reply.server_id = SWITCH_ID;
-        out.reply.client_id = *(client_id_t*)ptr;
-        ptr += sizeof(client_id_t);
-        out.reply.req_id = *(req_id_t*)ptr;
-        ptr += sizeof(req_id_t);
-        out.reply.req_time = *(req_time_t*)ptr;
-        ptr += sizeof(req_time_t);
-        out.reply.op_type = static_cast<OpType>(*(op_type_t*)ptr);
-        ptr += sizeof(op_type_t);
+        out.reply.client_id = req::client_id::load(buf);
+        out.reply.req_id = req::req_id::load(buf);
+        out.reply.req_time = req::req_time::load(buf);
+        out.reply.op_type = static_cast<OpType>(req::op_type::load(buf));
         out.reply.result = Result::OK;
         out.reply.value = cached_value;
         break;
@@ -446,6 +612,7 @@ bool NetcacheCodec::decode(const Message &in, MemcacheKVMessage &out)
 
 bool NetcacheCodec::encode(Message &out, const MemcacheKVMessage &in)
 {
+    namespace hdr = wire::netcache;
     // First determine buffer size
     size_t buf_size;
     switch (in.type) {
@@ -464,53 +631,47 @@ bool NetcacheCodec::encode(Message &out, const MemcacheKVMessage &in)
         return false;
     }
 
-    char *buf = (char*)malloc(buf_size);
-    char *ptr = buf;
+    char *buf = (char*)out.alloc_buf(buf_size);
+    char *ptr;
     // App header
-    *(identifier_t*)ptr = NETCACHE;
-    ptr += sizeof(identifier_t);
+    hdr::identifier::store(buf, NETCACHE);
     switch (in.type) {
     case MemcacheKVMessage::Type::REQUEST: {
         switch (in.request.op.op_type) {
         case OpType::GET:
-            *(op_type_t*)ptr = OP_READ;
+            hdr::op_type::store(buf, OP_READ);
             break;
         case OpType::PUT:
         case OpType::DEL:
-            *(op_type_t*)ptr = OP_WRITE;
+            hdr::op_type::store(buf, OP_WRITE);
             break;
         default:
             return false;
         }
-        ptr += sizeof(op_type_t);
-        memset(ptr, 0, KEY_SIZE);
-        memcpy(ptr, in.request.op.key.data(), std::min(in.request.op.key.size(),
-                                                       KEY_SIZE));
-        ptr += KEY_SIZE;
-        ptr += VALUE_SIZE;
+        memset(hdr::key::ptr(buf), 0, KEY_SIZE);
+        memcpy(hdr::key::ptr(buf), in.request.op.key.data(), std::min(in.request.op.key.size(),
+                                                                     KEY_SIZE));
+        memset(hdr::value::ptr(buf), 0, VALUE_SIZE);
         break;
     }
     case MemcacheKVMessage::Type::REPLY: {
         switch (in.reply.op_type) {
         case OpType::GET:
-            *(op_type_t*)ptr = OP_REP_R;
+            hdr::op_type::store(buf, OP_REP_R);
             break;
         case OpType::PUT:
         case OpType::DEL:
-            *(op_type_t*)ptr = OP_REP_W;
+            hdr::op_type::store(buf, OP_REP_W);
             break;
         default:
             return false;
         }
-        ptr += sizeof(op_type_t);
-        memset(ptr, 0, KEY_SIZE);
-        memcpy(ptr, in.reply.key.data(), std::min(in.reply.key.size(),
-                                                  KEY_SIZE));
-        ptr += KEY_SIZE;
-        memset(ptr, 0, VALUE_SIZE);
-        memcpy(ptr, in.reply.value.data(), std::min(in.reply.value.size(),
-                                                    VALUE_SIZE));
-        ptr += VALUE_SIZE;
+        memset(hdr::key::ptr(buf), 0, KEY_SIZE);
+        memcpy(hdr::key::ptr(buf), in.reply.key.data(), std::min(in.reply.key.size(),
+                                                                KEY_SIZE));
+        memset(hdr::value::ptr(buf), 0, VALUE_SIZE);
+        memcpy(hdr::value::ptr(buf), in.reply.value.data(), std::min(in.reply.value.size(),
+                                                                    VALUE_SIZE));
         break;
     }
     default:
@@ -520,44 +681,33 @@ bool NetcacheCodec::encode(Message &out, const MemcacheKVMessage &in)
     // Payload
     switch (in.type) {
     case MemcacheKVMessage::Type::REQUEST: {
-        *(client_id_t*)ptr = (client_id_t)in.request.client_id;
-        ptr += sizeof(client_id_t);
-        *(req_id_t*)ptr = (req_id_t)in.request.req_id;
-        ptr += sizeof(req_id_t);
-        *(req_time_t*)ptr = (req_time_t)in.request.req_time;
-        ptr += sizeof(req_time_t);
-        *(op_type_t*)ptr = static_cast<op_type_t>(in.request.op.op_type);
-        ptr += sizeof(op_type_t);
-        *(key_len_t*)ptr = (key_len_t)in.request.op.key.size();
-        ptr += sizeof(key_len_t);
+        namespace req = hdr::request;
+        req::client_id::store(buf, (client_id_t)in.request.client_id);
+        req::req_id::store(buf, (req_id_t)in.request.req_id);
+        req::req_time::store(buf, (req_time_t)in.request.req_time);
+        req::op_type::store(buf, static_cast<op_type_t>(in.request.op.op_type));
+        req::key_len::store(buf, (key_len_t)in.request.op.key.size());
+        ptr = buf + REQUEST_BASE_SIZE;
         memcpy(ptr, in.request.op.key.data(), in.request.op.key.size());
         ptr += in.request.op.key.size();
         if (in.request.op.op_type == OpType::PUT) {
-            *(value_len_t*)ptr = (value_len_t)in.request.op.value.size();
+            wire::store<value_len_t>(ptr, in.request.op.value.size());
             ptr += sizeof(value_len_t);
             memcpy(ptr, in.request.op.value.data(), in.request.op.value.size());
-            ptr += in.request.op.value.size();
         }
         break;
     }
     case MemcacheKVMessage::Type::REPLY: {
-        *(server_id_t*)ptr = (server_id_t)in.reply.server_id;
-        ptr += sizeof(server_id_t);
-        *(client_id_t*)ptr = (client_id_t)in.reply.client_id;
-        ptr += sizeof(client_id_t);
-        *(req_id_t*)ptr = (req_id_t)in.reply.req_id;
-        ptr += sizeof(req_id_t);
-        *(req_time_t*)ptr = (req_time_t)in.reply.req_time;
-        ptr += sizeof(req_time_t);
-        *(op_type_t*)ptr = static_cast<op_type_t>(in.reply.op_type);
-        ptr += sizeof(op_type_t);
-        *(result_t *)ptr = (result_t)in.reply.result;
-        ptr += sizeof(result_t);
-        *(value_len_t *)ptr = (value_len_t)in.reply.value.size();
-        ptr += sizeof(value_len_t);
+        namespace rep = hdr::reply;
+        rep::server_id::store(buf, (server_id_t)in.reply.server_id);
+        rep::client_id::store(buf, (client_id_t)in.reply.client_id);
+        rep::req_id::store(buf, (req_id_t)in.reply.req_id);
+        rep::req_time::store(buf, (req_time_t)in.reply.req_time);
+        rep::op_type::store(buf, static_cast<op_type_t>(in.reply.op_type));
+        rep::result::store(buf, (result_t)in.reply.result);
+        rep::value_len::store(buf, (value_len_t)in.reply.value.size());
         if (in.reply.value.size() > 0) {
-            memcpy(ptr, in.reply.value.data(), in.reply.value.size());
-            ptr += in.reply.value.size();
+            memcpy(buf + REPLY_BASE_SIZE, in.reply.value.data(), in.reply.value.size());
         }
         break;
     }
@@ -565,7 +715,6 @@ bool NetcacheCodec::encode(Message &out, const MemcacheKVMessage &in)
         return false;
     }
 
-    out.set_message(buf, buf_size, true);
     return true;
 }
 
@@ -657,7 +806,7 @@ bool ControllerCodec::encode(Message &out, const ControllerMessage &in)
         return false;
     }
 
-    char *buf = (char*)malloc(buf_size);
+    char *buf = (char*)out.alloc_buf(buf_size);
     char *ptr = buf;
     *(identifier_t*)ptr = CONTROLLER;
     ptr += sizeof(identifier_t);
@@ -692,7 +841,6 @@ bool ControllerCodec::encode(Message &out, const ControllerMessage &in)
         break;
     }
 
-    out.set_message(buf, buf_size, true);
     return true;
 }
 
@@ -2,10 +2,14 @@
 #define _MEMCACHEKV_MESSAGE_H_
 
 #include <sys/socket.h>
+#include <cstring>
 #include <list>
+#include <memory>
 #include <string>
 
 #include <transport.h>
+#include <apps/memcachekv/value.h>
+#include <apps/memcachekv/wire.h>
 
 namespace memcachekv {
 
@@ -14,7 +18,43 @@ typedef uint16_t load_t;
 typedef uint32_t ver_t;
 
 /*
- * KV messages
+ * Non-owning reference to a byte string, e.g. a key or value inside a
+ * received packet. Only valid while the referenced buffer is.
+ */
+class StringView {
+public:
+    StringView() = default;
+    StringView(const char *ptr, size_t len)
+        : ptr_(ptr), len_(len) {};
+    StringView(const std::string &str)
+        : ptr_(str.data()), len_(str.size()) {};
+    StringView(const Value &value)
+        : ptr_(value.data()), len_(value.size()) {};
+
+    const char *data() const { return this->ptr_; };
+    size_t size() const { return this->len_; };
+    bool empty() const { return this->len_ == 0; };
+    std::string str() const { return std::string(this->ptr_, this->len_); };
+    // Copy into str, reusing its buffer
+    void assign_to(std::string &str) const { str.assign(this->ptr_, this->len_); };
+    bool equals(const std::string &str) const
+    {
+        return equals(str.data(), str.size());
+    };
+    bool equals(const char *ptr, size_t len) const
+    {
+        return this->len_ == len && memcmp(this->ptr_, ptr, len) == 0;
+    };
+
+private:
+    const char *ptr_;
+    size_t len_;
+};
+
+/*
+ * KV messages. Keys and values are views: after decode they point into the
+ * received Message, and messages to encode point them at the sender's own
+ * buffers.
  */
 enum class OpType {
     GET,
@@ -23,21 +63,16 @@ enum class OpType {
     PUTFWD,
 };
 struct Operation {
-    Operation()
-        : op_type(OpType::GET), keyhash(0), ver(0), key(""), value("") {};
-
     OpType op_type;
+    // compute_keyhash(key), computed once by the client
     keyhash_t keyhash;
     ver_t ver;
 
-    std::string key;
-    std::string value;
+    StringView key;
+    StringView value;
 };
 
 struct MemcacheKVRequest {
-    MemcacheKVRequest()
-        : client_id(0), server_id(0), req_id(0), req_time(0) {};
-
     int client_id;
     int server_id;
     uint32_t req_id;
@@ -47,15 +82,11 @@ struct MemcacheKVRequest {
 
 enum class Result {
     OK,
-    NOT_FOUND
+    NOT_FOUND,
+    NOT_STORED
 };
 
 struct MemcacheKVReply {
-    MemcacheKVReply()
-        : client_id(0), server_id(0), req_id(0), req_time(0),
-        op_type(OpType::GET), keyhash(0), ver(0), key(""), value(""),
-        result(Result::OK), load(0) {};
-
     int client_id;
     int server_id;
     uint32_t req_id;
@@ -64,8 +95,12 @@ struct MemcacheKVReply {
     OpType op_type;
     keyhash_t keyhash;
     ver_t ver;
-    std::string key;
-    std::string value;
+    StringView key;
+    StringView value;
+    // If set, owns the bytes value refers to (e.g. a stored value shared
+    // with the server's store); codecs can then take a reference and send
+    // value without copying it
+    const std::shared_ptr<const Value> *value_owner;
 
     Result result;
     load_t load;
@@ -75,8 +110,8 @@ struct ReplicationRequest {
     keyhash_t keyhash;
     ver_t ver;
 
-    std::string key;
-    std::string value;
+    StringView key;
+    StringView value;
 };
 
 struct ReplicationAck {
@@ -86,22 +121,61 @@ struct ReplicationAck {
     ver_t ver;
 };
 
+/*
+ * Several operations on keys with the same home server, carried in one
+ * packet. ops refer to the sender's array or, after decode, to per-thread
+ * codec storage that is valid until the thread's next decode.
+ */
+struct MemcacheKVBatchRequest {
+    static const size_t MAX_OPS = 32;
+
+    int client_id;
+    int server_id;
+    uint32_t req_id;
+    uint32_t req_time;
+
+    size_t n_ops;
+    Operation *ops;
+};
+
+struct MemcacheKVBatchReply {
+    int client_id;
+    int server_id;
+    uint32_t req_id;
+    uint32_t req_time;
+
+    // One reply per executed operation, in request order. After decode,
+    // each also carries the ids and req_time above.
+    size_t n_ops;
+    MemcacheKVReply *ops;
+};
+
 struct MemcacheKVMessage {
     enum class Type {
         REQUEST,
         REPLY,
         RC_REQ,
         RC_ACK,
+        BATCH_REQ,
+        BATCH_REPLY,
         UNKNOWN
     };
     MemcacheKVMessage()
-        : type(Type::UNKNOWN) {};
+    {
+        memset((void*)this, 0, sizeof(*this));
+        this->type = Type::UNKNOWN;
+    };
 
+    // Tagged by type
     Type type;
-    MemcacheKVRequest request;
-    MemcacheKVReply reply;
-    ReplicationRequest rc_request;
-    ReplicationAck rc_ack;
+    union {
+        MemcacheKVRequest request;
+        MemcacheKVReply reply;
+        ReplicationRequest rc_request;
+        ReplicationAck rc_ack;
+        MemcacheKVBatchRequest batch_request;
+        MemcacheKVBatchReply batch_reply;
+    };
 };
 
 class MessageCodec {
@@ -110,6 +184,8 @@ public:
 
     virtual bool decode(const Message &in, MemcacheKVMessage &out) = 0;
     virtual bool encode(Message &out, const MemcacheKVMessage &in) = 0;
+    // Read only the key hash from the header, if the format carries one
+    virtual bool peek_keyhash(const Message &in, keyhash_t &keyhash) { return false; };
 };
 
 class WireCodec : public MessageCodec {
@@ -122,6 +198,7 @@ public:
 
     virtual bool decode(const Message &in, MemcacheKVMessage &out) override final;
     virtual bool encode(Message &out, const MemcacheKVMessage &in) override final;
+    virtual bool peek_keyhash(const Message &in, memcachekv::keyhash_t &keyhash) override final;
 
 private:
     bool proto_enable;
@@ -144,6 +221,17 @@ private:
      *
      * Replication ack:
      * empty
+     *
+     * Batch request (header key_hash is that of the first op; version
+     * applies to all writes):
+     * req_id (32) + req_time (32) + n_ops (8) + n_ops * (op_type (8) +
+     * key_hash (32) + key_len (16) + key (+ value_len (16) + value))
+     * The load balancer sets the BATCH_OP_SKIP bit in op_type of ops it
+     * sends on separately; receivers ignore them.
+     *
+     * Batch reply (values only for GETs):
+     * req_id (32) + req_time (32) + n_ops (8) + n_ops * (op_type (8) +
+     * result (8) + value_len (16) + value)
      */
     typedef uint16_t identifier_t;
     typedef uint8_t op_type_t;
@@ -170,12 +258,17 @@ private:
     static const op_type_t OP_RC_REQ    = 0x5;
     static const op_type_t OP_RC_ACK    = 0x6;
     static const op_type_t OP_PUT_FWD   = 0x7;
-
-    static const size_t PACKET_BASE_SIZE = sizeof(identifier_t) + sizeof(op_type_t) + sizeof(keyhash_t) + sizeof(node_t) + sizeof(node_t) + sizeof(load_t) + sizeof(ver_t) + sizeof(bitmap_t) + sizeof(hdr_req_id_t);
-    static const size_t REQUEST_BASE_SIZE = PACKET_BASE_SIZE + sizeof(req_id_t) + sizeof(req_time_t) + sizeof(op_type_t) + sizeof(key_len_t);
-    static const size_t REPLY_BASE_SIZE = PACKET_BASE_SIZE + sizeof(req_id_t) + sizeof(req_time_t) + sizeof(op_type_t) + sizeof(result_t) + sizeof(value_len_t);
-    static const size_t RC_REQ_BASE_SIZE = PACKET_BASE_SIZE + sizeof(key_len_t) + sizeof(value_len_t);
+    static const op_type_t OP_BATCH     = 0x8;
+    static const op_type_t OP_REP_BATCH = 0x9;
+    static const op_type_t BATCH_OP_SKIP = 0x80;
+
+    static const size_t PACKET_BASE_SIZE = wire::pegasus::HEADER_SIZE;
+    static const size_t REQUEST_BASE_SIZE = wire::pegasus::request::BASE_SIZE;
+    static const size_t REPLY_BASE_SIZE = wire::pegasus::reply::BASE_SIZE;
+    static const size_t RC_REQ_BASE_SIZE = wire::pegasus::rc_request::BASE_SIZE;
     static const size_t RC_ACK_BASE_SIZE = PACKET_BASE_SIZE;
+    static const size_t BATCH_REQ_BASE_SIZE = wire::pegasus::batch_request::BASE_SIZE;
+    static const size_t BATCH_REPLY_BASE_SIZE = wire::pegasus::batch_reply::BASE_SIZE;
 };
 
 /*
@@ -212,8 +305,8 @@ private:
     typedef uint16_t key_len_t;
     typedef uint8_t result_t;
     typedef uint16_t value_len_t;
-    static const size_t KEY_SIZE        = 6;
-    static const size_t VALUE_SIZE      = 4;
+    static const size_t KEY_SIZE        = wire::netcache::key::SIZE;
+    static const size_t VALUE_SIZE      = wire::netcache::value::SIZE;
     static const server_id_t SWITCH_ID  = 0xFF;
 
     static const identifier_t NETCACHE  = 0x5039;
@@ -223,9 +316,9 @@ private:
     static const op_type_t OP_REP_W     = 0x4;
     static const op_type_t OP_CACHE_HIT = 0x5;
 
-    static const size_t PACKET_BASE_SIZE = sizeof(identifier_t) + sizeof(op_type_t) + KEY_SIZE + VALUE_SIZE;
-    static const size_t REQUEST_BASE_SIZE = PACKET_BASE_SIZE + sizeof(client_id_t) + sizeof(req_id_t) + sizeof(req_time_t) + sizeof(op_type_t) + sizeof(key_len_t);
-    static const size_t REPLY_BASE_SIZE = PACKET_BASE_SIZE + sizeof(client_id_t) + sizeof(req_id_t) + sizeof(req_time_t) + sizeof(op_type_t) + sizeof(result_t) + sizeof(value_len_t);
+    static const size_t PACKET_BASE_SIZE = wire::netcache::HEADER_SIZE;
+    static const size_t REQUEST_BASE_SIZE = wire::netcache::request::BASE_SIZE;
+    static const size_t REPLY_BASE_SIZE = wire::netcache::reply::BASE_SIZE;
 };
 
 /*
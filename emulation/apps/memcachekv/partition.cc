@@ -0,0 +1,212 @@
+#include <cstring>
+
+#include <logger.h>
+#include <apps/memcachekv/partition.h>
+#include <apps/memcachekv/utils.h>
+
+// Length of a message in a HandoffRing, and the marker of a wrapped message
+#define RECORD_HDR_SIZE sizeof(size_t)
+#define RECORD_WRAP ((size_t)-1)
+
+static inline size_t record_size(size_t len)
+{
+    return RECORD_HDR_SIZE + ((len + 7) & ~(size_t)7);
+}
+
+namespace memcachekv {
+
+PartitionStore::Slot::Slot()
+    : used(false), keyhash(0), ver(0)
+{
+}
+
+PartitionStore::PartitionStore(size_t capacity)
+    : n_items(0)
+{
+    size_t n_slots = MIN_SLOTS;
+    while (n_slots * MAX_LOAD_PERCENT < capacity * 100) {
+        n_slots <<= 1;
+    }
+    this->slots = new Slot[n_slots];
+    this->mask = n_slots - 1;
+}
+
+PartitionStore::~PartitionStore()
+{
+    delete[] this->slots;
+}
+
+PartitionStore::Slot *PartitionStore::find(const StringView &key, keyhash_t keyhash) const
+{
+    // Keys of one partition may share some bits of their hash
+    size_t i = mix_hash32(keyhash) & this->mask;
+    while (true) {
+        Slot *slot = &this->slots[i];
+        if (!slot->used) {
+            return slot;
+        }
+        if (slot->keyhash == keyhash &&
+            slot->key.size() == key.size() &&
+            memcmp(slot->key.data(), key.data(), key.size()) == 0) {
+            return slot;
+        }
+        i = (i + 1) & this->mask;
+    }
+}
+
+bool PartitionStore::get(const StringView &key, keyhash_t keyhash,
+                         ver_t &ver, std::shared_ptr<const Value> &value)
+{
+    Slot *slot = find(key, keyhash);
+    if (!slot->used) {
+        return false;
+    }
+    ver = slot->ver;
+    value = slot->value;
+    return true;
+}
+
+bool PartitionStore::put(const StringView &key, keyhash_t keyhash,
+                         ver_t ver, const std::shared_ptr<const Value> &value)
+{
+    Slot *slot = find(key, keyhash);
+    if (slot->used) {
+        if (ver < slot->ver) {
+            return false;
+        }
+    } else {
+        if ((this->n_items + 1) * 100 > (this->mask + 1) * MAX_LOAD_PERCENT) {
+            grow();
+            slot = find(key, keyhash);
+        }
+        slot->used = true;
+        slot->keyhash = keyhash;
+        key.assign_to(slot->key);
+        this->n_items++;
+    }
+    slot->ver = ver;
+    slot->value = value;
+    return true;
+}
+
+void PartitionStore::grow()
+{
+    Slot *old_slots = this->slots;
+    size_t old_n_slots = this->mask + 1;
+
+    this->slots = new Slot[old_n_slots << 1];
+    this->mask = (old_n_slots << 1) - 1;
+    for (size_t i = 0; i < old_n_slots; i++) {
+        Slot &old_slot = old_slots[i];
+        if (!old_slot.used) {
+            continue;
+        }
+        size_t j = mix_hash32(old_slot.keyhash) & this->mask;
+        while (this->slots[j].used) {
+            j = (j + 1) & this->mask;
+        }
+        Slot &slot = this->slots[j];
+        slot.used = true;
+        slot.keyhash = old_slot.keyhash;
+        slot.ver = old_slot.ver;
+        slot.key.swap(old_slot.key);
+        slot.value.swap(old_slot.value);
+    }
+    delete[] old_slots;
+}
+
+void PartitionStore::report() const
+{
+    info("Partition store: %zu items in %zu slots", this->n_items, this->mask + 1);
+}
+
+void PartitionStore::prefetch(keyhash_t keyhash) const
+{
+    __builtin_prefetch(&this->slots[mix_hash32(keyhash) & this->mask], 1);
+}
+
+void PartitionStore::scan(const ScanFunction &fn) const
+{
+    for (size_t i = 0; i <= this->mask; i++) {
+        const Slot &slot = this->slots[i];
+        if (slot.used) {
+            fn(StringView(slot.key), slot.keyhash, slot.ver, slot.value);
+        }
+    }
+}
+
+HandoffRing::HandoffRing(size_t size)
+    : tail(0), cached_head(0), head(0), cached_tail(0), front_len(0)
+{
+    if (size == 0 || (size & (size - 1)) != 0) {
+        panic("HandoffRing size must be a power of 2");
+    }
+    this->buf = new char[size];
+    this->mask = size - 1;
+}
+
+HandoffRing::~HandoffRing()
+{
+    delete[] this->buf;
+}
+
+bool HandoffRing::push(const void *buf, size_t len)
+{
+    size_t size = this->mask + 1;
+    size_t rec = record_size(len);
+    if (rec > size / 2) {
+        panic("Message too large for handoff ring");
+    }
+    size_t pos = this->tail.load(std::memory_order_relaxed);
+    size_t off = pos & this->mask;
+    // Space left before the end of the buffer is skipped if rec does not fit
+    size_t skip = off + rec > size ? size - off : 0;
+
+    if (pos + skip + rec - this->cached_head > size) {
+        this->cached_head = this->head.load(std::memory_order_acquire);
+        if (pos + skip + rec - this->cached_head > size) {
+            return false;
+        }
+    }
+    if (skip > 0) {
+        *(size_t*)(this->buf + off) = RECORD_WRAP;
+        pos += skip;
+        off = 0;
+    }
+    *(size_t*)(this->buf + off) = len;
+    memcpy(this->buf + off + RECORD_HDR_SIZE, buf, len);
+    this->tail.store(pos + rec, std::memory_order_release);
+    return true;
+}
+
+const void *HandoffRing::front(size_t &len)
+{
+    size_t pos = this->head.load(std::memory_order_relaxed);
+    size_t off;
+
+    while (true) {
+        if (pos == this->cached_tail) {
+            this->cached_tail = this->tail.load(std::memory_order_acquire);
+            if (pos == this->cached_tail) {
+                return nullptr;
+            }
+        }
+        off = pos & this->mask;
+        if (*(size_t*)(this->buf + off) != RECORD_WRAP) {
+            break;
+        }
+        pos += this->mask + 1 - off;
+        this->head.store(pos, std::memory_order_release);
+    }
+    this->front_len = *(size_t*)(this->buf + off);
+    len = this->front_len;
+    return this->buf + off + RECORD_HDR_SIZE;
+}
+
+void HandoffRing::pop()
+{
+    size_t pos = this->head.load(std::memory_order_relaxed);
+    this->head.store(pos + record_size(this->front_len), std::memory_order_release);
+}
+
+} // namespace memcachekv
@@ -0,0 +1,96 @@
+#ifndef _MEMCACHEKV_PARTITION_H_
+#define _MEMCACHEKV_PARTITION_H_
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+#include <apps/memcachekv/store.h>
+
+namespace memcachekv {
+
+/*
+ * Store of a single keyspace partition, owned by one thread. Unlike the
+ * other stores it is not thread safe: it takes no locks and issues no atomic
+ * operations, so a hot key stays in its owner's cache. Open addressing with
+ * linear probing; the table doubles past MAX_LOAD_PERCENT.
+ */
+class PartitionStore : public Store {
+public:
+    // Initially sized to hold capacity items
+    PartitionStore(size_t capacity);
+    ~PartitionStore();
+
+    virtual bool get(const StringView &key, keyhash_t keyhash,
+                     ver_t &ver, std::shared_ptr<const Value> &value) override final;
+    virtual bool put(const StringView &key, keyhash_t keyhash,
+                     ver_t ver, const std::shared_ptr<const Value> &value) override final;
+    virtual void report() const override final;
+    virtual void scan(const ScanFunction &fn) const override final;
+    virtual void prefetch(keyhash_t keyhash) const override final;
+
+    static const size_t MIN_SLOTS = 64;
+    static const size_t MAX_LOAD_PERCENT = 75;
+
+private:
+    struct Slot {
+        Slot();
+
+        bool used;
+        keyhash_t keyhash;
+        ver_t ver;
+        std::string key;
+        std::shared_ptr<const Value> value;
+    };
+
+    // Slot holding key, or the empty slot it would be inserted into
+    inline Slot *find(const StringView &key, keyhash_t keyhash) const;
+    void grow();
+
+    Slot *slots;
+    size_t mask;
+    size_t n_items;
+};
+
+/*
+ * Bounded single-producer single-consumer ring of variable-length messages,
+ * used to hand requests from a transport thread to the thread owning their
+ * partition. Messages are copied in, preceded by their length, and padded
+ * to 8 bytes; a message that does not fit before the end of the buffer
+ * starts again at its beginning.
+ */
+class HandoffRing {
+public:
+    // size is in bytes, and must be a power of 2
+    HandoffRing(size_t size);
+    ~HandoffRing();
+
+    /* Producer side */
+    // Returns false if the ring is full
+    bool push(const void *buf, size_t len);
+
+    /* Consumer side */
+    // Returns the oldest message, or nullptr if the ring is empty
+    const void *front(size_t &len);
+    // Release the message returned by front()
+    void pop();
+
+private:
+    char *buf;
+    size_t mask;
+    // Producer and consumer positions are on separate cache lines; each side
+    // caches the other's position and only reloads it when the ring looks
+    // full (or empty)
+    char pad0[64];
+    std::atomic<size_t> tail;
+    size_t cached_head;
+    char pad1[64];
+    std::atomic<size_t> head;
+    size_t cached_tail;
+    size_t front_len;
+    char pad2[64];
+};
+
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_PARTITION_H_ */
@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include <logger.h>
+#include <apps/memcachekv/placement.h>
+#include <apps/memcachekv/utils.h>
+
+namespace memcachekv {
+
+bool parse_placement_type(const char *name, PlacementType &type)
+{
+    if (strcmp(name, "range") == 0) {
+        type = PlacementType::RANGE;
+    } else if (strcmp(name, "jump") == 0) {
+        type = PlacementType::JUMP;
+    } else if (strcmp(name, "ring") == 0) {
+        type = PlacementType::RING;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parse_node_weights(const char *str, std::vector<int> &weights)
+{
+    weights.clear();
+    while (*str != '\0') {
+        char *end;
+        long weight = strtol(str, &end, 10);
+        if (end == str || weight <= 0 || weight > INT_MAX) {
+            return false;
+        }
+        weights.push_back((int)weight);
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return false;
+        }
+        str = end;
+    }
+    return !weights.empty();
+}
+
+Placement::Placement(PlacementType type, int num_nodes, const std::vector<int> &weights)
+    : type(type), num_nodes(num_nodes)
+{
+    if (num_nodes < 1) {
+        panic("Placement requires at least one node");
+    }
+    std::vector<int> node_weights = weights;
+    if (node_weights.empty()) {
+        node_weights.assign(num_nodes, 1);
+    }
+    if ((int)node_weights.size() != num_nodes) {
+        panic("Expected %d node weights, got %zu", num_nodes, node_weights.size());
+    }
+
+    switch (type) {
+    case PlacementType::RANGE: {
+        for (int weight : node_weights) {
+            if (weight != node_weights[0]) {
+                panic("Range placement does not support node weights");
+            }
+        }
+        break;
+    }
+    case PlacementType::JUMP: {
+        // Node n owns buckets [sum(w_0..w_n-1), sum(w_0..w_n)), so adding a
+        // node only appends buckets
+        for (int node = 0; node < num_nodes; node++) {
+            this->buckets.insert(this->buckets.end(), node_weights[node], node);
+        }
+        break;
+    }
+    case PlacementType::RING: {
+        for (int node = 0; node < num_nodes; node++) {
+            for (int i = 0; i < node_weights[node] * RING_VNODES; i++) {
+                uint32_t point = (uint32_t)mix_hash64(((uint64_t)node << 32) | (uint32_t)i);
+                this->ring.push_back(std::make_pair(point, node));
+            }
+        }
+        std::sort(this->ring.begin(), this->ring.end());
+        size_t pos = 0;
+        for (uint64_t i = 0; i <= (1ULL << RING_INDEX_BITS); i++) {
+            while (pos < this->ring.size() &&
+                   (this->ring[pos].first >> (32 - RING_INDEX_BITS)) < i) {
+                pos++;
+            }
+            this->ring_index.push_back(pos);
+        }
+        break;
+    }
+    default:
+        panic("Unknown placement type");
+    }
+}
+
+Placement::~Placement()
+{
+}
+
+int Placement::node_id(uint32_t keyhash) const
+{
+    switch (this->type) {
+    case PlacementType::RANGE:
+        return range_node_id(keyhash);
+    case PlacementType::JUMP:
+        return jump_node_id(keyhash);
+    case PlacementType::RING:
+        return ring_node_id(keyhash);
+    default:
+        panic("Unknown placement type");
+    }
+    return -1;
+}
+
+int Placement::range_node_id(uint32_t keyhash) const
+{
+    return keyhash_to_node_id(keyhash, this->num_nodes);
+}
+
+int Placement::jump_node_id(uint32_t keyhash) const
+{
+    uint64_t key = mix_hash64(keyhash);
+    int64_t b = -1, j = 0;
+    int64_t num_buckets = this->buckets.size();
+
+    while (j < num_buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+    return this->buckets[b];
+}
+
+int Placement::ring_node_id(uint32_t keyhash) const
+{
+    uint32_t point = mix_hash32(keyhash);
+    uint32_t bucket = point >> (32 - RING_INDEX_BITS);
+    // First ring point at or after the key, wrapping around
+    size_t pos = this->ring_index[bucket];
+    size_t end = this->ring_index[bucket + 1];
+    while (pos < end && this->ring[pos].first < point) {
+        pos++;
+    }
+    if (pos == this->ring.size()) {
+        pos = 0;
+    }
+    return this->ring[pos].second;
+}
+
+} // namespace memcachekv
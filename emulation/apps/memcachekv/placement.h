@@ -0,0 +1,63 @@
+#ifndef _MEMCACHEKV_PLACEMENT_H_
+#define _MEMCACHEKV_PLACEMENT_H_
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace memcachekv {
+
+/*
+ * Key placement: maps a key hash to its home server. Clients and load
+ * balancers must use the same placement.
+ *
+ * RANGE: the hash range is split into num_nodes * N_VIRTUAL_NODES equal
+ *        intervals, assigned to nodes round robin. Changing the number of
+ *        nodes remaps almost every key.
+ * JUMP:  jump consistent hash (Lamping and Veach) over weight-many buckets
+ *        per node. Adding a node moves only the keys it takes over; only the
+ *        last node can be removed.
+ * RING:  consistent hash ring with RING_VNODES points per unit of weight.
+ *        Any node can be added or removed, moving only its share of keys.
+ */
+enum class PlacementType {
+    RANGE,
+    JUMP,
+    RING
+};
+
+// Parses "range", "jump" or "ring"
+bool parse_placement_type(const char *name, PlacementType &type);
+// Parses comma separated positive node weights, e.g. "1,2,1"
+bool parse_node_weights(const char *str, std::vector<int> &weights);
+
+class Placement {
+public:
+    // weights holds one weight per node, or is empty for equal weights
+    Placement(PlacementType type, int num_nodes, const std::vector<int> &weights);
+    ~Placement();
+
+    int node_id(uint32_t keyhash) const;
+
+    static const int RING_VNODES = 128;
+    static const int RING_INDEX_BITS = 12;
+
+private:
+    int range_node_id(uint32_t keyhash) const;
+    int jump_node_id(uint32_t keyhash) const;
+    int ring_node_id(uint32_t keyhash) const;
+
+    PlacementType type;
+    int num_nodes;
+    // JUMP: bucket -> node; each node owns weight consecutive buckets
+    std::vector<int> buckets;
+    // RING: (point, node), sorted by point
+    std::vector<std::pair<uint32_t, int>> ring;
+    // RING: position of the first point whose top RING_INDEX_BITS bits are
+    // >= i, so a lookup only scans the points sharing its top bits
+    std::vector<uint32_t> ring_index;
+};
+
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_PLACEMENT_H_ */
@@ -1,70 +1,260 @@
 #include <algorithm>
 #include <functional>
 #include <set>
+#include <thread>
 #include <unordered_map>
 
 #include <logger.h>
 #include <utils.h>
 #include <apps/memcachekv/server.h>
+#include <apps/memcachekv/cuckoo_store.h>
+#include <apps/memcachekv/utils.h>
 
 #define BASE_VERSION 1
+// Batch replies: bytes of op replies per packet, and the bytes of each op
+// reply besides its value
+#define MAX_BATCH_REPLY_BYTES 1400
+#define BATCH_REPLY_OP_OVERHEAD 8
 
 using std::string;
 
+// Replies to a batch, and the stored values they refer to
+thread_local static memcachekv::MemcacheKVReply batch_replies[memcachekv::MemcacheKVBatchRequest::MAX_OPS];
+thread_local static std::shared_ptr<const memcachekv::Value> batch_values[memcachekv::MemcacheKVBatchRequest::MAX_OPS];
+// Ops of a batch owned by this thread, on a partitioned server
+thread_local static memcachekv::Operation batch_ops[memcachekv::MemcacheKVBatchRequest::MAX_OPS];
+
 namespace memcachekv {
 
-Server::Item::Item()
-    : ver(BASE_VERSION), value("")
+Server::Server(Configuration *config, MessageCodec *codec, ControllerCodec *ctrl_codec,
+               int proc_latency, string default_value,
+               std::deque<std::string> &keys,
+               StoreType store_type,
+               SlabAllocator *slab,
+               const CachePolicy &cache,
+               const Snapshot *snapshot)
+    : config(config),
+    codec(codec),
+    ctrl_codec(ctrl_codec),
+    slab(slab),
+    proc_latency(proc_latency),
+    default_value(make_value(StringView(default_value))),
+    fill_misses(cache.limit > 0),
+    read_stats(config->n_app_threads + config->n_transport_threads)
 {
+    if (this->default_value == nullptr) {
+        panic("Slab allocator budget too small for the default value");
+    }
+    size_t n_items = snapshot != nullptr ? snapshot->size() : keys.size();
+    this->store = nullptr;
+    this->running = true;
+    switch (store_type) {
+    case StoreType::TBB:
+        if (cache.limit > 0) {
+            panic("Memory limit requires the cuckoo store");
+        }
+        this->store = new TBBStore();
+        break;
+    case StoreType::CUCKOO:
+        this->store = new CuckooStore(n_items, slab, cache);
+        break;
+    case StoreType::PARTITIONED:
+        if (cache.limit > 0) {
+            panic("Memory limit requires the cuckoo store");
+        }
+        if (config->n_app_threads < 1 || config->n_app_threads > MAX_PARTITIONS) {
+            panic("Partitioned store requires 1 to %d app threads", MAX_PARTITIONS);
+        }
+        for (int p = 0; p < config->n_app_threads; p++) {
+            this->partitions.push_back(new PartitionStore(n_items / config->n_app_threads + 1));
+        }
+        for (int t = 0; t < config->n_transport_threads; t++) {
+            for (int p = 0; p < config->n_app_threads; p++) {
+                this->handoff_rings.push_back(new HandoffRing(HANDOFF_RING_SIZE));
+            }
+        }
+        break;
+    default:
+        panic("Unknown store type");
+    }
+    if (snapshot != nullptr) {
+        snapshot->load([this](keyhash_t keyhash) {
+            return store_of(keyhash);
+        });
+        return;
+    }
+    // All preloaded keys share a single copy of the default value
+    for (const auto &key : keys) {
+        keyhash_t keyhash = compute_keyhash(key);
+        store_of(keyhash)->put(StringView(key), keyhash,
+                               BASE_VERSION, this->default_value);
+    }
 }
 
-Server::Item::Item(ver_t ver, const std::string &value)
-    : ver(ver), value(value)
+Server::~Server()
 {
+    delete this->store;
+    for (Store *partition : this->partitions) {
+        delete partition;
+    }
+    for (HandoffRing *ring : this->handoff_rings) {
+        delete ring;
+    }
 }
 
-Server::Item::Item(const Item &item)
-    : ver(item.ver), value(item.value)
+Server::ReadStats::ReadStats()
+    : n_gets(0), n_hits(0)
 {
 }
 
-Server::Server(Configuration *config, MessageCodec *codec, ControllerCodec *ctrl_codec,
-               int proc_latency, string default_value,
-               std::deque<std::string> &keys)
-    : config(config),
-    codec(codec),
-    ctrl_codec(ctrl_codec),
-    proc_latency(proc_latency),
-    default_value(default_value)
+void Server::report() const
 {
-    for (const auto &key : keys) {
-        this->store.insert(std::pair<std::string, Item>(key, Item(BASE_VERSION,
-                                                                  default_value)));
+    count_t n_gets = 0, n_hits = 0;
+    for (const ReadStats &stats : this->read_stats) {
+        n_gets += stats.n_gets;
+        n_hits += stats.n_hits;
+    }
+    info("Server %d: %llu GETs, %.2f%% hits", this->config->node_id,
+         (unsigned long long)n_gets, n_gets > 0 ? 100.0 * n_hits / n_gets : 0.0);
+    if (this->partitions.empty()) {
+        this->store->report();
+        return;
+    }
+    // Per partition load shows the skew of the workload across cores
+    for (size_t p = 0; p < this->partitions.size(); p++) {
+        info("Partition %zu: %llu GETs", p,
+             (unsigned long long)this->read_stats[p].n_gets);
+        this->partitions[p]->report();
     }
 }
 
-Server::~Server()
+void Server::stop()
+{
+    this->running = false;
+}
+
+bool Server::write_snapshot(const char *prefix) const
+{
+    std::vector<const Store*> stores;
+    if (this->partitions.empty()) {
+        stores.push_back(this->store);
+    } else {
+        stores.insert(stores.end(), this->partitions.begin(), this->partitions.end());
+    }
+    return Snapshot::write(snapshot_file(prefix, this->config->node_id), stores);
+}
+
+std::shared_ptr<const Value> Server::make_value(const StringView &value) const
+{
+    return Value::create(this->slab, value.data(), value.size());
+}
+
+int Server::partition_of(keyhash_t keyhash) const
+{
+    // Multiplicative hash: keys placed on this server may share the low or
+    // high bits of their key hash
+    return (int)(((uint64_t)(uint32_t)(keyhash * 0x9e3779b1U) * this->partitions.size()) >> 32);
+}
+
+Store *Server::store_of(keyhash_t keyhash) const
+{
+    if (this->partitions.empty()) {
+        return this->store;
+    }
+    return this->partitions[partition_of(keyhash)];
+}
+
+bool Server::owns(keyhash_t keyhash, int tid) const
 {
+    return this->partitions.empty() || partition_of(keyhash) == tid;
 }
 
 void Server::receive_message(const Message &msg, const Address &addr, int tid)
+{
+    if (!this->partitions.empty()) {
+        hand_off(msg, tid - this->config->n_app_threads);
+        return;
+    }
+    process_message(msg, tid);
+}
+
+void Server::process_message(const Message &msg, int tid)
 {
     // Check for controller message
     ControllerMessage ctrlmsg;
     if (this->ctrl_codec->decode(msg, ctrlmsg)) {
-        process_ctrl_message(ctrlmsg, addr);
+        process_ctrl_message(ctrlmsg);
         return;
     }
 
     // KV message
     MemcacheKVMessage kvmsg;
     if (this->codec->decode(msg, kvmsg)) {
-        process_kv_message(kvmsg, addr, tid);
+        process_kv_message(kvmsg, tid);
         return;
     }
     panic("Received unexpected message");
 }
 
+void Server::hand_off(const Message &msg, int transport_tid)
+{
+    // Bitmap of the partitions accessed by msg
+    uint64_t owners = 0;
+    ControllerMessage ctrlmsg;
+    MemcacheKVMessage kvmsg;
+    if (this->ctrl_codec->decode(msg, ctrlmsg)) {
+        if (ctrlmsg.type == ControllerMessage::Type::REPLICATION) {
+            owners = 1ULL << partition_of(ctrlmsg.replication.keyhash);
+        } else {
+            // Rejected by its receiver
+            owners = 1;
+        }
+    } else if (this->codec->decode(msg, kvmsg)) {
+        switch (kvmsg.type) {
+        case MemcacheKVMessage::Type::REQUEST:
+            owners = 1ULL << partition_of(kvmsg.request.op.keyhash);
+            break;
+        case MemcacheKVMessage::Type::RC_REQ:
+            owners = 1ULL << partition_of(kvmsg.rc_request.keyhash);
+            break;
+        case MemcacheKVMessage::Type::BATCH_REQ:
+            for (size_t i = 0; i < kvmsg.batch_request.n_ops; i++) {
+                owners |= 1ULL << partition_of(kvmsg.batch_request.ops[i].keyhash);
+            }
+            break;
+        default:
+            owners = 1;
+        }
+    } else {
+        panic("Received unexpected message");
+    }
+
+    size_t n_partitions = this->partitions.size();
+    for (size_t p = 0; p < n_partitions; p++) {
+        if (!(owners & (1ULL << p))) {
+            continue;
+        }
+        HandoffRing *ring = this->handoff_rings[transport_tid * n_partitions + p];
+        // Wait for the owner rather than drop: it is always draining
+        while (!ring->push(msg.buf(), msg.len())) {
+            if (!this->running) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool Server::flow_hash(const Message &msg, uint32_t &hash)
+{
+    keyhash_t keyhash;
+    if (!this->codec->peek_keyhash(msg, keyhash)) {
+        return false;
+    }
+    hash = keyhash;
+    return true;
+}
+
 typedef std::function<bool(std::pair<keyhash_t, uint64_t>,
                            std::pair<keyhash_t, uint64_t>)> Comparator;
 static Comparator comp =
@@ -76,32 +266,59 @@ static Comparator comp =
 
 void Server::run()
 {
-    // Do nothing
+    // App threads serve the partitions; otherwise transport threads do
+    // all the work
+    if (!this->partitions.empty()) {
+        this->transport->run_app_threads(this);
+    }
 }
 
 void Server::run_thread(int tid)
 {
+    size_t n_partitions = this->partitions.size();
+    while (this->running) {
+        bool idle = true;
+        for (int t = 0; t < this->config->n_transport_threads; t++) {
+            HandoffRing *ring = this->handoff_rings[t * n_partitions + tid];
+            const void *buf;
+            size_t len;
+            for (int n = 0; n < MAX_HANDOFF_BURST; n++) {
+                if ((buf = ring->front(len)) == nullptr) {
+                    break;
+                }
+                Message msg(const_cast<void*>(buf), len, false);
+                process_message(msg, tid);
+                ring->pop();
+                idle = false;
+            }
+        }
+        if (idle) {
+            std::this_thread::yield();
+        }
+    }
 }
 
-void Server::process_kv_message(const MemcacheKVMessage &msg,
-                                const Address &addr, int tid)
+void Server::process_kv_message(const MemcacheKVMessage &msg, int tid)
 {
     switch (msg.type) {
     case MemcacheKVMessage::Type::REQUEST: {
-        process_kv_request(msg.request, addr, tid);
+        process_kv_request(msg.request, tid);
         break;
     }
     case MemcacheKVMessage::Type::RC_REQ: {
         process_replication_request(msg.rc_request);
         break;
     }
+    case MemcacheKVMessage::Type::BATCH_REQ: {
+        process_kv_batch(msg.batch_request, tid);
+        break;
+    }
     default:
         panic("Server received unexpected kv message");
     }
 }
 
-void Server::process_ctrl_message(const ControllerMessage &msg,
-                                  const Address &addr)
+void Server::process_ctrl_message(const ControllerMessage &msg)
 {
     switch (msg.type) {
     case ControllerMessage::Type::REPLICATION: {
@@ -113,9 +330,7 @@ void Server::process_ctrl_message(const ControllerMessage &msg,
     }
 }
 
-void Server::process_kv_request(const MemcacheKVRequest &request,
-                                const Address &addr,
-                                int tid)
+void Server::process_kv_request(const MemcacheKVRequest &request, int tid)
 {
     // User defined processing latency
     if (this->proc_latency > 0) {
@@ -123,7 +338,9 @@ void Server::process_kv_request(const MemcacheKVRequest &request,
     }
 
     MemcacheKVMessage kvmsg;
-    process_op(request.op, kvmsg.reply, tid);
+    // Keeps a stored value in the reply alive until it is sent
+    std::shared_ptr<const Value> value;
+    process_op(request.op, kvmsg.reply, value, tid);
 
     // Chain replication: tail rack sends a reply; other racks forward the request
     if (this->config->rack_id == this->config->num_racks - 1) {
@@ -137,7 +354,7 @@ void Server::process_kv_request(const MemcacheKVRequest &request,
         kvmsg.request = request;
         kvmsg.request.op.op_type = OpType::PUTFWD;
     }
-    Message msg;
+    Message msg(this->transport);
     if (!this->codec->encode(msg, kvmsg)) {
         panic("Failed to encode message");
     }
@@ -158,41 +375,140 @@ void Server::process_kv_request(const MemcacheKVRequest &request,
     }
 }
 
+void Server::process_kv_batch(const MemcacheKVBatchRequest &request, int tid)
+{
+    bool tail = this->config->rack_id == this->config->num_racks - 1;
+    MemcacheKVMessage kvmsg;
+    const Operation *ops = request.ops;
+    size_t n_ops = request.n_ops;
+
+    // Partitioned: the owners of the other ops reply to them separately
+    if (!this->partitions.empty()) {
+        n_ops = 0;
+        for (size_t i = 0; i < request.n_ops; i++) {
+            if (owns(request.ops[i].keyhash, tid)) {
+                batch_ops[n_ops++] = request.ops[i];
+            }
+        }
+        ops = batch_ops;
+    }
+
+    for (size_t i = 0; i < n_ops; i++) {
+        // User defined processing latency
+        if (this->proc_latency > 0) {
+            wait(this->proc_latency);
+        }
+        // Chain replication: only the tail rack serves reads
+        if (!tail && ops[i].op_type == OpType::GET) {
+            continue;
+        }
+        memset((void*)&batch_replies[i], 0, sizeof(MemcacheKVReply));
+        process_op(ops[i], batch_replies[i], batch_values[i], tid);
+    }
+
+    if (n_ops == 0) {
+        return;
+    }
+    if (tail) {
+        kvmsg.type = MemcacheKVMessage::Type::BATCH_REPLY;
+        kvmsg.batch_reply.client_id = request.client_id;
+        kvmsg.batch_reply.server_id = this->config->node_id;
+        kvmsg.batch_reply.req_id = request.req_id;
+        kvmsg.batch_reply.req_time = request.req_time;
+        // Clients size batches by their requests: split replies whose
+        // values would not fit in a packet
+        size_t first = 0, bytes = 0;
+        for (size_t i = 0; i < n_ops; i++) {
+            size_t op_bytes = BATCH_REPLY_OP_OVERHEAD + batch_replies[i].value.size();
+            if (i > first && bytes + op_bytes > MAX_BATCH_REPLY_BYTES) {
+                kvmsg.batch_reply.n_ops = i - first;
+                kvmsg.batch_reply.ops = &batch_replies[first];
+                send_batch(kvmsg, request.client_id);
+                first = i;
+                bytes = 0;
+            }
+            bytes += op_bytes;
+        }
+        kvmsg.batch_reply.n_ops = n_ops - first;
+        kvmsg.batch_reply.ops = &batch_replies[first];
+        send_batch(kvmsg, request.client_id);
+    } else {
+        kvmsg.type = MemcacheKVMessage::Type::BATCH_REQ;
+        kvmsg.batch_request = request;
+        kvmsg.batch_request.n_ops = n_ops;
+        kvmsg.batch_request.ops = const_cast<Operation*>(ops);
+        send_batch(kvmsg, request.client_id);
+    }
+    // Batch replies copy values, so the stored values can be released
+    for (size_t i = 0; i < n_ops; i++) {
+        batch_values[i].reset();
+    }
+}
+
+void Server::send_batch(const MemcacheKVMessage &kvmsg, int client_id)
+{
+    Message msg(this->transport);
+    if (!this->codec->encode(msg, kvmsg)) {
+        panic("Failed to encode message");
+    }
+
+    if (this->config->use_endhost_lb) {
+        this->transport->send_message_to_lb(msg);
+    } else if (kvmsg.type == MemcacheKVMessage::Type::BATCH_REPLY) {
+        this->transport->send_message(msg,
+                *this->config->client_addresses[client_id]);
+    } else {
+        this->transport->send_message_to_node(msg,
+                this->config->rack_id+1,
+                this->config->node_id);
+    }
+}
+
 void
-Server::process_op(const Operation &op, MemcacheKVReply &reply, int tid)
+Server::process_op(const Operation &op,
+                   MemcacheKVReply &reply,
+                   std::shared_ptr<const Value> &value,
+                   int tid)
 {
     reply.op_type = op.op_type;
     reply.keyhash = op.keyhash;
     reply.key = op.key;
     switch (op.op_type) {
     case OpType::GET: {
-        const_store_ac_t ac;
-        if (this->store.find(ac, op.key)) {
+        ReadStats &stats = this->read_stats[tid];
+        stats.n_gets++;
+        if (store_of(op.keyhash)->get(op.key, op.keyhash, reply.ver, value)) {
             // Key is present
-            reply.ver = ac->second.ver;
-            reply.value = ac->second.value;
+            stats.n_hits++;
+            reply.value = StringView(*value);
+            reply.value_owner = &value;
+            reply.result = Result::OK;
+        } else if (this->fill_misses) {
+            // Cache miss: the value comes from the backing tier, and is
+            // cached unless admission turns it down
+            value = this->default_value;
+            store_of(op.keyhash)->put(op.key, op.keyhash, BASE_VERSION, value);
+            reply.ver = BASE_VERSION;
+            reply.value = StringView(*value);
+            reply.value_owner = &value;
             reply.result = Result::OK;
         } else {
             // Key not found
             reply.ver = BASE_VERSION;
-            reply.value = std::string("");
+            reply.value = StringView();
             reply.result = Result::NOT_FOUND;
         }
         break;
     }
     case OpType::PUT:
     case OpType::PUTFWD: {
-        {
-            store_ac_t ac;
-            this->store.insert(ac, op.key);
-            if (op.ver >= ac->second.ver) {
-                ac->second.ver = op.ver;
-                ac->second.value = op.value;
-            }
-        }
+        // Not stored if the store memory is exhausted (or ver is stale)
+        std::shared_ptr<const Value> new_value = make_value(op.value);
+        bool stored = new_value != nullptr &&
+            store_of(op.keyhash)->put(op.key, op.keyhash, op.ver, new_value);
         reply.ver = op.ver;
         reply.value = op.value; // for netcache
-        reply.result = Result::OK;
+        reply.result = stored ? Result::OK : Result::NOT_STORED;
         reply.op_type = OpType::PUT; // client doesn't expect PUTFWD
         break;
     }
@@ -204,16 +520,9 @@ Server::process_op(const Operation &op, MemcacheKVReply &reply, int tid)
 void
 Server::process_replication_request(const ReplicationRequest &request)
 {
-    bool reply = false;
-    {
-        store_ac_t ac;
-        this->store.insert(ac, request.key);
-        if (request.ver >= ac->second.ver) {
-            ac->second.ver = request.ver;
-            ac->second.value = request.value;
-            reply = true;
-        }
-    }
+    std::shared_ptr<const Value> value = make_value(request.value);
+    bool reply = value != nullptr &&
+        store_of(request.keyhash)->put(request.key, request.keyhash, request.ver, value);
 
     if (reply) {
         MemcacheKVMessage kvmsg;
@@ -222,7 +531,7 @@ Server::process_replication_request(const ReplicationRequest &request)
         kvmsg.rc_ack.ver = request.ver;
         kvmsg.rc_ack.server_id = this->config->node_id;
 
-        Message msg;
+        Message msg(this->transport);
         if (!this->codec->encode(msg, kvmsg)) {
             panic("Failed to encode migration ack");
         }
@@ -234,30 +543,26 @@ void
 Server::process_ctrl_replication(const ControllerReplication &request)
 {
     MemcacheKVMessage kvmsg;
-    bool reply;
-    {
-        const_store_ac_t ac;
-        if ((reply = this->store.find(ac, request.key))) {
-            kvmsg.rc_request.ver = ac->second.ver;
-            kvmsg.rc_request.value = ac->second.value;
-        }
-    }
-
-    if (reply) {
+    std::shared_ptr<const Value> value;
+    if (store_of(request.keyhash)->get(StringView(request.key), request.keyhash,
+                                       kvmsg.rc_request.ver, value)) {
         kvmsg.type = MemcacheKVMessage::Type::RC_REQ;
         kvmsg.rc_request.keyhash = request.keyhash;
-        kvmsg.rc_request.key = request.key;
+        kvmsg.rc_request.key = StringView(request.key);
+        kvmsg.rc_request.value = StringView(*value);
 
         // Send replication request to all nodes in the rack (except itself)
-        Message msg;
+        Message msg(this->transport);
         if (!this->codec->encode(msg, kvmsg)) {
             panic("Failed to encode message");
         }
+        std::vector<int> node_ids;
         for (int node_id = 0; node_id < this->config->num_nodes; node_id++) {
             if (node_id != this->config->node_id) {
-                this->transport->send_message_to_local_node(msg, node_id);
+                node_ids.push_back(node_id);
             }
         }
+        this->transport->send_message_to_local_nodes(msg, node_ids);
     }
 }
 
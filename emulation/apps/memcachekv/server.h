@@ -1,69 +1,121 @@
 #ifndef _MEMCACHEKV_SERVER_H_
 #define _MEMCACHEKV_SERVER_H_
 
+#include <atomic>
 #include <string>
+#include <memory>
 #include <vector>
 #include <deque>
 #include <mutex>
 #include <pthread.h>
-#include <tbb/concurrent_hash_map.h>
 #include <tbb/concurrent_unordered_map.h>
 #include <tbb/concurrent_unordered_set.h>
 
 #include <application.h>
+#include <apps/memcachekv/cache.h>
 #include <apps/memcachekv/message.h>
+#include <apps/memcachekv/partition.h>
+#include <apps/memcachekv/slab.h>
+#include <apps/memcachekv/snapshot.h>
+#include <apps/memcachekv/store.h>
 
 typedef uint64_t count_t;
 
 namespace memcachekv {
 
+/*
+ * With StoreType::PARTITIONED, the keyspace is split by key hash into one
+ * partition per app thread, and only the owning thread accesses a
+ * partition. Transport threads decode each request and hand it, through a
+ * HandoffRing per (transport thread, partition) pair, to the owner of its
+ * key; a batch goes to the owners of each of its ops, which each process
+ * and reply to their own ops.
+ */
 class Server : public Application {
 public:
     Server(Configuration *config, MessageCodec *codec,
            ControllerCodec *ctrl_codec, int proc_latency,
            std::string default_value,
-           std::deque<std::string> &keys);
+           std::deque<std::string> &keys,
+           StoreType store_type,
+           SlabAllocator *slab,
+           const CachePolicy &cache,
+           const Snapshot *snapshot);
     ~Server();
 
     virtual void receive_message(const Message &msg,
                                  const Address &addr,
                                  int tid) override final;
+    virtual bool flow_hash(const Message &msg, uint32_t &hash) override final;
     virtual void run() override final;
     virtual void run_thread(int tid) override final;
 
+    // Logs the GET hit rate and the store size
+    void report() const;
+    // Stops the app threads of a partitioned server
+    void stop();
+    // Writes the items of the server to its snapshot file for prefix. Only
+    // safe while the server runs with the cuckoo store.
+    bool write_snapshot(const char *prefix) const;
+
+    static const int MAX_PARTITIONS = 64;
+    // Bytes of each handoff ring
+    static const size_t HANDOFF_RING_SIZE = 1 << 20;
+    // Messages an app thread takes from a ring before polling the next
+    static const int MAX_HANDOFF_BURST = 32;
+
 private:
-    void process_kv_message(const MemcacheKVMessage &msg,
-                            const Address &addr,
-                            int tid);
-    void process_ctrl_message(const ControllerMessage &msg,
-                              const Address &addr);
-    void process_kv_request(const MemcacheKVRequest &request,
-                            const Address &addr,
-                            int tid);
+    // Per thread, padded to a cache line
+    struct ReadStats {
+        ReadStats();
+
+        count_t n_gets;
+        count_t n_hits;
+        char pad[48];
+    };
+
+    void process_message(const Message &msg, int tid);
+    // Copies msg into the handoff rings of the partitions it accesses
+    void hand_off(const Message &msg, int transport_tid);
+    void process_kv_message(const MemcacheKVMessage &msg, int tid);
+    void process_ctrl_message(const ControllerMessage &msg);
+    void process_kv_request(const MemcacheKVRequest &request, int tid);
+    void process_kv_batch(const MemcacheKVBatchRequest &request, int tid);
+    // Sends a batch reply to client_id, or forwards a batch request
+    void send_batch(const MemcacheKVMessage &kvmsg, int client_id);
+    // value holds the stored value reply refers to, if any
     void process_op(const Operation &op,
                     MemcacheKVReply &reply,
+                    std::shared_ptr<const Value> &value,
                     int tid);
     void process_replication_request(const ReplicationRequest &request);
     void process_ctrl_replication(const ControllerReplication &request);
+    // Copies value into the slab allocator, if any. Returns nullptr if the
+    // slab allocator is exhausted.
+    std::shared_ptr<const Value> make_value(const StringView &value) const;
+    inline int partition_of(keyhash_t keyhash) const;
+    inline Store *store_of(keyhash_t keyhash) const;
+    // Whether thread tid processes ops on keyhash
+    inline bool owns(keyhash_t keyhash, int tid) const;
 
     Configuration *config;
     MessageCodec *codec;
     ControllerCodec *ctrl_codec;
-
-    struct Item {
-        Item();
-        Item(ver_t ver, const std::string &value);
-        Item(const Item &item);
-
-        ver_t ver;
-        std::string value;
-    };
-    typedef tbb::concurrent_hash_map<std::string, Item>::const_accessor const_store_ac_t;
-    typedef tbb::concurrent_hash_map<std::string, Item>::accessor store_ac_t;
-    tbb::concurrent_hash_map<std::string, Item> store;
+    Store *store;
+    SlabAllocator *slab;
+    // Partitioned stores replace store
+    std::vector<Store*> partitions;
+    // Ring from transport thread t to partition p at t * n_partitions + p
+    std::vector<HandoffRing*> handoff_rings;
+    std::atomic<bool> running;
 
     int proc_latency;
-    std::string default_value;
+    std::shared_ptr<const Value> default_value;
+    // With a memory limit, the store caches a backing tier: GET misses
+    // fetch the key from it (emulated as holding every key at the default
+    // value) and insert it
+    bool fill_misses;
+    std::vector<ReadStats> read_stats;
 };
 
 } // namespace memcachekv
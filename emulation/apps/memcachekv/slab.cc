@@ -0,0 +1,323 @@
+#include <sys/mman.h>
+
+#include <logger.h>
+#include <apps/memcachekv/slab.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGEPAGE_1GB (1UL << 30)
+#define BASE_PAGE_SIZE 4096
+
+// Frees can still come after the thread cache is destroyed, e.g. from
+// epoch reclamation when the thread exits
+thread_local static bool thread_cache_destroyed = false;
+
+namespace memcachekv {
+
+std::mutex SlabAllocator::registry_lock;
+SlabAllocator *SlabAllocator::registry[SlabAllocator::MAX_ALLOCATORS];
+uint64_t SlabAllocator::next_gen = 0;
+
+SlabAllocator::SizeClass::SizeClass()
+    : chunk_size(0), free_list(nullptr), n_free(0),
+    carve_ptr(nullptr), carve_end(nullptr), n_slabs(0), n_held(0)
+{
+}
+
+SlabAllocator::ThreadCache::ThreadCache()
+{
+    for (int i = 0; i < MAX_ALLOCATORS; i++) {
+        this->gens[i] = 0;
+        this->magazines[i] = nullptr;
+    }
+}
+
+SlabAllocator::ThreadCache::~ThreadCache()
+{
+    std::lock_guard<std::mutex> lck(registry_lock);
+    for (int i = 0; i < MAX_ALLOCATORS; i++) {
+        Magazine *mags = this->magazines[i];
+        if (mags == nullptr) {
+            continue;
+        }
+        // Return cached chunks, unless their allocator is gone
+        SlabAllocator *slab = registry[i];
+        if (slab != nullptr && slab->gen == this->gens[i]) {
+            for (int cls = 0; cls < slab->n_classes; cls++) {
+                if (mags[cls].n > 0) {
+                    slab->drain(cls, mags[cls], mags[cls].n);
+                }
+            }
+        }
+        delete[] mags;
+    }
+    thread_cache_destroyed = true;
+}
+
+SlabAllocator::SlabAllocator(size_t budget)
+    : arena_ptr(nullptr), arena_end(nullptr), mapped(0), page_type("none")
+{
+    {
+        std::lock_guard<std::mutex> lck(registry_lock);
+        this->slot = -1;
+        for (int i = 0; i < MAX_ALLOCATORS; i++) {
+            if (registry[i] == nullptr) {
+                this->slot = i;
+                break;
+            }
+        }
+        if (this->slot < 0) {
+            panic("More than %d slab allocators", MAX_ALLOCATORS);
+        }
+        registry[this->slot] = this;
+        this->gen = ++next_gen;
+    }
+
+    // Size classes grow by 1.25x, in multiples of MIN_CHUNK_SIZE
+    std::vector<size_t> sizes;
+    for (size_t size = MIN_CHUNK_SIZE; size < MAX_CHUNK_SIZE; ) {
+        sizes.push_back(size);
+        size = (size * 5 / 4 + MIN_CHUNK_SIZE - 1) / MIN_CHUNK_SIZE * MIN_CHUNK_SIZE;
+    }
+    sizes.push_back(size_t(MAX_CHUNK_SIZE));
+    this->n_classes = sizes.size();
+    this->classes = new SizeClass[this->n_classes];
+    this->class_index.resize(MAX_CHUNK_SIZE / MIN_CHUNK_SIZE + 1);
+    int cls = 0;
+    for (size_t i = 0; i < this->class_index.size(); i++) {
+        while (sizes[cls] < i * MIN_CHUNK_SIZE) {
+            cls++;
+        }
+        this->class_index[i] = cls;
+    }
+    for (int i = 0; i < this->n_classes; i++) {
+        this->classes[i].chunk_size = sizes[i];
+    }
+
+    // Preallocate the whole budget
+    this->budget = (budget + SLAB_SIZE - 1) / SLAB_SIZE * SLAB_SIZE;
+    if (this->budget > 0) {
+        map_region(this->budget, true);
+        info("Slab allocator preallocated %zu MB with %s",
+             this->budget >> 20, this->page_type);
+    }
+}
+
+SlabAllocator::~SlabAllocator()
+{
+    {
+        std::lock_guard<std::mutex> lck(registry_lock);
+        registry[this->slot] = nullptr;
+    }
+    for (const auto &region : this->regions) {
+        munmap(region.first, region.second);
+    }
+    delete[] this->classes;
+}
+
+void *SlabAllocator::alloc(size_t size)
+{
+    if (size > MAX_CHUNK_SIZE) {
+        return nullptr;
+    }
+    int cls = class_of(size);
+    Magazine *mag = magazine(cls);
+    if (mag == nullptr) {
+        // Thread is exiting: take a chunk and give back the rest
+        Magazine tmp;
+        tmp.n = 0;
+        if (!refill(cls, tmp)) {
+            return nullptr;
+        }
+        void *chunk = tmp.chunks[--tmp.n];
+        drain(cls, tmp, tmp.n);
+        return chunk;
+    }
+    if (mag->n == 0 && !refill(cls, *mag)) {
+        return nullptr;
+    }
+    return mag->chunks[--mag->n];
+}
+
+void SlabAllocator::free(void *ptr)
+{
+    const SlabHeader *header = reinterpret_cast<const SlabHeader*>(
+        reinterpret_cast<uintptr_t>(ptr) & ~(uintptr_t)(SLAB_SIZE - 1));
+    header->owner->release(header->cls, ptr);
+}
+
+void SlabAllocator::report() const
+{
+    size_t slabs = 0, held = 0;
+    for (int i = 0; i < this->n_classes; i++) {
+        SizeClass &c = this->classes[i];
+        std::lock_guard<std::mutex> lck(c.lock);
+        if (c.n_slabs == 0) {
+            continue;
+        }
+        size_t n_held = c.n_held.load(std::memory_order_relaxed);
+        size_t n_free = c.n_free + (c.carve_end - c.carve_ptr) / c.chunk_size;
+        info("Slab class %2d: %6zu B chunks, %5zu slabs, %10zu held, %10zu free",
+             i, c.chunk_size, c.n_slabs, n_held, n_free);
+        slabs += c.n_slabs;
+        held += n_held * c.chunk_size;
+    }
+    info("Slab allocator: %zu MB mapped with %s, %zu MB in slabs, %zu MB held",
+         this->mapped >> 20, this->page_type, (slabs * SLAB_SIZE) >> 20, held >> 20);
+}
+
+SlabAllocator::ThreadCache *SlabAllocator::thread_cache()
+{
+    if (thread_cache_destroyed) {
+        return nullptr;
+    }
+    thread_local static ThreadCache cache;
+    return &cache;
+}
+
+SlabAllocator::Magazine *SlabAllocator::magazine(int cls)
+{
+    ThreadCache *cache = thread_cache();
+    if (cache == nullptr) {
+        return nullptr;
+    }
+    if (cache->gens[this->slot] != this->gen) {
+        // First use, or the slot belonged to a destroyed allocator
+        delete[] cache->magazines[this->slot];
+        cache->magazines[this->slot] = new Magazine[this->n_classes]();
+        cache->gens[this->slot] = this->gen;
+    }
+    return &cache->magazines[this->slot][cls];
+}
+
+void SlabAllocator::release(int cls, void *ptr)
+{
+    Magazine *mag = magazine(cls);
+    if (mag == nullptr) {
+        Magazine tmp;
+        tmp.n = 1;
+        tmp.chunks[0] = ptr;
+        drain(cls, tmp, 1);
+        return;
+    }
+    if (mag->n == MAGAZINE_SIZE) {
+        drain(cls, *mag, MAGAZINE_SIZE / 2);
+    }
+    mag->chunks[mag->n++] = ptr;
+}
+
+bool SlabAllocator::refill(int cls, Magazine &mag)
+{
+    SizeClass &c = this->classes[cls];
+    std::lock_guard<std::mutex> lck(c.lock);
+    // Half a magazine, so that a thread alternating allocs and frees does
+    // not go back to the class on every operation
+    while (mag.n < MAGAZINE_SIZE / 2 && c.free_list != nullptr) {
+        void *chunk = c.free_list;
+        c.free_list = *static_cast<void**>(chunk);
+        c.n_free--;
+        mag.chunks[mag.n++] = chunk;
+    }
+    while (mag.n < MAGAZINE_SIZE / 2) {
+        if ((size_t)(c.carve_end - c.carve_ptr) < c.chunk_size) {
+            char *slab = new_slab(cls);
+            if (slab == nullptr) {
+                break;
+            }
+            c.carve_ptr = slab + SLAB_HEADER_SIZE;
+            c.carve_end = slab + SLAB_SIZE;
+            c.n_slabs++;
+        }
+        mag.chunks[mag.n++] = c.carve_ptr;
+        c.carve_ptr += c.chunk_size;
+    }
+    c.n_held.fetch_add(mag.n, std::memory_order_relaxed);
+    return mag.n > 0;
+}
+
+void SlabAllocator::drain(int cls, Magazine &mag, int n)
+{
+    SizeClass &c = this->classes[cls];
+    std::lock_guard<std::mutex> lck(c.lock);
+    for (int i = 0; i < n; i++) {
+        void *chunk = mag.chunks[--mag.n];
+        *static_cast<void**>(chunk) = c.free_list;
+        c.free_list = chunk;
+    }
+    c.n_free += n;
+    c.n_held.fetch_sub(n, std::memory_order_relaxed);
+}
+
+char *SlabAllocator::new_slab(int cls)
+{
+    std::lock_guard<std::mutex> lck(this->arena_lock);
+    if (this->arena_ptr == this->arena_end) {
+        if (this->budget > 0) {
+            return nullptr;
+        }
+        map_region(REGION_SIZE, false);
+    }
+    char *slab = this->arena_ptr;
+    this->arena_ptr += SLAB_SIZE;
+    SlabHeader *header = reinterpret_cast<SlabHeader*>(slab);
+    header->owner = this;
+    header->cls = cls;
+    return slab;
+}
+
+void SlabAllocator::map_region(size_t size, bool populate)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (populate ? MAP_POPULATE : 0);
+    void *mem = MAP_FAILED;
+
+    // Hugetlb pages are only there if reserved by the administrator
+    if (size % HUGEPAGE_1GB == 0) {
+        mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   flags | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+        this->page_type = "1GB hugepages";
+    }
+    if (mem == MAP_FAILED) {
+        mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   flags | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        this->page_type = "2MB hugepages";
+    }
+    if (mem == MAP_FAILED) {
+        // Align to slabs, so transparent hugepages can back them
+        size_t len = size + SLAB_SIZE;
+        char *raw = static_cast<char*>(mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) {
+            panic("Failed to map %zu MB for slab allocator", size >> 20);
+        }
+        char *aligned = reinterpret_cast<char*>(
+            (reinterpret_cast<uintptr_t>(raw) + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+        if (aligned > raw) {
+            munmap(raw, aligned - raw);
+        }
+        if (raw + len > aligned + size) {
+            munmap(aligned + size, raw + len - (aligned + size));
+        }
+        madvise(aligned, size, MADV_HUGEPAGE);
+        if (populate) {
+            for (char *page = aligned; page < aligned + size; page += BASE_PAGE_SIZE) {
+                *page = 0;
+            }
+        }
+        mem = aligned;
+        this->page_type = "transparent hugepages";
+    }
+    this->regions.push_back(std::make_pair(mem, size));
+    this->arena_ptr = static_cast<char*>(mem);
+    this->arena_end = this->arena_ptr + size;
+    this->mapped += size;
+}
+
+} // namespace memcachekv
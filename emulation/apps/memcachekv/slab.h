@@ -0,0 +1,156 @@
+#ifndef _MEMCACHEKV_SLAB_H_
+#define _MEMCACHEKV_SLAB_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace memcachekv {
+
+/*
+ * Slab allocator for store items (keys and values). Memory is carved into
+ * 2MB slabs, each split into chunks of one size class (classes grow by
+ * 1.25x, as memcached's). Threads allocate from and free into per-class
+ * magazines, and only take a class lock to exchange half a magazine of
+ * chunks with the shared free list.
+ *
+ * Slabs come from regions mapped with 1GB or 2MB hugepages when the
+ * system has them reserved, and transparent hugepages otherwise. With a
+ * budget, all of it is mapped and faulted in upfront, and allocations fail
+ * once it is used up; without one, regions are mapped as needed.
+ */
+class SlabAllocator {
+public:
+    // budget in bytes, or 0 for no limit
+    SlabAllocator(size_t budget);
+    ~SlabAllocator();
+
+    // Returns nullptr if size is above MAX_CHUNK_SIZE or memory is exhausted
+    void *alloc(size_t size);
+    // Frees a chunk of any allocator
+    static void free(void *ptr);
+    // Logs memory use per size class
+    void report() const;
+
+    // For containers and shared_ptr control blocks
+    template<typename T>
+    class StlAllocator {
+    public:
+        typedef T value_type;
+
+        StlAllocator(SlabAllocator *slab) : slab(slab) {}
+        template<typename U>
+        StlAllocator(const StlAllocator<U> &other) : slab(other.slab) {}
+
+        T *allocate(size_t n)
+        {
+            void *ptr = this->slab->alloc(n * sizeof(T));
+            if (ptr == nullptr) {
+                throw std::bad_alloc();
+            }
+            return static_cast<T*>(ptr);
+        }
+        void deallocate(T *ptr, size_t n)
+        {
+            SlabAllocator::free(ptr);
+        }
+        bool operator==(const StlAllocator &other) const
+        {
+            return this->slab == other.slab;
+        }
+        bool operator!=(const StlAllocator &other) const
+        {
+            return this->slab != other.slab;
+        }
+
+        SlabAllocator *slab;
+    };
+
+    static const size_t SLAB_SIZE = 2 << 20;
+    static const size_t MIN_CHUNK_SIZE = 16;
+    // Values are at most 64KB (value_len_t)
+    static const size_t MAX_CHUNK_SIZE = 128 << 10;
+    // Mapped at a time when there is no budget
+    static const size_t REGION_SIZE = 64 << 20;
+    static const int MAGAZINE_SIZE = 32;
+    static const int MAX_ALLOCATORS = 16;
+
+private:
+    // At the start of every slab, so free() finds the owner of a chunk
+    struct SlabHeader {
+        SlabAllocator *owner;
+        int cls;
+    };
+    static const size_t SLAB_HEADER_SIZE = 64;
+
+    struct SizeClass {
+        SizeClass();
+
+        size_t chunk_size;
+        std::mutex lock;
+        // Free chunks, linked through their first word
+        void *free_list;
+        size_t n_free;
+        // Part of the last slab not handed out yet
+        char *carve_ptr;
+        char *carve_end;
+        // Slabs, and chunks held by threads (in use or in magazines)
+        size_t n_slabs;
+        std::atomic<size_t> n_held;
+    };
+
+    struct Magazine {
+        int n;
+        void *chunks[MAGAZINE_SIZE];
+    };
+    struct ThreadCache {
+        ThreadCache();
+        ~ThreadCache();
+
+        uint64_t gens[MAX_ALLOCATORS];
+        Magazine *magazines[MAX_ALLOCATORS];
+    };
+
+    inline int class_of(size_t size) const
+    {
+        return this->class_index[(size + MIN_CHUNK_SIZE - 1) / MIN_CHUNK_SIZE];
+    }
+    // nullptr if the calling thread is exiting
+    Magazine *magazine(int cls);
+    void release(int cls, void *ptr);
+    // Moves chunks between a magazine and the class free list
+    bool refill(int cls, Magazine &mag);
+    void drain(int cls, Magazine &mag, int n);
+    char *new_slab(int cls);
+    void map_region(size_t size, bool populate);
+
+    // nullptr once the calling thread's cache is destroyed
+    static ThreadCache *thread_cache();
+
+    // Live allocators, to flush magazines of exiting threads
+    static std::mutex registry_lock;
+    static SlabAllocator *registry[MAX_ALLOCATORS];
+    static uint64_t next_gen;
+
+    int slot;
+    uint64_t gen;
+    size_t budget;
+
+    int n_classes;
+    SizeClass *classes;
+    std::vector<uint8_t> class_index;
+
+    std::mutex arena_lock;
+    char *arena_ptr;
+    char *arena_end;
+    std::vector<std::pair<void*, size_t>> regions;
+    size_t mapped;
+    const char *page_type;
+};
+
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_SLAB_H_ */
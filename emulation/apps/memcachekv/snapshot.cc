@@ -0,0 +1,259 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <logger.h>
+#include <apps/memcachekv/snapshot.h>
+
+// "PGSNAP02"
+#define SNAPSHOT_MAGIC 0x323050414e534750ULL
+#define WRITE_BUFFER_SIZE (1 << 20)
+// SnapshotEntry flags: the value is logged once for several items
+#define ENTRY_SHARED_VALUE 0x1
+
+namespace memcachekv {
+
+struct SnapshotHeader {
+    uint64_t magic;
+    uint64_t n_items;
+    uint64_t index_off;
+    // Of the whole file
+    uint64_t size;
+};
+
+struct SnapshotEntry {
+    uint64_t key_off;
+    uint64_t value_off;
+    keyhash_t keyhash;
+    ver_t ver;
+    uint32_t key_len;
+    uint32_t flags;
+};
+
+/*
+ * Files mapped by snapshots, while any of their values is referenced.
+ * Values loaded from a mapping share its refcount, so their use count says
+ * nothing about being shared with other items.
+ */
+static std::mutex mappings_lock;
+static std::vector<std::weak_ptr<const void> > mappings;
+
+Snapshot::Snapshot(const std::shared_ptr<const void> &mapping, size_t n_items)
+    : mapping(mapping), n_items(n_items)
+{
+}
+
+Snapshot::~Snapshot()
+{
+}
+
+Snapshot *Snapshot::open(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        info("Ignoring invalid snapshot %s", path.c_str());
+        return nullptr;
+    }
+    size_t size = st.st_size;
+    void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        info("Failed to map snapshot %s: %s", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+    std::shared_ptr<const void> mapping(base, [size](const void *p) {
+        munmap(const_cast<void*>(p), size);
+    });
+
+    const SnapshotHeader *header = static_cast<const SnapshotHeader*>(base);
+    if (header->magic != SNAPSHOT_MAGIC ||
+        header->size != size ||
+        header->index_off < sizeof(SnapshotHeader) ||
+        header->index_off % sizeof(uint64_t) != 0 ||
+        header->index_off > size ||
+        (size - header->index_off) / sizeof(SnapshotEntry) != header->n_items) {
+        info("Ignoring invalid snapshot %s", path.c_str());
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lck(mappings_lock);
+        mappings.push_back(mapping);
+    }
+    // The whole index is read while loading
+    size_t index_page = header->index_off & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+    madvise(static_cast<char*>(base) + index_page, size - index_page, MADV_WILLNEED);
+    return new Snapshot(mapping, header->n_items);
+}
+
+bool Snapshot::write(const std::string &path, const std::vector<const Store*> &stores)
+{
+    std::string tmp_path = path + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "w");
+    if (file == nullptr) {
+        info("Failed to create snapshot %s: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    setvbuf(file, nullptr, _IOFBF, WRITE_BUFFER_SIZE);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    std::vector<SnapshotEntry> index;
+    // Logged values referenced elsewhere (maybe by other items). Holding
+    // them keeps their addresses from being reused while the store changes.
+    std::unordered_map<const Value*, std::pair<std::shared_ptr<const Value>, uint64_t> > shared;
+    // Held until the snapshot is written
+    std::vector<std::shared_ptr<const void> > live_mappings;
+    {
+        std::lock_guard<std::mutex> lck(mappings_lock);
+        size_t kept = 0;
+        for (size_t i = 0; i < mappings.size(); i++) {
+            std::shared_ptr<const void> mapping = mappings[i].lock();
+            if (mapping != nullptr) {
+                live_mappings.push_back(mapping);
+                mappings[kept++] = mappings[i];
+            }
+        }
+        mappings.resize(kept);
+    }
+    auto in_mapping = [&](const std::shared_ptr<const Value> &value) {
+        for (const auto &mapping : live_mappings) {
+            if (!value.owner_before(mapping) && !mapping.owner_before(value)) {
+                return true;
+            }
+        }
+        return false;
+    };
+    uint64_t off = 0;
+    bool ok = true;
+    auto append = [&](const void *buf, size_t len) {
+        ok = ok && fwrite(buf, 1, len, file) == len;
+        off += len;
+    };
+    auto align = [&](size_t alignment) {
+        static const char zeros[sizeof(uint64_t)] = {0};
+        append(zeros, (alignment - off % alignment) % alignment);
+    };
+
+    append(&header, sizeof(header));
+    for (const Store *store : stores) {
+        store->scan([&](const StringView &key, keyhash_t keyhash, ver_t ver,
+                        const std::shared_ptr<const Value> &value) {
+            SnapshotEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.keyhash = keyhash;
+            entry.ver = ver;
+            entry.key_off = off;
+            entry.key_len = key.size();
+            append(key.data(), key.size());
+
+            // Values loaded in place are each referenced by one item; shared
+            // ones were given their own refcount by load()
+            bool is_shared = value.use_count() > 1 && !in_mapping(value);
+            if (is_shared) {
+                entry.flags = ENTRY_SHARED_VALUE;
+                auto it = shared.find(value.get());
+                if (it != shared.end()) {
+                    entry.value_off = it->second.second;
+                    index.push_back(entry);
+                    return;
+                }
+            }
+            align(alignof(Value));
+            entry.value_off = off;
+            if (is_shared) {
+                shared[value.get()] = std::make_pair(value, off);
+            }
+            // Values are followed by their bytes
+            append(value.get(), sizeof(Value) + value->size());
+            index.push_back(entry);
+        });
+    }
+    align(sizeof(uint64_t));
+    header.magic = SNAPSHOT_MAGIC;
+    header.n_items = index.size();
+    header.index_off = off;
+    append(index.data(), index.size() * sizeof(SnapshotEntry));
+    header.size = off;
+
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        info("Failed to write snapshot %s: %s", path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+size_t Snapshot::size() const
+{
+    return this->n_items;
+}
+
+void Snapshot::load(const std::function<Store*(keyhash_t)> &store_of) const
+{
+    const char *base = static_cast<const char*>(this->mapping.get());
+    const SnapshotHeader *header = reinterpret_cast<const SnapshotHeader*>(base);
+    const SnapshotEntry *index = reinterpret_cast<const SnapshotEntry*>(base + header->index_off);
+    uint64_t log_end = header->index_off;
+    // Values logged once for several items, by offset, each with a refcount
+    // of its own (that also keeps the file mapped). Items sharing a value are
+    // usually many in a row, e.g. preloaded keys at the default value.
+    std::unordered_map<uint64_t, std::shared_ptr<const Value> > shared;
+    uint64_t last_shared_off = 0;
+    std::shared_ptr<const Value> last_shared;
+
+    for (size_t i = 0; i < this->n_items; i++) {
+        // Inserts are bound by cache misses on the table
+        if (i + PREFETCH_DISTANCE < this->n_items) {
+            keyhash_t ahead = index[i + PREFETCH_DISTANCE].keyhash;
+            store_of(ahead)->prefetch(ahead);
+        }
+        const SnapshotEntry &entry = index[i];
+        if (entry.key_off + entry.key_len > log_end ||
+            entry.value_off % alignof(Value) != 0 ||
+            entry.value_off + sizeof(Value) > log_end) {
+            panic("Corrupt snapshot entry %zu", i);
+        }
+        std::shared_ptr<const Value> value;
+        if ((entry.flags & ENTRY_SHARED_VALUE) && last_shared != nullptr &&
+            entry.value_off == last_shared_off) {
+            value = last_shared;
+        } else {
+            value = Value::wrap(base + entry.value_off, this->mapping);
+            if (entry.value_off + sizeof(Value) + value->size() > log_end) {
+                panic("Corrupt snapshot entry %zu", i);
+            }
+            if (entry.flags & ENTRY_SHARED_VALUE) {
+                std::shared_ptr<const Value> &owned = shared[entry.value_off];
+                if (owned == nullptr) {
+                    owned = std::shared_ptr<const Value>(value.get(), [value](const Value*) {});
+                }
+                value = owned;
+                last_shared_off = entry.value_off;
+                last_shared = owned;
+            }
+        }
+        store_of(entry.keyhash)->put(StringView(base + entry.key_off, entry.key_len),
+                                     entry.keyhash, entry.ver, value);
+    }
+}
+
+std::string snapshot_file(const char *prefix, int node_id)
+{
+    return std::string(prefix) + "." + std::to_string(node_id);
+}
+
+} // namespace memcachekv
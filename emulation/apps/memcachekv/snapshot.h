@@ -0,0 +1,58 @@
+#ifndef _MEMCACHEKV_SNAPSHOT_H_
+#define _MEMCACHEKV_SNAPSHOT_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <apps/memcachekv/store.h>
+
+namespace memcachekv {
+
+/*
+ * On-disk image of the items of a server, loaded by mapping the file:
+ *
+ *   header | log | index
+ *
+ * The log holds the key bytes, and each value as the image of a Value, so
+ * that values loaded from a snapshot are used in place (see Value::wrap) and
+ * only paged in when read. Values shared by several items (e.g. the default
+ * value of preloaded keys) are logged once, and flagged in the index so that
+ * loading shares them again. The index has a fixed-size entry per item, with
+ * its key hash, version and log offsets.
+ *
+ * Snapshots are written to a temporary file renamed over the previous one,
+ * so a crash while writing leaves the previous snapshot intact.
+ */
+class Snapshot {
+public:
+    ~Snapshot();
+
+    // Maps the snapshot at path; returns nullptr if there is none, or if it
+    // is not a valid snapshot
+    static Snapshot *open(const std::string &path);
+    // Writes the items of stores to path. Returns false on I/O errors.
+    static bool write(const std::string &path, const std::vector<const Store*> &stores);
+
+    size_t size() const;
+    // Puts every item into store_of(its key hash). Items keep their
+    // versions, and the file stays mapped while any value is referenced.
+    void load(const std::function<Store*(keyhash_t)> &store_of) const;
+
+    // Items ahead whose buckets are prefetched while loading
+    static const size_t PREFETCH_DISTANCE = 16;
+
+private:
+    Snapshot(const std::shared_ptr<const void> &mapping, size_t n_items);
+
+    std::shared_ptr<const void> mapping;
+    size_t n_items;
+};
+
+// Snapshot file of server node_id, for snapshots named prefix
+std::string snapshot_file(const char *prefix, int node_id);
+
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_SNAPSHOT_H_ */
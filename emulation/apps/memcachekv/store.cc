@@ -0,0 +1,100 @@
+#include <cstring>
+
+#include <logger.h>
+#include <apps/memcachekv/store.h>
+
+#define BASE_VERSION 1
+
+// Copy of the key being looked up; requests only carry a view of it
+thread_local static memcachekv::StoreKey key_buf;
+
+// Value of items just inserted, until the put stores its own
+static const std::shared_ptr<const memcachekv::Value> empty_value =
+    memcachekv::Value::create(nullptr, "", 0);
+
+namespace memcachekv {
+
+bool parse_store_type(const char *name, StoreType &type)
+{
+    if (strcmp(name, "tbb") == 0) {
+        type = StoreType::TBB;
+    } else if (strcmp(name, "cuckoo") == 0) {
+        type = StoreType::CUCKOO;
+    } else if (strcmp(name, "partitioned") == 0) {
+        type = StoreType::PARTITIONED;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+StoreKey::StoreKey()
+    : keyhash(0)
+{
+}
+
+StoreKey::StoreKey(const std::string &key, keyhash_t keyhash)
+    : key(key), keyhash(keyhash)
+{
+}
+
+TBBStore::Item::Item()
+    : ver(BASE_VERSION), value(empty_value)
+{
+}
+
+TBBStore::Item::Item(const Item &item)
+    : ver(item.ver), value(item.value)
+{
+}
+
+TBBStore::TBBStore()
+{
+}
+
+TBBStore::~TBBStore()
+{
+}
+
+bool TBBStore::get(const StringView &key, keyhash_t keyhash,
+                   ver_t &ver, std::shared_ptr<const Value> &value)
+{
+    map_t::const_accessor ac;
+    key.assign_to(key_buf.key);
+    key_buf.keyhash = keyhash;
+    if (!this->map.find(ac, key_buf)) {
+        return false;
+    }
+    ver = ac->second.ver;
+    value = ac->second.value;
+    return true;
+}
+
+bool TBBStore::put(const StringView &key, keyhash_t keyhash,
+                   ver_t ver, const std::shared_ptr<const Value> &value)
+{
+    map_t::accessor ac;
+    key.assign_to(key_buf.key);
+    key_buf.keyhash = keyhash;
+    this->map.insert(ac, key_buf);
+    if (ver < ac->second.ver) {
+        return false;
+    }
+    ac->second.ver = ver;
+    ac->second.value = value;
+    return true;
+}
+
+void TBBStore::report() const
+{
+    info("TBB store: %zu items", this->map.size());
+}
+
+void TBBStore::scan(const ScanFunction &fn) const
+{
+    for (map_t::const_iterator it = this->map.begin(); it != this->map.end(); ++it) {
+        fn(StringView(it->first.key), it->first.keyhash, it->second.ver, it->second.value);
+    }
+}
+
+} // namespace memcachekv
@@ -0,0 +1,106 @@
+#ifndef _MEMCACHEKV_STORE_H_
+#define _MEMCACHEKV_STORE_H_
+
+#include <functional>
+#include <string>
+#include <memory>
+#include <tbb/concurrent_hash_map.h>
+
+#include <apps/memcachekv/message.h>
+
+namespace memcachekv {
+
+/*
+ * Key-value store backing a Server. Values are immutable and refcounted: a
+ * put swaps in a new value, so replies still referencing the old one (e.g.
+ * in flight on the NIC) keep it alive. All methods are thread safe.
+ */
+class Store {
+public:
+    typedef std::function<void(const StringView &key, keyhash_t keyhash, ver_t ver,
+                               const std::shared_ptr<const Value> &value)> ScanFunction;
+
+    virtual ~Store() {}
+
+    // Returns false if key is not present
+    virtual bool get(const StringView &key, keyhash_t keyhash,
+                     ver_t &ver, std::shared_ptr<const Value> &value) = 0;
+    // Stores value at version ver, unless key holds a newer version or the
+    // store is out of memory. Returns whether the value was stored.
+    virtual bool put(const StringView &key, keyhash_t keyhash,
+                     ver_t ver, const std::shared_ptr<const Value> &value) = 0;
+    // Logs the size of the store, and its evictions if memory is bounded
+    virtual void report() const = 0;
+    // Calls fn on every item. Only CuckooStore may be modified meanwhile.
+    virtual void scan(const ScanFunction &fn) const = 0;
+    // Hint that keyhash is about to be accessed
+    virtual void prefetch(keyhash_t keyhash) const {}
+};
+
+/*
+ * PARTITIONED splits the keyspace by key hash into one PartitionStore per
+ * app thread (see Server).
+ */
+enum class StoreType {
+    TBB,
+    CUCKOO,
+    PARTITIONED
+};
+
+// Parses "tbb", "cuckoo" or "partitioned"
+bool parse_store_type(const char *name, StoreType &type);
+
+/*
+ * Store keys carry their key hash, so the store reuses the hash computed by
+ * the client instead of hashing the key again.
+ */
+struct StoreKey {
+    StoreKey();
+    StoreKey(const std::string &key, keyhash_t keyhash);
+
+    std::string key;
+    keyhash_t keyhash;
+};
+
+struct StoreKeyHashCompare {
+    size_t hash(const StoreKey &k) const
+    {
+        return k.keyhash;
+    }
+    bool equal(const StoreKey &a, const StoreKey &b) const
+    {
+        return a.keyhash == b.keyhash && a.key == b.key;
+    }
+};
+
+/*
+ * tbb::concurrent_hash_map: lookups take a bucket accessor lock.
+ */
+class TBBStore : public Store {
+public:
+    TBBStore();
+    ~TBBStore();
+
+    virtual bool get(const StringView &key, keyhash_t keyhash,
+                     ver_t &ver, std::shared_ptr<const Value> &value) override final;
+    virtual bool put(const StringView &key, keyhash_t keyhash,
+                     ver_t ver, const std::shared_ptr<const Value> &value) override final;
+    virtual void report() const override final;
+    virtual void scan(const ScanFunction &fn) const override final;
+
+private:
+    struct Item {
+        Item();
+        Item(const Item &item);
+
+        ver_t ver;
+        std::shared_ptr<const Value> value;
+    };
+    typedef tbb::concurrent_hash_map<StoreKey, Item, StoreKeyHashCompare> map_t;
+
+    map_t map;
+};
+
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_STORE_H_ */
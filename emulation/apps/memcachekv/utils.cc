@@ -0,0 +1,21 @@
+#include <cstring>
+
+#include <apps/memcachekv/utils.h>
+
+namespace memcachekv {
+
+KeyHashType keyhash_type = KeyHashType::DJB2;
+
+bool parse_keyhash_type(const char *name, KeyHashType &type)
+{
+    if (strcmp(name, "djb2") == 0) {
+        type = KeyHashType::DJB2;
+    } else if (strcmp(name, "city") == 0) {
+        type = KeyHashType::CITY;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+} // namespace memcachekv
@@ -4,24 +4,71 @@
 #include <cstdint>
 #include <string>
 
+#include <apps/memcachekv/city_hash.h>
+
 namespace memcachekv {
 
 #define N_VIRTUAL_NODES 16
 #define KEYHASH_MASK 0x7FFFFFFF
 #define KEYHASH_RANGE 0x80000000
 
-inline uint32_t compute_keyhash(const std::string &key)
+/*
+ * Key hash function. Every node of a cluster must use the same one: clients
+ * compute key hashes once per operation, and load balancers and servers use
+ * the hash carried in requests.
+ */
+enum class KeyHashType {
+    DJB2,
+    CITY
+};
+extern KeyHashType keyhash_type;
+
+// Parses "djb2" or "city"
+bool parse_keyhash_type(const char *name, KeyHashType &type);
+
+inline uint32_t compute_keyhash(const char *key, size_t key_len)
 {
+    if (keyhash_type == KeyHashType::CITY) {
+        return CityHash32(key, key_len) & KEYHASH_MASK;
+    }
     uint64_t hash = 5381;
-    for (auto c : key) {
-        hash = ((hash << 5) + hash) + (uint64_t)c;
+    for (size_t i = 0; i < key_len; i++) {
+        hash = ((hash << 5) + hash) + (uint64_t)key[i];
     }
     return (uint32_t)(hash & KEYHASH_MASK);
 }
 
-inline int key_to_node_id(const std::string &key, int num_nodes)
+inline uint32_t compute_keyhash(const std::string &key)
+{
+    return compute_keyhash(key.data(), key.size());
+}
+
+/*
+ * Key hashes (e.g. djb2 of similar keys) can be poorly mixed; scramble them
+ * before deriving a bucket or a ring position (MurmurHash3 finalizers).
+ */
+inline uint32_t mix_hash32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+inline uint64_t mix_hash64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+inline int keyhash_to_node_id(uint32_t keyhash, int num_nodes)
 {
-    uint32_t keyhash = compute_keyhash(key);
     uint32_t interval = (uint32_t)KEYHASH_RANGE / (num_nodes * N_VIRTUAL_NODES);
     return (int)((keyhash / interval) % num_nodes);
 }
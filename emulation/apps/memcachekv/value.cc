@@ -0,0 +1,46 @@
+#include <cstring>
+
+#include <apps/memcachekv/value.h>
+
+namespace memcachekv {
+
+Value::Value(const char *data, size_t size)
+    : len(size)
+{
+    memcpy(this + 1, data, size);
+}
+
+std::shared_ptr<const Value> Value::create(SlabAllocator *slab,
+                                           const char *data, size_t size)
+{
+    if (slab == nullptr) {
+        void *mem = ::operator new(sizeof(Value) + size);
+        return std::shared_ptr<const Value>(new (mem) Value(data, size),
+                                            [](const Value *value) {
+                                                ::operator delete(const_cast<Value*>(value));
+                                            });
+    }
+    void *mem = slab->alloc(sizeof(Value) + size);
+    if (mem == nullptr) {
+        return nullptr;
+    }
+    try {
+        return std::shared_ptr<const Value>(new (mem) Value(data, size),
+                                            [](const Value *value) {
+                                                SlabAllocator::free(const_cast<Value*>(value));
+                                            },
+                                            SlabAllocator::StlAllocator<Value>(slab));
+    } catch (const std::bad_alloc &) {
+        // The value itself was freed by the deleter
+        return nullptr;
+    }
+}
+
+std::shared_ptr<const Value> Value::wrap(const void *mem,
+                                         const std::shared_ptr<const void> &owner)
+{
+    // Shares the refcount of owner
+    return std::shared_ptr<const Value>(owner, static_cast<const Value*>(mem));
+}
+
+} // namespace memcachekv
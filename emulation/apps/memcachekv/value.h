@@ -0,0 +1,45 @@
+#ifndef _MEMCACHEKV_VALUE_H_
+#define _MEMCACHEKV_VALUE_H_
+
+#include <cstdint>
+#include <memory>
+
+#include <apps/memcachekv/slab.h>
+
+namespace memcachekv {
+
+/*
+ * Immutable stored value: a length followed by the bytes, in a single
+ * chunk of a SlabAllocator (or of the heap). Shared by the store and
+ * replies in flight, like the values it replaces.
+ */
+class Value {
+public:
+    // Copies size bytes at data. With a slab allocator, its refcount lives
+    // in the slab too; returns nullptr if the slab allocator is exhausted.
+    static std::shared_ptr<const Value> create(SlabAllocator *slab,
+                                               const char *data, size_t size);
+    // Refers without copying to the image of a value (sizeof(Value) bytes
+    // then its bytes, aligned as a Value) at mem, e.g. in a mapped file.
+    // owner keeps the memory alive while the value is referenced.
+    static std::shared_ptr<const Value> wrap(const void *mem,
+                                             const std::shared_ptr<const void> &owner);
+
+    const char *data() const
+    {
+        return reinterpret_cast<const char*>(this + 1);
+    }
+    size_t size() const
+    {
+        return this->len;
+    }
+
+private:
+    Value(const char *data, size_t size);
+
+    uint32_t len;
+};
+
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_VALUE_H_ */
@@ -0,0 +1,198 @@
+#ifndef _MEMCACHEKV_WIRE_H_
+#define _MEMCACHEKV_WIRE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace memcachekv {
+namespace wire {
+
+/*
+ * Compile-time wire layouts. A layout is a chain of fields, each placed right
+ * after its predecessor, so every offset is a constant expression. Accessors
+ * are unaligned-safe (memcpy) and compile to a single load/store, plus a bswap
+ * for network byte order fields.
+ */
+
+enum class Order {
+    HOST,
+    NET
+};
+
+inline uint8_t bswap(uint8_t v) { return v; }
+inline uint16_t bswap(uint16_t v) { return __builtin_bswap16(v); }
+inline uint32_t bswap(uint32_t v) { return __builtin_bswap32(v); }
+
+/* Unaligned access at an arbitrary (e.g. variable-length) position */
+template<typename T, Order O = Order::HOST>
+inline T load(const void *ptr)
+{
+    T v;
+    memcpy(&v, ptr, sizeof(T));
+    return O == Order::NET ? bswap(v) : v;
+}
+
+template<typename T, Order O = Order::HOST>
+inline void store(void *ptr, T v)
+{
+    if (O == Order::NET) {
+        v = bswap(v);
+    }
+    memcpy(ptr, &v, sizeof(T));
+}
+
+/* Start of a layout */
+struct Begin {
+    static const size_t END = 0;
+};
+
+/* Integer field of type T following field Prev */
+template<typename T, typename Prev, Order O = Order::HOST>
+struct Field {
+    typedef T type;
+    static const size_t OFFSET = Prev::END;
+    static const size_t END = OFFSET + sizeof(T);
+
+    static inline T load(const void *base)
+    {
+        return wire::load<T, O>((const char*)base + OFFSET);
+    }
+    static inline void store(void *base, T v)
+    {
+        wire::store<T, O>((char*)base + OFFSET, v);
+    }
+};
+
+/* Opaque N-byte field following field Prev */
+template<size_t N, typename Prev>
+struct Bytes {
+    static const size_t OFFSET = Prev::END;
+    static const size_t END = OFFSET + N;
+    static const size_t SIZE = N;
+
+    static inline const char *ptr(const void *base)
+    {
+        return (const char*)base + OFFSET;
+    }
+    static inline char *ptr(void *base)
+    {
+        return (char*)base + OFFSET;
+    }
+};
+
+/*
+ * Pegasus header, shared by WireCodec, the load balancer and the decrementor:
+ * identifier (16) + op_type (8) + keyhash (32) + client_id (8) + server_id (8)
+ * + load (16) + version (32) + bitmap (32) + req_id (8)
+ * keyhash, load, version and bitmap are in network byte order.
+ */
+namespace pegasus {
+typedef Field<uint16_t, Begin> identifier;
+typedef Field<uint8_t, identifier> op_type;
+typedef Field<uint32_t, op_type, Order::NET> keyhash;
+typedef Field<uint8_t, keyhash> client_id;
+typedef Field<uint8_t, client_id> server_id;
+typedef Field<uint16_t, server_id, Order::NET> load;
+typedef Field<uint32_t, load, Order::NET> ver;
+typedef Field<uint32_t, ver, Order::NET> bitmap;
+typedef Field<uint8_t, bitmap> hdr_req_id;
+static const size_t HEADER_SIZE = hdr_req_id::END;
+
+/* req_id (32) + req_time (32) + op_type (8) + key_len (16) + key ... */
+namespace request {
+typedef Field<uint32_t, hdr_req_id> req_id;
+typedef Field<uint32_t, req_id> req_time;
+typedef Field<uint8_t, req_time> op_type;
+typedef Field<uint16_t, op_type> key_len;
+static const size_t BASE_SIZE = key_len::END;
+} // namespace request
+
+/* req_id (32) + req_time (32) + op_type (8) + result (8) + value_len (16) + value */
+namespace reply {
+typedef Field<uint32_t, hdr_req_id> req_id;
+typedef Field<uint32_t, req_id> req_time;
+typedef Field<uint8_t, req_time> op_type;
+typedef Field<uint8_t, op_type> result;
+typedef Field<uint16_t, result> value_len;
+static const size_t BASE_SIZE = value_len::END;
+} // namespace reply
+
+/* req_id (32) + req_time (32) + n_ops (8) + n_ops * batch_op */
+namespace batch_request {
+typedef Field<uint32_t, hdr_req_id> req_id;
+typedef Field<uint32_t, req_id> req_time;
+typedef Field<uint8_t, req_time> n_ops;
+static const size_t BASE_SIZE = n_ops::END;
+} // namespace batch_request
+
+/* op_type (8) + keyhash (32) + key_len (16) + key (+ value_len (16) + value) */
+namespace batch_op {
+typedef Field<uint8_t, Begin> op_type;
+typedef Field<uint32_t, op_type, Order::NET> keyhash;
+typedef Field<uint16_t, keyhash> key_len;
+static const size_t BASE_SIZE = key_len::END;
+} // namespace batch_op
+
+/* req_id (32) + req_time (32) + n_ops (8) + n_ops * batch_op_reply */
+namespace batch_reply {
+typedef Field<uint32_t, hdr_req_id> req_id;
+typedef Field<uint32_t, req_id> req_time;
+typedef Field<uint8_t, req_time> n_ops;
+static const size_t BASE_SIZE = n_ops::END;
+} // namespace batch_reply
+
+/* op_type (8) + result (8) + value_len (16) + value */
+namespace batch_op_reply {
+typedef Field<uint8_t, Begin> op_type;
+typedef Field<uint8_t, op_type> result;
+typedef Field<uint16_t, result> value_len;
+static const size_t BASE_SIZE = value_len::END;
+} // namespace batch_op_reply
+
+/* key_len (16) + key + value_len (16) + value */
+namespace rc_request {
+typedef Field<uint16_t, hdr_req_id> key_len;
+static const size_t BASE_SIZE = key_len::END + sizeof(uint16_t);
+} // namespace rc_request
+} // namespace pegasus
+
+/*
+ * Netcache header:
+ * identifier (16) + op_type (8) + key (48) + value (32)
+ */
+namespace netcache {
+typedef Field<uint16_t, Begin> identifier;
+typedef Field<uint8_t, identifier> op_type;
+typedef Bytes<6, op_type> key;
+typedef Bytes<4, key> value;
+static const size_t HEADER_SIZE = value::END;
+
+/* client_id (32) + req_id (32) + req_time (32) + op_type (8) + key_len (16) + key ... */
+namespace request {
+typedef Field<uint32_t, value> client_id;
+typedef Field<uint32_t, client_id> req_id;
+typedef Field<uint32_t, req_id> req_time;
+typedef Field<uint8_t, req_time> op_type;
+typedef Field<uint16_t, op_type> key_len;
+static const size_t BASE_SIZE = key_len::END;
+} // namespace request
+
+/* server_id (8) + client_id (32) + req_id (32) + req_time (32) + op_type (8)
+ * + result (8) + value_len (16) + value */
+namespace reply {
+typedef Field<uint8_t, value> server_id;
+typedef Field<uint32_t, server_id> client_id;
+typedef Field<uint32_t, client_id> req_id;
+typedef Field<uint32_t, req_id> req_time;
+typedef Field<uint8_t, req_time> op_type;
+typedef Field<uint8_t, op_type> result;
+typedef Field<uint16_t, result> value_len;
+static const size_t BASE_SIZE = value_len::END;
+} // namespace reply
+} // namespace netcache
+
+} // namespace wire
+} // namespace memcachekv
+
+#endif /* _MEMCACHEKV_WIRE_H_ */
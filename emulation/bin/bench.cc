@@ -0,0 +1,589 @@
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <x86intrin.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
+
+#include <logger.h>
+#include <utils.h>
+#include <transport.h>
+#include <apps/memcachekv/cuckoo_store.h>
+#include <apps/memcachekv/message.h>
+#include <apps/memcachekv/server.h>
+#include <apps/memcachekv/utils.h>
+
+/*
+ * Microbenchmarks of code paths that need no network or testbed:
+ *
+ *   bench -b header   DPDK packet header build and LB checksum rewrite,
+ *                     before and after header templates (cycles/packet)
+ *   bench -b codec    WireCodec decode, and a Server GET/PUT from decode to
+ *                     encoded reply (heap allocations/op and ns/op)
+ *   bench -b growth   CuckooStore put and get latency percentiles while
+ *                     inserting -n keys, presized and growing from 64K keys
+ *   bench -b stress   -t threads insert -n keys in total into a growing
+ *                     CuckooStore while as many threads look up keys
+ *                     already inserted; panics on a false miss
+ *
+ * -n sets the number of iterations (or keys), -t the number of threads.
+ */
+
+#define IPV4_HDR_SIZE 5
+#define IPV4_TTL 0xFF
+#define CHECK_ITERATIONS 1000000
+
+/* Packet headers */
+
+struct FrameHeader {
+    struct rte_ether_hdr ether;
+    struct rte_ipv4_hdr ip;
+    struct rte_udp_hdr udp;
+};
+
+struct HeaderAddress {
+    struct rte_ether_addr ether_addr;
+    rte_be32_t ip_addr;
+    rte_be16_t udp_port;
+};
+
+static inline uint16_t cksum_fold(uint32_t sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+// Header build before templates: every field, then the checksum over the
+// whole IP header
+static void build_header_full(FrameHeader *frame,
+                              const HeaderAddress &src,
+                              const HeaderAddress &dst,
+                              size_t payload_len)
+{
+    frame->ether.ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+    memcpy(&frame->ether.d_addr, &dst.ether_addr, sizeof(struct rte_ether_addr));
+    memcpy(&frame->ether.s_addr, &src.ether_addr, sizeof(struct rte_ether_addr));
+    frame->ip.version_ihl = (IPVERSION << 4) | IPV4_HDR_SIZE;
+    frame->ip.type_of_service = 0;
+    frame->ip.total_length = rte_cpu_to_be_16(IPV4_HDR_SIZE * RTE_IPV4_IHL_MULTIPLIER +
+                                              sizeof(struct rte_udp_hdr) +
+                                              payload_len);
+    frame->ip.packet_id = 0;
+    frame->ip.fragment_offset = 0;
+    frame->ip.time_to_live = IPV4_TTL;
+    frame->ip.next_proto_id = IPPROTO_UDP;
+    frame->ip.hdr_checksum = 0;
+    frame->ip.src_addr = src.ip_addr;
+    frame->ip.dst_addr = dst.ip_addr;
+    frame->ip.hdr_checksum = rte_ipv4_cksum(&frame->ip);
+    frame->udp.src_port = 0;
+    frame->udp.dst_port = dst.udp_port;
+    frame->udp.dgram_len = rte_cpu_to_be_16(sizeof(struct rte_udp_hdr) + payload_len);
+    frame->udp.dgram_cksum = 0;
+}
+
+// Header build as DPDKTransport::fill_headers: copy of the template, then
+// the per-packet fields, with the checksum updated from the template's
+static void build_header_template(FrameHeader *frame,
+                                  const FrameHeader &tmpl,
+                                  uint16_t cksum_base,
+                                  const HeaderAddress &dst,
+                                  size_t payload_len)
+{
+    memcpy(frame, &tmpl, sizeof(FrameHeader));
+    memcpy(&frame->ether.d_addr, &dst.ether_addr, sizeof(struct rte_ether_addr));
+    frame->ip.total_length = rte_cpu_to_be_16(IPV4_HDR_SIZE * RTE_IPV4_IHL_MULTIPLIER +
+                                              sizeof(struct rte_udp_hdr) +
+                                              payload_len);
+    frame->ip.dst_addr = dst.ip_addr;
+    uint32_t sum = cksum_base;
+    sum += frame->ip.total_length;
+    sum += (frame->ip.dst_addr & 0xFFFF) + (frame->ip.dst_addr >> 16);
+    frame->ip.hdr_checksum = ~cksum_fold(sum);
+    frame->udp.src_port = 0;
+    frame->udp.dst_port = dst.udp_port;
+    frame->udp.dgram_len = rte_cpu_to_be_16(sizeof(struct rte_udp_hdr) + payload_len);
+}
+
+// LB address rewrite before: checksum over the whole IP header
+static void rewrite_full(FrameHeader *frame, const HeaderAddress &src, const HeaderAddress &dst)
+{
+    frame->ip.src_addr = src.ip_addr;
+    frame->ip.dst_addr = dst.ip_addr;
+    frame->ip.hdr_checksum = 0;
+    uint32_t sum = 0;
+    const uint16_t *v = (const uint16_t*)((const char*)frame + sizeof(struct rte_ether_hdr));
+    for (size_t i = 0; i < sizeof(struct rte_ipv4_hdr) / sizeof(uint16_t); i++) {
+        sum += v[i];
+    }
+    frame->ip.hdr_checksum = ~cksum_fold(sum);
+}
+
+// As LoadBalancer::update_chksum (RFC 1624), for the 64-bit source and
+// destination address pair
+static uint16_t update_chksum(uint16_t chksum, uint64_t old_val, uint64_t new_val)
+{
+    uint64_t sum = (uint16_t)~chksum;
+    old_val = ~old_val;
+    sum += (old_val & 0xFFFFFFFF) + (old_val >> 32);
+    sum += (new_val & 0xFFFFFFFF) + (new_val >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+// LB address rewrite after: checksum patched for the two addresses
+static void rewrite_incremental(FrameHeader *frame, const HeaderAddress &src, const HeaderAddress &dst)
+{
+    uint64_t old_addrs, new_addrs;
+    memcpy(&old_addrs, &frame->ip.src_addr, sizeof(old_addrs));
+    frame->ip.src_addr = src.ip_addr;
+    frame->ip.dst_addr = dst.ip_addr;
+    memcpy(&new_addrs, &frame->ip.src_addr, sizeof(new_addrs));
+    frame->ip.hdr_checksum = update_chksum(frame->ip.hdr_checksum, old_addrs, new_addrs);
+}
+
+static void random_address(HeaderAddress &addr)
+{
+    for (size_t i = 0; i < sizeof(addr.ether_addr); i++) {
+        ((uint8_t*)&addr.ether_addr)[i] = rand();
+    }
+    addr.ip_addr = ((uint32_t)rand() << 16) ^ rand();
+    addr.udp_port = rand();
+}
+
+static void bench_header(long iterations)
+{
+    const int N_DSTS = 64, N_FRAMES = 256;
+    HeaderAddress src, dsts[N_DSTS];
+    FrameHeader tmpl, frame, check, frames[N_FRAMES];
+    uint64_t start, cycles;
+    uint32_t sink = 0;
+
+    srand(0);
+    random_address(src);
+    for (int i = 0; i < N_DSTS; i++) {
+        random_address(dsts[i]);
+    }
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.ether.ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+    memcpy(&tmpl.ether.s_addr, &src.ether_addr, sizeof(struct rte_ether_addr));
+    tmpl.ip.version_ihl = (IPVERSION << 4) | IPV4_HDR_SIZE;
+    tmpl.ip.time_to_live = IPV4_TTL;
+    tmpl.ip.next_proto_id = IPPROTO_UDP;
+    tmpl.ip.src_addr = src.ip_addr;
+    uint16_t cksum_base = ~rte_ipv4_cksum(&tmpl.ip);
+
+    /* Both ways must give the same checksums */
+    for (int i = 0; i < CHECK_ITERATIONS; i++) {
+        HeaderAddress dst, new_src;
+        random_address(dst);
+        random_address(new_src);
+        size_t len = rand() % 1400;
+        build_header_full(&check, src, dst, len);
+        build_header_template(&frame, tmpl, cksum_base, dst, len);
+        if (memcmp(&check, &frame, sizeof(FrameHeader)) != 0) {
+            panic("Header mismatch for payload length %zu", len);
+        }
+        rewrite_full(&check, new_src, dst);
+        rewrite_incremental(&frame, new_src, dst);
+        if (check.ip.hdr_checksum != frame.ip.hdr_checksum &&
+            (uint16_t)(check.ip.hdr_checksum + frame.ip.hdr_checksum) != 0xFFFF) {
+            panic("Rewrite checksum mismatch");
+        }
+    }
+    info("Checksums match on %d random headers", CHECK_ITERATIONS);
+    for (int i = 0; i < N_FRAMES; i++) {
+        build_header_full(&frames[i], src, dsts[i % N_DSTS], i);
+    }
+
+    // Packets of a burst are independent: each iteration works on its own
+    // frame, so that the loops do not serialize on one checksum
+    start = __rdtsc();
+    for (long i = 0; i < iterations; i++) {
+        FrameHeader *f = &frames[i % N_FRAMES];
+        build_header_full(f, src, dsts[i % N_DSTS], i & 0x3FF);
+        sink += f->ip.hdr_checksum;
+    }
+    cycles = __rdtsc() - start;
+    info("Header build, full checksum:        %.1f cycles/pkt", (double)cycles / iterations);
+
+    start = __rdtsc();
+    for (long i = 0; i < iterations; i++) {
+        FrameHeader *f = &frames[i % N_FRAMES];
+        build_header_template(f, tmpl, cksum_base, dsts[i % N_DSTS], i & 0x3FF);
+        sink += f->ip.hdr_checksum;
+    }
+    cycles = __rdtsc() - start;
+    info("Header build, template:             %.1f cycles/pkt", (double)cycles / iterations);
+
+    start = __rdtsc();
+    for (long i = 0; i < iterations; i++) {
+        FrameHeader *f = &frames[i % N_FRAMES];
+        rewrite_full(f, dsts[i % N_DSTS], dsts[(i + 1) % N_DSTS]);
+        sink += f->ip.hdr_checksum;
+    }
+    cycles = __rdtsc() - start;
+    info("LB rewrite, full checksum:          %.1f cycles/pkt", (double)cycles / iterations);
+
+    start = __rdtsc();
+    for (long i = 0; i < iterations; i++) {
+        FrameHeader *f = &frames[i % N_FRAMES];
+        rewrite_incremental(f, dsts[i % N_DSTS], dsts[(i + 1) % N_DSTS]);
+        sink += f->ip.hdr_checksum;
+    }
+    cycles = __rdtsc() - start;
+    info("LB rewrite, incremental checksum:   %.1f cycles/pkt", (double)cycles / iterations);
+    debug("%u", sink);
+}
+
+/* KV message processing */
+
+// Heap allocations of this thread, counted by the replaced global operator new
+static thread_local unsigned long n_allocs = 0;
+
+void *operator new(size_t size)
+{
+    n_allocs++;
+    void *p = malloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+class BenchAddress : public Address {
+public:
+    ~BenchAddress() {};
+};
+
+class BenchConfiguration : public Configuration {
+public:
+    ~BenchConfiguration() {};
+};
+
+// Drops every message: replies are encoded, but not sent anywhere
+class BenchTransport : public Transport {
+public:
+    BenchTransport(const Configuration *config)
+        : Transport(config) {};
+    ~BenchTransport() {};
+
+    virtual void send_message(const Message &msg, const Address &addr) override final {};
+    virtual void run(void) override final {};
+    virtual void stop(void) override final {};
+    virtual void wait(void) override final {};
+    virtual void run_app_threads(Application *app) override final {};
+};
+
+static void encode_request(memcachekv::MessageCodec &codec, Message &msg,
+                           memcachekv::OpType op_type,
+                           const std::string &key, const std::string &value)
+{
+    memcachekv::MemcacheKVMessage kvmsg;
+    kvmsg.type = memcachekv::MemcacheKVMessage::Type::REQUEST;
+    kvmsg.request.client_id = 0;
+    kvmsg.request.server_id = 0;
+    kvmsg.request.req_id = 1;
+    kvmsg.request.req_time = 0;
+    kvmsg.request.op.op_type = op_type;
+    kvmsg.request.op.keyhash = memcachekv::compute_keyhash(key);
+    kvmsg.request.op.key = memcachekv::StringView(key);
+    kvmsg.request.op.value = memcachekv::StringView(value);
+    if (!codec.encode(msg, kvmsg)) {
+        panic("Failed to encode request");
+    }
+}
+
+// Allocations and time per call of fn, after a warm-up call
+template<typename F>
+static void measure(const char *name, long iterations, F fn)
+{
+    struct timespec start, end;
+
+    fn(0);
+    unsigned long allocs = n_allocs;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++) {
+        fn(i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    allocs = n_allocs - allocs;
+    info("%-26s %.2f allocs/op, %.1f ns/op", name,
+         (double)allocs / iterations, (double)latency_ns(start, end) / iterations);
+}
+
+static void bench_codec(long iterations)
+{
+    const int N_KEYS = 100000, VALUE_LEN = 64;
+    memcachekv::WireCodec codec(false);
+    memcachekv::ControllerCodec ctrl_codec;
+    std::deque<std::string> keys;
+    std::string value(VALUE_LEN, 'v');
+
+    for (int i = 0; i < N_KEYS; i++) {
+        keys.push_back("key-" + std::to_string(i));
+    }
+    std::vector<Message> gets(N_KEYS), puts(N_KEYS);
+    for (int i = 0; i < N_KEYS; i++) {
+        encode_request(codec, gets[i], memcachekv::OpType::GET, keys[i], "");
+        encode_request(codec, puts[i], memcachekv::OpType::PUT, keys[i], value);
+    }
+    Message reply;
+    memcachekv::MemcacheKVMessage kvmsg;
+    kvmsg.type = memcachekv::MemcacheKVMessage::Type::REPLY;
+    kvmsg.reply.op_type = memcachekv::OpType::GET;
+    kvmsg.reply.keyhash = memcachekv::compute_keyhash(keys[0]);
+    kvmsg.reply.key = memcachekv::StringView(keys[0]);
+    kvmsg.reply.value = memcachekv::StringView(value);
+    kvmsg.reply.result = memcachekv::Result::OK;
+    if (!codec.encode(reply, kvmsg)) {
+        panic("Failed to encode reply");
+    }
+
+    measure("WireCodec decode GET:", iterations, [&](long i) {
+        memcachekv::MemcacheKVMessage out;
+        if (!codec.decode(gets[i % N_KEYS], out)) {
+            panic("Failed to decode request");
+        }
+    });
+    measure("WireCodec decode PUT:", iterations, [&](long i) {
+        memcachekv::MemcacheKVMessage out;
+        if (!codec.decode(puts[i % N_KEYS], out)) {
+            panic("Failed to decode request");
+        }
+    });
+    measure("WireCodec decode REPLY:", iterations, [&](long i) {
+        memcachekv::MemcacheKVMessage out;
+        if (!codec.decode(reply, out)) {
+            panic("Failed to decode reply");
+        }
+    });
+
+    // A single tail server with one transport thread, which replies to
+    // client 0
+    BenchConfiguration config;
+    config.num_racks = 1;
+    config.num_nodes = 1;
+    config.rack_id = 0;
+    config.node_id = 0;
+    config.n_transport_threads = 1;
+    config.node_type = Configuration::NodeType::SERVER;
+    config.client_addresses.push_back(new BenchAddress());
+    BenchTransport transport(&config);
+    BenchAddress addr;
+    memcachekv::CachePolicy cache;
+    const std::pair<memcachekv::StoreType, std::string> stores[] = {
+        {memcachekv::StoreType::TBB, "tbb"},
+        {memcachekv::StoreType::CUCKOO, "cuckoo"},
+    };
+    for (const auto &store : stores) {
+        memcachekv::Server server(&config, &codec, &ctrl_codec, 0, value, keys,
+                                  store.first, nullptr, cache, nullptr);
+        transport.register_receiver(&server);
+        server.register_transport(&transport);
+        measure(("Server GET (" + store.second + "):").c_str(), iterations, [&](long i) {
+            server.receive_message(gets[i % N_KEYS], addr, 0);
+        });
+        measure(("Server PUT (" + store.second + "):").c_str(), iterations, [&](long i) {
+            server.receive_message(puts[i % N_KEYS], addr, 0);
+        });
+    }
+}
+
+/* CuckooStore growth */
+
+static std::string bench_key(int thread, long i)
+{
+    return "key-" + std::to_string(thread) + "-" + std::to_string(i);
+}
+
+static void report_percentiles(const char *name, std::vector<uint32_t> &ns)
+{
+    std::sort(ns.begin(), ns.end());
+    size_t n = ns.size();
+    info("%-20s p50 %u ns, p99 %u ns, p99.9 %u ns, max %u ns", name,
+         ns[n / 2], ns[n * 99 / 100], ns[n * 999 / 1000], ns[n - 1]);
+}
+
+static uint32_t elapsed_ns(const struct timespec &start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (uint32_t)std::min(latency_ns(start, end), (long)UINT32_MAX);
+}
+
+// One put of a new key and one get of a random inserted key per step
+static void bench_growth_run(const char *name, size_t capacity, long n_keys)
+{
+    memcachekv::CachePolicy cache;
+    memcachekv::CuckooStore store(capacity, nullptr, cache);
+    std::shared_ptr<const memcachekv::Value> value =
+        memcachekv::Value::create(nullptr, "value", 5);
+    std::vector<uint32_t> put_ns(n_keys), get_ns(n_keys);
+    std::default_random_engine generator(0);
+    std::shared_ptr<const memcachekv::Value> out;
+    memcachekv::ver_t ver;
+    struct timespec start;
+
+    for (long i = 0; i < n_keys; i++) {
+        std::string key = bench_key(0, i);
+        memcachekv::keyhash_t keyhash = memcachekv::compute_keyhash(key);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        store.put(memcachekv::StringView(key), keyhash, 1, value);
+        put_ns[i] = elapsed_ns(start);
+
+        key = bench_key(0, std::uniform_int_distribution<long>(0, i)(generator));
+        keyhash = memcachekv::compute_keyhash(key);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!store.get(memcachekv::StringView(key), keyhash, ver, out)) {
+            panic("Key %s missing", key.c_str());
+        }
+        get_ns[i] = elapsed_ns(start);
+    }
+    info("%s:", name);
+    report_percentiles("  put", put_ns);
+    report_percentiles("  get", get_ns);
+    store.report();
+}
+
+static void bench_growth(long n_keys)
+{
+    bench_growth_run("Presized", n_keys, n_keys);
+    bench_growth_run("Growing from 64K keys", 1 << 16, n_keys);
+}
+
+static void bench_stress(long n_keys, int n_threads)
+{
+    memcachekv::CachePolicy cache;
+    memcachekv::CuckooStore store(memcachekv::CuckooStore::MIN_BUCKETS, nullptr, cache);
+    std::shared_ptr<const memcachekv::Value> value =
+        memcachekv::Value::create(nullptr, "value", 5);
+    long keys_per_thread = n_keys / n_threads;
+    // Keys each writer has inserted so far
+    std::vector<std::atomic<long>> n_inserted(n_threads);
+    std::atomic<int> n_writers(n_threads);
+    std::atomic<long> n_lookups(0);
+    std::vector<std::thread> threads;
+
+    for (int w = 0; w < n_threads; w++) {
+        n_inserted[w] = 0;
+    }
+    for (int w = 0; w < n_threads; w++) {
+        threads.push_back(std::thread([&, w]() {
+            for (long i = 0; i < keys_per_thread; i++) {
+                std::string key = bench_key(w, i);
+                store.put(memcachekv::StringView(key), memcachekv::compute_keyhash(key),
+                          1, value);
+                n_inserted[w].store(i + 1, std::memory_order_release);
+            }
+            n_writers--;
+        }));
+    }
+    for (int r = 0; r < n_threads; r++) {
+        threads.push_back(std::thread([&, r]() {
+            std::default_random_engine generator(r);
+            std::shared_ptr<const memcachekv::Value> out;
+            memcachekv::ver_t ver;
+            long n = 0;
+            while (n_writers > 0) {
+                int w = std::uniform_int_distribution<int>(0, n_threads - 1)(generator);
+                long inserted = n_inserted[w].load(std::memory_order_acquire);
+                if (inserted == 0) {
+                    continue;
+                }
+                std::string key = bench_key(w, std::uniform_int_distribution<long>(0, inserted - 1)(generator));
+                if (!store.get(memcachekv::StringView(key), memcachekv::compute_keyhash(key), ver, out) ||
+                    out != value) {
+                    panic("False miss on %s", key.c_str());
+                }
+                n++;
+            }
+            n_lookups += n;
+        }));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::shared_ptr<const memcachekv::Value> out;
+    memcachekv::ver_t ver;
+    for (int w = 0; w < n_threads; w++) {
+        for (long i = 0; i < keys_per_thread; i++) {
+            std::string key = bench_key(w, i);
+            if (!store.get(memcachekv::StringView(key), memcachekv::compute_keyhash(key), ver, out)) {
+                panic("Key %s missing", key.c_str());
+            }
+        }
+    }
+    info("%d writers inserted %ld keys, %d readers did %ld lookups: no misses",
+         n_threads, keys_per_thread * n_threads, n_threads, n_lookups.load());
+    store.report();
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    std::string bench;
+    long iterations = 10000000;
+    int n_threads = 4;
+
+    while ((opt = getopt(argc, argv, "b:n:t:")) != -1) {
+        switch (opt) {
+        case 'b': {
+            bench = optarg;
+            break;
+        }
+        case 'n': {
+            iterations = stol(std::string(optarg));
+            if (iterations < 1) {
+                panic("Number of iterations should be > 0");
+            }
+            break;
+        }
+        case 't': {
+            n_threads = stoi(std::string(optarg));
+            if (n_threads < 1) {
+                panic("Number of threads should be > 0");
+            }
+            break;
+        }
+        default:
+            panic("Unknown argument %s", argv[optind]);
+        }
+    }
+
+    if (bench == "header") {
+        bench_header(iterations);
+    } else if (bench == "codec") {
+        bench_codec(iterations);
+    } else if (bench == "growth") {
+        bench_growth(iterations);
+    } else if (bench == "stress") {
+        bench_stress(iterations, n_threads);
+    } else {
+        panic("Option -b header|codec|growth|stress required");
+    }
+    return 0;
+}
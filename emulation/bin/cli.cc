@@ -12,10 +12,14 @@ using namespace memcachekv;
 int main(int argc, char *argv[])
 {
     if (argc < 3) {
-        panic("usage: cli <config_file> <node_type> <op_type> <key> (<value>)\n");
+        panic("usage: cli <config_file> <node_type> (<placement>)\n");
     }
     const char *config_file_path = argv[1];
     int node_type = stoi(string(argv[2]));
+    PlacementType placement_type = PlacementType::RANGE;
+    if (argc > 3 && !parse_placement_type(argv[3], placement_type)) {
+        panic("Unknown placement %s", argv[3]);
+    }
 
     MessageCodec *codec;
     switch (node_type) {
@@ -38,7 +42,8 @@ int main(int argc, char *argv[])
     config->terminating = true;
     config->use_raw_transport = false;
     Transport *transport = new UDPTransport(config);
-    CLIClient cli(config, codec);
+    Placement placement(placement_type, config->num_nodes, std::vector<int>());
+    CLIClient cli(config, codec, &placement);
     Node node(config, transport);
     node.register_app(&cli);
 
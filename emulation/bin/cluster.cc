@@ -0,0 +1,472 @@
+#include <unistd.h>
+#include <fstream>
+#include <sys/time.h>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include <node.h>
+#include <logger.h>
+#include <utils.h>
+#include <transports/dpdk/configuration.h>
+#include <transports/local/transport.h>
+#include <apps/echo/client.h>
+#include <apps/echo/server.h>
+#include <apps/memcachekv/message.h>
+#include <apps/memcachekv/server.h>
+#include <apps/memcachekv/client.h>
+#include <apps/memcachekv/epoch.h>
+#include <apps/memcachekv/loadbalancer.h>
+#include <apps/memcachekv/stats.h>
+#include <apps/memcachekv/placement.h>
+#include <apps/memcachekv/snapshot.h>
+#include <apps/memcachekv/utils.h>
+
+/*
+ * Runs every client and server of the configuration in a single process
+ * over LocalTransport, to profile application code paths without a network.
+ * With -l 1 (one rack only), requests and replies go through a LoadBalancer
+ * node, as with the emulator's endhost LB. Uses the DPDK configuration file
+ * format, which then needs an lb line.
+ */
+
+enum class AppMode {
+    ECHO,
+    MEMCACHEKV,
+    UNKNOWN
+};
+
+struct ClusterNode {
+    Configuration *config;
+    Transport *transport;
+    Application *app;
+    memcachekv::MessageCodec *codec;
+    memcachekv::ControllerCodec *ctrl_codec;
+    Node *node;
+    std::thread *thread;
+    // Clients only
+    Stats *stats;
+    memcachekv::KVWorkloadGenerator *gen;
+};
+
+static Configuration *make_config(const char *config_file_path,
+                                  int duration,
+                                  int n_transport_threads,
+                                  int n_app_threads)
+{
+    Configuration *config = new DPDKConfiguration(config_file_path);
+    config->duration = duration;
+    config->transport_core = -1;
+    config->n_transport_threads = n_transport_threads;
+    config->app_core = -1;
+    config->n_app_threads = n_app_threads;
+    config->use_raw_transport = false;
+    return config;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    AppMode app_mode = AppMode::UNKNOWN;
+    float mean_interval = 1000, get_ratio = 0.5, alpha = 0.5;
+    int n_transport_threads = 1, n_app_threads = 1, value_len = 256, nkeys = 1000, duration = 1, target_latency = 100, batch_size = 1;
+    const char *keys_file_path = nullptr, *config_file_path = nullptr, *stats_file_path = nullptr;
+    std::deque<std::string> keys;
+    memcachekv::KeyType key_type = memcachekv::KeyType::UNIFORM;
+    memcachekv::PlacementType placement_type = memcachekv::PlacementType::RANGE;
+    std::vector<int> node_weights;
+    memcachekv::StoreType store_type = memcachekv::StoreType::TBB;
+    // Keyspace partitions (and app threads) per server with -X partitioned
+    int n_partitions = 1;
+    // Slab allocator budget per server, 0 for no limit, or -1 to store items on the heap
+    int slab_budget_mb = -1;
+    // Memory limit and eviction policy of each server's store
+    memcachekv::CachePolicy cache_policy;
+    // Servers start from <prefix>.<node id> if present, and write it on exit
+    const char *snapshot_prefix = nullptr;
+    // Route memcachekv messages through an in-process load balancer
+    bool use_lb = false;
+
+    while ((opt = getopt(argc, argv, "a:b:c:d:f:g:i:j:l:n:q:s:t:u:v:J:L:P:T:U:V:W:X:Y:Z:")) != -1) {
+        switch (opt) {
+        case 'a': {
+            alpha = stof(std::string(optarg));
+            break;
+        }
+        case 'b': {
+            snapshot_prefix = optarg;
+            break;
+        }
+        case 'c': {
+            config_file_path = optarg;
+            break;
+        }
+        case 'd': {
+            duration = stoi(std::string(optarg));
+            break;
+        }
+        case 'f': {
+            keys_file_path = optarg;
+            break;
+        }
+        case 'g': {
+            get_ratio = stof(std::string(optarg));
+            break;
+        }
+        case 'i': {
+            mean_interval = stof(std::string(optarg));
+            break;
+        }
+        case 'j': {
+            if (!memcachekv::parse_cache_policy(optarg, cache_policy)) {
+                panic("Unknown cache policy %s", optarg);
+            }
+            break;
+        }
+        case 'l': {
+            use_lb = stoi(std::string(optarg)) == 1;
+            break;
+        }
+        case 'n': {
+            nkeys = stoi(std::string(optarg));
+            break;
+        }
+        case 'q': {
+            if (strcmp(optarg, "echo") == 0) {
+                app_mode = AppMode::ECHO;
+            } else if (strcmp(optarg, "kv") == 0) {
+                app_mode = AppMode::MEMCACHEKV;
+            } else {
+                panic("Unknown application %s", optarg);
+            }
+            break;
+        }
+        case 's': {
+            stats_file_path = optarg;
+            break;
+        }
+        case 't': {
+            if (strcmp(optarg, "unif") == 0) {
+                key_type = memcachekv::KeyType::UNIFORM;
+            } else if (strcmp(optarg, "zipf") == 0) {
+                key_type = memcachekv::KeyType::ZIPF;
+            } else {
+                panic("Unknown key type %s", optarg);
+            }
+            break;
+        }
+        case 'u': {
+            target_latency = stoi(std::string(optarg));
+            break;
+        }
+        case 'v': {
+            value_len = stoi(std::string(optarg));
+            break;
+        }
+        case 'J': {
+            n_app_threads = stoi(std::string(optarg));
+            break;
+        }
+        case 'L': {
+            n_transport_threads = stoi(std::string(optarg));
+            break;
+        }
+        case 'P': {
+            n_partitions = stoi(std::string(optarg));
+            break;
+        }
+        case 'T': {
+            batch_size = stoi(std::string(optarg));
+            break;
+        }
+        case 'U': {
+            if (!memcachekv::parse_keyhash_type(optarg, memcachekv::keyhash_type)) {
+                panic("Unknown key hash %s", optarg);
+            }
+            break;
+        }
+        case 'V': {
+            if (!memcachekv::parse_placement_type(optarg, placement_type)) {
+                panic("Unknown placement %s", optarg);
+            }
+            break;
+        }
+        case 'W': {
+            if (!memcachekv::parse_node_weights(optarg, node_weights)) {
+                panic("Invalid node weights %s", optarg);
+            }
+            break;
+        }
+        case 'X': {
+            if (!memcachekv::parse_store_type(optarg, store_type)) {
+                panic("Unknown store %s", optarg);
+            }
+            break;
+        }
+        case 'Y': {
+            slab_budget_mb = stoi(std::string(optarg));
+            break;
+        }
+        case 'Z': {
+            cache_policy.limit = (size_t)stoi(std::string(optarg)) << 20;
+            break;
+        }
+        default:
+            panic("Unknown argument %s", argv[optind]);
+        }
+    }
+
+    if (app_mode == AppMode::UNKNOWN) {
+        panic("Option -q required");
+    }
+
+    if (config_file_path == nullptr) {
+        panic("Option -c <config file> required");
+    }
+
+    if (use_lb && app_mode != AppMode::MEMCACHEKV) {
+        panic("The load balancer requires application kv");
+    }
+
+    if (slab_budget_mb > 0 && cache_policy.limit > ((size_t)slab_budget_mb << 20)) {
+        panic("Memory limit exceeds the slab allocator budget");
+    }
+
+    if (app_mode == AppMode::MEMCACHEKV) {
+        // Read in all keys
+        std::ifstream in;
+        in.open(keys_file_path);
+        if (!in) {
+            panic("Failed to read keys from %s", keys_file_path);
+        }
+        std::string key;
+        for (int i = 0; i < nkeys; i++) {
+            getline(in, key);
+            keys.push_back(key);
+        }
+        in.close();
+    }
+
+    /* Servers: every node of every rack (racks chain-replicate) */
+    std::vector<ClusterNode> servers;
+    DPDKConfiguration layout(config_file_path);
+    int num_racks = layout.num_racks, num_nodes = layout.num_nodes;
+    int num_clients = layout.client_addresses.size();
+    if (num_clients == 0) {
+        panic("The configuration has no client");
+    }
+    if (use_lb && num_racks > 1) {
+        panic("The load balancer does not forward writes along the rack chain");
+    }
+    // One allocator, as the process hosts them all
+    memcachekv::SlabAllocator *slab = nullptr;
+    if (app_mode == AppMode::MEMCACHEKV && slab_budget_mb >= 0) {
+        slab = new memcachekv::SlabAllocator(((size_t)slab_budget_mb << 20) * num_racks * num_nodes);
+    }
+    for (int rack_id = 0; rack_id < num_racks; rack_id++) {
+        for (int node_id = 0; node_id < num_nodes; node_id++) {
+            ClusterNode s;
+            s.config = make_config(config_file_path, duration, n_transport_threads,
+                                   store_type == memcachekv::StoreType::PARTITIONED ? n_partitions : 0);
+            s.config->rack_id = rack_id;
+            s.config->node_id = node_id;
+            s.config->node_type = Configuration::NodeType::SERVER;
+            s.config->terminating = false;
+            s.config->use_endhost_lb = use_lb;
+            s.codec = nullptr;
+            s.ctrl_codec = nullptr;
+            switch (app_mode) {
+            case AppMode::ECHO:
+                s.app = new echo::Server();
+                break;
+            case AppMode::MEMCACHEKV: {
+                s.codec = new memcachekv::WireCodec(false);
+                s.ctrl_codec = new memcachekv::ControllerCodec();
+                struct timeval start, end;
+                gettimeofday(&start, nullptr);
+                // Replicas in every rack start from the same snapshot
+                memcachekv::Snapshot *snapshot = nullptr;
+                if (snapshot_prefix != nullptr) {
+                    snapshot = memcachekv::Snapshot::open(memcachekv::snapshot_file(snapshot_prefix, node_id));
+                }
+                s.app = new memcachekv::Server(s.config,
+                                               s.codec,
+                                               s.ctrl_codec,
+                                               0,
+                                               std::string(value_len, 'v'),
+                                               keys,
+                                               store_type,
+                                               slab,
+                                               cache_policy,
+                                               snapshot);
+                gettimeofday(&end, nullptr);
+                info("Server %d in rack %d started from %s in %.2f s", node_id, rack_id,
+                     snapshot != nullptr ? "snapshot" : "keys", latency(start, end) / 1e6);
+                // Loaded values keep the snapshot mapped
+                delete snapshot;
+                break;
+            }
+            default:
+                panic("Unreachable");
+            }
+            s.transport = new LocalTransport(s.config);
+            s.node = new Node(s.config, s.transport);
+            s.node->register_app(s.app);
+            servers.push_back(s);
+        }
+    }
+
+    /* Clients: every client, sharing the placement */
+    std::vector<ClusterNode> clients;
+    memcachekv::Placement *placement = nullptr;
+    if (app_mode == AppMode::MEMCACHEKV) {
+        placement = new memcachekv::Placement(placement_type, num_nodes, node_weights);
+    }
+    for (int client_id = 0; client_id < num_clients; client_id++) {
+        ClusterNode c;
+        c.config = make_config(config_file_path, duration, n_transport_threads, n_app_threads);
+        c.config->rack_id = -1;
+        c.config->client_id = client_id;
+        c.config->node_type = Configuration::NodeType::CLIENT;
+        c.config->terminating = true;
+        c.config->use_endhost_lb = use_lb;
+        c.codec = nullptr;
+        c.ctrl_codec = nullptr;
+        c.gen = nullptr;
+        // Clients other than the first write their stats to <file>.<client id>
+        std::string client_stats_file;
+        if (stats_file_path != nullptr) {
+            client_stats_file = client_id == 0 ? std::string(stats_file_path) :
+                std::string(stats_file_path) + "." + std::to_string(client_id);
+        }
+        const char *stats_file = stats_file_path != nullptr ? client_stats_file.c_str() : nullptr;
+        switch (app_mode) {
+        case AppMode::ECHO:
+            c.stats = new Stats(n_app_threads + n_transport_threads, stats_file, 0);
+            c.app = new echo::Client(c.config, c.stats, mean_interval, value_len);
+            break;
+        case AppMode::MEMCACHEKV: {
+            memcachekv::MemcacheKVStats *kv_stats =
+                new memcachekv::MemcacheKVStats(n_app_threads + n_transport_threads,
+                                                stats_file,
+                                                0);
+            c.gen = new memcachekv::KVWorkloadGenerator(keys,
+                                                        value_len,
+                                                        get_ratio,
+                                                        (1-get_ratio),
+                                                        mean_interval,
+                                                        target_latency,
+                                                        alpha,
+                                                        key_type,
+                                                        memcachekv::SendMode::FIXED,
+                                                        memcachekv::DynamismType::NONE,
+                                                        0,
+                                                        0,
+                                                        n_app_threads,
+                                                        kv_stats);
+            c.codec = new memcachekv::WireCodec(false);
+            c.app = new memcachekv::Client(c.config, kv_stats, c.gen, c.codec, placement, batch_size);
+            c.stats = kv_stats;
+            break;
+        }
+        default:
+            panic("Unreachable");
+        }
+        c.transport = new LocalTransport(c.config);
+        c.node = new Node(c.config, c.transport);
+        c.node->register_app(c.app);
+        clients.push_back(c);
+    }
+
+    /* Load balancer */
+    ClusterNode *lb = nullptr;
+    if (use_lb) {
+        lb = new ClusterNode();
+        // One app thread, for the hot key stats
+        lb->config = make_config(config_file_path, duration, n_transport_threads, 1);
+        lb->config->rack_id = 0;
+        lb->config->node_id = -1;
+        lb->config->client_id = -1;
+        lb->config->node_type = Configuration::NodeType::LB;
+        lb->config->terminating = false;
+        lb->config->use_raw_transport = true;
+        lb->app = new memcachekv::LoadBalancer(lb->config, placement);
+        lb->transport = new LocalTransport(lb->config);
+        lb->node = new Node(lb->config, lb->transport);
+        lb->node->register_app(lb->app);
+    }
+
+    /* Run: servers and load balancer in the background, clients until done */
+    for (ClusterNode &s : servers) {
+        s.thread = new std::thread(&Node::run, s.node);
+    }
+    if (lb != nullptr) {
+        lb->thread = new std::thread(&Node::run, lb->node);
+    }
+    for (size_t i = 1; i < clients.size(); i++) {
+        clients[i].thread = new std::thread(&Node::run, clients[i].node);
+    }
+    clients[0].node->run();
+    for (size_t i = 1; i < clients.size(); i++) {
+        clients[i].thread->join();
+        delete clients[i].thread;
+    }
+    if (lb != nullptr) {
+        static_cast<memcachekv::LoadBalancer*>(lb->app)->stop();
+        lb->transport->stop();
+        lb->thread->join();
+        delete lb->thread;
+    }
+    for (ClusterNode &s : servers) {
+        if (app_mode == AppMode::MEMCACHEKV) {
+            static_cast<memcachekv::Server*>(s.app)->stop();
+        }
+        s.transport->stop();
+        s.thread->join();
+        delete s.thread;
+        if (app_mode == AppMode::MEMCACHEKV) {
+            memcachekv::Server *server = static_cast<memcachekv::Server*>(s.app);
+            server->report();
+            // Server threads are done, so any store can be scanned. The
+            // tail rack has every committed write.
+            if (snapshot_prefix != nullptr && s.config->rack_id == num_racks - 1) {
+                server->write_snapshot(snapshot_prefix);
+            }
+        }
+    }
+
+    /* Clean up */
+    if (lb != nullptr) {
+        delete lb->node;
+        delete lb->transport;
+        delete lb->app;
+        delete lb->config;
+        delete lb;
+    }
+    for (ClusterNode &c : clients) {
+        delete c.node;
+        delete c.transport;
+        delete c.app;
+        delete c.codec;
+        delete c.gen;
+        delete c.stats;
+        delete c.config;
+    }
+    delete placement;
+    for (ClusterNode &s : servers) {
+        delete s.node;
+        delete s.transport;
+        delete s.app;
+        delete s.codec;
+        delete s.ctrl_codec;
+        delete s.config;
+    }
+    if (slab != nullptr) {
+        // Retired items go back to the slab
+        memcachekv::Epoch::drain();
+        slab->report();
+        delete slab;
+    }
+
+    return 0;
+}
@@ -1,14 +1,21 @@
 #include <unistd.h>
+#include <atomic>
 #include <fstream>
+#include <getopt.h>
 #include <signal.h>
+#include <sys/time.h>
 #include <deque>
+#include <thread>
+#include <vector>
 
 #include <node.h>
 #include <logger.h>
+#include <utils.h>
 #include <transports/udp/configuration.h>
 #include <transports/udp/transport.h>
 #include <transports/dpdk/configuration.h>
 #include <transports/dpdk/transport.h>
+#include <transports/uring/transport.h>
 #include <apps/echo/client.h>
 #include <apps/echo/server.h>
 #include <apps/memcachekv/message.h>
@@ -16,7 +23,11 @@
 #include <apps/memcachekv/client.h>
 #include <apps/memcachekv/controller.h>
 #include <apps/memcachekv/decrementor.h>
+#include <apps/memcachekv/epoch.h>
 #include <apps/memcachekv/loadbalancer.h>
+#include <apps/memcachekv/placement.h>
+#include <apps/memcachekv/snapshot.h>
+#include <apps/memcachekv/utils.h>
 
 enum class NodeMode {
     CLIENT,
@@ -29,7 +40,8 @@ enum class NodeMode {
 
 enum class TransportMode {
     UDP,
-    DPDK
+    DPDK,
+    URING
 };
 
 enum class ProtocolMode {
@@ -44,6 +56,136 @@ enum class AppMode {
     UNKNOWN
 };
 
+// Options without a short form (all letters are taken)
+enum LongOption {
+    OPT_SNAPSHOT = 256,
+    OPT_SNAPSHOT_INTERVAL,
+    OPT_HOST_COLOCATED
+};
+
+static const struct option long_options[] = {
+    {"snapshot", required_argument, nullptr, OPT_SNAPSHOT},
+    {"snapshot-interval", required_argument, nullptr, OPT_SNAPSHOT_INTERVAL},
+    {"host-colocated", no_argument, nullptr, OPT_HOST_COLOCATED},
+    {nullptr, 0, nullptr, 0}
+};
+
+/*
+ * Configuration of colocated server colocate_id, hosted in this process on
+ * the same DPDK port as the server described by config
+ */
+static Configuration *make_colocated_config(const Configuration *config,
+                                            const char *config_file_path,
+                                            int colocate_id)
+{
+    const DPDKConfiguration *dc = static_cast<const DPDKConfiguration*>(config);
+    DPDKConfiguration *colocated = new DPDKConfiguration(config_file_path);
+    colocated->use_tx_buffer = dc->use_tx_buffer;
+    colocated->tx_buffer_size = dc->tx_buffer_size;
+    colocated->tx_flush_us = dc->tx_flush_us;
+    colocated->idle_polls = dc->idle_polls;
+    colocated->pipeline_mode = dc->pipeline_mode;
+    colocated->duration = config->duration;
+    colocated->num_racks = config->num_racks;
+    colocated->num_nodes = config->num_nodes;
+    colocated->rack_id = config->rack_id;
+    colocated->node_id = config->node_id + colocate_id;
+    colocated->client_id = config->client_id;
+    colocated->transport_core = config->transport_core;
+    colocated->n_transport_threads = config->n_transport_threads;
+    colocated->app_core = config->app_core;
+    colocated->n_app_threads = config->n_app_threads;
+    colocated->colocate_id = colocate_id;
+    colocated->n_colocate_nodes = config->n_colocate_nodes;
+    colocated->node_type = config->node_type;
+    colocated->terminating = config->terminating;
+    colocated->use_raw_transport = config->use_raw_transport;
+    colocated->use_endhost_lb = config->use_endhost_lb;
+    return colocated;
+}
+
+// Store items of memcachekv servers, if enabled
+static memcachekv::SlabAllocator *slab = nullptr;
+// memcachekv servers hosted by this process
+static std::vector<memcachekv::Server*> kv_servers;
+
+// Stops the app threads of partitioned servers, and their handoffs, so
+// that nothing touches the stores while the process reports and exits
+static void stop_servers()
+{
+    for (memcachekv::Server *server : kv_servers) {
+        server->stop();
+    }
+}
+
+static void report_servers()
+{
+    for (memcachekv::Server *server : kv_servers) {
+        server->report();
+    }
+}
+
+// Takes the size class locks, so never called from a signal handler
+static void report_slab()
+{
+    if (slab != nullptr) {
+        slab->report();
+    }
+}
+
+// Prefix of the snapshot files of memcachekv servers, if enabled, and
+// seconds between snapshots (0 to only write them on exit)
+static const char *snapshot_prefix = nullptr;
+static int snapshot_interval = 0;
+
+static void write_snapshots()
+{
+    for (memcachekv::Server *server : kv_servers) {
+        struct timeval start, end;
+        gettimeofday(&start, nullptr);
+        if (server->write_snapshot(snapshot_prefix)) {
+            gettimeofday(&end, nullptr);
+            info("Wrote snapshot in %.2f s", latency(start, end) / 1e6);
+        }
+    }
+}
+
+// Seconds the signal thread waits for a signal before checking whether
+// the process is exiting or a snapshot is due
+#define SIGNAL_POLL_S 1
+
+// Set when node->run() returns, to stop the signal thread
+static std::atomic<bool> signal_thread_stop(false);
+
+/*
+ * In memcachekv servers, INT and TERM are blocked in every thread and taken
+ * by this one rather than by the signal handlers, as writing snapshots and
+ * reporting the stores is not async-signal-safe. A signal stops the servers
+ * and the transport, so that node->run() returns and main does both.
+ */
+static void signal_thread(sigset_t signals, Transport *transport)
+{
+    struct timeval last, now;
+    gettimeofday(&last, nullptr);
+    while (!signal_thread_stop) {
+        struct timespec timeout = {SIGNAL_POLL_S, 0};
+        int sig = sigtimedwait(&signals, nullptr, &timeout);
+        if (sig < 0) {
+            gettimeofday(&now, nullptr);
+            if (snapshot_interval > 0 &&
+                now.tv_sec - last.tv_sec >= snapshot_interval) {
+                write_snapshots();
+                gettimeofday(&last, nullptr);
+            }
+            continue;
+        }
+        info("Received %s signal", sig == SIGINT ? "INT" : "TERM");
+        stop_servers();
+        transport->stop();
+        return;
+    }
+}
+
 void sigint_handler(int param)
 {
     info("Received INT signal\n");
@@ -64,20 +206,32 @@ int main(int argc, char *argv[])
     TransportMode transport_mode = TransportMode::UDP;
     AppMode app_mode = AppMode::UNKNOWN;
     float mean_interval = 1000;
-    int n_transport_threads = 1, n_app_threads = 1, value_len = 256, nkeys = 1000, duration = 1, rack_id = -1, node_id = -1, num_racks = 1, num_nodes = 1, proc_latency = 0, dec_interval = 1000, n_dec = 1, num_rkeys = 32, interval = 0, d_interval = 1000000, d_nkeys = 100, target_latency = 100, app_core = 0, transport_core = 1, colocate_id = 0, n_colocate_nodes = 1;
+    int n_transport_threads = 1, n_app_threads = 1, value_len = 256, nkeys = 1000, duration = 1, rack_id = -1, node_id = -1, num_racks = 1, num_nodes = 1, proc_latency = 0, dec_interval = 1000, n_dec = 1, num_rkeys = 32, interval = 0, d_interval = 1000000, d_nkeys = 100, target_latency = 100, app_core = 0, transport_core = 1, colocate_id = 0, n_colocate_nodes = 1, batch_size = 1;
     float get_ratio = 0.5, alpha = 0.5;
     bool use_endhost_lb = false, use_flow_api = false, use_tx_buffer= false;
+    // Host all colocated servers in this process, rather than one process
+    // per colocate id
+    bool host_colocated = false;
     size_t tx_buffer_size = 4;
+    unsigned tx_flush_us = 10;
+    unsigned idle_polls = 0;
+    DPDKConfiguration::PipelineMode pipeline_mode = DPDKConfiguration::PipelineMode::NONE;
     const char *keys_file_path = nullptr, *config_file_path = nullptr, *stats_file_path = nullptr, *nodeops_file_path = nullptr, *interval_file_path = nullptr;
     std::deque<std::string> keys;
     memcachekv::KeyType key_type = memcachekv::KeyType::UNIFORM;
     memcachekv::DynamismType d_type = memcachekv::DynamismType::NONE;
     memcachekv::SendMode send_mode = memcachekv::SendMode::FIXED;
+    memcachekv::PlacementType placement_type = memcachekv::PlacementType::RANGE;
+    std::vector<int> node_weights;
+    memcachekv::StoreType store_type = memcachekv::StoreType::TBB;
+    // Slab allocator budget, 0 for no limit, or -1 to store items on the heap
+    int slab_budget_mb = -1;
+    memcachekv::CachePolicy cache_policy;
 
     signal(SIGINT, sigint_handler);
     signal(SIGTERM, sigterm_handler);
 
-    while ((opt = getopt(argc, argv, "a:b:c:d:e:f:g:i:k:l:m:n:o:p:q:r:s:t:u:v:w:x:y:z:A:B:C:D:E:F:G:H:I:J:K:L:M:N:O:P:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "a:b:c:d:e:f:g:i:j:k:l:m:n:o:p:q:r:s:t:u:v:w:x:y:z:A:B:C:D:E:F:G:H:I:J:K:L:M:N:O:P:Q:R:S:T:U:V:W:X:Y:Z:", long_options, nullptr)) != -1) {
         switch (opt) {
         case 'a': {
             alpha = stof(std::string(optarg));
@@ -111,6 +265,12 @@ int main(int argc, char *argv[])
             mean_interval = stof(std::string(optarg));
             break;
         }
+        case 'j': {
+            if (!memcachekv::parse_cache_policy(optarg, cache_policy)) {
+                panic("Unknown cache policy %s", optarg);
+            }
+            break;
+        }
         case 'k': {
             use_flow_api = stoi(std::string(optarg)) != 0;
             break;
@@ -144,6 +304,8 @@ int main(int argc, char *argv[])
                 transport_mode = TransportMode::UDP;
             } else if (strcmp(optarg, "dpdk") == 0) {
                 transport_mode = TransportMode::DPDK;
+            } else if (strcmp(optarg, "uring") == 0) {
+                transport_mode = TransportMode::URING;
             } else {
                 panic("Unknown transport mode %s", optarg);
             }
@@ -310,11 +472,115 @@ int main(int argc, char *argv[])
             tx_buffer_size = stoi(std::string(optarg));
             break;
         }
+        case 'Q': {
+            if (strcmp(optarg, "none") == 0) {
+                pipeline_mode = DPDKConfiguration::PipelineMode::NONE;
+            } else if (strcmp(optarg, "keyhash") == 0) {
+                pipeline_mode = DPDKConfiguration::PipelineMode::KEYHASH;
+            } else if (strcmp(optarg, "load") == 0) {
+                pipeline_mode = DPDKConfiguration::PipelineMode::LEAST_LOADED;
+            } else {
+                panic("Unknown pipeline mode %s", optarg);
+            }
+            break;
+        }
+        case 'R': {
+            tx_flush_us = stoi(std::string(optarg));
+            break;
+        }
+        case 'S': {
+            idle_polls = stoi(std::string(optarg));
+            break;
+        }
+        case 'T': {
+            batch_size = stoi(std::string(optarg));
+            if (batch_size < 1) {
+                panic("Batch size should be >= 1");
+            }
+            break;
+        }
+        case 'U': {
+            if (!memcachekv::parse_keyhash_type(optarg, memcachekv::keyhash_type)) {
+                panic("Unknown key hash %s", optarg);
+            }
+            break;
+        }
+        case 'V': {
+            if (!memcachekv::parse_placement_type(optarg, placement_type)) {
+                panic("Unknown placement %s", optarg);
+            }
+            break;
+        }
+        case 'W': {
+            if (!memcachekv::parse_node_weights(optarg, node_weights)) {
+                panic("Invalid node weights %s", optarg);
+            }
+            break;
+        }
+        case 'X': {
+            if (!memcachekv::parse_store_type(optarg, store_type)) {
+                panic("Unknown store %s", optarg);
+            }
+            break;
+        }
+        case 'Y': {
+            slab_budget_mb = stoi(std::string(optarg));
+            break;
+        }
+        case 'Z': {
+            // Memory limit of the store, in MB
+            cache_policy.limit = (size_t)stoi(std::string(optarg)) << 20;
+            break;
+        }
+        case OPT_SNAPSHOT: {
+            // Servers load <prefix>.<node id> at startup, and write it on exit
+            snapshot_prefix = optarg;
+            break;
+        }
+        case OPT_SNAPSHOT_INTERVAL: {
+            snapshot_interval = stoi(std::string(optarg));
+            break;
+        }
+        case OPT_HOST_COLOCATED: {
+            host_colocated = true;
+            break;
+        }
         default:
             panic("Unknown argument %s", argv[optind]);
         }
     }
 
+    bool use_signal_thread = app_mode == AppMode::MEMCACHEKV && node_mode == NodeMode::SERVER;
+    bool use_snapshots = snapshot_prefix != nullptr && use_signal_thread;
+    if (use_snapshots && store_type != memcachekv::StoreType::CUCKOO) {
+        panic("Snapshots of a running server require the cuckoo store");
+    }
+    sigset_t signal_thread_signals;
+    if (use_signal_thread) {
+        // Before any other thread starts, so that all inherit the mask
+        sigemptyset(&signal_thread_signals);
+        sigaddset(&signal_thread_signals, SIGINT);
+        sigaddset(&signal_thread_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signal_thread_signals, nullptr);
+    }
+    // Servers starting from a snapshot do not need the keys
+    auto read_keys = [&]() {
+        if (!keys.empty()) {
+            return;
+        }
+        std::ifstream in;
+        in.open(keys_file_path);
+        if (!in) {
+            panic("Failed to read keys from %s", keys_file_path);
+        }
+        std::string key;
+        for (int i = 0; i < nkeys; i++) {
+            getline(in, key);
+            keys.push_back(key);
+        }
+        in.close();
+    };
+
     if (node_mode == NodeMode::UNKNOWN) {
         panic("Option -m <client/server> required");
     }
@@ -327,17 +593,41 @@ int main(int argc, char *argv[])
         panic("Option -c <config file> required");
     }
 
+    if (host_colocated) {
+        if (transport_mode != TransportMode::DPDK || app_mode != AppMode::MEMCACHEKV ||
+            node_mode != NodeMode::SERVER) {
+            panic("--host-colocated requires a DPDK memcachekv server");
+        }
+        if (colocate_id != 0) {
+            panic("--host-colocated is given to colocate id 0 only, which hosts the others");
+        }
+    }
+
+    if (store_type == memcachekv::StoreType::PARTITIONED &&
+        host_colocated && n_colocate_nodes > 1) {
+        // Only the first server's partitions get app threads to own them
+        panic("Partitioned store does not support colocated servers");
+    }
+
     /* Initialize configuration and application */
     Configuration *config = nullptr;
     Application *app = nullptr;
     switch (transport_mode) {
     case TransportMode::UDP:
-        config = new UDPConfiguration(config_file_path);
+    case TransportMode::URING: {
+        UDPConfiguration *uc = new UDPConfiguration(config_file_path);
+        uc->use_batching = use_tx_buffer;
+        uc->batch_size = tx_buffer_size;
+        config = uc;
         break;
+    }
     case TransportMode::DPDK:
         DPDKConfiguration *dc = new DPDKConfiguration(config_file_path);
         dc->use_tx_buffer = use_tx_buffer;
         dc->tx_buffer_size = tx_buffer_size;
+        dc->tx_flush_us = tx_flush_us;
+        dc->idle_polls = idle_polls;
+        dc->pipeline_mode = pipeline_mode;
         config = dc;
         break;
     }
@@ -356,6 +646,7 @@ int main(int argc, char *argv[])
     memcachekv::KVWorkloadGenerator *gen = nullptr;
     memcachekv::MessageCodec *codec = nullptr;
     memcachekv::ControllerCodec *ctrl_codec = nullptr;
+    memcachekv::Placement *placement = nullptr;
 
     switch (app_mode) {
     case AppMode::ECHO: {
@@ -395,6 +686,7 @@ int main(int argc, char *argv[])
     }
     case AppMode::MEMCACHEKV: {
         ctrl_codec = new memcachekv::ControllerCodec();
+        placement = new memcachekv::Placement(placement_type, num_nodes, node_weights);
 
         switch (protocol_mode) {
         case ProtocolMode::STATIC:
@@ -410,19 +702,8 @@ int main(int argc, char *argv[])
             panic("Unreachable");
         }
 
-        if (node_mode == NodeMode::CLIENT || node_mode == NodeMode::SERVER) {
-            // Read in all keys
-            std::ifstream in;
-            in.open(keys_file_path);
-            if (!in) {
-                panic("Failed to read keys from %s", keys_file_path);
-            }
-            std::string key;
-            for (int i = 0; i < nkeys; i++) {
-                getline(in, key);
-                keys.push_back(key);
-            }
-            in.close();
+        if (node_mode == NodeMode::CLIENT) {
+            read_keys();
         }
 
         switch (node_mode) {
@@ -456,7 +737,7 @@ int main(int argc, char *argv[])
                                                       n_app_threads,
                                                       stats);
 
-            app = new memcachekv::Client(config, (memcachekv::MemcacheKVStats*)stats, gen, codec);
+            app = new memcachekv::Client(config, (memcachekv::MemcacheKVStats*)stats, gen, codec, placement, batch_size);
             break;
         }
         case NodeMode::SERVER: {
@@ -472,7 +753,29 @@ int main(int argc, char *argv[])
             config->terminating = false;
             config->use_raw_transport = false;
             std::string default_value = std::string(value_len, 'v');
-            app = new memcachekv::Server(config, codec, ctrl_codec, proc_latency, default_value, keys);
+            if (slab_budget_mb > 0 && cache_policy.limit > ((size_t)slab_budget_mb << 20)) {
+                panic("Memory limit exceeds the slab allocator budget");
+            }
+            if (slab_budget_mb >= 0) {
+                slab = new memcachekv::SlabAllocator((size_t)slab_budget_mb << 20);
+            }
+            struct timeval start, end;
+            gettimeofday(&start, nullptr);
+            memcachekv::Snapshot *snapshot = nullptr;
+            if (use_snapshots) {
+                snapshot = memcachekv::Snapshot::open(memcachekv::snapshot_file(snapshot_prefix, node_id));
+            }
+            if (snapshot == nullptr) {
+                read_keys();
+            }
+            memcachekv::Server *server = new memcachekv::Server(config, codec, ctrl_codec, proc_latency, default_value, keys, store_type, slab, cache_policy, snapshot);
+            gettimeofday(&end, nullptr);
+            info("Server started from %s in %.2f s",
+                 snapshot != nullptr ? "snapshot" : "keys file", latency(start, end) / 1e6);
+            // Loaded values keep the snapshot mapped
+            delete snapshot;
+            kv_servers.push_back(server);
+            app = server;
             break;
         }
         case NodeMode::CONTROLLER: {
@@ -506,7 +809,7 @@ int main(int argc, char *argv[])
             config->node_type = Configuration::NodeType::LB;
             config->terminating = false;
             config->use_raw_transport = true;
-            app = new memcachekv::LoadBalancer(config);
+            app = new memcachekv::LoadBalancer(config, placement);
             break;
         default:
             panic("Unknown node mode");
@@ -526,22 +829,94 @@ int main(int argc, char *argv[])
     case TransportMode::DPDK:
         transport = new DPDKTransport(config, use_flow_api);
         break;
+    case TransportMode::URING:
+        transport = new IOUringTransport(config);
+        break;
     }
     Node *node = new Node(config, transport);
 
     /* Run application */
     node->register_app(app);
+
+    /*
+     * With --host-colocated, colocated memcachekv servers share this
+     * process and its DPDK port; the transport demultiplexes their packets
+     * by destination address. Otherwise each colocate id runs its own
+     * process.
+     */
+    std::vector<Configuration*> colocated_configs;
+    std::vector<Application*> colocated_apps;
+    if (host_colocated && n_colocate_nodes > 1) {
+        DPDKTransport *dpdk_transport = static_cast<DPDKTransport*>(transport);
+        dpdk_transport->register_colocated_receiver(0, app);
+        for (int c = 1; c < n_colocate_nodes; c++) {
+            Configuration *colocated_config = make_colocated_config(config, config_file_path, c);
+            memcachekv::Snapshot *snapshot = nullptr;
+            if (use_snapshots) {
+                snapshot = memcachekv::Snapshot::open(
+                        memcachekv::snapshot_file(snapshot_prefix, colocated_config->node_id));
+            }
+            if (snapshot == nullptr) {
+                read_keys();
+            }
+            memcachekv::Server *colocated_app = new memcachekv::Server(colocated_config,
+                                                                       codec,
+                                                                       ctrl_codec,
+                                                                       proc_latency,
+                                                                       std::string(value_len, 'v'),
+                                                                       keys,
+                                                                       store_type,
+                                                                       slab,
+                                                                       cache_policy,
+                                                                       snapshot);
+            delete snapshot;
+            kv_servers.push_back(colocated_app);
+            colocated_app->register_transport(transport);
+            dpdk_transport->register_colocated_receiver(c, colocated_app);
+            colocated_configs.push_back(colocated_config);
+            colocated_apps.push_back(colocated_app);
+        }
+        info("Hosting %d colocated servers", n_colocate_nodes);
+    }
+    std::thread *signal_handling_thread = nullptr;
+    if (use_signal_thread) {
+        signal_handling_thread = new std::thread(signal_thread, signal_thread_signals, transport);
+    }
     node->run();
+    if (signal_handling_thread != nullptr) {
+        // No thread iterates the servers past this point
+        signal_thread_stop = true;
+        signal_handling_thread->join();
+        delete signal_handling_thread;
+    }
+    if (use_snapshots) {
+        write_snapshots();
+    }
+    report_servers();
+    report_slab();
+    kv_servers.clear();
 
     /* Clean up */
+    for (Application *colocated_app : colocated_apps) {
+        delete colocated_app;
+    }
+    for (Configuration *colocated_config : colocated_configs) {
+        delete colocated_config;
+    }
     delete transport;
     delete config;
     delete node;
     delete app;
     delete ctrl_codec;
     delete codec;
+    delete placement;
     //delete gen;
     delete stats;
+    if (slab != nullptr) {
+        // The stores are gone; free the items they retired before the slab
+        memcachekv::Epoch::drain();
+        delete slab;
+    }
 
     return 0;
 }
@@ -8,7 +8,7 @@ Configuration::Configuration()
     client_id(-1), transport_core(-1), n_transport_threads(0), app_core(-1),
     n_app_threads(0), colocate_id(-1), n_colocate_nodes(0),
     node_type(Configuration::NodeType::CLIENT), terminating(false),
-    use_raw_transport(false), lb_address(nullptr)
+    use_raw_transport(false), use_endhost_lb(false), lb_address(nullptr)
 {
 }
 
@@ -1,4 +1,5 @@
 #include <cassert>
+#include <mutex>
 
 #include <stats.h>
 #include <logger.h>
@@ -105,6 +106,9 @@ void Stats::done()
 
 void Stats::dump()
 {
+    // Clients sharing a process (see cluster) print one at a time
+    static std::mutex dump_lock;
+    std::lock_guard<std::mutex> lck(dump_lock);
     uint64_t duration = (this->end_time.tv_sec - this->start_time.tv_sec) * 1000000 +
         (this->end_time.tv_usec - this->start_time.tv_usec);
     uint64_t total_latency = 0, count = 0;
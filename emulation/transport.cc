@@ -1,21 +1,43 @@
 #include <assert.h>
 #include <sys/socket.h>
 #include <cstring>
+#include <vector>
 
 #include <transport.h>
 #include <logger.h>
 
+/* Default message buffer pool */
+#define POOL_BUF_SIZE 9216
+#define POOL_MAX_FREE 1024
+
+// Free pool buffers of a thread, released when the thread exits
+struct FreeBuffers {
+    ~FreeBuffers()
+    {
+        for (void *buf : this->bufs) {
+            free(buf);
+        }
+    }
+
+    std::vector<void*> bufs;
+};
+thread_local static FreeBuffers free_buffers;
+
 Message::Message()
-    : buf_(nullptr), len_(0), dealloc_(false)
+    : buf_(nullptr), len_(0), dealloc_(false), transport_(nullptr), tdata_(nullptr),
+    ext_buf_(nullptr), ext_len_(0)
 {
 }
 
 Message::Message(void *buf, size_t len, bool dealloc)
-    : buf_(buf), len_(len), dealloc_(dealloc)
+    : buf_(buf), len_(len), dealloc_(dealloc), transport_(nullptr), tdata_(nullptr),
+    ext_buf_(nullptr), ext_len_(0)
 {
 }
 
 Message::Message(const std::string &str)
+    : transport_(nullptr), tdata_(nullptr),
+    ext_buf_(nullptr), ext_len_(0)
 {
     this->buf_ = malloc(str.size());
     memcpy(this->buf_, str.data(), str.size());
@@ -23,11 +45,32 @@ Message::Message(const std::string &str)
     this->dealloc_ = true;
 }
 
+Message::Message(Transport *transport)
+    : buf_(nullptr), len_(0), dealloc_(false), transport_(transport), tdata_(nullptr),
+    ext_buf_(nullptr), ext_len_(0)
+{
+}
+
 Message::~Message()
 {
-    if (this->dealloc_ && this->buf_ != nullptr) {
+    release();
+}
+
+void Message::release()
+{
+    this->ext_buf_ = nullptr;
+    this->ext_len_ = 0;
+    this->ext_owner_.reset();
+    if (this->buf_ == nullptr) {
+        return;
+    }
+    if (this->transport_ != nullptr) {
+        this->transport_->free_message_buffer(this->buf_, this->len_, this->tdata_);
+    } else if (this->dealloc_) {
         free(this->buf_);
     }
+    this->buf_ = nullptr;
+    this->tdata_ = nullptr;
 }
 
 const void *Message::buf() const
@@ -40,14 +83,67 @@ size_t Message::len() const
     return this->len_;
 }
 
+void *Message::tdata() const
+{
+    return this->tdata_;
+}
+
 void Message::set_message(void *buf, size_t len, bool dealloc)
 {
-    if (this->buf_ != nullptr) {
-        free(this->buf_);
-    }
+    release();
     this->buf_ = buf;
     this->len_ = len;
     this->dealloc_ = dealloc;
+    this->transport_ = nullptr;
+    this->tdata_ = nullptr;
+}
+
+void Message::set_ext(const void *buf, size_t len, const std::shared_ptr<const void> &owner)
+{
+    this->ext_buf_ = buf;
+    this->ext_len_ = len;
+    this->ext_owner_ = owner;
+}
+
+const void *Message::ext_buf() const
+{
+    return this->ext_buf_;
+}
+
+size_t Message::ext_len() const
+{
+    return this->ext_len_;
+}
+
+const std::shared_ptr<const void> &Message::ext_owner() const
+{
+    return this->ext_owner_;
+}
+
+size_t Message::total_len() const
+{
+    return this->len_ + this->ext_len_;
+}
+
+void Message::copy_to(void *dst) const
+{
+    memcpy(dst, this->buf_, this->len_);
+    if (this->ext_len_ > 0) {
+        memcpy((char*)dst + this->len_, this->ext_buf_, this->ext_len_);
+    }
+}
+
+void *Message::alloc_buf(size_t len)
+{
+    release();
+    if (this->transport_ != nullptr) {
+        this->buf_ = this->transport_->alloc_message_buffer(len, this->tdata_);
+    } else {
+        this->buf_ = malloc(len);
+        this->dealloc_ = true;
+    }
+    this->len_ = len;
+    return this->buf_;
 }
 
 TransportReceiver::~TransportReceiver()
@@ -64,6 +160,11 @@ bool TransportReceiver::receive_raw(void *buf, void *tdata, int tid)
     panic("receive_raw not implemented");
 }
 
+bool TransportReceiver::flow_hash(const Message &msg, uint32_t &hash)
+{
+    return false;
+}
+
 Transport::Transport(const Configuration *config)
     : config(config), receiver(nullptr)
 {
@@ -93,6 +194,17 @@ void Transport::send_message_to_local_node(const Message &msg, int node_id)
                  *this->config->node_addresses.at(this->config->rack_id).at(node_id));
 }
 
+void Transport::send_message_to_local_nodes(const Message &msg, const std::vector<int> &node_ids)
+{
+    assert(this->config->rack_id >= 0);
+    std::vector<const Address*> addrs;
+    for (int node_id : node_ids) {
+        assert(node_id < this->config->num_nodes && node_id >= 0);
+        addrs.push_back(this->config->node_addresses.at(this->config->rack_id).at(node_id));
+    }
+    send_messages(msg, addrs);
+}
+
 void Transport::send_message_to_lb(const Message &msg)
 {
     send_message(msg, *this->config->lb_address);
@@ -104,7 +216,42 @@ void Transport::send_message_to_controller(const Message &msg, int rack_id)
     send_message(msg, *this->config->controller_addresses.at(rack_id));
 }
 
+void Transport::send_messages(const Message &msg, const std::vector<const Address*> &addrs)
+{
+    for (const Address *addr : addrs) {
+        send_message(msg, *addr);
+    }
+}
+
 void Transport::send_raw(const void *buf, void *tdata)
 {
     panic("send_raw not implemented");
 }
+
+bool Transport::raw_ip_checksum_offload() const
+{
+    return false;
+}
+
+void *Transport::alloc_message_buffer(size_t len, void *&tdata)
+{
+    tdata = nullptr;
+    if (len > POOL_BUF_SIZE) {
+        return malloc(len);
+    }
+    if (free_buffers.bufs.empty()) {
+        return malloc(POOL_BUF_SIZE);
+    }
+    void *buf = free_buffers.bufs.back();
+    free_buffers.bufs.pop_back();
+    return buf;
+}
+
+void Transport::free_message_buffer(void *buf, size_t len, void *tdata)
+{
+    if (len > POOL_BUF_SIZE || free_buffers.bufs.size() >= POOL_MAX_FREE) {
+        free(buf);
+    } else {
+        free_buffers.bufs.push_back(buf);
+    }
+}
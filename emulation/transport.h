@@ -3,6 +3,8 @@
 
 #include <string>
 #include <list>
+#include <vector>
+#include <memory>
 
 #include <configuration.h>
 
@@ -14,16 +16,42 @@ public:
     Message();
     Message(void *buf, size_t len, bool dealloc);
     Message(const std::string &str);
+    // Buffer is allocated from the transport's pool by alloc_buf
+    Message(Transport *transport);
     ~Message();
 
     const void *buf() const;
     size_t len() const;
+    void *tdata() const;
     void set_message(void *buf, size_t len, bool dealloc);
+    // Allocate a writable buffer of len bytes for the codec to encode into
+    void *alloc_buf(size_t len);
+
+    /*
+     * Optional external tail sent after buf() without being copied into it
+     * (e.g. a stored value); owner keeps the bytes alive while any
+     * transport still references them.
+     */
+    void set_ext(const void *buf, size_t len, const std::shared_ptr<const void> &owner);
+    const void *ext_buf() const;
+    size_t ext_len() const;
+    const std::shared_ptr<const void> &ext_owner() const;
+    // len() + ext_len()
+    size_t total_len() const;
+    // Copy buf() followed by the external tail into dst
+    void copy_to(void *dst) const;
 
 private:
+    void release();
+
     void *buf_;
     size_t len_;
     bool dealloc_;
+    Transport *transport_;
+    void *tdata_;
+    const void *ext_buf_;
+    size_t ext_len_;
+    std::shared_ptr<const void> ext_owner_;
 };
 
 class TransportReceiver {
@@ -35,6 +63,9 @@ public:
                                  int tid) = 0;
     // Return true if callee reuses the buffer to send a packet
     virtual bool receive_raw(void *buf, void *tdata, int tid);
+    // Hash used to steer the message to a thread; return false if the
+    // message has no flow affinity
+    virtual bool flow_hash(const Message &msg, uint32_t &hash);
 
 protected:
     Transport *transport;
@@ -48,11 +79,25 @@ public:
     void register_receiver(TransportReceiver *receiver);
     void send_message_to_node(const Message &msg, int rack_id, int node_id);
     void send_message_to_local_node(const Message &msg, int node_id);
+    void send_message_to_local_nodes(const Message &msg, const std::vector<int> &node_ids);
     void send_message_to_lb(const Message &msg);
     void send_message_to_controller(const Message &msg, int rack_id);
 
     virtual void send_message(const Message &msg, const Address &addr) = 0;
+    // Send the same message to multiple destinations
+    virtual void send_messages(const Message &msg, const std::vector<const Address*> &addrs);
     virtual void send_raw(const void *buf, void *tdata);
+    // True if send_raw fills in the IPv4 header checksum itself (e.g. by NIC
+    // offload), so receivers rewriting raw packets can leave it stale
+    virtual bool raw_ip_checksum_offload() const;
+    /*
+     * Buffers for encode-in-place messages. tdata is transport specific
+     * (e.g. the mbuf backing the buffer); send_message recognizes messages
+     * built on its own buffers and avoids copying them. The default
+     * implementation keeps a per-thread pool of fixed-size buffers.
+     */
+    virtual void *alloc_message_buffer(size_t len, void *&tdata);
+    virtual void free_message_buffer(void *buf, size_t len, void *tdata);
     virtual void run(void) = 0;
     virtual void stop(void) = 0;
     virtual void wait(void) = 0;
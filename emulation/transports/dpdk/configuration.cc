@@ -17,7 +17,17 @@ DPDKAddress::DPDKAddress(const char *ether,
         panic("Failed to parse IP address");
     }
     this->udp_port = rte_cpu_to_be_16(uint16_t(std::stoul(port)));
-    this->dev_port = uint16_t(std::stoul(dev_port));
+    std::string ports(dev_port);
+    size_t start = 0, end;
+    do {
+        end = ports.find(',', start);
+        if (end == std::string::npos) {
+            end = ports.size();
+        }
+        this->dev_ports.push_back(uint16_t(std::stoul(ports.substr(start, end - start))));
+        start = end + 1;
+    } while (end < ports.size());
+    this->dev_port = this->dev_ports[0];
 }
 
 DPDKAddress::DPDKAddress(const struct rte_ether_addr &ether_addr,
@@ -30,7 +40,8 @@ DPDKAddress::DPDKAddress(const struct rte_ether_addr &ether_addr,
 }
 
 DPDKConfiguration::DPDKConfiguration(const char *file_path)
-    : Configuration()
+    : Configuration(), use_tx_buffer(false), tx_buffer_size(0), tx_flush_us(10),
+    pipeline_mode(PipelineMode::NONE), idle_polls(0)
 {
     std::ifstream file;
     std::vector<Address*> rack;
@@ -67,7 +78,7 @@ DPDKConfiguration::DPDKConfiguration(const char *file_path)
             char *dev_port = strtok(nullptr, "|");
 
             if (ether == nullptr || ip == nullptr || port == nullptr || dev_port == nullptr) {
-                panic("Configuration line format: 'node ether|ip|port|dev_port[|blacklist]'");
+                panic("Configuration line format: 'node ether|ip|port|dev_port[,dev_port...][|blacklist]'");
             }
             DPDKAddress *addr = new DPDKAddress(ether, ip, port, dev_port);
             char *blacklist;
@@ -87,7 +98,7 @@ DPDKConfiguration::DPDKConfiguration(const char *file_path)
             char *dev_port = strtok(nullptr, "|");
 
             if (ether == nullptr || ip == nullptr || port == nullptr || dev_port == nullptr) {
-                panic("Configuration line format: 'client ether|ip|port|dev_port[|blacklist]'");
+                panic("Configuration line format: 'client ether|ip|port|dev_port[,dev_port...][|blacklist]'");
             }
             DPDKAddress *addr = new DPDKAddress(ether, ip, port, dev_port);
             char *blacklist;
@@ -107,7 +118,7 @@ DPDKConfiguration::DPDKConfiguration(const char *file_path)
             char *dev_port = strtok(nullptr, "|");
 
             if (ether == nullptr || ip == nullptr || port == nullptr || dev_port == nullptr) {
-                panic("Configuration line format: 'lb ether|ip|port|dev_port[|blacklist]'");
+                panic("Configuration line format: 'lb ether|ip|port|dev_port[,dev_port...][|blacklist]'");
             }
             DPDKAddress *addr = new DPDKAddress(ether, ip, port, dev_port);
             char *blacklist;
@@ -127,7 +138,7 @@ DPDKConfiguration::DPDKConfiguration(const char *file_path)
             char *dev_port = strtok(nullptr, "|");
 
             if (ether == nullptr || ip == nullptr || port == nullptr || dev_port == nullptr) {
-                panic("Configuration line format: 'controller ether|ip|port|dev_port[|blacklist]'");
+                panic("Configuration line format: 'controller ether|ip|port|dev_port[,dev_port...][|blacklist]'");
             }
             DPDKAddress *addr = new DPDKAddress(ether, ip, port, dev_port);
             char *blacklist;
@@ -2,6 +2,7 @@
 #define _DPDK_CONFIGURATION_H_
 
 #include <list>
+#include <vector>
 #include <rte_ether.h>
 #include <rte_byteorder.h>
 
@@ -22,6 +23,9 @@ public:
     rte_be32_t ip_addr;
     rte_be16_t udp_port;
     uint16_t dev_port;
+    // All DPDK ports of the node, from a comma separated dev_port field
+    // (only set for configured addresses); dev_port is the first of them
+    std::vector<uint16_t> dev_ports;
     std::list<std::string> blacklist;
 };
 
@@ -29,8 +33,23 @@ class DPDKConfiguration : public Configuration {
 public:
     DPDKConfiguration(const char *file_path);
 
+    // Pipeline mode: a distributor thread polls the NIC and dispatches
+    // packets to the transport (worker) threads
+    enum class PipelineMode {
+        NONE,
+        KEYHASH,
+        LEAST_LOADED
+    };
+
     bool use_tx_buffer;
+    // Maximum TX batch size
     size_t tx_buffer_size;
+    // Longest time a packet may wait in a TX batch
+    unsigned tx_flush_us;
+    PipelineMode pipeline_mode;
+    // Consecutive empty polls after which a transport thread waits for an
+    // RX interrupt (or sleeps); 0 to busy-poll
+    unsigned idle_polls;
 };
 
 #endif /* _DPDK_CONFIGURATION_H_ */
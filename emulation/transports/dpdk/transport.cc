@@ -1,4 +1,5 @@
 #include <cassert>
+#include <algorithm>
 #include <net/ethernet.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -8,6 +9,9 @@
 #include <rte_ethdev.h>
 #include <rte_mbuf.h>
 #include <rte_malloc.h>
+#include <rte_ring.h>
+#include <rte_cycles.h>
+#include <rte_interrupts.h>
 
 #include <logger.h>
 #include <application.h>
@@ -18,9 +22,19 @@
 #define RTE_TX_DESC 4096
 #define MAX_PKT_BURST 32
 #define MEMPOOL_CACHE_SIZE 256
+#define WORKER_RING_SIZE 4096
+// Transport thread polls between mempool occupancy samples
+#define POOL_SAMPLE_INTERVAL 4096
+// Idle mode: bound on one interrupt wait, so that stop() is noticed
+#define IDLE_INTR_TIMEOUT_MS 10
+// Idle mode without RX interrupts: sleeps back off up to this
+#define IDLE_SLEEP_MAX_US 128
+// External message tails shorter than this are copied instead of attached
+#define EXT_BUF_MIN_LEN 512
 
 #define IPV4_HDR_SIZE 5
 #define IPV4_TTL 0xFF
+#define FRAME_HDR_LEN (ETHER_HDR_LEN + IPV4_HDR_SIZE * RTE_IPV4_IHL_MULTIPLIER + sizeof(struct rte_udp_hdr))
 
 #define FLOW_DEFAULT_PRIORITY 1
 #define FLOW_TRANSPORT_PRIORITY 0
@@ -34,20 +48,21 @@
 #define DEFAULT_PORT_ID 0
 
 thread_local static int rx_queue_id;
+thread_local static uint16_t rx_dev_port;
 thread_local static int tx_queue_id;
+thread_local static int pool_socket = -1;
 thread_local static uint16_t rand_port;
 #define RAND_PORT_BASE 12345
 #define RAND_PORT_MAX 10000
 
 static bool use_tx_buffer;
 static size_t tx_buffer_size;
-thread_local static struct rte_eth_dev_tx_buffer *tx_buffer;
+static uint64_t tx_flush_cycles;
 
 struct AppArg {
     Application *app;
     int tid;
     int tx_queue_id;
-    int dev_port;
 };
 
 struct TransportArg {
@@ -59,48 +74,309 @@ struct TransportArg {
 };
 
 #define MAX_THREADS 128
+#define MAX_PORTS 8
 
 static struct TransportArg transport_args[MAX_THREADS];
 static struct AppArg app_args[MAX_THREADS];
 
-static void tx_buffer_init(int dev_port)
+// Ports driven by the transport, by port index. Every thread has a TX queue
+// on each of them; transport threads poll RX queues of a single port.
+static int n_ports;
+static uint16_t dev_ports[MAX_PORTS];
+
+/*
+ * Per-thread TX batch (-O 1), one for each port. A batch is sent when it reaches its target
+ * size, at the end of each RX burst, or once its oldest packet has waited
+ * tx_flush_cycles. The target follows the offered load: it is the number
+ * of packets the thread is expected to send within the deadline (from an
+ * average of the gap between sends), between 1 and tx_buffer_size, so low
+ * rate traffic is sent right away. App threads have no poll loop: transport
+ * thread 0 flushes their expired batches, serialized with the owner by the
+ * busy flag, and never waits idle past their deadlines.
+ */
+struct TxBatch {
+    std::atomic<bool> busy;
+    uint16_t dev_port;
+    uint16_t queue_id;
+    uint16_t n;
+    uint16_t target;
+    uint64_t first_tsc;
+    uint64_t last_tsc;
+    uint64_t gap_ewma;
+    struct rte_mbuf **pkts;
+};
+
+thread_local static TxBatch *tx_batches[MAX_PORTS];
+// Kept until the transport is destroyed, as transport thread 0 may still
+// be flushing them
+static std::atomic<TxBatch*> app_tx_batches[MAX_THREADS][MAX_PORTS];
+
+static TxBatch *tx_batch_create(uint16_t dev_port, uint16_t queue_id)
+{
+    TxBatch *batch = new TxBatch();
+    batch->busy = false;
+    batch->dev_port = dev_port;
+    batch->queue_id = queue_id;
+    batch->n = 0;
+    batch->target = 1;
+    batch->first_tsc = 0;
+    batch->last_tsc = rte_rdtsc();
+    batch->gap_ewma = tx_flush_cycles;
+    batch->pkts = new struct rte_mbuf*[tx_buffer_size];
+    return batch;
+}
+
+static void tx_batch_destroy(TxBatch *batch)
+{
+    delete [] batch->pkts;
+    delete batch;
+}
+
+static inline void tx_batch_lock(TxBatch *batch)
+{
+    while (batch->busy.exchange(true, std::memory_order_acquire)) {
+        rte_pause();
+    }
+}
+
+static inline void tx_batch_unlock(TxBatch *batch)
+{
+    batch->busy.store(false, std::memory_order_release);
+}
+
+// Caller holds the batch
+static void tx_batch_send(TxBatch *batch)
+{
+    if (batch->n > 0) {
+        uint16_t sent = rte_eth_tx_burst(batch->dev_port, batch->queue_id, batch->pkts, batch->n);
+        for (uint16_t i = sent; i < batch->n; i++) {
+            rte_pktmbuf_free(batch->pkts[i]);
+        }
+        batch->n = 0;
+    }
+    uint64_t target = tx_flush_cycles / (batch->gap_ewma + 1);
+    batch->target = (uint16_t)std::max<uint64_t>(1, std::min<uint64_t>(target, tx_buffer_size));
+}
+
+static void tx_batch_flush(TxBatch *batch)
+{
+    tx_batch_lock(batch);
+    tx_batch_send(batch);
+    tx_batch_unlock(batch);
+}
+
+static void tx_batches_create(uint16_t queue_id)
+{
+    for (int port = 0; port < n_ports; port++) {
+        tx_batches[port] = tx_batch_create(dev_ports[port], queue_id);
+    }
+}
+
+static void tx_batches_flush()
+{
+    for (int port = 0; port < n_ports; port++) {
+        if (tx_batches[port] != nullptr) {
+            tx_batch_flush(tx_batches[port]);
+        }
+    }
+}
+
+// Flush if the oldest packet is past the deadline; skips a batch its owner
+// is using. Returns the deadline of the packets left in the batch (now if
+// the batch was busy), or UINT64_MAX if it is empty.
+static uint64_t tx_batch_flush_expired(TxBatch *batch, uint64_t now)
+{
+    uint64_t deadline = UINT64_MAX;
+    if (batch->busy.exchange(true, std::memory_order_acquire)) {
+        return now;
+    }
+    if (batch->n > 0 && now - batch->first_tsc >= tx_flush_cycles) {
+        tx_batch_send(batch);
+    }
+    if (batch->n > 0) {
+        deadline = batch->first_tsc + tx_flush_cycles;
+    }
+    tx_batch_unlock(batch);
+    return deadline;
+}
+
+// Flush the expired TX batches of all app threads. Returns the earliest
+// deadline of the packets left in them.
+static uint64_t app_tx_batches_flush_expired(int n_app_threads, uint64_t now)
+{
+    uint64_t deadline = UINT64_MAX;
+    for (int app_tid = 0; app_tid < n_app_threads; app_tid++) {
+        for (int port = 0; port < n_ports; port++) {
+            TxBatch *batch = app_tx_batches[app_tid][port];
+            if (batch != nullptr) {
+                deadline = std::min(deadline, tx_batch_flush_expired(batch, now));
+            }
+        }
+    }
+    return deadline;
+}
+
+// Fold a 32-bit ones' complement sum into 16 bits
+static inline uint16_t cksum_fold(uint32_t sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+static void tx_packets(int port, struct rte_mbuf **pkts, uint16_t n)
+{
+    TxBatch *batch = tx_batches[port];
+    if (batch != nullptr) {
+        tx_batch_lock(batch);
+        uint64_t now = rte_rdtsc();
+        uint64_t gap = (now - batch->last_tsc) / n;
+        batch->gap_ewma = batch->gap_ewma - batch->gap_ewma / 8 + gap / 8;
+        batch->last_tsc = now;
+        for (uint16_t i = 0; i < n; i++) {
+            if (batch->n == 0) {
+                batch->first_tsc = now;
+            }
+            batch->pkts[batch->n++] = pkts[i];
+            if (batch->n >= batch->target) {
+                tx_batch_send(batch);
+            }
+        }
+        if (batch->n > 0 && now - batch->first_tsc >= tx_flush_cycles) {
+            tx_batch_send(batch);
+        }
+        tx_batch_unlock(batch);
+    } else {
+        uint16_t sent = rte_eth_tx_burst(dev_ports[port], tx_queue_id, pkts, n);
+        for (uint16_t i = sent; i < n; i++) {
+            rte_pktmbuf_free(pkts[i]);
+        }
+    }
+}
+
+static void tx_packet(int port, struct rte_mbuf *m)
 {
-    tx_buffer = (rte_eth_dev_tx_buffer*)rte_zmalloc_socket(nullptr, RTE_ETH_TX_BUFFER_SIZE(tx_buffer_size), 0, rte_eth_dev_socket_id(dev_port));
-    if (tx_buffer == nullptr) {
-        panic("Failed to allocate TX buffer");
+    tx_packets(port, &m, 1);
+}
+
+// Send out this thread's TX batches and free the mbufs of completed TX
+// descriptors; returns the number of mbufs freed
+static int tx_reclaim()
+{
+    int ret = 0;
+    for (int port = 0; port < n_ports; port++) {
+        TxBatch *batch = tx_batches[port];
+        int freed;
+        if (batch != nullptr) {
+            tx_batch_lock(batch);
+            tx_batch_send(batch);
+            freed = rte_eth_tx_done_cleanup(dev_ports[port], tx_queue_id, 0);
+            tx_batch_unlock(batch);
+        } else {
+            freed = rte_eth_tx_done_cleanup(dev_ports[port], tx_queue_id, 0);
+        }
+        if (freed > 0) {
+            ret += freed;
+        }
     }
-    if (rte_eth_tx_buffer_init(tx_buffer, tx_buffer_size) != 0) {
-        panic("Failed to initialize TX buffer");
+    return ret;
+}
+
+/*
+ * Port index to send a packet on. With several ports, packets are spread
+ * by their addresses as over an aggregated link; the random source port of
+ * our packets makes this per request rather than per destination.
+ */
+static inline int select_tx_port(rte_be32_t dst_ip, rte_be16_t src_port, rte_be16_t dst_port)
+{
+    if (n_ports == 1) {
+        return 0;
+    }
+    uint32_t hash = dst_ip ^ (((uint32_t)src_port << 16) | dst_port);
+    hash ^= hash >> 16;
+    hash *= 0x45D9F3B;
+    hash ^= hash >> 16;
+    return hash % n_ports;
+}
+
+/*
+ * Shared info of an external buffer segment; holds a reference to the
+ * tail's owner until the NIC has transmitted (and the driver freed) it.
+ */
+struct ExtBufRef {
+    struct rte_mbuf_ext_shared_info shinfo;
+    std::shared_ptr<const void> owner;
+};
+
+static void ext_buf_free(void *addr, void *opaque)
+{
+    delete (ExtBufRef*)opaque;
+}
+
+static bool attach_ext_buf(struct rte_mbuf *m, const Message &msg)
+{
+    void *addr = (void*)msg.ext_buf();
+    rte_iova_t iova = rte_mem_virt2iova(addr);
+    if (iova == RTE_BAD_IOVA) {
+        return false;
     }
+    ExtBufRef *ref = new ExtBufRef();
+    ref->owner = msg.ext_owner();
+    ref->shinfo.free_cb = ext_buf_free;
+    ref->shinfo.fcb_opaque = ref;
+    rte_mbuf_ext_refcnt_set(&ref->shinfo, 1);
+    rte_pktmbuf_attach_extbuf(m, addr, iova, (uint16_t)msg.ext_len(), &ref->shinfo);
+    m->data_len = (uint16_t)msg.ext_len();
+    m->pkt_len = msg.ext_len();
+    return true;
 }
 
 static int transport_thread_(void *arg)
 {
     struct TransportArg *targ = (struct TransportArg*)arg;
     rx_queue_id = targ->rx_queue_id;
+    rx_dev_port = targ->dev_port;
     tx_queue_id = targ->tx_queue_id;
     rand_port = rand() % RAND_PORT_MAX;
     if (use_tx_buffer) {
-        tx_buffer_init(targ->dev_port);
+        tx_batches_create(tx_queue_id);
     }
     targ->transport->transport_thread(targ->tid);
     if (use_tx_buffer) {
-        rte_free(tx_buffer);
+        tx_batches_flush();
+        for (int port = 0; port < n_ports; port++) {
+            tx_batch_destroy(tx_batches[port]);
+            tx_batches[port] = nullptr;
+        }
     }
     return 0;
 }
 
+static int distributor_thread_(void *arg)
+{
+    DPDKTransport *transport = (DPDKTransport*)arg;
+    rx_queue_id = 0;
+    transport->distributor_thread();
+    return 0;
+}
+
 static int app_thread(void *arg)
 {
     struct AppArg *app_arg = (struct AppArg*)arg;
     tx_queue_id = app_arg->tx_queue_id;
     rand_port = rand() % RAND_PORT_MAX;
     if (use_tx_buffer) {
-        tx_buffer_init(app_arg->dev_port);
+        tx_batches_create(tx_queue_id);
+        for (int port = 0; port < n_ports; port++) {
+            app_tx_batches[app_arg->tid][port] = tx_batches[port];
+        }
     }
     app_arg->app->run_thread(app_arg->tid);
     if (use_tx_buffer) {
-        rte_free(tx_buffer);
+        tx_batches_flush();
+        for (int port = 0; port < n_ports; port++) {
+            tx_batches[port] = nullptr;
+        }
     }
     return 0;
 }
@@ -117,7 +393,12 @@ static void construct_arguments(const Configuration *config, int argc, char **ar
         sprintf(app_cores, "%d-%d", config->app_core, config->app_core+config->n_app_threads-1);
         cores.append(app_cores);
     }
-    sprintf(transport_cores, "%d-%d", config->transport_core, config->transport_core+config->n_transport_threads-1);
+    // Pipeline mode runs the distributor on the core after the transport threads
+    int n_transport_cores = config->n_transport_threads;
+    if (static_cast<const DPDKConfiguration*>(config)->pipeline_mode != DPDKConfiguration::PipelineMode::NONE) {
+        n_transport_cores++;
+    }
+    sprintf(transport_cores, "%d-%d", config->transport_core, config->transport_core+n_transport_cores-1);
     cores.append(",");
     cores.append(transport_cores);
     argv[2] = new char[cores.length()+1];
@@ -134,7 +415,7 @@ static void construct_arguments(const Configuration *config, int argc, char **ar
     }
 }
 
-static void generate_flow_rules(const Configuration *config, uint16_t dev_port)
+static void generate_flow_rules(const Configuration *config, uint16_t dev_port, int num_rx_queues)
 {
 
     {
@@ -183,8 +464,9 @@ static void generate_flow_rules(const Configuration *config, uint16_t dev_port)
         default:
             panic("Unreachable");
         }
-        // Each node gets one rx queue
-        uint16_t rx_queue_id = colocate_id;
+        // Each node gets one rx queue; nodes share queues if there are
+        // fewer queues than nodes
+        uint16_t rx_queue_id = colocate_id % num_rx_queues;
 
         /* Attributes */
         struct rte_flow_attr attr;
@@ -247,20 +529,62 @@ static void generate_flow_rules(const Configuration *config, uint16_t dev_port)
     }
 }
 
+// Socket of a port's memory; ports without NUMA information use ours
+static int port_socket(uint16_t dev_port)
+{
+    int socket = rte_eth_dev_socket_id(dev_port);
+    if (socket < 0 || socket >= RTE_MAX_NUMA_NODES) {
+        socket = rte_socket_id();
+    }
+    return socket;
+}
+
+/*
+ * Transport thread i polls RX queue i / n_ports of port i % n_ports, so each
+ * port has one queue per thread assigned to it. The pipeline distributor
+ * polls queue 0 of every port.
+ */
+static int port_rx_queues(const Configuration *config, bool pipeline, int port)
+{
+    if (pipeline) {
+        return 1;
+    }
+    return (config->n_transport_threads - port + n_ports - 1) / n_ports;
+}
+
 DPDKTransport::DPDKTransport(const Configuration *config, bool use_flow_api)
-    : Transport(config), use_flow_api(use_flow_api), status(STOPPED)
+    : Transport(config), use_flow_api(use_flow_api), use_multi_seg(false),
+    use_ext_buf(false), use_ip_cksum_offload(false), use_rx_intr(false),
+    status(STOPPED)
 {
-    uint16_t nb_ports, nb_rxd = RTE_RX_DESC, nb_txd = RTE_TX_DESC;
-    struct rte_eth_rxconf rxconf;
-    struct rte_eth_txconf txconf;
+    uint16_t nb_ports;
     struct rte_eth_conf port_conf;
     struct rte_eth_dev_info dev_info;
 
     // Initialize
     const DPDKAddress *addr = static_cast<const DPDKAddress*>(config->my_address());
-    this->dev_port = addr->dev_port;
+    if (addr->dev_ports.empty() || addr->dev_ports.size() > MAX_PORTS) {
+        panic("A node uses 1 to %d DPDK ports", MAX_PORTS);
+    }
+    n_ports = addr->dev_ports.size();
+    for (int port = 0; port < n_ports; port++) {
+        dev_ports[port] = addr->dev_ports[port];
+    }
     use_tx_buffer = static_cast<const DPDKConfiguration*>(config)->use_tx_buffer;
     tx_buffer_size = static_cast<const DPDKConfiguration*>(config)->tx_buffer_size;
+    if (use_tx_buffer && tx_buffer_size == 0) {
+        panic("TX batch size must be positive");
+    }
+    this->pipeline_mode = static_cast<const DPDKConfiguration*>(config)->pipeline_mode;
+    if (this->pipeline_mode == DPDKConfiguration::PipelineMode::NONE &&
+        config->n_transport_threads < n_ports) {
+        panic("Each DPDK port needs at least one transport thread");
+    }
+    this->idle_polls = static_cast<const DPDKConfiguration*>(config)->idle_polls;
+    if (this->idle_polls > 0) {
+        this->idle_stats.resize(config->n_transport_threads);
+        memset(this->idle_stats.data(), 0, this->idle_stats.size() * sizeof(IdleStats));
+    }
 
     this->argc = 4 + (addr->blacklist.size() * 2);
     this->argv = new char*[this->argc];
@@ -269,45 +593,169 @@ DPDKTransport::DPDKTransport(const Configuration *config, bool use_flow_api)
         panic("rte_eal_init failed");
     }
 
+    tx_flush_cycles = rte_get_tsc_hz() / 1000000 *
+        static_cast<const DPDKConfiguration*>(config)->tx_flush_us;
+
     if ((nb_ports = rte_eth_dev_count_avail()) == 0) {
         panic("No available Ethernet ports");
     }
+    for (int port = 0; port < n_ports; port++) {
+        if (!rte_eth_dev_is_valid_port(dev_ports[port])) {
+            panic("DPDK port %u is not available", dev_ports[port]);
+        }
+    }
+
+    // Initialize mempools: one per NUMA socket hosting our lcores or ports.
+    // A pool backs the RX queues of the ports on its socket, which fill from
+    // it whichever socket polls them, and the TX queues of the threads on
+    // its socket, which allocate from their own socket's pool.
+    this->nic_socket = port_socket(dev_ports[0]);
+    int n_transport_cores = config->n_transport_threads;
+    if (this->pipeline_mode != DPDKConfiguration::PipelineMode::NONE) {
+        n_transport_cores++;
+    }
+    unsigned socket_threads[RTE_MAX_NUMA_NODES] = {0};
+    unsigned socket_rx_queues[RTE_MAX_NUMA_NODES] = {0};
+    for (int i = 0; i < config->n_app_threads; i++) {
+        socket_threads[rte_lcore_to_socket_id(config->app_core + i)]++;
+    }
+    for (int i = 0; i < n_transport_cores; i++) {
+        socket_threads[rte_lcore_to_socket_id(config->transport_core + i)]++;
+    }
+    for (int port = 0; port < n_ports; port++) {
+        int socket = port_socket(dev_ports[port]);
+        socket_rx_queues[socket] += port_rx_queues(config,
+                                                   this->pipeline_mode != DPDKConfiguration::PipelineMode::NONE,
+                                                   port);
+        // Threads outside our lcores use the NIC's pool
+        if (socket_threads[socket] == 0) {
+            socket_threads[socket] = 1;
+        }
+    }
+    this->pktmbuf_pools.resize(RTE_MAX_NUMA_NODES, nullptr);
+    for (int socket = 0; socket < RTE_MAX_NUMA_NODES; socket++) {
+        if (socket_threads[socket] == 0) {
+            continue;
+        }
+        MbufPool *mp = new MbufPool();
+        // Each RX queue is refilled by its polling thread, through that
+        // lcore's cache of the pool
+        mp->size = socket_rx_queues[socket] * (RTE_RX_DESC + MAX_PKT_BURST + MEMPOOL_CACHE_SIZE) +
+            socket_threads[socket] * (n_ports * RTE_TX_DESC + MAX_PKT_BURST + MEMPOOL_CACHE_SIZE);
+        mp->alloc_failures = 0;
+        mp->peak_in_use = 0;
+        char pool_name[32];
+        sprintf(pool_name, "pktmbuf_pool_%d", socket);
+        mp->pool = rte_pktmbuf_pool_create(pool_name,
+                                           mp->size,
+                                           MEMPOOL_CACHE_SIZE,
+                                           0,
+                                           RTE_MBUF_DEFAULT_BUF_SIZE,
+                                           socket);
+        if (mp->pool == nullptr) {
+            panic("rte_pktmbuf_pool_create failed");
+        }
+        this->pktmbuf_pools[socket] = mp;
+    }
 
-    // Initialize mempool
-    unsigned nb_mbufs = (config->n_app_threads + config->n_transport_threads) * (nb_rxd + nb_txd + MAX_PKT_BURST + MEMPOOL_CACHE_SIZE);
-    char pool_name[32];
-    sprintf(pool_name, "pktmbuf_pool");
-    this->pktmbuf_pool = rte_pktmbuf_pool_create(pool_name,
-                                                 nb_mbufs,
-                                                 MEMPOOL_CACHE_SIZE,
-                                                 0,
-                                                 RTE_MBUF_DEFAULT_BUF_SIZE,
-                                                 rte_socket_id());
-    if (this->pktmbuf_pool == nullptr) {
-        panic("rte_pktmbuf_pool_create failed");
+    // Pipeline mode: one SP/SC ring from the distributor to each worker
+    if (this->pipeline_mode != DPDKConfiguration::PipelineMode::NONE) {
+        for (int tid = 0; tid < config->n_transport_threads; tid++) {
+            char ring_name[32];
+            sprintf(ring_name, "worker_ring_%d", tid);
+            struct rte_ring *ring = rte_ring_create(ring_name,
+                                                    WORKER_RING_SIZE,
+                                                    rte_socket_id(),
+                                                    RING_F_SP_ENQ | RING_F_SC_DEQ);
+            if (ring == nullptr) {
+                panic("rte_ring_create failed");
+            }
+            this->worker_rings.push_back(ring);
+        }
+        this->pipeline_stats.resize(config->n_transport_threads);
+        memset(this->pipeline_stats.data(), 0, this->pipeline_stats.size() * sizeof(PipelineStats));
     }
 
-    // Initialize port
+    // Initialize ports
     memset(&port_conf, 0, sizeof(port_conf));
     port_conf.txmode.mq_mode = ETH_MQ_TX_NONE;
     port_conf.rx_adv_conf.rss_conf.rss_key = nullptr;
     port_conf.rx_adv_conf.rss_conf.rss_hf = ETH_RSS_HF;
 
-    if (rte_eth_dev_info_get(this->dev_port, &dev_info) != 0) {
-        panic("rte_eth_dev_info_get failed");
+    // Packets are built the same way whichever port sends them: use only
+    // the offloads every port has
+    uint64_t tx_offload_capa = ~0ULL;
+    for (int port = 0; port < n_ports; port++) {
+        if (rte_eth_dev_info_get(dev_ports[port], &dev_info) != 0) {
+            panic("rte_eth_dev_info_get failed");
+        }
+        tx_offload_capa &= dev_info.tx_offload_capa;
+    }
+    // MBUF_FAST_FREE is not enabled: encode-in-place messages and
+    // multi-destination payloads are transmitted with a reference count above 1
+    this->use_multi_seg = (tx_offload_capa & DEV_TX_OFFLOAD_MULTI_SEGS) != 0;
+    if (this->use_multi_seg) {
+        port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MULTI_SEGS;
+    }
+    this->use_ip_cksum_offload = (tx_offload_capa & DEV_TX_OFFLOAD_IPV4_CKSUM) != 0;
+    if (this->use_ip_cksum_offload) {
+        port_conf.txmode.offloads |= DEV_TX_OFFLOAD_IPV4_CKSUM;
     }
-    if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE) {
-        port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MBUF_FAST_FREE;
+    init_header_template();
+    // Message tails (stored values) live in ordinary heap memory, which the
+    // NIC can only DMA from when IOVAs are virtual addresses
+    this->use_ext_buf = this->use_multi_seg && rte_eal_iova_mode() == RTE_IOVA_VA;
+    if (this->use_ext_buf) {
+        info("Sending stored values as external buffer segments");
     }
-    int num_rx_queues = config->n_transport_threads;
-    int num_tx_queues = config->n_app_threads + config->n_transport_threads;
-    if (rte_eth_dev_configure(this->dev_port,
+    // Idle transport threads wait for RX interrupts if the device has them,
+    // and sleep otherwise
+    this->use_rx_intr = this->idle_polls > 0 && this->worker_rings.empty();
+    port_conf.intr_conf.rxq = this->use_rx_intr ? 1 : 0;
+    for (int port = 0; port < n_ports; port++) {
+        init_port(port,
+                  port_conf,
+                  port_rx_queues(config, !this->worker_rings.empty(), port),
+                  config->n_app_threads + config->n_transport_threads);
+    }
+    if (n_ports > 1) {
+        info("Using %d DPDK ports", n_ports);
+    }
+}
+
+void DPDKTransport::init_port(int port,
+                              const struct rte_eth_conf &conf,
+                              int num_rx_queues,
+                              int num_tx_queues)
+{
+    uint16_t dev_port = dev_ports[port];
+    uint16_t nb_rxd = RTE_RX_DESC, nb_txd = RTE_TX_DESC;
+    struct rte_eth_conf port_conf = conf;
+    struct rte_eth_rxconf rxconf;
+    struct rte_eth_txconf txconf;
+    struct rte_eth_dev_info dev_info;
+    int socket = port_socket(dev_port);
+
+    if (rte_eth_dev_info_get(dev_port, &dev_info) != 0) {
+        panic("rte_eth_dev_info_get failed");
+    }
+    if (rte_eth_dev_configure(dev_port,
                               num_rx_queues,
                               num_tx_queues,
                               &port_conf) < 0) {
-        panic("rte_eth_dev_configure failed");
+        if (port_conf.intr_conf.rxq == 0) {
+            panic("rte_eth_dev_configure failed");
+        }
+        info("Port %u: RX interrupts not supported, idle transport threads will sleep", dev_port);
+        port_conf.intr_conf.rxq = 0;
+        if (rte_eth_dev_configure(dev_port,
+                                  num_rx_queues,
+                                  num_tx_queues,
+                                  &port_conf) < 0) {
+            panic("rte_eth_dev_configure failed");
+        }
     }
-    if (rte_eth_dev_adjust_nb_rx_tx_desc(this->dev_port, &nb_rxd, &nb_txd) < 0) {
+    if (rte_eth_dev_adjust_nb_rx_tx_desc(dev_port, &nb_rxd, &nb_txd) < 0) {
         panic("rte_eth_dev_adjust_nb_rx_tx_desc failed");
     }
 
@@ -315,12 +763,12 @@ DPDKTransport::DPDKTransport(const Configuration *config, bool use_flow_api)
     rxconf = dev_info.default_rxconf;
     rxconf.offloads = port_conf.rxmode.offloads;
     for (int qid = 0; qid < num_rx_queues; qid++) {
-        if (rte_eth_rx_queue_setup(this->dev_port,
+        if (rte_eth_rx_queue_setup(dev_port,
                                    qid,
                                    nb_rxd,
-                                   rte_eth_dev_socket_id(this->dev_port),
+                                   socket,
                                    &rxconf,
-                                   this->pktmbuf_pool) < 0) {
+                                   this->pktmbuf_pools[socket]->pool) < 0) {
             panic("rte_eth_rx_queue_setup failed");
         }
     }
@@ -329,35 +777,48 @@ DPDKTransport::DPDKTransport(const Configuration *config, bool use_flow_api)
     txconf = dev_info.default_txconf;
     txconf.offloads = port_conf.txmode.offloads;
     for (int qid = 0; qid < num_tx_queues; qid++) {
-        if (rte_eth_tx_queue_setup(this->dev_port,
+        if (rte_eth_tx_queue_setup(dev_port,
                                    qid,
                                    nb_txd,
-                                   rte_eth_dev_socket_id(this->dev_port),
+                                   socket,
                                    &txconf) < 0) {
             panic("rte_eth_tx_queue_setup failed");
         }
     }
 
     // Start device
-    if (rte_eth_dev_start(this->dev_port) < 0) {
+    if (rte_eth_dev_start(dev_port) < 0) {
         panic("rte_eth_dev_start failed");
     }
-    if (rte_eth_promiscuous_enable(this->dev_port) != 0) {
+    if (rte_eth_promiscuous_enable(dev_port) != 0) {
         panic("rte_eth_promiscuous_enable failed");
     }
 
     // Create flow rules
     if (this->use_flow_api) {
-        generate_flow_rules(config, this->dev_port);
+        generate_flow_rules(this->config, dev_port, num_rx_queues);
     }
 }
 
 DPDKTransport::~DPDKTransport()
 {
     if (rte_eal_process_type() == RTE_PROC_PRIMARY) {
-        rte_flow_flush(this->dev_port, nullptr);
-        rte_eth_dev_stop(this->dev_port);
-        rte_eth_dev_close(this->dev_port);
+        for (int port = 0; port < n_ports; port++) {
+            rte_flow_flush(dev_ports[port], nullptr);
+            rte_eth_dev_stop(dev_ports[port]);
+            rte_eth_dev_close(dev_ports[port]);
+        }
+    }
+    for (MbufPool *mp : this->pktmbuf_pools) {
+        delete mp;
+    }
+    for (int tid = 0; tid < this->config->n_app_threads; tid++) {
+        for (int port = 0; port < n_ports; port++) {
+            TxBatch *batch = app_tx_batches[tid][port].exchange(nullptr);
+            if (batch != nullptr) {
+                tx_batch_destroy(batch);
+            }
+        }
     }
     if (this->argv != nullptr) {
         for (int i = 0; i < this->argc; i++) {
@@ -369,95 +830,212 @@ DPDKTransport::~DPDKTransport()
 
 void DPDKTransport::send_message(const Message &msg, const Address &addr)
 {
-    struct rte_mbuf *m;
-    struct rte_ether_hdr *ether_hdr;
-    struct rte_ipv4_hdr *ip_hdr;
-    struct rte_udp_hdr *udp_hdr;
-    void *dgram;
+    struct rte_mbuf *m = (struct rte_mbuf*)msg.tdata();
     const DPDKAddress &dst_addr = static_cast<const DPDKAddress&>(addr);
-    const DPDKAddress &src_addr = static_cast<const DPDKAddress&>(*this->config->my_address());
 
-    /* Allocate mbuf */
-    m = rte_pktmbuf_alloc(this->pktmbuf_pool);
+    if (msg.ext_len() > 0) {
+        send_ext_message(msg, dst_addr);
+        return;
+    }
+
+    if (m != nullptr && rte_mbuf_refcnt_read(m) == 1) {
+        /*
+         * Message was encoded in place into one of our mbufs (and is not
+         * still queued from an earlier send): write the headers into the room
+         * reserved in front of the payload. The extra reference keeps the
+         * mbuf alive for the Message, which may be sent again.
+         */
+        m->data_off = (uint16_t)((char*)msg.buf() - (char*)m->buf_addr - FRAME_HDR_LEN);
+        m->data_len = FRAME_HDR_LEN + msg.len();
+        m->pkt_len = m->data_len;
+        rte_mbuf_refcnt_update(m, 1);
+    } else {
+        /* Allocate mbuf */
+        if ((m = alloc_mbuf()) == nullptr) {
+            // Pool exhausted: drop, as a full NIC queue would
+            return;
+        }
+        char *dgram = rte_pktmbuf_append(m, FRAME_HDR_LEN + msg.len());
+        if (dgram == nullptr) {
+            panic("Failed to allocate data gram");
+        }
+        memcpy(dgram + FRAME_HDR_LEN, msg.buf(), msg.len());
+    }
+    int port = fill_headers(m, rte_pktmbuf_mtod(m, char*), dst_addr, msg.len());
+    tx_packet(port, m);
+}
+
+void DPDKTransport::send_ext_message(const Message &msg, const DPDKAddress &dst_addr)
+{
+    /*
+     * The head (e.g. a reply header) is copied into a fresh header mbuf,
+     * never chained behind the Message's own mbuf, which may be sent again.
+     * Large tails are attached as an external buffer segment; small ones
+     * are cheaper to copy.
+     */
+    struct rte_mbuf *tail = nullptr;
+    if (this->use_ext_buf && msg.ext_len() >= EXT_BUF_MIN_LEN &&
+        (tail = alloc_mbuf()) != nullptr && !attach_ext_buf(tail, msg)) {
+        rte_pktmbuf_free(tail);
+        tail = nullptr;
+    }
+    size_t copy_len = tail == nullptr ? msg.total_len() : msg.len();
+
+    struct rte_mbuf *m = alloc_mbuf();
     if (m == nullptr) {
-        panic("Failed to allocate rte_mbuf");
-    }
-    /* Ethernet header */
-    ether_hdr = (struct rte_ether_hdr*)rte_pktmbuf_append(m, ETHER_HDR_LEN);
-    if (ether_hdr == nullptr) {
-        panic("Failed to allocate Ethernet header");
-    }
-    ether_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
-    memcpy(&ether_hdr->d_addr, &dst_addr.ether_addr, sizeof(struct rte_ether_addr));
-    memcpy(&ether_hdr->s_addr, &src_addr.ether_addr, sizeof(struct rte_ether_addr));
-    /* IP header */
-    ip_hdr = (struct rte_ipv4_hdr*)rte_pktmbuf_append(m, IPV4_HDR_SIZE * RTE_IPV4_IHL_MULTIPLIER);
-    if (ip_hdr == nullptr) {
-        panic("Failed to allocated IP header");
-    }
-    ip_hdr->version_ihl = (IPVERSION << 4) | IPV4_HDR_SIZE;
-    ip_hdr->type_of_service = 0;
-    ip_hdr->total_length = rte_cpu_to_be_16(IPV4_HDR_SIZE * RTE_IPV4_IHL_MULTIPLIER +
-                                            sizeof(struct rte_udp_hdr) +
-                                            msg.len());
-    ip_hdr->packet_id = 0;
-    ip_hdr->fragment_offset = 0;
-    ip_hdr->time_to_live = IPV4_TTL;
-    ip_hdr->next_proto_id = IPPROTO_UDP;
-    ip_hdr->hdr_checksum = 0;
-    ip_hdr->src_addr = src_addr.ip_addr;
-    ip_hdr->dst_addr = dst_addr.ip_addr;
-    ip_hdr->hdr_checksum = rte_ipv4_cksum(ip_hdr);
-    /* UDP header */
-    udp_hdr = (struct rte_udp_hdr*)rte_pktmbuf_append(m, sizeof(struct rte_udp_hdr));
-    if (udp_hdr == nullptr) {
-        panic("Failed to allocate UDP header");
+        if (tail != nullptr) {
+            rte_pktmbuf_free(tail);
+        }
+        return;
     }
-    // Use random src port for RSS
-    udp_hdr->src_port = RAND_PORT_BASE + (rand_port++ % RAND_PORT_MAX);
-    udp_hdr->dst_port = dst_addr.udp_port;
-    udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct rte_udp_hdr) + msg.len());
-    udp_hdr->dgram_cksum = 0;
-    /* Datagram */
-    dgram = rte_pktmbuf_append(m, msg.len());
+    char *dgram = rte_pktmbuf_append(m, FRAME_HDR_LEN + copy_len);
     if (dgram == nullptr) {
         panic("Failed to allocate data gram");
     }
-    memcpy(dgram, msg.buf(), msg.len());
-    /* Send packet */
-    if (use_tx_buffer) {
-        rte_eth_tx_buffer(this->dev_port, tx_queue_id, tx_buffer, m);
+    if (tail == nullptr) {
+        msg.copy_to(dgram + FRAME_HDR_LEN);
     } else {
-        if (rte_eth_tx_burst(this->dev_port, tx_queue_id, &m, 1) < 1) {
-            rte_pktmbuf_free(m);
+        memcpy(dgram + FRAME_HDR_LEN, msg.buf(), msg.len());
+        m->next = tail;
+        m->nb_segs = 2;
+        m->pkt_len += tail->pkt_len;
+    }
+    int port = fill_headers(m, dgram, dst_addr, msg.total_len());
+    tx_packet(port, m);
+}
+
+void DPDKTransport::send_messages(const Message &msg, const std::vector<const Address*> &addrs)
+{
+    if (!this->use_multi_seg || addrs.size() < 2 || msg.ext_len() > 0) {
+        Transport::send_messages(msg, addrs);
+        return;
+    }
+
+    uint16_t n = addrs.size();
+    struct rte_mbuf *pkts[n_ports][n];
+    uint16_t n_port_pkts[n_ports];
+    struct rte_mbuf *payload = (struct rte_mbuf*)msg.tdata();
+
+    /*
+     * All packets share one payload segment (by reference count); each
+     * destination only gets its own header mbuf chained in front of it.
+     */
+    if (payload != nullptr && rte_mbuf_refcnt_read(payload) == 1) {
+        payload->data_off = (uint16_t)((char*)msg.buf() - (char*)payload->buf_addr);
+        payload->data_len = msg.len();
+        payload->pkt_len = msg.len();
+        rte_mbuf_refcnt_update(payload, n);
+    } else {
+        if ((payload = alloc_mbuf()) == nullptr) {
+            return;
+        }
+        char *dgram = rte_pktmbuf_append(payload, msg.len());
+        if (dgram == nullptr) {
+            panic("Failed to allocate data gram");
+        }
+        memcpy(dgram, msg.buf(), msg.len());
+        rte_mbuf_refcnt_update(payload, n - 1);
+    }
+    uint16_t n_pkts;
+    memset(n_port_pkts, 0, sizeof(n_port_pkts));
+    for (n_pkts = 0; n_pkts < n; n_pkts++) {
+        struct rte_mbuf *hdr = alloc_mbuf();
+        if (hdr == nullptr) {
+            // Drop the remaining destinations' references to the payload
+            for (uint16_t i = n_pkts; i < n; i++) {
+                rte_pktmbuf_free(payload);
+            }
+            break;
+        }
+        char *frame = rte_pktmbuf_append(hdr, FRAME_HDR_LEN);
+        if (frame == nullptr) {
+            panic("Failed to allocate packet header");
+        }
+        int port = fill_headers(hdr,
+                                frame,
+                                static_cast<const DPDKAddress&>(*addrs[n_pkts]),
+                                msg.len());
+        hdr->next = payload;
+        hdr->nb_segs = 2;
+        hdr->pkt_len += msg.len();
+        pkts[port][n_port_pkts[port]++] = hdr;
+    }
+    for (int port = 0; port < n_ports; port++) {
+        if (n_port_pkts[port] > 0) {
+            tx_packets(port, pkts[port], n_port_pkts[port]);
         }
     }
 }
 
 void DPDKTransport::send_raw(const void *buf, void *tdata)
+{
+    struct rte_mbuf *m = (struct rte_mbuf*)tdata;
+    struct rte_ipv4_hdr *ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr*, ETHER_HDR_LEN);
+    size_t ip_hdr_len = (ip_hdr->version_ihl & RTE_IPV4_HDR_IHL_MASK) * RTE_IPV4_IHL_MULTIPLIER;
+    if (this->use_ip_cksum_offload) {
+        ip_hdr->hdr_checksum = 0;
+        m->l2_len = ETHER_HDR_LEN;
+        m->l3_len = ip_hdr_len;
+        m->ol_flags |= PKT_TX_IPV4 | PKT_TX_IP_CKSUM;
+    }
+    int port = 0;
+    if (n_ports > 1) {
+        const struct rte_udp_hdr *udp_hdr =
+            (const struct rte_udp_hdr*)((char*)ip_hdr + ip_hdr_len);
+        port = select_tx_port(ip_hdr->dst_addr, udp_hdr->src_port, udp_hdr->dst_port);
+    }
+    tx_packet(port, m);
+}
+
+bool DPDKTransport::raw_ip_checksum_offload() const
+{
+    return this->use_ip_cksum_offload;
+}
+
+void *DPDKTransport::alloc_message_buffer(size_t len, void *&tdata)
 {
     struct rte_mbuf *m;
 
-    m = (struct rte_mbuf*)tdata;
-    if (use_tx_buffer) {
-        rte_eth_tx_buffer(this->dev_port, tx_queue_id, tx_buffer, m);
+    // Payload goes after room for the Ethernet/IP/UDP headers, so that
+    // send_message does not need to copy it
+    if (RTE_PKTMBUF_HEADROOM + FRAME_HDR_LEN + len > rte_pktmbuf_data_room_size(local_pool()->pool) ||
+        (m = alloc_mbuf()) == nullptr) {
+        return Transport::alloc_message_buffer(len, tdata);
+    }
+    tdata = m;
+    return rte_pktmbuf_mtod_offset(m, void*, FRAME_HDR_LEN);
+}
+
+void DPDKTransport::free_message_buffer(void *buf, size_t len, void *tdata)
+{
+    if (tdata != nullptr) {
+        rte_pktmbuf_free((struct rte_mbuf*)tdata);
     } else {
-        if (rte_eth_tx_burst(this->dev_port, tx_queue_id, &m, 1) < 1) {
-            rte_pktmbuf_free(m);
-        }
+        Transport::free_message_buffer(buf, len, tdata);
     }
 }
 
 void DPDKTransport::run(void)
 {
     this->status = RUNNING;
-    // Start all transport threads
-    for (int tid = 1; tid < this->config->n_transport_threads; tid++) {
+    // Transport thread i polls RX queue i / n_ports of port i % n_ports (see
+    // port_rx_queues); pipeline workers poll worker ring i instead
+    for (int tid = 0; tid < this->config->n_transport_threads; tid++) {
         transport_args[tid].transport = this;
         transport_args[tid].tid = this->config->n_app_threads + tid;
-        transport_args[tid].rx_queue_id = tid;
+        transport_args[tid].rx_queue_id = this->worker_rings.empty() ? tid / n_ports : tid;
         transport_args[tid].tx_queue_id = tid;
-        transport_args[tid].dev_port = this->dev_port;
+        transport_args[tid].dev_port = dev_ports[tid % n_ports];
+        unsigned core_socket = rte_lcore_to_socket_id(this->config->transport_core + tid);
+        if (this->worker_rings.empty() &&
+            (int)core_socket != port_socket(transport_args[tid].dev_port)) {
+            info("Transport thread %d polls port %u on a remote NUMA socket",
+                 tid, transport_args[tid].dev_port);
+        }
+    }
+
+    // Start all transport threads
+    for (int tid = 1; tid < this->config->n_transport_threads; tid++) {
         if (rte_eal_remote_launch(transport_thread_,
                                   &transport_args[tid],
                                   this->config->transport_core + tid) != 0) {
@@ -465,11 +1043,13 @@ void DPDKTransport::run(void)
         }
     }
 
-    transport_args[0].transport = this;
-    transport_args[0].tid = this->config->n_app_threads;
-    transport_args[0].rx_queue_id = 0;
-    transport_args[0].tx_queue_id = 0;
-    transport_args[0].dev_port = this->dev_port;
+    if (!this->worker_rings.empty()) {
+        if (rte_eal_remote_launch(distributor_thread_,
+                                  this,
+                                  this->config->transport_core + this->config->n_transport_threads) != 0) {
+            panic("distributor thread rte_eal_remote_launch failed");
+        }
+    }
 
     if (this->config->n_app_threads > 0) {
         if (rte_eal_remote_launch(transport_thread_,
@@ -494,6 +1074,16 @@ void DPDKTransport::wait(void)
             panic("rte_eal_wait_lcore failed on transport core");
         }
     }
+    if (!this->worker_rings.empty()) {
+        if (rte_eal_wait_lcore(this->config->transport_core + this->config->n_transport_threads) < 0) {
+            panic("rte_eal_wait_lcore failed on distributor core");
+        }
+        dump_pipeline_stats();
+    }
+    if (this->idle_polls > 0) {
+        dump_idle_stats();
+    }
+    dump_pool_stats();
 }
 
 void DPDKTransport::run_app_threads(Application *app)
@@ -504,7 +1094,6 @@ void DPDKTransport::run_app_threads(Application *app)
         app_args[tid].app = app;
         app_args[tid].tid = tid;
         app_args[tid].tx_queue_id = this->config->n_transport_threads + tid;
-        app_args[tid].dev_port = this->dev_port;
         if (rte_eal_remote_launch(app_thread,
                                   &app_args[tid],
                                   this->config->app_core + tid) != 0) {
@@ -516,7 +1105,6 @@ void DPDKTransport::run_app_threads(Application *app)
     app_args[0].app = app;
     app_args[0].tid = 0;
     app_args[0].tx_queue_id = this->config->n_transport_threads;
-    app_args[0].dev_port = this->dev_port;
     app_thread(&app_args[0]);
 
     // Wait for app slave cores to finish
@@ -531,56 +1119,416 @@ void DPDKTransport::transport_thread(int tid)
 {
     uint16_t n_rx, i;
     struct rte_mbuf *pkt_burst[MAX_PKT_BURST];
-    struct rte_mbuf *m;
-    size_t offset;
+    uint64_t processed = 0, polls = 0, next_sweep_tsc = 0, empty_polls = 0;
+    // Transport thread 0 flushes app threads' expired TX batches
+    bool sweep_tx = tx_batches[0] != nullptr && tid == this->config->n_app_threads;
+    IdleStats idle;
+    memset(&idle, 0, sizeof(idle));
+    idle.sleep_us = 1;
+    idle.use_intr = this->use_rx_intr &&
+        rte_eth_dev_rx_intr_ctl_q(rx_dev_port,
+                                  rx_queue_id,
+                                  RTE_EPOLL_PER_THREAD,
+                                  RTE_INTR_EVENT_ADD,
+                                  nullptr) == 0;
+    uint64_t start_tsc = rte_rdtsc();
+
+    while (this->status == DPDKTransport::RUNNING) {
+        if (++polls % POOL_SAMPLE_INTERVAL == 0) {
+            sample_pool_occupancy();
+        }
+        if (sweep_tx) {
+            uint64_t now = rte_rdtsc();
+            if (now >= next_sweep_tsc) {
+                app_tx_batches_flush_expired(this->config->n_app_threads, now);
+                next_sweep_tsc = now + tx_flush_cycles / 2;
+            }
+        }
+        if (this->worker_rings.empty()) {
+            n_rx = rte_eth_rx_burst(rx_dev_port,
+                                    rx_queue_id,
+                                    pkt_burst,
+                                    MAX_PKT_BURST);
+        } else {
+            // Pipeline worker: rx_queue_id indexes the worker ring
+            n_rx = rte_ring_sc_dequeue_burst(this->worker_rings[rx_queue_id],
+                                             (void**)pkt_burst,
+                                             MAX_PKT_BURST,
+                                             nullptr);
+        }
+        for (i = 0; i < n_rx; i++) {
+            process_packet(pkt_burst[i], tid);
+        }
+        if (n_rx > 0) {
+            tx_batches_flush();
+        }
+        processed += n_rx;
+        if (this->idle_polls > 0) {
+            if (n_rx > 0) {
+                empty_polls = 0;
+                idle.sleep_us = 1;
+            } else if (++empty_polls >= this->idle_polls) {
+                uint64_t max_wait = UINT64_MAX;
+                if (sweep_tx) {
+                    // App threads' batches are only flushed from here: wake
+                    // up for the earliest deadline, and for the next sweep
+                    // in case app threads queue more packets meanwhile
+                    uint64_t now = rte_rdtsc();
+                    uint64_t deadline = app_tx_batches_flush_expired(this->config->n_app_threads, now);
+                    next_sweep_tsc = std::min(deadline, now + tx_flush_cycles / 2);
+                    max_wait = next_sweep_tsc > now ? next_sweep_tsc - now : 0;
+                }
+                idle_wait(idle, max_wait);
+            }
+        }
+    }
+    if (!this->worker_rings.empty()) {
+        this->pipeline_stats[rx_queue_id].processed = processed;
+    }
+    if (this->idle_polls > 0) {
+        idle.total_cycles = rte_rdtsc() - start_tsc;
+        this->idle_stats[tid - this->config->n_app_threads] = idle;
+    }
+}
+
+void DPDKTransport::idle_wait(IdleStats &stats, uint64_t max_cycles)
+{
+    uint64_t start = rte_rdtsc();
+    uint64_t cycles_per_us = rte_get_tsc_hz() / 1000000;
+
+    if (max_cycles < cycles_per_us) {
+        return;
+    }
+    // rte_epoll_wait counts in milliseconds: shorter waits sleep
+    if (stats.use_intr && max_cycles >= cycles_per_us * 1000) {
+        struct rte_epoll_event event;
+        int timeout_ms = std::min<uint64_t>(IDLE_INTR_TIMEOUT_MS, max_cycles / (cycles_per_us * 1000));
+        rte_eth_dev_rx_intr_enable(rx_dev_port, rx_queue_id);
+        // A packet may have landed between the last poll and arming the
+        // interrupt
+        if (rte_eth_rx_descriptor_status(rx_dev_port, rx_queue_id, 0) != RTE_ETH_RX_DESC_DONE) {
+            if (rte_epoll_wait(RTE_EPOLL_PER_THREAD, &event, 1, timeout_ms) > 0) {
+                stats.intr_wakeups++;
+            }
+        }
+        rte_eth_dev_rx_intr_disable(rx_dev_port, rx_queue_id);
+    } else {
+        // Back off exponentially while the queue stays empty
+        unsigned sleep_us = std::min<uint64_t>(stats.sleep_us, max_cycles / cycles_per_us);
+        rte_delay_us_sleep(sleep_us);
+        uint64_t requested = cycles_per_us * sleep_us;
+        uint64_t slept = rte_rdtsc() - start;
+        if (slept > requested) {
+            stats.oversleep_cycles += slept - requested;
+        }
+        stats.timed_sleeps++;
+        stats.sleep_us = std::min(stats.sleep_us * 2, (unsigned)IDLE_SLEEP_MAX_US);
+    }
+    stats.sleeps++;
+    stats.sleep_cycles += rte_rdtsc() - start;
+}
+
+void DPDKTransport::dump_idle_stats() const
+{
+    double cycles_per_us = rte_get_tsc_hz() / 1000000.0;
+    for (size_t i = 0; i < this->idle_stats.size(); i++) {
+        const IdleStats &stats = this->idle_stats[i];
+        double util = stats.total_cycles > 0 ?
+            100.0 * (stats.total_cycles - stats.sleep_cycles) / stats.total_cycles : 0.0;
+        double avg_sleep = stats.sleeps > 0 ? stats.sleep_cycles / cycles_per_us / stats.sleeps : 0.0;
+        // A packet arriving during a timed sleep waits for the rest of it,
+        // plus the scheduler's wake-up delay
+        double avg_oversleep = stats.timed_sleeps > 0 ?
+            stats.oversleep_cycles / cycles_per_us / stats.timed_sleeps : 0.0;
+        if (stats.use_intr) {
+            // Waits shorter than the interrupt timeout's 1 ms granularity
+            // (e.g. for app TX deadlines) are timed sleeps
+            info("Transport thread %lu: CPU %.1f%% sleeps %lu (%lu woken by RX interrupt, %lu timed) avg sleep %.1f us avg timed wake-up delay %.1f us",
+                 i, util, stats.sleeps, stats.intr_wakeups, stats.timed_sleeps, avg_sleep, avg_oversleep);
+        } else {
+            info("Transport thread %lu: CPU %.1f%% sleeps %lu avg sleep %.1f us avg wake-up delay %.1f us",
+                 i, util, stats.sleeps, avg_sleep, avg_oversleep);
+        }
+    }
+}
+
+void DPDKTransport::distributor_thread()
+{
+    uint16_t n_rx, i;
+    unsigned worker, n_workers = this->worker_rings.size();
+    struct rte_mbuf *pkt_burst[MAX_PKT_BURST];
+    struct rte_mbuf *worker_pkts[n_workers][MAX_PKT_BURST];
+    unsigned n_worker_pkts[n_workers];
+    int port = 0;
 
     while (this->status == DPDKTransport::RUNNING) {
-        n_rx = rte_eth_rx_burst(this->dev_port,
+        // Poll the ports in turn
+        n_rx = rte_eth_rx_burst(dev_ports[port],
                                 rx_queue_id,
                                 pkt_burst,
                                 MAX_PKT_BURST);
+        port = (port + 1) % n_ports;
+        if (n_rx == 0) {
+            continue;
+        }
+        memset(n_worker_pkts, 0, sizeof(n_worker_pkts));
         for (i = 0; i < n_rx; i++) {
-            m = pkt_burst[i];
-            if (this->config->use_raw_transport) {
-                if (!this->receiver->receive_raw(rte_pktmbuf_mtod_offset(m, void*, 0),
-                                                 m,
-                                                 tid)) {
-                    rte_pktmbuf_free(m);
-                }
+            if (classify(pkt_burst[i], n_worker_pkts, worker)) {
+                worker_pkts[worker][n_worker_pkts[worker]++] = pkt_burst[i];
             } else {
-                /* Parse packet header */
-                struct rte_ether_hdr *ether_hdr;
-                struct rte_ipv4_hdr *ip_hdr;
-                struct rte_udp_hdr *udp_hdr;
-                offset = 0;
-                ether_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr*, offset);
-                offset += ETHER_HDR_LEN;
-                ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr*, offset);
-                offset += (ip_hdr->version_ihl & RTE_IPV4_HDR_IHL_MASK) * RTE_IPV4_IHL_MULTIPLIER;
-                udp_hdr = rte_pktmbuf_mtod_offset(m, struct rte_udp_hdr*, offset);
-                offset += sizeof(struct rte_udp_hdr);
-
-                if (this->use_flow_api || filter_packet(DPDKAddress(ether_hdr->d_addr,
-                                                                    ip_hdr->dst_addr,
-                                                                    udp_hdr->dst_port,
-                                                                    DEFAULT_PORT_ID))) {
-                    /* Construct source address */
-                    DPDKAddress addr(ether_hdr->s_addr,
-                                     ip_hdr->src_addr,
-                                     udp_hdr->src_port,
-                                     DEFAULT_PORT_ID);
-                    /* Upcall to transport receiver */
-                    Message msg(rte_pktmbuf_mtod_offset(m, void*, offset),
-                            rte_be_to_cpu_16(udp_hdr->dgram_len)-sizeof(struct rte_udp_hdr),
-                            false);
-                    this->receiver->receive_message(msg, addr, tid);
+                rte_pktmbuf_free(pkt_burst[i]);
+            }
+        }
+        for (worker = 0; worker < n_workers; worker++) {
+            PipelineStats &stats = this->pipeline_stats[worker];
+            if (n_worker_pkts[worker] > 0) {
+                unsigned n_enq = rte_ring_sp_enqueue_burst(this->worker_rings[worker],
+                                                           (void**)worker_pkts[worker],
+                                                           n_worker_pkts[worker],
+                                                           nullptr);
+                for (unsigned j = n_enq; j < n_worker_pkts[worker]; j++) {
+                    rte_pktmbuf_free(worker_pkts[worker][j]);
                 }
-                rte_pktmbuf_free(m);
+                stats.enqueued += n_enq;
+                stats.dropped += n_worker_pkts[worker] - n_enq;
             }
+            // Sample queue depth once per received burst
+            unsigned depth = rte_ring_count(this->worker_rings[worker]);
+            stats.depth_sum += depth;
+            stats.depth_samples++;
+            if (depth > stats.max_depth) {
+                stats.max_depth = depth;
+            }
+        }
+    }
+}
+
+void DPDKTransport::init_header_template()
+{
+    const DPDKAddress *src_addr = static_cast<const DPDKAddress*>(this->config->my_address());
+    FrameHeader &hdr = this->hdr_template;
+
+    static_assert(sizeof(FrameHeader) == FRAME_HDR_LEN, "Unexpected frame header size");
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.ether.ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+    memcpy(&hdr.ether.s_addr, &src_addr->ether_addr, sizeof(struct rte_ether_addr));
+    hdr.ip.version_ihl = (IPVERSION << 4) | IPV4_HDR_SIZE;
+    hdr.ip.time_to_live = IPV4_TTL;
+    hdr.ip.next_proto_id = IPPROTO_UDP;
+    hdr.ip.src_addr = src_addr->ip_addr;
+    // The checksum of a zero length, zero destination header; the actual
+    // values are added per packet (RFC 1624)
+    this->hdr_cksum_base = ~rte_ipv4_cksum(&hdr.ip);
+}
+
+int DPDKTransport::fill_headers(struct rte_mbuf *m,
+                                 char *hdr,
+                                 const DPDKAddress &dst_addr,
+                                 size_t payload_len)
+{
+    FrameHeader *frame = (FrameHeader*)hdr;
+
+    memcpy(frame, &this->hdr_template, sizeof(FrameHeader));
+    memcpy(&frame->ether.d_addr, &dst_addr.ether_addr, sizeof(struct rte_ether_addr));
+    frame->ip.total_length = rte_cpu_to_be_16(IPV4_HDR_SIZE * RTE_IPV4_IHL_MULTIPLIER +
+                                              sizeof(struct rte_udp_hdr) +
+                                              payload_len);
+    frame->ip.dst_addr = dst_addr.ip_addr;
+    if (this->use_ip_cksum_offload) {
+        m->l2_len = ETHER_HDR_LEN;
+        m->l3_len = IPV4_HDR_SIZE * RTE_IPV4_IHL_MULTIPLIER;
+        m->ol_flags |= PKT_TX_IPV4 | PKT_TX_IP_CKSUM;
+    } else {
+        uint32_t sum = this->hdr_cksum_base;
+        sum += frame->ip.total_length;
+        sum += (frame->ip.dst_addr & 0xFFFF) + (frame->ip.dst_addr >> 16);
+        frame->ip.hdr_checksum = ~cksum_fold(sum);
+    }
+    // Use random src port for RSS
+    frame->udp.src_port = RAND_PORT_BASE + (rand_port++ % RAND_PORT_MAX);
+    frame->udp.dst_port = dst_addr.udp_port;
+    frame->udp.dgram_len = rte_cpu_to_be_16(sizeof(struct rte_udp_hdr) + payload_len);
+    return select_tx_port(frame->ip.dst_addr, frame->udp.src_port, frame->udp.dst_port);
+}
+
+DPDKTransport::MbufPool *DPDKTransport::local_pool()
+{
+    // Threads allocate from their own socket's pool, falling back to the
+    // NIC's socket for threads not pinned to one of our lcores
+    if (pool_socket < 0) {
+        unsigned socket = rte_socket_id();
+        if (socket < this->pktmbuf_pools.size() && this->pktmbuf_pools[socket] != nullptr) {
+            pool_socket = socket;
+        } else {
+            pool_socket = this->nic_socket;
+        }
+    }
+    return this->pktmbuf_pools[pool_socket];
+}
+
+struct rte_mbuf *DPDKTransport::alloc_mbuf()
+{
+    MbufPool *mp = local_pool();
+    struct rte_mbuf *m = rte_pktmbuf_alloc(mp->pool);
+    if (m == nullptr) {
+        /*
+         * Backpressure: push out packets still held in this thread's TX
+         * batch and reclaim mbufs the NIC has finished transmitting, then
+         * retry once before the caller drops.
+         */
+        if (tx_reclaim() > 0) {
+            m = rte_pktmbuf_alloc(mp->pool);
+        }
+        if (m == nullptr) {
+            mp->alloc_failures++;
+        }
+    }
+    return m;
+}
+
+void DPDKTransport::sample_pool_occupancy()
+{
+    MbufPool *mp = local_pool();
+    unsigned in_use = rte_mempool_in_use_count(mp->pool);
+    unsigned peak = mp->peak_in_use.load(std::memory_order_relaxed);
+    while (in_use > peak &&
+           !mp->peak_in_use.compare_exchange_weak(peak, in_use, std::memory_order_relaxed)) {
+    }
+}
+
+void DPDKTransport::dump_pool_stats() const
+{
+    for (size_t socket = 0; socket < this->pktmbuf_pools.size(); socket++) {
+        const MbufPool *mp = this->pktmbuf_pools[socket];
+        if (mp == nullptr) {
+            continue;
+        }
+        info("mbuf pool socket %lu: size %u in use %u peak %u alloc failures %lu",
+             socket,
+             mp->size,
+             rte_mempool_in_use_count(mp->pool),
+             mp->peak_in_use.load(),
+             mp->alloc_failures.load());
+    }
+    for (int port = 0; port < n_ports; port++) {
+        struct rte_eth_stats stats;
+        if (rte_eth_stats_get(dev_ports[port], &stats) == 0) {
+            info("Port %u RX packets %lu TX packets %lu RX no mbuf %lu missed %lu",
+                 dev_ports[port], stats.ipackets, stats.opackets, stats.rx_nombuf, stats.imissed);
         }
     }
 }
 
+void DPDKTransport::process_packet(struct rte_mbuf *m, int tid)
+{
+    size_t offset;
+
+    if (this->config->use_raw_transport) {
+        if (!this->receiver->receive_raw(rte_pktmbuf_mtod_offset(m, void*, 0),
+                                         m,
+                                         tid)) {
+            rte_pktmbuf_free(m);
+        }
+    } else {
+        /* Parse packet header */
+        struct rte_ether_hdr *ether_hdr;
+        struct rte_ipv4_hdr *ip_hdr;
+        struct rte_udp_hdr *udp_hdr;
+        offset = 0;
+        ether_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr*, offset);
+        offset += ETHER_HDR_LEN;
+        ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr*, offset);
+        offset += (ip_hdr->version_ihl & RTE_IPV4_HDR_IHL_MASK) * RTE_IPV4_IHL_MULTIPLIER;
+        udp_hdr = rte_pktmbuf_mtod_offset(m, struct rte_udp_hdr*, offset);
+        offset += sizeof(struct rte_udp_hdr);
+
+        // In pipeline mode the distributor has already filtered the packet;
+        // colocated nodes still have to be told apart
+        TransportReceiver *receiver;
+        if (this->colocated_nodes.empty() &&
+            (this->use_flow_api || !this->worker_rings.empty())) {
+            receiver = this->receiver;
+        } else {
+            receiver = dispatch(DPDKAddress(ether_hdr->d_addr,
+                                            ip_hdr->dst_addr,
+                                            udp_hdr->dst_port,
+                                            DEFAULT_PORT_ID));
+        }
+        if (receiver != nullptr) {
+            /* Construct source address */
+            DPDKAddress addr(ether_hdr->s_addr,
+                             ip_hdr->src_addr,
+                             udp_hdr->src_port,
+                             DEFAULT_PORT_ID);
+            /* Upcall to transport receiver */
+            Message msg(rte_pktmbuf_mtod_offset(m, void*, offset),
+                    rte_be_to_cpu_16(udp_hdr->dgram_len)-sizeof(struct rte_udp_hdr),
+                    false);
+            receiver->receive_message(msg, addr, tid);
+        }
+        rte_pktmbuf_free(m);
+    }
+}
+
+bool DPDKTransport::classify(struct rte_mbuf *m, const unsigned *n_pending, unsigned &worker)
+{
+    unsigned n_workers = this->worker_rings.size();
+
+    if (!this->config->use_raw_transport) {
+        size_t offset = 0;
+        struct rte_ether_hdr *ether_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ether_hdr*, offset);
+        offset += ETHER_HDR_LEN;
+        struct rte_ipv4_hdr *ip_hdr = rte_pktmbuf_mtod_offset(m, struct rte_ipv4_hdr*, offset);
+        offset += (ip_hdr->version_ihl & RTE_IPV4_HDR_IHL_MASK) * RTE_IPV4_IHL_MULTIPLIER;
+        struct rte_udp_hdr *udp_hdr = rte_pktmbuf_mtod_offset(m, struct rte_udp_hdr*, offset);
+        offset += sizeof(struct rte_udp_hdr);
+
+        if (!this->use_flow_api && dispatch(DPDKAddress(ether_hdr->d_addr,
+                                                        ip_hdr->dst_addr,
+                                                        udp_hdr->dst_port,
+                                                        DEFAULT_PORT_ID)) == nullptr) {
+            return false;
+        }
+        if (this->pipeline_mode == DPDKConfiguration::PipelineMode::KEYHASH) {
+            uint32_t hash;
+            Message msg(rte_pktmbuf_mtod_offset(m, void*, offset),
+                        rte_be_to_cpu_16(udp_hdr->dgram_len)-sizeof(struct rte_udp_hdr),
+                        false);
+            if (this->receiver->flow_hash(msg, hash)) {
+                worker = hash % n_workers;
+                return true;
+            }
+        }
+    }
+
+    // Least loaded worker, counting the packets of this burst not yet
+    // enqueued to it
+    unsigned min_depth = rte_ring_count(this->worker_rings[0]) + n_pending[0];
+    worker = 0;
+    for (unsigned i = 1; i < n_workers && min_depth > 0; i++) {
+        unsigned depth = rte_ring_count(this->worker_rings[i]) + n_pending[i];
+        if (depth < min_depth) {
+            min_depth = depth;
+            worker = i;
+        }
+    }
+    return true;
+}
+
+void DPDKTransport::dump_pipeline_stats() const
+{
+    for (size_t i = 0; i < this->pipeline_stats.size(); i++) {
+        const PipelineStats &stats = this->pipeline_stats[i];
+        info("Pipeline worker %lu: enqueued %lu dropped %lu processed %lu avg depth %.2f max depth %u",
+             i,
+             stats.enqueued,
+             stats.dropped,
+             stats.processed,
+             stats.depth_samples > 0 ? (double)stats.depth_sum / stats.depth_samples : 0.0,
+             stats.max_depth);
+    }
+}
+
 bool DPDKTransport::filter_packet(const DPDKAddress &addr) const
 {
     const DPDKAddress *my_addr = static_cast<const DPDKAddress*>(this->config->my_address());
@@ -593,3 +1541,42 @@ bool DPDKTransport::filter_packet(const DPDKAddress &addr) const
     }
     return true;
 }
+
+static inline uint64_t colocated_key(rte_be32_t ip_addr, rte_be16_t udp_port)
+{
+    return ((uint64_t)ip_addr << 16) | udp_port;
+}
+
+void DPDKTransport::register_colocated_receiver(int colocate_id, TransportReceiver *receiver)
+{
+    if (this->config->node_type != Configuration::NodeType::SERVER) {
+        panic("Only servers can be colocated");
+    }
+    if (colocate_id < 0 || colocate_id >= this->config->n_colocate_nodes) {
+        panic("Invalid colocate id %d", colocate_id);
+    }
+    ColocatedNode node;
+    node.addr = static_cast<const DPDKAddress*>(
+        this->config->node_addresses.at(this->config->rack_id).at(this->config->node_id + colocate_id));
+    node.receiver = receiver;
+    uint64_t key = colocated_key(node.addr->ip_addr, node.addr->udp_port);
+    if (this->colocated_nodes.count(key) > 0) {
+        panic("Colocated nodes must have distinct IP address and UDP port pairs");
+    }
+    this->colocated_nodes[key] = node;
+}
+
+TransportReceiver *DPDKTransport::dispatch(const DPDKAddress &addr) const
+{
+    if (this->colocated_nodes.empty()) {
+        return filter_packet(addr) ? this->receiver : nullptr;
+    }
+    auto it = this->colocated_nodes.find(colocated_key(addr.ip_addr, addr.udp_port));
+    if (it == this->colocated_nodes.end()) {
+        return nullptr;
+    }
+    if (memcmp(&addr.ether_addr, &it->second.addr->ether_addr, sizeof(struct rte_ether_addr)) != 0) {
+        return nullptr;
+    }
+    return it->second.receiver;
+}
@@ -1,7 +1,14 @@
 #ifndef _DPDK_TRANSPORT_H_
 #define _DPDK_TRANSPORT_H_
 
+#include <atomic>
+#include <unordered_map>
+#include <vector>
 #include <rte_mempool.h>
+#include <rte_ring.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
 
 #include <transport.h>
 #include <transports/dpdk/configuration.h>
@@ -12,27 +19,125 @@ public:
     ~DPDKTransport();
 
     virtual void send_message(const Message &msg, const Address &addr) override final;
+    virtual void send_messages(const Message &msg, const std::vector<const Address*> &addrs) override final;
     virtual void send_raw(const void *buf, void *tdata) override final;
+    virtual bool raw_ip_checksum_offload() const override final;
+    virtual void *alloc_message_buffer(size_t len, void *&tdata) override final;
+    virtual void free_message_buffer(void *buf, size_t len, void *tdata) override final;
     virtual void run() override final;
     virtual void stop() override final;
     virtual void wait() override final;
     virtual void run_app_threads(Application *app) override final;
 
+    /*
+     * Host several colocated logical servers (node_id + colocate_id) on this
+     * port. Received packets are demultiplexed in software by destination
+     * IP address and UDP port, so flow rules are not required. Must be
+     * called, for every colocated node, before run().
+     */
+    void register_colocated_receiver(int colocate_id, TransportReceiver *receiver);
+
     void distributor_thread();
     void transport_thread(int tid);
 
 private:
+    // Per worker counters of the pipeline mode. Written by the distributor,
+    // except processed, which the worker stores when it exits
+    struct PipelineStats {
+        uint64_t enqueued;
+        uint64_t dropped;
+        uint64_t processed;
+        uint64_t depth_sum;
+        uint64_t depth_samples;
+        unsigned max_depth;
+    };
+
+    // mbuf pool of one NUMA socket
+    struct MbufPool {
+        struct rte_mempool *pool;
+        unsigned size;
+        std::atomic<uint64_t> alloc_failures;
+        std::atomic<unsigned> peak_in_use;
+    };
+
+    // Ethernet/IPv4/UDP headers of our packets
+    struct FrameHeader {
+        struct rte_ether_hdr ether;
+        struct rte_ipv4_hdr ip;
+        struct rte_udp_hdr udp;
+    };
+
+    void init_port(int port,
+                   const struct rte_eth_conf &conf,
+                   int num_rx_queues,
+                   int num_tx_queues);
+    void init_header_template();
+    // Returns the index of the port to send the packet on
+    int fill_headers(struct rte_mbuf *m,
+                     char *hdr,
+                     const DPDKAddress &dst_addr,
+                     size_t payload_len);
+    MbufPool *local_pool();
+    struct rte_mbuf *alloc_mbuf();
+    void sample_pool_occupancy();
+    void dump_pool_stats() const;
+    void send_ext_message(const Message &msg, const DPDKAddress &dst_addr);
+    // Per transport thread counters of the idle mode
+    struct IdleStats {
+        bool use_intr;
+        unsigned sleep_us;
+        uint64_t sleeps;
+        uint64_t intr_wakeups;
+        uint64_t timed_sleeps;
+        uint64_t sleep_cycles;
+        uint64_t oversleep_cycles;
+        uint64_t total_cycles;
+    };
+
+    // Receiver of one colocated logical server
+    struct ColocatedNode {
+        const DPDKAddress *addr;
+        TransportReceiver *receiver;
+    };
+
+    // Waits for packets for at most max_cycles
+    void idle_wait(IdleStats &stats, uint64_t max_cycles);
+    void dump_idle_stats() const;
     bool filter_packet(const DPDKAddress &addr) const;
+    TransportReceiver *dispatch(const DPDKAddress &addr) const;
+    void process_packet(struct rte_mbuf *m, int tid);
+    // n_pending: packets of the current burst already assigned to each worker
+    bool classify(struct rte_mbuf *m, const unsigned *n_pending, unsigned &worker);
+    void dump_pipeline_stats() const;
 
     bool use_flow_api;
+    bool use_multi_seg;
+    bool use_ext_buf;
+    bool use_ip_cksum_offload;
+    bool use_rx_intr;
+    // Empty polls before an idle transport thread waits; 0 to always poll
+    unsigned idle_polls;
+    std::vector<IdleStats> idle_stats;
+    // Source-side header fields prebuilt once; per-packet fields (destination,
+    // lengths, ports) are left zero and patched into each copy
+    FrameHeader hdr_template;
+    // Ones' complement sum of the template's IPv4 header
+    uint16_t hdr_cksum_base;
     int argc;
     char **argv;
-    uint16_t dev_port;
     volatile enum {
         RUNNING,
         STOPPED,
     } status;
-    struct rte_mempool *pktmbuf_pool;
+    // Indexed by socket id; nullptr for sockets without any of our lcores
+    std::vector<MbufPool*> pktmbuf_pools;
+    // Socket of the first port
+    int nic_socket;
+    DPDKConfiguration::PipelineMode pipeline_mode;
+    std::vector<struct rte_ring*> worker_rings;
+    std::vector<PipelineStats> pipeline_stats;
+    // Keyed by destination IP address and UDP port; read-only once running
+    std::unordered_map<uint64_t, ColocatedNode> colocated_nodes;
 };
 
 #endif /* _DPDK_TRANSPORT_H_ */
@@ -0,0 +1,70 @@
+#include <logger.h>
+#include <transports/local/ring.h>
+
+LocalRing::LocalRing(size_t n_slots)
+    : enqueue_pos(0), dequeue_pos(0)
+{
+    if (n_slots == 0 || (n_slots & (n_slots - 1)) != 0) {
+        panic("LocalRing size must be a power of 2");
+    }
+    this->slots = new Slot[n_slots];
+    this->mask = n_slots - 1;
+    for (size_t i = 0; i < n_slots; i++) {
+        this->slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+LocalRing::~LocalRing()
+{
+    delete [] this->slots;
+}
+
+void *LocalRing::reserve(size_t &ticket)
+{
+    size_t pos = this->enqueue_pos.load(std::memory_order_relaxed);
+    Slot *slot;
+
+    while (true) {
+        slot = &this->slots[pos & this->mask];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (this->enqueue_pos.compare_exchange_weak(pos,
+                                                        pos + 1,
+                                                        std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Consumer has not released this slot yet: full
+            return nullptr;
+        } else {
+            pos = this->enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    ticket = pos;
+    return slot->frame;
+}
+
+void LocalRing::commit(size_t ticket, size_t len)
+{
+    Slot *slot = &this->slots[ticket & this->mask];
+    slot->len = len;
+    slot->seq.store(ticket + 1, std::memory_order_release);
+}
+
+void *LocalRing::front(size_t &len)
+{
+    Slot *slot = &this->slots[this->dequeue_pos & this->mask];
+    if (slot->seq.load(std::memory_order_acquire) != this->dequeue_pos + 1) {
+        return nullptr;
+    }
+    len = slot->len;
+    return slot->frame;
+}
+
+void LocalRing::pop()
+{
+    Slot *slot = &this->slots[this->dequeue_pos & this->mask];
+    slot->seq.store(this->dequeue_pos + this->mask + 1, std::memory_order_release);
+    this->dequeue_pos++;
+}
@@ -0,0 +1,47 @@
+#ifndef _LOCAL_RING_H_
+#define _LOCAL_RING_H_
+
+#include <atomic>
+#include <cstddef>
+
+/*
+ * Bounded multi-producer single-consumer ring of fixed-size frame slots
+ * (sequence-numbered array queue). Producers copy frames straight into a
+ * reserved slot; with a single producer the reservation CAS is uncontended
+ * and the ring behaves as a SPSC ring.
+ */
+class LocalRing {
+public:
+    LocalRing(size_t n_slots);
+    ~LocalRing();
+
+    /* Producer side */
+    // Reserve the next slot; returns nullptr if the ring is full
+    void *reserve(size_t &ticket);
+    // Publish a reserved slot holding len bytes
+    void commit(size_t ticket, size_t len);
+
+    /* Consumer side */
+    // Returns the oldest frame, or nullptr if the ring is empty
+    void *front(size_t &len);
+    // Release the frame returned by front()
+    void pop();
+
+    static const size_t FRAME_SIZE = 9216;
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        size_t len;
+        char frame[FRAME_SIZE];
+    };
+
+    Slot *slots;
+    size_t mask;
+    std::atomic<size_t> enqueue_pos;
+    // Keep producer and consumer positions on separate cache lines
+    char pad[64];
+    size_t dequeue_pos;
+};
+
+#endif /* _LOCAL_RING_H_ */
@@ -0,0 +1,244 @@
+#include <cassert>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
+
+#include <logger.h>
+#include <utils.h>
+#include <application.h>
+#include <transports/local/transport.h>
+#include <transports/dpdk/configuration.h>
+
+#define IPV4_HDR_SIZE 5
+#define IPV4_TTL 0xFF
+#define FRAME_HDR_LEN (ETHER_HDR_LEN + IPV4_HDR_SIZE * RTE_IPV4_IHL_MULTIPLIER + sizeof(struct rte_udp_hdr))
+
+#define RAND_PORT_BASE 12345
+#define RAND_PORT_MAX 10000
+
+thread_local static uint16_t rand_port;
+
+/* All LocalTransports in this process, by IP address */
+static std::unordered_map<rte_be32_t, LocalTransport*> fabric;
+static std::mutex fabric_lock;
+
+LocalTransport::LocalTransport(const Configuration *config)
+    : Transport(config), status(STOPPED)
+{
+    const DPDKAddress *addr = static_cast<const DPDKAddress*>(config->my_address());
+    this->ip_addr = addr->ip_addr;
+    for (int tid = 0; tid < config->n_transport_threads; tid++) {
+        this->rings.push_back(new LocalRing(RING_SLOTS));
+    }
+
+    std::lock_guard<std::mutex> lck(fabric_lock);
+    if (fabric.count(this->ip_addr) > 0) {
+        panic("Local transport address already registered");
+    }
+    fabric[this->ip_addr] = this;
+}
+
+LocalTransport::~LocalTransport()
+{
+    {
+        std::lock_guard<std::mutex> lck(fabric_lock);
+        fabric.erase(this->ip_addr);
+    }
+    for (LocalRing *ring : this->rings) {
+        delete ring;
+    }
+}
+
+void LocalTransport::send_message(const Message &msg, const Address &addr)
+{
+    const DPDKAddress &dst_addr = static_cast<const DPDKAddress&>(addr);
+    const DPDKAddress &src_addr = static_cast<const DPDKAddress&>(*this->config->my_address());
+    struct rte_ether_hdr *ether_hdr;
+    struct rte_ipv4_hdr *ip_hdr;
+    struct rte_udp_hdr *udp_hdr;
+    size_t ticket;
+
+    if (FRAME_HDR_LEN + msg.total_len() > LocalRing::FRAME_SIZE) {
+        panic("Message too large for local transport");
+    }
+    // Use random src port to spread flows across receiving threads
+    rte_be16_t src_port = RAND_PORT_BASE + (rand_port++ % RAND_PORT_MAX);
+    LocalRing *ring = select_ring(dst_addr.ip_addr, src_port);
+    if (ring == nullptr) {
+        return;
+    }
+    char *frame = (char*)ring->reserve(ticket);
+    if (frame == nullptr) {
+        // Receiver is behind: drop, as a full NIC queue would
+        return;
+    }
+
+    /* Ethernet header */
+    ether_hdr = (struct rte_ether_hdr*)frame;
+    ether_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+    memcpy(&ether_hdr->d_addr, &dst_addr.ether_addr, sizeof(struct rte_ether_addr));
+    memcpy(&ether_hdr->s_addr, &src_addr.ether_addr, sizeof(struct rte_ether_addr));
+    /* IP header */
+    ip_hdr = (struct rte_ipv4_hdr*)(frame + ETHER_HDR_LEN);
+    ip_hdr->version_ihl = (IPVERSION << 4) | IPV4_HDR_SIZE;
+    ip_hdr->type_of_service = 0;
+    ip_hdr->total_length = rte_cpu_to_be_16(IPV4_HDR_SIZE * RTE_IPV4_IHL_MULTIPLIER +
+                                            sizeof(struct rte_udp_hdr) +
+                                            msg.total_len());
+    ip_hdr->packet_id = 0;
+    ip_hdr->fragment_offset = 0;
+    ip_hdr->time_to_live = IPV4_TTL;
+    ip_hdr->next_proto_id = IPPROTO_UDP;
+    ip_hdr->hdr_checksum = 0;
+    ip_hdr->src_addr = src_addr.ip_addr;
+    ip_hdr->dst_addr = dst_addr.ip_addr;
+    ip_hdr->hdr_checksum = rte_ipv4_cksum(ip_hdr);
+    /* UDP header */
+    udp_hdr = (struct rte_udp_hdr*)(frame + ETHER_HDR_LEN + IPV4_HDR_SIZE * RTE_IPV4_IHL_MULTIPLIER);
+    udp_hdr->src_port = src_port;
+    udp_hdr->dst_port = dst_addr.udp_port;
+    udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct rte_udp_hdr) + msg.total_len());
+    udp_hdr->dgram_cksum = 0;
+    /* Datagram */
+    msg.copy_to(frame + FRAME_HDR_LEN);
+
+    ring->commit(ticket, FRAME_HDR_LEN + msg.total_len());
+}
+
+void LocalTransport::send_raw(const void *buf, void *tdata)
+{
+    // tdata carries the frame length
+    size_t len = *(size_t*)tdata;
+    size_t ticket;
+    const struct rte_ipv4_hdr *ip_hdr =
+        (const struct rte_ipv4_hdr*)((const char*)buf + ETHER_HDR_LEN);
+    const struct rte_udp_hdr *udp_hdr =
+        (const struct rte_udp_hdr*)((const char*)ip_hdr +
+                                    (ip_hdr->version_ihl & RTE_IPV4_HDR_IHL_MASK) * RTE_IPV4_IHL_MULTIPLIER);
+
+    LocalRing *ring = select_ring(ip_hdr->dst_addr, udp_hdr->src_port);
+    if (ring == nullptr) {
+        return;
+    }
+    void *frame = ring->reserve(ticket);
+    if (frame == nullptr) {
+        return;
+    }
+    memcpy(frame, buf, len);
+    ring->commit(ticket, len);
+}
+
+void LocalTransport::run(void)
+{
+    this->status = RUNNING;
+    for (int tid = 0; tid < this->config->n_transport_threads; tid++) {
+        this->threads.push_back(new std::thread(&LocalTransport::run_transport, this, tid));
+    }
+}
+
+void LocalTransport::stop(void)
+{
+    this->status = STOPPED;
+}
+
+void LocalTransport::wait(void)
+{
+    for (std::thread *thread : this->threads) {
+        thread->join();
+        delete thread;
+    }
+    this->threads.clear();
+}
+
+void LocalTransport::run_app_threads(Application *app)
+{
+    std::thread *app_threads[this->config->n_app_threads];
+
+    for (int i = 1; i < this->config->n_app_threads; i++) {
+        app_threads[i] = new std::thread(&LocalTransport::run_app_thread, this, app, i);
+    }
+    run_app_thread(app, 0);
+    for (int i = 1; i < this->config->n_app_threads; i++) {
+        app_threads[i]->join();
+        delete app_threads[i];
+    }
+}
+
+void LocalTransport::run_app_thread(Application *app, int tid)
+{
+    rand_port = rand() % RAND_PORT_MAX;
+    // A negative base core leaves threads unpinned
+    if (this->config->app_core >= 0) {
+        pin_to_core(this->config->app_core + tid);
+    }
+    app->run_thread(tid);
+}
+
+LocalRing *LocalTransport::select_ring(rte_be32_t dst_ip, rte_be16_t src_port)
+{
+    // The fabric is only modified while nodes are being set up
+    auto it = fabric.find(dst_ip);
+    if (it == fabric.end()) {
+        return nullptr;
+    }
+    const std::vector<LocalRing*> &rings = it->second->rings;
+    return rings[rte_be_to_cpu_16(src_port) % rings.size()];
+}
+
+void LocalTransport::run_transport(int tid)
+{
+    LocalRing *ring = this->rings.at(tid);
+    void *frame;
+    size_t len;
+    int n_rx;
+
+    rand_port = rand() % RAND_PORT_MAX;
+    if (this->config->transport_core >= 0) {
+        pin_to_core(this->config->transport_core + tid);
+    }
+    assert(this->receiver);
+    while (this->status == LocalTransport::RUNNING) {
+        for (n_rx = 0; n_rx < MAX_RX_BURST; n_rx++) {
+            if ((frame = ring->front(len)) == nullptr) {
+                break;
+            }
+            if (this->config->use_raw_transport) {
+                this->receiver->receive_raw(frame,
+                                            &len,
+                                            this->config->n_app_threads + tid);
+            } else {
+                /* Parse packet header */
+                const struct rte_ether_hdr *ether_hdr = (const struct rte_ether_hdr*)frame;
+                const struct rte_ipv4_hdr *ip_hdr =
+                    (const struct rte_ipv4_hdr*)((char*)frame + ETHER_HDR_LEN);
+                size_t offset = ETHER_HDR_LEN +
+                    (ip_hdr->version_ihl & RTE_IPV4_HDR_IHL_MASK) * RTE_IPV4_IHL_MULTIPLIER;
+                const struct rte_udp_hdr *udp_hdr =
+                    (const struct rte_udp_hdr*)((char*)frame + offset);
+                offset += sizeof(struct rte_udp_hdr);
+
+                /* Construct source address */
+                DPDKAddress addr(ether_hdr->s_addr,
+                                 ip_hdr->src_addr,
+                                 udp_hdr->src_port,
+                                 0);
+                /* Upcall to transport receiver */
+                Message msg((char*)frame + offset,
+                            rte_be_to_cpu_16(udp_hdr->dgram_len)-sizeof(struct rte_udp_hdr),
+                            false);
+                this->receiver->receive_message(msg, addr, this->config->n_app_threads + tid);
+            }
+            ring->pop();
+        }
+        if (n_rx == 0) {
+            std::this_thread::yield();
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef _LOCAL_TRANSPORT_H_
+#define _LOCAL_TRANSPORT_H_
+
+#include <thread>
+#include <vector>
+#include <rte_byteorder.h>
+
+#include <transport.h>
+#include <transports/local/ring.h>
+
+/*
+ * In-process transport: nodes running in the same process exchange
+ * Ethernet/IPv4/UDP frames (same layout as DPDKTransport) through
+ * LocalRings, one per receiving transport thread. Uses DPDKConfiguration
+ * addresses; nodes are looked up by IP address, and the receiving thread is
+ * selected by the UDP source port as RSS would. All LocalTransports must be
+ * constructed before any of them is run.
+ */
+class LocalTransport : public Transport {
+public:
+    LocalTransport(const Configuration *config);
+    ~LocalTransport();
+
+    virtual void send_message(const Message &msg, const Address &addr) override final;
+    virtual void send_raw(const void *buf, void *tdata) override final;
+    virtual void run(void) override final;
+    virtual void stop(void) override final;
+    virtual void wait(void) override final;
+    virtual void run_app_threads(Application *app) override final;
+
+private:
+    LocalRing *select_ring(rte_be32_t dst_ip, rte_be16_t src_port);
+    void run_transport(int tid);
+    void run_app_thread(Application *app, int tid);
+
+    static const size_t RING_SLOTS = 1024;
+    static const int MAX_RX_BURST = 32;
+
+    rte_be32_t ip_addr;
+    std::vector<LocalRing*> rings;
+    std::vector<std::thread*> threads;
+    volatile enum {
+        RUNNING,
+        STOPPED,
+    } status;
+};
+
+#endif /* _LOCAL_TRANSPORT_H_ */
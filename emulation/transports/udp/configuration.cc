@@ -32,7 +32,7 @@ UDPAddress::UDPAddress(const struct sockaddr &saddr)
 }
 
 UDPConfiguration::UDPConfiguration(const char *file_path)
-    : Configuration()
+    : Configuration(), use_batching(false), batch_size(32)
 {
     std::ifstream file;
     std::vector<Address*> rack;
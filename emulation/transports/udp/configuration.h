@@ -16,6 +16,9 @@ public:
 class UDPConfiguration : public Configuration {
 public:
     UDPConfiguration(const char *file_path);
+
+    bool use_batching;
+    size_t batch_size;
 };
 
 #endif /* _UDP_CONFIGURATION_H_ */
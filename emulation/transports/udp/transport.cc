@@ -1,8 +1,11 @@
+#include <cerrno>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 #include <unistd.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/udp.h>
 #include <event2/thread.h>
 #include <event2/event.h>
 
@@ -11,74 +14,203 @@
 #include <transports/udp/transport.h>
 #include <utils.h>
 
-UDPTransport::UDPTransport(const Configuration *config)
-    : Transport(config), socket_fd(-1), controller_fd(-1)
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define RX_CTRL_SIZE CMSG_SPACE(sizeof(int))
+#define TX_CTRL_SIZE CMSG_SPACE(sizeof(uint16_t))
+
+// Set while the transport thread is processing a recvmmsg batch: replies sent
+// from within receive_message are queued and flushed with one sendmmsg
+thread_local static bool in_rx_batch = false;
+// Thread state whose socket this thread sends on (transport threads use their
+// own; app threads are spread across them)
+thread_local static void *local_state = nullptr;
+
+UDPTransport::ThreadState::ThreadState(UDPTransport *transport, int tid)
+    : transport(transport), tid(tid), socket_fd(-1), thread(nullptr),
+    use_gso(false), use_gro(false), rx_msgs(nullptr), tx_msgs(nullptr), n_tx(0)
 {
-    evthread_use_pthreads();
-
     this->event_base = event_base_new();
     if (this->event_base == nullptr) {
         panic("Failed to create new libevent event base");
     }
+}
+
+UDPTransport::ThreadState::~ThreadState()
+{
+    for (auto event : this->events) {
+        event_free(event);
+    }
 
+    if (this->socket_fd > 0) {
+        close(this->socket_fd);
+    }
+
+    if (this->event_base != nullptr) {
+        event_base_free(this->event_base);
+    }
+
+    if (this->rx_msgs != nullptr) {
+        delete [] this->rx_msgs;
+        delete [] this->rx_iovs;
+        delete [] this->rx_addrs;
+        delete [] this->rx_bufs;
+        delete [] this->rx_ctrls;
+        delete [] this->tx_msgs;
+        delete [] this->tx_iovs;
+        delete [] this->tx_addrs;
+        delete [] this->tx_bufs;
+        delete [] this->tx_ctrls;
+    }
+}
+
+UDPTransport::UDPTransport(const Configuration *config)
+    : Transport(config), controller_fd(-1)
+{
+    evthread_use_pthreads();
+
+    const UDPConfiguration *udp_config = static_cast<const UDPConfiguration*>(config);
+    this->use_batching = udp_config->use_batching;
+    this->batch_size = udp_config->batch_size;
+    if (this->batch_size == 0) {
+        panic("UDP batch size should be > 0");
+    }
+
+    const Address *addr;
     switch (config->node_type) {
     case Configuration::NodeType::SERVER:
-        register_address(config->node_addresses.at(config->rack_id).at(config->node_id));
+        addr = config->node_addresses.at(config->rack_id).at(config->node_id);
         break;
     case Configuration::NodeType::CLIENT:
-        register_address(config->client_addresses.at(config->client_id));
+        addr = config->client_addresses.at(config->client_id);
         break;
     case Configuration::NodeType::LB:
-        register_address(config->lb_address);
+        addr = config->lb_address;
         break;
     default:
         panic("Unreachable");
     }
-    register_controller();
+
+    // One socket per transport thread, all bound to the node address with
+    // SO_REUSEPORT; the kernel shards incoming flows across them
+    int n_threads = std::max(config->n_transport_threads, 1);
+    for (int i = 0; i < n_threads; i++) {
+        ThreadState *ts = new ThreadState(this, i);
+        register_address(ts, addr);
+        if (this->use_batching) {
+            init_batching(ts);
+        }
+        this->thread_states.push_back(ts);
+    }
+    register_controller(this->thread_states[0]);
 }
 
 UDPTransport::~UDPTransport()
 {
-    for (auto event : this->events) {
-        event_free(event);
+    for (ThreadState *ts : this->thread_states) {
+        delete ts;
     }
 
-    if (this->socket_fd > 0) {
-        close(this->socket_fd);
-    }
     if (this->controller_fd > 0) {
         close(this->controller_fd);
     }
-
-    if (this->event_base != nullptr) {
-        event_base_free(this->event_base);
-    }
 }
 
 void UDPTransport::send_message(const Message &msg, const Address &addr)
 {
     const UDPAddress &udp_addr = static_cast<const UDPAddress&>(addr);
+    ThreadState *ts = local_state != nullptr ?
+        static_cast<ThreadState*>(local_state) : this->thread_states[0];
+
+    if (in_rx_batch && enqueue_tx(ts, msg, udp_addr.saddr)) {
+        return;
+    }
 
-    if (sendto(this->socket_fd, msg.buf(), msg.len(), 0,
-               &udp_addr.saddr, sizeof(udp_addr.saddr)) == -1) {
+    // Gather the external tail (if any) straight from its owner
+    struct iovec iovs[2];
+    struct msghdr hdr;
+    iovs[0].iov_base = (void*)msg.buf();
+    iovs[0].iov_len = msg.len();
+    iovs[1].iov_base = (void*)msg.ext_buf();
+    iovs[1].iov_len = msg.ext_len();
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = (void*)&udp_addr.saddr;
+    hdr.msg_namelen = sizeof(udp_addr.saddr);
+    hdr.msg_iov = iovs;
+    hdr.msg_iovlen = msg.ext_len() > 0 ? 2 : 1;
+    if (sendmsg(ts->socket_fd, &hdr, 0) == -1) {
         printf("Failed to send message\n");
     }
 }
 
+void UDPTransport::send_messages(const Message &msg, const std::vector<const Address*> &addrs)
+{
+    ThreadState *ts = local_state != nullptr ?
+        static_cast<ThreadState*>(local_state) : this->thread_states[0];
+
+    if (in_rx_batch) {
+        for (const Address *addr : addrs) {
+            send_message(msg, *addr);
+        }
+        return;
+    }
+
+    // One sendmmsg sharing the payload iovec across all destinations
+    size_t n = addrs.size();
+    struct mmsghdr msgs[n];
+    struct iovec iovs[2];
+    iovs[0].iov_base = (void*)msg.buf();
+    iovs[0].iov_len = msg.len();
+    iovs[1].iov_base = (void*)msg.ext_buf();
+    iovs[1].iov_len = msg.ext_len();
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for (size_t i = 0; i < n; i++) {
+        const UDPAddress *udp_addr = static_cast<const UDPAddress*>(addrs[i]);
+        msgs[i].msg_hdr.msg_name = (void*)&udp_addr->saddr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(udp_addr->saddr);
+        msgs[i].msg_hdr.msg_iov = iovs;
+        msgs[i].msg_hdr.msg_iovlen = msg.ext_len() > 0 ? 2 : 1;
+    }
+    size_t sent = 0;
+    while (sent < n) {
+        int ret = sendmmsg(ts->socket_fd, msgs + sent, n - sent, 0);
+        if (ret == -1) {
+            printf("Failed to send message\n");
+            break;
+        }
+        sent += ret;
+    }
+}
+
 void UDPTransport::run(void)
 {
-    this->transport_thread = new std::thread(&UDPTransport::run_transport, this);
+    for (ThreadState *ts : this->thread_states) {
+        ts->thread = new std::thread(&UDPTransport::run_transport, this, ts);
+    }
 }
 
 void UDPTransport::stop(void)
 {
-    event_base_loopbreak(this->event_base);
+    for (ThreadState *ts : this->thread_states) {
+        event_base_loopbreak(ts->event_base);
+    }
 }
 
 void UDPTransport::wait(void)
 {
-    this->transport_thread->join();
-    delete this->transport_thread;
+    for (ThreadState *ts : this->thread_states) {
+        ts->thread->join();
+        delete ts->thread;
+        ts->thread = nullptr;
+    }
 }
 
 void UDPTransport::run_app_threads(Application *app)
@@ -86,62 +218,87 @@ void UDPTransport::run_app_threads(Application *app)
     std::thread *app_threads[this->config->n_app_threads];
 
     for (int i = 1; i < this->config->n_app_threads; i++) {
-        app_threads[i] = new std::thread(&Application::run_thread, app, i);
+        app_threads[i] = new std::thread(&UDPTransport::run_app_thread, this, app, i);
     }
-    app->run_thread(0);
+    run_app_thread(app, 0);
     for (int i = 1; i < this->config->n_app_threads; i++) {
         app_threads[i]->join();
         delete app_threads[i];
     }
 }
 
-void UDPTransport::register_address(const Address *addr)
+void UDPTransport::run_app_thread(Application *app, int tid)
+{
+    local_state = this->thread_states[tid % this->thread_states.size()];
+    app->run_thread(tid);
+}
+
+void UDPTransport::register_address(ThreadState *ts, const Address *addr)
 {
     const UDPAddress *udp_addr = static_cast<const UDPAddress*>(addr);
 
     // Setup socket
-    this->socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (this->socket_fd == -1) {
+    ts->socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ts->socket_fd == -1) {
         panic("Failed to create socket");
     }
 
     // Non-blocking mode
-    if (fcntl(this->socket_fd, F_SETFL, O_NONBLOCK, 1) == -1) {
+    if (fcntl(ts->socket_fd, F_SETFL, O_NONBLOCK, 1) == -1) {
         panic("Failed to set O_NONBLOCK");
     }
 
     // Enable outgoing broadcast
     int n = 1;
-    if (setsockopt(this->socket_fd, SOL_SOCKET, SO_BROADCAST, (char *)&n, sizeof(n)) < 0) {
+    if (setsockopt(ts->socket_fd, SOL_SOCKET, SO_BROADCAST, (char *)&n, sizeof(n)) < 0) {
         panic("Failed to set SO_BROADCAST");
     }
 
-    // Disable UDP checksum
-    n = 1;
-    if (setsockopt(this->socket_fd, SOL_SOCKET, SO_NO_CHECK, (char *)&n, sizeof(n)) < 0) {
-        panic("Failed to set SO_NO_CHECK");
+    // UDP GSO/GRO (kernel >= 4.18/5.0); only probed in batching mode
+    if (this->use_batching) {
+        n = 0;
+        ts->use_gso = setsockopt(ts->socket_fd, SOL_UDP, UDP_SEGMENT, (char *)&n, sizeof(n)) == 0;
+        n = 1;
+        ts->use_gro = setsockopt(ts->socket_fd, SOL_UDP, UDP_GRO, (char *)&n, sizeof(n)) == 0;
+    }
+
+    // Disable UDP checksum (the kernel rejects GSO sends on sockets without
+    // TX checksums)
+    if (!ts->use_gso) {
+        n = 1;
+        if (setsockopt(ts->socket_fd, SOL_SOCKET, SO_NO_CHECK, (char *)&n, sizeof(n)) < 0) {
+            panic("Failed to set SO_NO_CHECK");
+        }
+    }
+
+    // Share the port among transport threads
+    if (this->config->n_transport_threads > 1) {
+        n = 1;
+        if (setsockopt(ts->socket_fd, SOL_SOCKET, SO_REUSEPORT, (char *)&n, sizeof(n)) < 0) {
+            panic("Failed to set SO_REUSEPORT");
+        }
     }
 
     // Increase buffer size
     n = this->SOCKET_BUF_SIZE;
-    if (setsockopt(this->socket_fd, SOL_SOCKET, SO_RCVBUF, (char *)&n, sizeof(n)) < 0) {
+    if (setsockopt(ts->socket_fd, SOL_SOCKET, SO_RCVBUF, (char *)&n, sizeof(n)) < 0) {
         panic("Failed to set SO_RCVBUF");
     }
-    if (setsockopt(this->socket_fd, SOL_SOCKET, SO_SNDBUF, (char *)&n, sizeof(n)) < 0) {
+    if (setsockopt(ts->socket_fd, SOL_SOCKET, SO_SNDBUF, (char *)&n, sizeof(n)) < 0) {
         panic("Failed to set SO_SNDBUF");
     }
 
     // Bind to address
-    if (bind(this->socket_fd,
+    if (bind(ts->socket_fd,
              &udp_addr->saddr,
              sizeof(udp_addr->saddr)) != 0) {
         panic("Failed to bind port");
     }
 
-    add_socket_event(this->socket_fd);
+    add_socket_event(ts, ts->socket_fd);
 }
 
-void UDPTransport::register_controller()
+void UDPTransport::register_controller(ThreadState *ts)
 {
     // Setup socket
     this->controller_fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -169,11 +326,16 @@ void UDPTransport::register_controller()
         panic("Failed to bind port");
     }
 
-    add_socket_event(this->controller_fd);
+    add_socket_event(ts, this->controller_fd);
 }
 
-void UDPTransport::on_readable(int fd)
+void UDPTransport::on_readable(ThreadState *ts, int fd)
 {
+    if (this->use_batching) {
+        on_readable_batched(ts, fd);
+        return;
+    }
+
     const int BUFSIZE = 65535;
     char buf[BUFSIZE];
     struct sockaddr src_addr;
@@ -191,34 +353,184 @@ void UDPTransport::on_readable(int fd)
     assert(this->receiver);
     this->receiver->receive_message(Message(buf, ret, false),
                                     UDPAddress(src_addr),
-                                    0); // Currently single threaded transport
+                                    this->config->n_app_threads + ts->tid);
+}
+
+void UDPTransport::on_readable_batched(ThreadState *ts, int fd)
+{
+    int n_rx;
+
+    do {
+        for (size_t i = 0; i < this->batch_size; i++) {
+            ts->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr);
+            ts->rx_msgs[i].msg_hdr.msg_controllen = ts->use_gro ? RX_CTRL_SIZE : 0;
+        }
+        n_rx = recvmmsg(fd, ts->rx_msgs, this->batch_size, MSG_DONTWAIT, nullptr);
+        if (n_rx == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("Failed to receive message\n");
+            }
+            break;
+        }
+
+        assert(this->receiver);
+        in_rx_batch = true;
+        for (int i = 0; i < n_rx; i++) {
+            struct msghdr *hdr = &ts->rx_msgs[i].msg_hdr;
+            size_t len = ts->rx_msgs[i].msg_len;
+            size_t seg_size = len;
+            if (ts->use_gro) {
+                // GRO coalesces datagrams from the same flow into one buffer
+                for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+                     cmsg != nullptr;
+                     cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+                    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                        seg_size = *(int*)CMSG_DATA(cmsg);
+                        break;
+                    }
+                }
+            }
+            UDPAddress src_addr(ts->rx_addrs[i]);
+            const char *buf = (const char*)ts->rx_iovs[i].iov_base;
+            for (size_t offset = 0; offset < len; offset += seg_size) {
+                this->receiver->receive_message(Message((void*)(buf + offset),
+                                                        std::min(seg_size, len - offset),
+                                                        false),
+                                                src_addr,
+                                                this->config->n_app_threads + ts->tid);
+            }
+        }
+        in_rx_batch = false;
+        flush_tx(ts);
+    } while ((size_t)n_rx == this->batch_size);
+}
+
+void UDPTransport::init_batching(ThreadState *ts)
+{
+    ts->rx_msgs = new struct mmsghdr[this->batch_size];
+    ts->rx_iovs = new struct iovec[this->batch_size];
+    ts->rx_addrs = new struct sockaddr[this->batch_size];
+    ts->rx_bufs = new char[this->batch_size * DGRAM_BUF_SIZE];
+    ts->rx_ctrls = new char[this->batch_size * RX_CTRL_SIZE];
+    ts->tx_msgs = new struct mmsghdr[this->batch_size];
+    ts->tx_iovs = new struct iovec[this->batch_size];
+    ts->tx_addrs = new struct sockaddr[this->batch_size];
+    ts->tx_bufs = new char[this->batch_size * DGRAM_BUF_SIZE];
+    ts->tx_ctrls = new char[this->batch_size * TX_CTRL_SIZE];
+
+    memset(ts->rx_msgs, 0, this->batch_size * sizeof(struct mmsghdr));
+    for (size_t i = 0; i < this->batch_size; i++) {
+        ts->rx_iovs[i].iov_base = ts->rx_bufs + i * DGRAM_BUF_SIZE;
+        ts->rx_iovs[i].iov_len = DGRAM_BUF_SIZE;
+        ts->rx_msgs[i].msg_hdr.msg_name = &ts->rx_addrs[i];
+        ts->rx_msgs[i].msg_hdr.msg_iov = &ts->rx_iovs[i];
+        ts->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        ts->rx_msgs[i].msg_hdr.msg_control = ts->rx_ctrls + i * RX_CTRL_SIZE;
+    }
+    info("UDP transport thread %d batching enabled: batch size %lu, GSO %s, GRO %s",
+         ts->tid,
+         this->batch_size,
+         ts->use_gso ? "on" : "off",
+         ts->use_gro ? "on" : "off");
+}
+
+bool UDPTransport::enqueue_tx(ThreadState *ts, const Message &msg, const struct sockaddr &saddr)
+{
+    if (msg.total_len() > DGRAM_BUF_SIZE) {
+        return false;
+    }
+    if (ts->n_tx == this->batch_size) {
+        flush_tx(ts);
+    }
+    char *buf = ts->tx_bufs + ts->n_tx * DGRAM_BUF_SIZE;
+    msg.copy_to(buf);
+    ts->tx_iovs[ts->n_tx].iov_base = buf;
+    ts->tx_iovs[ts->n_tx].iov_len = msg.total_len();
+    ts->tx_addrs[ts->n_tx] = saddr;
+    ts->n_tx++;
+    return true;
+}
+
+void UDPTransport::flush_tx(ThreadState *ts)
+{
+    size_t n_msgs = 0, i = 0, j;
+
+    // With GSO, consecutive equal-sized datagrams to the same destination
+    // are sent as one super-packet that the kernel (or NIC) segments. The
+    // kernel rejects the whole super-packet if its segments do not fit the
+    // MTU or it exceeds the largest UDP payload.
+    while (i < ts->n_tx) {
+        j = i + 1;
+        size_t seg_len = ts->tx_iovs[i].iov_len;
+        if (ts->use_gso && seg_len <= GSO_MAX_SEGMENT_SIZE) {
+            while (j < ts->n_tx &&
+                   j - i < MAX_GSO_SEGMENTS &&
+                   (j - i + 1) * seg_len <= GSO_MAX_BYTES &&
+                   ts->tx_iovs[j].iov_len == seg_len &&
+                   memcmp(&ts->tx_addrs[j], &ts->tx_addrs[i], sizeof(struct sockaddr)) == 0) {
+                j++;
+            }
+        }
+        struct msghdr *hdr = &ts->tx_msgs[n_msgs].msg_hdr;
+        memset(hdr, 0, sizeof(struct msghdr));
+        hdr->msg_name = &ts->tx_addrs[i];
+        hdr->msg_namelen = sizeof(struct sockaddr);
+        hdr->msg_iov = &ts->tx_iovs[i];
+        hdr->msg_iovlen = j - i;
+        if (j - i > 1) {
+            hdr->msg_control = ts->tx_ctrls + n_msgs * TX_CTRL_SIZE;
+            hdr->msg_controllen = TX_CTRL_SIZE;
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t*)CMSG_DATA(cmsg) = (uint16_t)seg_len;
+        }
+        n_msgs++;
+        i = j;
+    }
+
+    size_t sent = 0;
+    while (sent < n_msgs) {
+        int ret = sendmmsg(ts->socket_fd, ts->tx_msgs + sent, n_msgs - sent, 0);
+        if (ret == -1) {
+            // sendmmsg stops at the first failed message: drop it and send
+            // the rest
+            info("Failed to send message: %s", strerror(errno));
+            sent++;
+            continue;
+        }
+        sent += ret;
+    }
+    ts->n_tx = 0;
 }
 
-void UDPTransport::add_socket_event(int fd)
+void UDPTransport::add_socket_event(ThreadState *ts, int fd)
 {
-    struct event *sock_ev = event_new(this->event_base,
+    struct event *sock_ev = event_new(ts->event_base,
                                       fd,
                                       EV_READ | EV_PERSIST,
                                       socket_callback,
-                                      (void *)this);
+                                      (void *)ts);
     if (sock_ev == nullptr) {
         panic("Failed to create new event");
     }
 
     event_add(sock_ev, nullptr);
-    this->events.push_back(sock_ev);
+    ts->events.push_back(sock_ev);
 }
 
-void UDPTransport::run_transport(void)
+void UDPTransport::run_transport(ThreadState *ts)
 {
-    pin_to_core(this->config->transport_core);
-    event_base_dispatch(this->event_base);
+    local_state = ts;
+    pin_to_core(this->config->transport_core + ts->tid);
+    event_base_dispatch(ts->event_base);
 }
 
 void UDPTransport::socket_callback(evutil_socket_t fd, short what, void *arg)
 {
     if (what & EV_READ) {
-        UDPTransport *transport = (UDPTransport *)arg;
-        transport->on_readable(fd);
+        ThreadState *ts = (ThreadState *)arg;
+        ts->transport->on_readable(ts, fd);
     }
 }
@@ -3,6 +3,8 @@
 
 #include <thread>
 #include <list>
+#include <vector>
+#include <sys/socket.h>
 #include <event2/util.h>
 
 #include <transport.h>
@@ -15,26 +17,71 @@ public:
     ~UDPTransport();
 
     virtual void send_message(const Message &msg, const Address &addr) override final;
+    virtual void send_messages(const Message &msg, const std::vector<const Address*> &addrs) override final;
     virtual void run(void) override final;
     virtual void stop(void) override final;
     virtual void wait(void) override final;
     virtual void run_app_threads(Application *app) override final;
 
 private:
-    void register_address(const Address *addr);
-    void register_controller(void);
-    void on_readable(int fd);
-    void add_socket_event(int fd);
-    void run_transport(void);
+    // Per transport thread: each thread owns one SO_REUSEPORT socket and
+    // its own event loop
+    class ThreadState {
+    public:
+        ThreadState(UDPTransport *transport, int tid);
+        ~ThreadState();
+
+        UDPTransport *transport;
+        int tid;
+        int socket_fd;
+        struct event_base *event_base;
+        std::list<struct event *> events;
+        std::thread *thread;
+
+        /* recvmmsg/sendmmsg batching */
+        bool use_gso;
+        bool use_gro;
+        // RX batch
+        struct mmsghdr *rx_msgs;
+        struct iovec *rx_iovs;
+        struct sockaddr *rx_addrs;
+        char *rx_bufs;
+        char *rx_ctrls;
+        // TX batch (only filled from the transport thread while it processes
+        // a RX batch; flushed with a single sendmmsg)
+        struct mmsghdr *tx_msgs;
+        struct iovec *tx_iovs;
+        struct sockaddr *tx_addrs;
+        char *tx_bufs;
+        char *tx_ctrls;
+        size_t n_tx;
+    };
+
+    void register_address(ThreadState *ts, const Address *addr);
+    void register_controller(ThreadState *ts);
+    void on_readable(ThreadState *ts, int fd);
+    void on_readable_batched(ThreadState *ts, int fd);
+    void add_socket_event(ThreadState *ts, int fd);
+    void run_transport(ThreadState *ts);
+    void run_app_thread(Application *app, int tid);
     static void socket_callback(evutil_socket_t fd, short what, void *arg);
 
+    void init_batching(ThreadState *ts);
+    bool enqueue_tx(ThreadState *ts, const Message &msg, const struct sockaddr &saddr);
+    void flush_tx(ThreadState *ts);
+
     const int SOCKET_BUF_SIZE = 1024 * 1024; // 1MB buffer size
+    static const size_t DGRAM_BUF_SIZE = 65535;
+    static const size_t MAX_GSO_SEGMENTS = 64;
+    // Largest UDP payload of a GSO super-packet
+    static const size_t GSO_MAX_BYTES = 65507;
+    // Largest segment that fits a 1500 byte Ethernet MTU
+    static const size_t GSO_MAX_SEGMENT_SIZE = 1472;
 
-    int socket_fd;
     int controller_fd;
-    std::thread *transport_thread;
-    struct event_base *event_base;
-    std::list<struct event *> events;
+    bool use_batching;
+    size_t batch_size;
+    std::vector<ThreadState*> thread_states;
 };
 
 #endif /* __UDP_TRANSPORT_H__ */
@@ -0,0 +1,511 @@
+#include <cerrno>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <application.h>
+#include <transports/udp/configuration.h>
+#include <transports/uring/transport.h>
+#include <utils.h>
+
+#define RX_BUF_GROUP 0
+
+#define UDATA_RECV 1ULL
+#define UDATA_SEND 2ULL
+#define UDATA(type, val) (((type) << 32) | (uint32_t)(val))
+#define UDATA_TYPE(udata) ((udata) >> 32)
+#define UDATA_VAL(udata) ((uint32_t)(udata))
+
+// Set while the transport thread runs receive upcalls: replies are queued as
+// SQEs instead of issuing a sendto each
+thread_local static bool in_rx_batch = false;
+// Thread state whose socket this thread sends on
+thread_local static void *local_state = nullptr;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags, const void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg,
+                             unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+IOUringTransport::ThreadState::ThreadState(IOUringTransport *transport, int tid)
+    : transport(transport), tid(tid), socket_fd(-1), thread(nullptr),
+    ring_fd(-1), sq_ring_ptr(MAP_FAILED), cq_ring_ptr(MAP_FAILED),
+    sqes(nullptr), sq_local_tail(0), buf_ring(nullptr), rx_bufs(nullptr),
+    buf_ring_tail(0), tx_bufs(nullptr), tx_msgs(nullptr), tx_iovs(nullptr),
+    tx_addrs(nullptr)
+{
+}
+
+IOUringTransport::ThreadState::~ThreadState()
+{
+    if (this->ring_fd >= 0) {
+        close(this->ring_fd);
+    }
+    if (this->sqes != nullptr) {
+        munmap(this->sqes, this->sqes_size);
+    }
+    if (this->cq_ring_ptr != MAP_FAILED && this->cq_ring_ptr != this->sq_ring_ptr) {
+        munmap(this->cq_ring_ptr, this->cq_ring_size);
+    }
+    if (this->sq_ring_ptr != MAP_FAILED) {
+        munmap(this->sq_ring_ptr, this->sq_ring_size);
+    }
+    if (this->buf_ring != nullptr) {
+        munmap(this->buf_ring, RX_BUF_ENTRIES * sizeof(struct io_uring_buf));
+    }
+    if (this->socket_fd > 0) {
+        close(this->socket_fd);
+    }
+    delete [] this->rx_bufs;
+    delete [] this->tx_bufs;
+    delete [] this->tx_msgs;
+    delete [] this->tx_iovs;
+    delete [] this->tx_addrs;
+}
+
+IOUringTransport::IOUringTransport(const Configuration *config)
+    : Transport(config), controller_fd(-1), status(STOPPED)
+{
+    const Address *addr;
+    switch (config->node_type) {
+    case Configuration::NodeType::SERVER:
+        addr = config->node_addresses.at(config->rack_id).at(config->node_id);
+        break;
+    case Configuration::NodeType::CLIENT:
+        addr = config->client_addresses.at(config->client_id);
+        break;
+    case Configuration::NodeType::LB:
+        addr = config->lb_address;
+        break;
+    default:
+        panic("Unreachable");
+    }
+
+    int n_threads = std::max(config->n_transport_threads, 1);
+    for (int i = 0; i < n_threads; i++) {
+        ThreadState *ts = new ThreadState(this, i);
+        register_address(ts, addr);
+        setup_ring(ts);
+        this->thread_states.push_back(ts);
+    }
+    register_controller();
+}
+
+IOUringTransport::~IOUringTransport()
+{
+    for (ThreadState *ts : this->thread_states) {
+        delete ts;
+    }
+    if (this->controller_fd > 0) {
+        close(this->controller_fd);
+    }
+}
+
+void IOUringTransport::send_message(const Message &msg, const Address &addr)
+{
+    const UDPAddress &udp_addr = static_cast<const UDPAddress&>(addr);
+    ThreadState *ts = local_state != nullptr ?
+        static_cast<ThreadState*>(local_state) : this->thread_states[0];
+
+    // Only the owning transport thread may produce SQEs on its ring
+    if (in_rx_batch && enqueue_send(ts, msg, udp_addr.saddr)) {
+        return;
+    }
+
+    struct iovec iovs[2];
+    struct msghdr hdr;
+    iovs[0].iov_base = (void*)msg.buf();
+    iovs[0].iov_len = msg.len();
+    iovs[1].iov_base = (void*)msg.ext_buf();
+    iovs[1].iov_len = msg.ext_len();
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = (void*)&udp_addr.saddr;
+    hdr.msg_namelen = sizeof(udp_addr.saddr);
+    hdr.msg_iov = iovs;
+    hdr.msg_iovlen = msg.ext_len() > 0 ? 2 : 1;
+    if (sendmsg(ts->socket_fd, &hdr, 0) == -1) {
+        info("Failed to send message: %s", strerror(errno));
+    }
+}
+
+void IOUringTransport::run(void)
+{
+    this->status = RUNNING;
+    for (ThreadState *ts : this->thread_states) {
+        ts->thread = new std::thread(&IOUringTransport::run_transport, this, ts);
+    }
+}
+
+void IOUringTransport::stop(void)
+{
+    this->status = STOPPED;
+}
+
+void IOUringTransport::wait(void)
+{
+    for (ThreadState *ts : this->thread_states) {
+        ts->thread->join();
+        delete ts->thread;
+        ts->thread = nullptr;
+    }
+}
+
+void IOUringTransport::run_app_threads(Application *app)
+{
+    std::thread *app_threads[this->config->n_app_threads];
+
+    for (int i = 1; i < this->config->n_app_threads; i++) {
+        app_threads[i] = new std::thread(&IOUringTransport::run_app_thread, this, app, i);
+    }
+    run_app_thread(app, 0);
+    for (int i = 1; i < this->config->n_app_threads; i++) {
+        app_threads[i]->join();
+        delete app_threads[i];
+    }
+}
+
+void IOUringTransport::run_app_thread(Application *app, int tid)
+{
+    local_state = this->thread_states[tid % this->thread_states.size()];
+    app->run_thread(tid);
+}
+
+void IOUringTransport::register_address(ThreadState *ts, const Address *addr)
+{
+    const UDPAddress *udp_addr = static_cast<const UDPAddress*>(addr);
+
+    ts->socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ts->socket_fd == -1) {
+        panic("Failed to create socket");
+    }
+
+    // Non-blocking mode (used by the sendto fallback)
+    if (fcntl(ts->socket_fd, F_SETFL, O_NONBLOCK, 1) == -1) {
+        panic("Failed to set O_NONBLOCK");
+    }
+
+    int n = 1;
+    if (setsockopt(ts->socket_fd, SOL_SOCKET, SO_BROADCAST, (char *)&n, sizeof(n)) < 0) {
+        panic("Failed to set SO_BROADCAST");
+    }
+    n = 1;
+    if (setsockopt(ts->socket_fd, SOL_SOCKET, SO_NO_CHECK, (char *)&n, sizeof(n)) < 0) {
+        panic("Failed to set SO_NO_CHECK");
+    }
+    if (this->config->n_transport_threads > 1) {
+        n = 1;
+        if (setsockopt(ts->socket_fd, SOL_SOCKET, SO_REUSEPORT, (char *)&n, sizeof(n)) < 0) {
+            panic("Failed to set SO_REUSEPORT");
+        }
+    }
+    n = this->SOCKET_BUF_SIZE;
+    if (setsockopt(ts->socket_fd, SOL_SOCKET, SO_RCVBUF, (char *)&n, sizeof(n)) < 0) {
+        panic("Failed to set SO_RCVBUF");
+    }
+    if (setsockopt(ts->socket_fd, SOL_SOCKET, SO_SNDBUF, (char *)&n, sizeof(n)) < 0) {
+        panic("Failed to set SO_SNDBUF");
+    }
+
+    if (bind(ts->socket_fd,
+             &udp_addr->saddr,
+             sizeof(udp_addr->saddr)) != 0) {
+        panic("Failed to bind port");
+    }
+}
+
+void IOUringTransport::register_controller(void)
+{
+    this->controller_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (this->controller_fd == -1) {
+        panic("Failed to create socket");
+    }
+
+    int n = 1;
+    if (setsockopt(this->controller_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&n, sizeof(n)) < 0) {
+        panic("Failed to set SO_REUSEADDR");
+    }
+
+    // Bind to any address
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = 0;
+
+    if (bind(this->controller_fd, (sockaddr *)&sin, sizeof(sin)) != 0) {
+        panic("Failed to bind port");
+    }
+}
+
+void IOUringTransport::setup_ring(ThreadState *ts)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ts->ring_fd = io_uring_setup(RING_ENTRIES, &params);
+    if (ts->ring_fd < 0) {
+        panic("io_uring_setup failed");
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        panic("io_uring transport requires IORING_FEAT_EXT_ARG (Linux >= 5.11)");
+    }
+
+    // Map submission and completion rings
+    ts->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ts->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ts->sq_ring_size = ts->cq_ring_size = std::max(ts->sq_ring_size, ts->cq_ring_size);
+    }
+    ts->sq_ring_ptr = mmap(nullptr, ts->sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ts->ring_fd, IORING_OFF_SQ_RING);
+    if (ts->sq_ring_ptr == MAP_FAILED) {
+        panic("Failed to map io_uring SQ ring");
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ts->cq_ring_ptr = ts->sq_ring_ptr;
+    } else {
+        ts->cq_ring_ptr = mmap(nullptr, ts->cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ts->ring_fd, IORING_OFF_CQ_RING);
+        if (ts->cq_ring_ptr == MAP_FAILED) {
+            panic("Failed to map io_uring CQ ring");
+        }
+    }
+    ts->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ts->sqes = (struct io_uring_sqe*)mmap(nullptr, ts->sqes_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, ts->ring_fd, IORING_OFF_SQES);
+    if (ts->sqes == MAP_FAILED) {
+        ts->sqes = nullptr;
+        panic("Failed to map io_uring SQEs");
+    }
+
+    char *sq = (char*)ts->sq_ring_ptr;
+    ts->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ts->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ts->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ts->sq_local_tail = *ts->sq_tail;
+    // Identity map SQ slots to SQEs
+    unsigned *sq_array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+    char *cq = (char*)ts->cq_ring_ptr;
+    ts->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ts->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ts->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ts->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Register provided buffer ring for RX
+    ts->buf_ring = (struct io_uring_buf_ring*)mmap(nullptr,
+                                                   RX_BUF_ENTRIES * sizeof(struct io_uring_buf),
+                                                   PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ts->buf_ring == MAP_FAILED) {
+        ts->buf_ring = nullptr;
+        panic("Failed to allocate io_uring buffer ring");
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)ts->buf_ring;
+    reg.ring_entries = RX_BUF_ENTRIES;
+    reg.bgid = RX_BUF_GROUP;
+    if (io_uring_register(ts->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        panic("io_uring provided buffer ring registration failed (Linux >= 5.19 required)");
+    }
+    ts->rx_bufs = new char[RX_BUF_ENTRIES * RX_BUF_SIZE];
+    ts->buf_ring_tail = 0;
+    for (unsigned short bid = 0; bid < RX_BUF_ENTRIES; bid++) {
+        recycle_buffer(ts, bid);
+    }
+    // Multishot recvmsg only uses the name and control lengths
+    memset(&ts->rx_msghdr, 0, sizeof(ts->rx_msghdr));
+    ts->rx_msghdr.msg_namelen = sizeof(struct sockaddr);
+
+    // TX slots
+    ts->tx_bufs = new char[TX_SLOTS * TX_BUF_SIZE];
+    ts->tx_msgs = new struct msghdr[TX_SLOTS];
+    ts->tx_iovs = new struct iovec[TX_SLOTS];
+    ts->tx_addrs = new struct sockaddr[TX_SLOTS];
+    memset(ts->tx_msgs, 0, TX_SLOTS * sizeof(struct msghdr));
+    for (unsigned i = 0; i < TX_SLOTS; i++) {
+        ts->tx_iovs[i].iov_base = ts->tx_bufs + i * TX_BUF_SIZE;
+        ts->tx_msgs[i].msg_name = &ts->tx_addrs[i];
+        ts->tx_msgs[i].msg_namelen = sizeof(struct sockaddr);
+        ts->tx_msgs[i].msg_iov = &ts->tx_iovs[i];
+        ts->tx_msgs[i].msg_iovlen = 1;
+        ts->tx_free.push_back(i);
+    }
+}
+
+struct io_uring_sqe *IOUringTransport::get_sqe(ThreadState *ts)
+{
+    unsigned head = __atomic_load_n(ts->sq_head, __ATOMIC_ACQUIRE);
+    if (ts->sq_local_tail - head > ts->sq_mask) {
+        // SQ full
+        return nullptr;
+    }
+    struct io_uring_sqe *sqe = &ts->sqes[ts->sq_local_tail & ts->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ts->sq_local_tail++;
+    return sqe;
+}
+
+void IOUringTransport::arm_recv(ThreadState *ts, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(ts);
+    if (sqe == nullptr) {
+        panic("io_uring SQ full");
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)&ts->rx_msghdr;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RX_BUF_GROUP;
+    sqe->user_data = UDATA(UDATA_RECV, fd);
+}
+
+void IOUringTransport::recycle_buffer(ThreadState *ts, unsigned short bid)
+{
+    // bufs is a flexible array aliasing the ring header; index the ring
+    // directly since C++ gives the empty struct in __DECLARE_FLEX_ARRAY a size
+    struct io_uring_buf *buf = (struct io_uring_buf *)ts->buf_ring +
+        (ts->buf_ring_tail & (RX_BUF_ENTRIES - 1));
+    buf->addr = (uint64_t)(ts->rx_bufs + bid * RX_BUF_SIZE);
+    buf->len = RX_BUF_SIZE;
+    buf->bid = bid;
+    ts->buf_ring_tail++;
+    __atomic_store_n(&ts->buf_ring->tail, ts->buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+bool IOUringTransport::enqueue_send(ThreadState *ts, const Message &msg,
+                                    const struct sockaddr &saddr)
+{
+    if (msg.total_len() > TX_BUF_SIZE || ts->tx_free.empty()) {
+        return false;
+    }
+    struct io_uring_sqe *sqe = get_sqe(ts);
+    if (sqe == nullptr) {
+        return false;
+    }
+    unsigned slot = ts->tx_free.back();
+    ts->tx_free.pop_back();
+    msg.copy_to(ts->tx_iovs[slot].iov_base);
+    ts->tx_iovs[slot].iov_len = msg.total_len();
+    ts->tx_addrs[slot] = saddr;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = ts->socket_fd;
+    sqe->addr = (uint64_t)&ts->tx_msgs[slot];
+    sqe->len = 1;
+    sqe->user_data = UDATA(UDATA_SEND, slot);
+    return true;
+}
+
+int IOUringTransport::submit_and_wait(ThreadState *ts)
+{
+    unsigned to_submit = ts->sq_local_tail - *ts->sq_tail;
+    __atomic_store_n(ts->sq_tail, ts->sq_local_tail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = WAIT_TIMEOUT_US * 1000L;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)&timeout;
+
+    return io_uring_enter(ts->ring_fd, to_submit, 1,
+                          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                          &arg, sizeof(arg));
+}
+
+void IOUringTransport::process_cqe(ThreadState *ts, const struct io_uring_cqe *cqe)
+{
+    switch (UDATA_TYPE(cqe->user_data)) {
+    case UDATA_RECV: {
+        int fd = (int)UDATA_VAL(cqe->user_data);
+        if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            char *buf = ts->rx_bufs + bid * RX_BUF_SIZE;
+            // Multishot recvmsg layout: header, name, control, payload
+            const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out*)buf;
+            if (out->flags & MSG_TRUNC) {
+                info("Received truncated message");
+            } else {
+                struct sockaddr *src_addr = (struct sockaddr*)(buf + sizeof(*out));
+                char *payload = buf + sizeof(*out) + ts->rx_msghdr.msg_namelen +
+                    ts->rx_msghdr.msg_controllen;
+                assert(this->receiver);
+                this->receiver->receive_message(Message(payload, out->payloadlen, false),
+                                                UDPAddress(*src_addr),
+                                                this->config->n_app_threads + ts->tid);
+            }
+            recycle_buffer(ts, bid);
+        } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+            info("Failed to receive message: %s", strerror(-cqe->res));
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            // Multishot terminated (e.g. ran out of buffers): re-arm
+            arm_recv(ts, fd);
+        }
+        break;
+    }
+    case UDATA_SEND: {
+        if (cqe->res < 0) {
+            info("Failed to send message: %s", strerror(-cqe->res));
+        }
+        ts->tx_free.push_back(UDATA_VAL(cqe->user_data));
+        break;
+    }
+    default:
+        panic("Unexpected io_uring completion");
+    }
+}
+
+void IOUringTransport::run_transport(ThreadState *ts)
+{
+    local_state = ts;
+    pin_to_core(this->config->transport_core + ts->tid);
+
+    arm_recv(ts, ts->socket_fd);
+    if (ts->tid == 0) {
+        arm_recv(ts, this->controller_fd);
+    }
+
+    while (this->status == IOUringTransport::RUNNING) {
+        int ret = submit_and_wait(ts);
+        if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            panic("io_uring_enter failed");
+        }
+
+        // Drain all available completions as one batch
+        in_rx_batch = true;
+        unsigned head = *ts->cq_head;
+        unsigned tail = __atomic_load_n(ts->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            process_cqe(ts, &ts->cqes[head & ts->cq_mask]);
+            head++;
+            __atomic_store_n(ts->cq_head, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(ts->cq_tail, __ATOMIC_ACQUIRE);
+        }
+        in_rx_batch = false;
+    }
+}
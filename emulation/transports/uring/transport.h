@@ -0,0 +1,98 @@
+#ifndef _URING_TRANSPORT_H_
+#define _URING_TRANSPORT_H_
+
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include <transport.h>
+
+/*
+ * Kernel UDP transport driven by io_uring: each transport thread owns a
+ * SO_REUSEPORT socket and a ring with a multishot recvmsg into a registered
+ * provided-buffer ring. Replies sent from within receive_message are queued
+ * as SQEs and submitted together with the next wait for completions.
+ */
+class IOUringTransport : public Transport {
+public:
+    IOUringTransport(const Configuration *config);
+    ~IOUringTransport();
+
+    virtual void send_message(const Message &msg, const Address &addr) override final;
+    virtual void run(void) override final;
+    virtual void stop(void) override final;
+    virtual void wait(void) override final;
+    virtual void run_app_threads(Application *app) override final;
+
+private:
+    class ThreadState {
+    public:
+        ThreadState(IOUringTransport *transport, int tid);
+        ~ThreadState();
+
+        IOUringTransport *transport;
+        int tid;
+        int socket_fd;
+        std::thread *thread;
+
+        // Ring
+        int ring_fd;
+        void *sq_ring_ptr;
+        size_t sq_ring_size;
+        void *cq_ring_ptr;
+        size_t cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned sq_mask;
+        unsigned sq_local_tail;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe *cqes;
+
+        // RX: provided buffer ring for multishot recvmsg
+        struct io_uring_buf_ring *buf_ring;
+        char *rx_bufs;
+        unsigned short buf_ring_tail;
+        struct msghdr rx_msghdr;
+
+        // TX: preallocated send slots
+        char *tx_bufs;
+        struct msghdr *tx_msgs;
+        struct iovec *tx_iovs;
+        struct sockaddr *tx_addrs;
+        std::vector<unsigned> tx_free;
+    };
+
+    void register_address(ThreadState *ts, const Address *addr);
+    void register_controller(void);
+    void setup_ring(ThreadState *ts);
+    struct io_uring_sqe *get_sqe(ThreadState *ts);
+    void arm_recv(ThreadState *ts, int fd);
+    void recycle_buffer(ThreadState *ts, unsigned short bid);
+    bool enqueue_send(ThreadState *ts, const Message &msg, const struct sockaddr &saddr);
+    int submit_and_wait(ThreadState *ts);
+    void process_cqe(ThreadState *ts, const struct io_uring_cqe *cqe);
+    void run_transport(ThreadState *ts);
+    void run_app_thread(Application *app, int tid);
+
+    const int SOCKET_BUF_SIZE = 1024 * 1024; // 1MB buffer size
+    static const unsigned RING_ENTRIES = 1024;
+    static const unsigned RX_BUF_ENTRIES = 512;     // power of 2
+    static const size_t RX_BUF_SIZE = 16384;
+    static const unsigned TX_SLOTS = 256;
+    static const size_t TX_BUF_SIZE = 16384;
+    static const int WAIT_TIMEOUT_US = 100000;
+
+    int controller_fd;
+    volatile enum {
+        RUNNING,
+        STOPPED,
+    } status;
+    std::vector<ThreadState*> thread_states;
+};
+
+#endif /* _URING_TRANSPORT_H_ */